@@ -1,5 +1,9 @@
 #include "BaseConnection.h"
 
+#ifdef __linux__
+#include <sys/sendfile.h>
+#endif
+
 BaseConnection::BaseConnection(boost::asio::io_context& io_context)
     : m_io_context(io_context), m_socket(io_context), m_state(ConnectionState::DISCONNECTED) {
 }
@@ -13,6 +17,13 @@ void BaseConnection::stop() {
     boost::system::error_code ec;
     m_socket.close(ec);
     m_accumulated_buffer.clear();
+
+    // Wake up bulk senders blocked on flow control
+    {
+        std::lock_guard<std::mutex> lock(m_write_wait_mutex);
+        m_pending_write_bytes = 0;
+    }
+    m_write_wait_cv.notify_all();
 }
 
 void BaseConnection::close() {
@@ -30,30 +41,167 @@ void BaseConnection::send(const std::string& message) {
 }
 
 void BaseConnection::send(const NetworkMessage& message) {
+    send(NetworkMessage(message));
+}
+
+void BaseConnection::send(NetworkMessage&& message) {
     if (!isConnected()) return;
+    if (message.file_slice.length && !supportsZeroCopy() && !loadFileSlice(message)) {
+        std::string error_msg = "Failed to read file data for sending";
+        if (m_error_callback) {
+            m_error_callback(error_msg);
+        }
+        onError(error_msg);
+        stop();
+        return;
+    }
+    enqueueWrite(preprocessSend(std::move(message)));
+}
+
+bool BaseConnection::supportsZeroCopy() const {
+#ifdef __linux__
+    return true;
+#else
+    return false;
+#endif
+}
+
+bool BaseConnection::loadFileSlice(NetworkMessage& message) {
+    FileSlice slice = std::move(message.file_slice);
+    message.file_slice = FileSlice();
+#ifdef _WIN32
+    return slice.length == 0;
+#else
+    size_t start = message.data.size();
+    message.data.resize(start + slice.length);
+    for (size_t done = 0; done < slice.length;) {
+        ssize_t n = ::pread(*slice.fd, message.data.data() + start + done, slice.length - done, static_cast<off_t>(slice.offset + done));
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) return false;
+        done += static_cast<size_t>(n);
+    }
+    return true;
+#endif
+}
+
+void BaseConnection::enqueueWrite(NetworkMessage&& message) {
+    // Header and payload are written as two buffers so the payload is never copied
+    auto frame = std::make_shared<OutgoingFrame>();
+    frame->header = message.header();
+    frame->data = std::move(message.data);
+    frame->file = std::move(message.file_slice);
+    {
+        // Under the mutex, as handleWrite's read-modify-write of the count is
+        std::lock_guard<std::mutex> lock(m_write_wait_mutex);
+        m_pending_write_bytes += frame->size();
+    }
 
-    NetworkMessage processed_msg = preprocessSend(message);
     std::shared_ptr<BaseConnection> self = shared_from_this();
-    
-    // Create a shared_ptr to the message data to keep it alive during async operation
-    auto serialized = std::make_shared<std::vector<uint8_t>>(processed_msg.serialize());
-
-    boost::asio::async_write(m_socket,
-        boost::asio::buffer(*serialized),
-        [this, self, serialized](const boost::system::error_code& error, size_t bytes_transferred) {
-            handleWrite(error, bytes_transferred);
+    boost::asio::post(m_io_context, [this, self, frame]() {
+        m_write_queue.push_back(frame);
+        if (!m_writing)
+            writeNext();
+    });
+}
+
+void BaseConnection::writeNext() {
+    if (m_write_queue.empty()) {
+        m_writing = false;
+        return;
+    }
+    m_writing = true;
+    std::shared_ptr<OutgoingFrame> frame = m_write_queue.front();
+    std::array<boost::asio::const_buffer, 2> buffers = {
+        boost::asio::buffer(frame->header),
+        boost::asio::buffer(frame->data)
+    };
+    std::shared_ptr<BaseConnection> self = shared_from_this();
+    boost::asio::async_write(m_socket, buffers,
+        [this, self, frame](const boost::system::error_code& error, size_t bytes_transferred) {
+            if (!error && frame->file.length)
+                writeFileSlice(frame);
+            else
+                handleWrite(error, bytes_transferred);
         });
 }
 
+// Streams a frame's file slice with sendfile, parking on the reactor whenever the socket is full
+void BaseConnection::writeFileSlice(std::shared_ptr<OutgoingFrame> frame) {
+#ifdef __linux__
+    boost::system::error_code ec;
+    if (!m_socket.native_non_blocking())
+        m_socket.native_non_blocking(true, ec);
+    while (!ec && frame->file_sent < frame->file.length) {
+        off_t offset = static_cast<off_t>(frame->file.offset + frame->file_sent);
+        ssize_t n = ::sendfile(m_socket.native_handle(), *frame->file.fd, &offset, frame->file.length - frame->file_sent);
+        if (n > 0) {
+            frame->file_sent += static_cast<size_t>(n);
+        } else if (n < 0 && errno == EINTR) {
+            continue;
+        } else if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+            std::shared_ptr<BaseConnection> self = shared_from_this();
+            m_socket.async_wait(tcp::socket::wait_write, [this, self, frame](const boost::system::error_code& error) {
+                if (error)
+                    handleWrite(error, 0);
+                else
+                    writeFileSlice(frame);
+            });
+            return;
+        } else {
+            // n == 0: the file shrank under the frame, which can no longer be completed
+            ec = n == 0 ? boost::asio::error::make_error_code(boost::asio::error::eof)
+                        : boost::system::error_code(errno, boost::system::system_category());
+        }
+    }
+    handleWrite(ec, frame->size());
+#else
+    handleWrite(boost::asio::error::operation_not_supported, 0);
+#endif
+}
+
 void BaseConnection::handleWrite(const boost::system::error_code& error, size_t bytes_transferred) {
     if (error) {
+        clearWriteQueue();
         std::string error_msg = "Write error: " + error.message();
         if (m_error_callback) {
             m_error_callback(error_msg);
         }
         onError(error_msg);
         stop();
+        return;
+    }
+
+    size_t written = m_write_queue.front()->size();
+    m_write_queue.pop_front();
+    {
+        std::lock_guard<std::mutex> lock(m_write_wait_mutex);
+        size_t pending = m_pending_write_bytes.load();
+        m_pending_write_bytes = pending > written ? pending - written : 0;
+    }
+    m_write_wait_cv.notify_all();
+    writeNext();
+}
+
+void BaseConnection::clearWriteQueue() {
+    m_write_queue.clear();
+    m_writing = false;
+    {
+        std::lock_guard<std::mutex> lock(m_write_wait_mutex);
+        m_pending_write_bytes = 0;
     }
+    m_write_wait_cv.notify_all();
+}
+
+size_t BaseConnection::pendingWriteBytes() const {
+    return m_pending_write_bytes.load();
+}
+
+bool BaseConnection::waitForWriteCapacity(size_t limit, std::chrono::milliseconds timeout) {
+    std::unique_lock<std::mutex> lock(m_write_wait_mutex);
+    bool ready = m_write_wait_cv.wait_for(lock, timeout, [this, limit]() {
+        return m_pending_write_bytes.load() <= limit || !isConnected();
+    });
+    return ready && isConnected();
 }
 
 void BaseConnection::startReading() {
@@ -83,10 +231,10 @@ void BaseConnection::handleRead(const boost::system::error_code& error, size_t b
             NetworkMessage message;
             message.type = MessageType(m_accumulated_buffer[offset]);
             message.data.assign(m_accumulated_buffer.begin() + offset + 5, m_accumulated_buffer.begin() + offset + 5 + data_size);
-            auto processed_msg = preprocessReceive(message);
+            auto processed_msg = preprocessReceive(std::move(message));
 
             if (m_message_callback) 
-                m_message_callback(processed_msg);
+                m_message_callback(std::move(processed_msg));
 
             // Move to next message
             offset += total_message_size;
@@ -22,7 +22,21 @@ protected:
 
     // Buffer for reading
     std::vector<uint8_t> m_accumulated_buffer;
-    std::array<uint8_t, 8192> m_read_buffer;
+    std::array<uint8_t, 65536> m_read_buffer;
+
+    // Outgoing frames, only touched on the io thread so writes never interleave
+    struct OutgoingFrame {
+        std::array<uint8_t, 5> header;
+        std::vector<uint8_t> data;
+        FileSlice file;
+        size_t file_sent = 0;
+        size_t size() const { return header.size() + data.size() + file.length; }
+    };
+    std::deque<std::shared_ptr<OutgoingFrame>> m_write_queue;
+    bool m_writing = false;
+    std::atomic<size_t> m_pending_write_bytes{ 0 };
+    std::mutex m_write_wait_mutex;
+    std::condition_variable m_write_wait_cv;
 
 public:
     BaseConnection(boost::asio::io_context& io_context);
@@ -34,6 +48,11 @@ public:
     void close();
     virtual void send(const NetworkMessage& message);
     virtual void send(const std::string& message);
+    void send(NetworkMessage&& message);
+
+    // Flow control for bulk senders
+    size_t pendingWriteBytes() const;
+    bool waitForWriteCapacity(size_t limit, std::chrono::milliseconds timeout);
 
     // Callback setters
     void setConnectionCallback(ConnectionCallback callback);
@@ -49,6 +68,12 @@ protected:
     void startReading();
     void handleRead(const boost::system::error_code& error, size_t bytes_transferred);
     void handleWrite(const boost::system::error_code& error, size_t bytes_transferred);
+    void enqueueWrite(NetworkMessage&& message);
+    void writeNext();
+    void writeFileSlice(std::shared_ptr<OutgoingFrame> frame);
+    void clearWriteQueue();
+    // Reads a message's file slice into its data, for connections that cannot send it zero-copy
+    static bool loadFileSlice(NetworkMessage& message);
 
     // Virtual methods for extension points
     virtual void onConnected() {}
@@ -57,5 +82,9 @@ protected:
 
     // Message processing (can be overridden for encryption, etc.)
     virtual NetworkMessage preprocessSend(NetworkMessage message) { return message; }
+    // Whether file slices may go from the page cache straight to the socket. A connection that
+    // transforms payloads in preprocessSend (compression, TLS) must return false so they are
+    // read into memory first.
+    virtual bool supportsZeroCopy() const;
     virtual NetworkMessage preprocessReceive(NetworkMessage message) { return message; }
 };
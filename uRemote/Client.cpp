@@ -1,4 +1,5 @@
 #include "Client.h"
+#include "logger.h"
 
 Client::Client(boost::asio::io_context& io_context, const std::string& host, const std::string& port, const std::string& password)
     : BaseConnection(io_context), m_host(host), m_port(port), m_password(password), m_resolver(io_context) {
@@ -65,18 +66,18 @@ void Client::handleConnect(const boost::system::error_code& error) {
 }
 
 void Client::onConnected() {
-    std::cout << "Client: Connected to server" << std::endl;
+    LOG_INFO("Client: Connected to server");
     // Send authentication request
     NetworkMessage auth_msg;
     auth_msg.fromAuthRequest(m_password);
     send(auth_msg);
-	std::cout << "Client: Sent authentication request" << std::endl;
+	LOG_INFO("Client: Sent authentication request");
 }
 
 void Client::onDisconnected() {
-    std::cout << "Client: Disconnected from server" << std::endl;
+    LOG_INFO("Client: Disconnected from server");
 }
 
 void Client::onError(const std::string& error_message) {
-    std::cerr << "Client error: " << error_message << std::endl;
+    LOG_ERROR("Client error: {}", error_message);
 }
\ No newline at end of file
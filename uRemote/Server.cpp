@@ -1,4 +1,5 @@
 #include "Server.h"
+#include "logger.h"
 
 Server::Server(boost::asio::io_context& io_context, const std::string& port)
     : BaseConnection(io_context), m_acceptor(io_context), m_port(port) {
@@ -36,7 +37,7 @@ void Server::stop() {
     boost::system::error_code ec;
     m_acceptor.close(ec);
     if (ec) {
-        std::cerr << "Error closing acceptor: " << ec.message() << std::endl;
+        LOG_ERROR("Error closing acceptor: {}", ec.message());
     }
 
     // Then call base class to close socket and stop IO context
@@ -65,11 +66,11 @@ void Server::handleAccept(const boost::system::error_code& error) {
 }
 
 void Server::onConnected() {
-    std::cout << "Server: Client connected" << std::endl;
+    LOG_INFO("Server: Client connected");
 }
 
 void Server::onDisconnected() {
-    std::cout << "Server: Client disconnected" << std::endl;
+    LOG_INFO("Server: Client disconnected");
     // Restart accepting new connections
     if (getState() != ConnectionState::DISCONNECTING) {
         m_socket = tcp::socket(m_io_context);
@@ -78,5 +79,5 @@ void Server::onDisconnected() {
 }
 
 void Server::onError(const std::string& error_message) {
-    std::cerr << "Server error: " << error_message << std::endl;
+    LOG_ERROR("Server error: {}", error_message);
 }
\ No newline at end of file
@@ -0,0 +1,427 @@
+#include "cas.h"
+#include "hash.h"
+#include "logger.h"
+#include <filesystem>
+#include <fstream>
+
+#if defined(__linux__)
+#include <fcntl.h>
+#include <sys/ioctl.h>
+#include <unistd.h>
+#include <linux/fs.h>
+#elif defined(__APPLE__)
+#include <sys/clonefile.h>
+#endif
+
+// Size of each read while hashing
+constexpr size_t FILE_HASH_READ_SIZE = 1024 * 1024;
+// The server forgets its digests beyond this many files rather than growing without bound
+constexpr size_t FILE_HASH_CACHE_LIMIT = 65536;
+
+FileHashService::FileHashService(SendFunction send) : m_send(std::move(send)) {
+}
+
+FileHashService::~FileHashService() {
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        m_stop = true;
+    }
+    m_cv.notify_all();
+    if (m_worker.joinable()) m_worker.join();
+}
+
+void FileHashService::request(uint32_t id, const std::string& path) {
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        m_jobs.push_back({ id, path });
+        if (!m_worker.joinable())
+            m_worker = std::thread(&FileHashService::run, this);
+    }
+    m_cv.notify_one();
+}
+
+void FileHashService::cancelAll() {
+    std::lock_guard<std::mutex> lock(m_mutex);
+    m_jobs.clear();
+}
+
+void FileHashService::run() {
+    for (;;) {
+        Job job;
+        {
+            std::unique_lock<std::mutex> lock(m_mutex);
+            m_cv.wait(lock, [this]() { return m_stop || !m_jobs.empty(); });
+            if (m_stop) break;
+            job = std::move(m_jobs.front());
+            m_jobs.pop_front();
+        }
+        NetworkMessage msg;
+        msg.fromFileHashResponse(hash(job));
+        m_send(std::move(msg));
+    }
+}
+
+FileHashInfo FileHashService::hash(const Job& job) {
+    FileHashInfo info;
+    info.id = job.id;
+    info.path = job.path;
+
+    NativeFile file = openFileForRead(job.path, info.size, info.mtime);
+    FileIdentity before;
+    if (!isValidNativeFile(file) || !fileIdentity(file, before)) {
+        closeNativeFile(file);
+        info.error = "Cannot open file";
+        return info;
+    }
+
+    Key key{ before.device, before.inode, before.size, before.mtime_ns };
+    auto cached = m_cache.find(key);
+    if (cached != m_cache.end()) {
+        closeNativeFile(file);
+        info.hash = cached->second;
+        ++m_hits;
+        LOG_DEBUG("hash {}: cached digest for {} ({} hits, {} misses)", job.id, job.path, m_hits, m_misses);
+        return info;
+    }
+
+    auto started = std::chrono::steady_clock::now();
+    Sha256 sha;
+    std::vector<uint8_t> buffer(FILE_HASH_READ_SIZE);
+    uint64_t offset = 0;
+    while (offset < info.size) {
+        size_t want = static_cast<size_t>(std::min<uint64_t>(buffer.size(), info.size - offset));
+        int64_t n = readFileAt(file, buffer.data(), want, offset);
+        if (n <= 0) break;
+        sha.update(buffer.data(), static_cast<size_t>(n));
+        offset += static_cast<uint64_t>(n);
+    }
+    FileIdentity after;
+    bool unchanged = fileIdentity(file, after) && after == before;
+    closeNativeFile(file);
+    if (offset != info.size || !unchanged) {
+        // The client falls back to a plain download
+        info.error = "File changed while hashing";
+        return info;
+    }
+
+    info.hash = sha.finishHex();
+    if (m_cache.size() >= FILE_HASH_CACHE_LIMIT) m_cache.clear();
+    m_cache.emplace(key, info.hash);
+    ++m_misses;
+    double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - started).count();
+    LOG_INFO("hash {}: hashed {} ({} bytes) at {} MB/s ({} hits, {} misses)", job.id, job.path, info.size,
+        seconds > 0 ? info.size / seconds / 1e6 : 0.0, m_hits, m_misses);
+    return info;
+}
+
+// Copy-on-write clone of `from` at `to`, where the filesystem supports it
+static bool reflinkFile(const std::string& from, const std::string& to) {
+#if defined(__linux__) && defined(FICLONE)
+    int source = ::open(from.c_str(), O_RDONLY | O_CLOEXEC);
+    if (source < 0) return false;
+    int target = ::open(to.c_str(), O_WRONLY | O_CREAT | O_EXCL | O_CLOEXEC, 0644);
+    if (target < 0) {
+        ::close(source);
+        return false;
+    }
+    bool ok = ::ioctl(target, FICLONE, source) == 0;
+    ::close(source);
+    ::close(target);
+    if (!ok) ::unlink(to.c_str());
+    return ok;
+#elif defined(__APPLE__)
+    return clonefile(from.c_str(), to.c_str(), 0) == 0;
+#else
+    (void)from;
+    (void)to;
+    return false;
+#endif
+}
+
+// Makes `to` a new file with the contents of `from`, as cheaply as the filesystem allows
+static const char* linkFile(const std::string& from, const std::string& to) {
+    std::error_code ec;
+    std::filesystem::remove(to, ec);
+    if (reflinkFile(from, to)) return "reflink";
+    std::filesystem::create_hard_link(from, to, ec);
+    if (!ec) return "hardlink";
+    std::filesystem::copy_file(from, to, std::filesystem::copy_options::overwrite_existing, ec);
+    if (!ec) return "copy";
+    std::filesystem::remove(to, ec);
+    return nullptr;
+}
+
+static bool statFile(const std::string& path, FileIdentity& identity) {
+    uint64_t size = 0;
+    int64_t mtime = 0;
+    NativeFile file = openFileForRead(path, size, mtime);
+    bool ok = isValidNativeFile(file) && fileIdentity(file, identity);
+    closeNativeFile(file);
+    return ok;
+}
+
+// Digests come from the server and become path components, so accept only SHA-256 hex
+static bool isValidHash(const std::string& hash) {
+    if (hash.size() != 64) return false;
+    return std::all_of(hash.begin(), hash.end(), [](char c) { return (c >= '0' && c <= '9') || (c >= 'a' && c <= 'f'); });
+}
+
+ContentStore::~ContentStore() {
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        m_stop = true;
+        m_jobs.clear();
+    }
+    m_cv.notify_all();
+    if (m_worker.joinable()) m_worker.join();
+}
+
+void ContentStore::open(const std::string& root) {
+    m_open = true;
+    m_expected.clear();
+    Job job;
+    job.kind = Job::Kind::OPEN;
+    job.root = root;
+    push(std::move(job));
+}
+
+void ContentStore::push(Job&& job) {
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        m_jobs.push_back(std::move(job));
+        if (!m_worker.joinable())
+            m_worker = std::thread(&ContentStore::run, this);
+    }
+    m_cv.notify_one();
+}
+
+std::vector<ContentStore::Event> ContentStore::popEvents() {
+    std::lock_guard<std::mutex> lock(m_mutex);
+    std::vector<Event> events;
+    events.swap(m_events);
+    return events;
+}
+
+void ContentStore::run() {
+    for (;;) {
+        Job job;
+        {
+            std::unique_lock<std::mutex> lock(m_mutex);
+            // The index is written once the queue runs dry, not after every change
+            if (m_jobs.empty() && m_dirty && !m_stop) {
+                lock.unlock();
+                save();
+                lock.lock();
+            }
+            m_cv.wait(lock, [this]() { return m_stop || !m_jobs.empty(); });
+            if (m_stop) break;
+            job = std::move(m_jobs.front());
+            m_jobs.pop_front();
+        }
+        switch (job.kind) {
+        case Job::Kind::OPEN:
+            if (m_dirty) save();
+            load(job.root);
+            break;
+        case Job::Kind::LOOKUP: {
+            Event event;
+            event.restored = place(job.file);
+            event.info = std::move(job.file.info);
+            event.local_path = std::move(job.file.local_path);
+            std::lock_guard<std::mutex> lock(m_mutex);
+            m_events.push_back(std::move(event));
+            break;
+        }
+        case Job::Kind::ADD:
+            add(job.file);
+            break;
+        }
+    }
+    if (m_dirty) save();
+}
+
+void ContentStore::load(const std::string& root) {
+    m_root = root;
+    m_objects.clear();
+    m_hits = m_misses = m_bytes_saved = 0;
+
+    std::ifstream file(std::filesystem::path(root) / "index.json");
+    if (!file.is_open()) return;
+    try {
+        json index = json::parse(file);
+        json objects = index.value("objects", json::object());
+        for (auto& [hash, object] : objects.items()) {
+            if (!isValidHash(hash)) continue;
+            m_objects[hash] = { object.value("size", uint64_t(0)), object.value("mtime_ns", int64_t(0)) };
+        }
+        m_hits = index.value("hits", uint64_t(0));
+        m_misses = index.value("misses", uint64_t(0));
+        m_bytes_saved = index.value("bytes_saved", uint64_t(0));
+        LOG_INFO("content store {}: {} objects, {} hits, {} misses, {} bytes saved", root, m_objects.size(), m_hits.load(), m_misses.load(), m_bytes_saved.load());
+    } catch (const std::exception& e) {
+        LOG_WARN("content store {}: ignoring unreadable index: {}", root, e.what());
+        m_objects.clear();
+    }
+}
+
+std::string ContentStore::objectPath(const std::string& hash) const {
+    return (std::filesystem::path(m_root) / "objects" / hash.substr(0, 2) / hash).string();
+}
+
+bool ContentStore::verify(const std::string& hash, const Object& object) const {
+    FileIdentity identity;
+    return statFile(objectPath(hash), identity) && identity.size == object.size && identity.mtime_ns == object.mtime_ns;
+}
+
+void ContentStore::evict(const std::string& hash) {
+    std::error_code ec;
+    std::filesystem::remove(objectPath(hash), ec);
+    m_objects.erase(hash);
+}
+
+bool ContentStore::lookup(const FileHashInfo& info, const std::string& local_path) {
+    if (!m_open || !isValidHash(info.hash)) return false;
+    Job job;
+    job.kind = Job::Kind::LOOKUP;
+    job.file = { info, local_path };
+    push(std::move(job));
+    return true;
+}
+
+bool ContentStore::place(const Expected& file) {
+    const FileHashInfo& info = file.info;
+    const std::string& local_path = file.local_path;
+    m_dirty = true;
+    auto it = m_objects.find(info.hash);
+    if (it == m_objects.end() || it->second.size != info.size) {
+        ++m_misses;
+        return false;
+    }
+    if (!verify(info.hash, it->second)) {
+        LOG_WARN("content store: object {} was modified or removed, evicting it", info.hash);
+        evict(info.hash);
+        ++m_misses;
+        return false;
+    }
+
+    // Build the file beside its destination and rename it into place, like a finished download
+    std::error_code ec;
+    std::filesystem::create_directories(std::filesystem::path(local_path).parent_path(), ec);
+    std::string temp = local_path + ".cas";
+    const char* method = linkFile(objectPath(info.hash), temp);
+    if (method) {
+        std::filesystem::rename(temp, local_path, ec);
+        if (ec) std::filesystem::remove(temp, ec);
+    }
+    if (!method || ec) {
+        LOG_WARN("content store: could not place {} at {}", info.hash, local_path);
+        ++m_misses;
+        return false;
+    }
+
+    ++m_hits;
+    m_bytes_saved += info.size;
+    LOG_INFO("download {}: restored {} ({} bytes) from the content store by {}", info.id, local_path, info.size, method);
+    return true;
+}
+
+void ContentStore::expect(uint32_t id, const FileHashInfo& info, const std::string& local_path) {
+    if (!m_open || !isValidHash(info.hash)) return;
+    m_expected[id] = { info, local_path };
+}
+
+void ContentStore::onHeader(const FileTransferHeader& header) {
+    auto it = m_expected.find(header.id);
+    if (it == m_expected.end()) return;
+    if (header.size != it->second.info.size || header.mtime != it->second.info.mtime)
+        m_expected.erase(it);
+}
+
+void ContentStore::onCompleted(uint32_t id, bool success, const std::string& sha256) {
+    auto it = m_expected.find(id);
+    if (it == m_expected.end()) return;
+    Expected expected = std::move(it->second);
+    m_expected.erase(it);
+    if (!success) return;
+
+    const std::string& hash = expected.info.hash;
+    // The server's claim alone would let a file changed after hashing, or a lying server,
+    // put wrong content under the hash for every later download of it
+    if (sha256.empty()) {
+        LOG_WARN("content store: not adding {}, its SHA-256 was not verified", expected.local_path);
+        return;
+    }
+    if (sha256 != hash) {
+        LOG_WARN("content store: not adding {}, it hashes to {} rather than {}", expected.local_path, sha256, hash);
+        return;
+    }
+    Job job;
+    job.kind = Job::Kind::ADD;
+    job.file = std::move(expected);
+    push(std::move(job));
+}
+
+void ContentStore::add(const Expected& file) {
+    const std::string& hash = file.info.hash;
+    auto existing = m_objects.find(hash);
+    if (existing != m_objects.end() && verify(hash, existing->second)) return;
+
+    FileIdentity identity;
+    if (!statFile(file.local_path, identity) || identity.size != file.info.size) return;
+
+    std::string object = objectPath(hash);
+    std::error_code ec;
+    std::filesystem::create_directories(std::filesystem::path(object).parent_path(), ec);
+    std::string temp = object + ".tmp";
+    const char* method = linkFile(file.local_path, temp);
+    if (!method) {
+        LOG_WARN("content store: could not add {}", file.local_path);
+        return;
+    }
+    std::filesystem::rename(temp, object, ec);
+    if (ec || !statFile(object, identity)) {
+        std::filesystem::remove(temp, ec);
+        return;
+    }
+    m_objects[hash] = { identity.size, identity.mtime_ns };
+    m_dirty = true;
+    LOG_DEBUG("content store: added {} as {} by {}", file.local_path, hash, method);
+}
+
+void ContentStore::forget(uint32_t id) {
+    m_expected.erase(id);
+    std::lock_guard<std::mutex> lock(m_mutex);
+    m_jobs.erase(std::remove_if(m_jobs.begin(), m_jobs.end(),
+        [id](const Job& job) { return job.kind == Job::Kind::LOOKUP && job.file.info.id == id; }), m_jobs.end());
+}
+
+void ContentStore::forgetAll() {
+    m_expected.clear();
+    std::lock_guard<std::mutex> lock(m_mutex);
+    m_jobs.erase(std::remove_if(m_jobs.begin(), m_jobs.end(),
+        [](const Job& job) { return job.kind == Job::Kind::LOOKUP; }), m_jobs.end());
+}
+
+void ContentStore::save() {
+    m_dirty = false;
+    if (m_root.empty()) return;
+    json objects = json::object();
+    for (const auto& [hash, object] : m_objects)
+        objects[hash] = { {"size", object.size}, {"mtime_ns", object.mtime_ns} };
+    json index;
+    index["objects"] = std::move(objects);
+    index["hits"] = m_hits.load();
+    index["misses"] = m_misses.load();
+    index["bytes_saved"] = m_bytes_saved.load();
+
+    std::error_code ec;
+    std::filesystem::create_directories(m_root, ec);
+    std::string path = (std::filesystem::path(m_root) / "index.json").string();
+    std::string temp = path + ".tmp";
+    {
+        std::ofstream file(temp, std::ios::trunc);
+        if (!file.is_open()) return;
+        file << index.dump();
+    }
+    std::filesystem::rename(temp, path, ec);
+}
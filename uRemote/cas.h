@@ -0,0 +1,131 @@
+#pragma once
+#include "uRemote.h"
+#include "network.h"
+#include "transfer.h"
+#include <map>
+#include <tuple>
+
+// Name of the content store's directory inside the download folder
+constexpr const char* CONTENT_STORE_DIR = ".uremote-cas";
+
+// Server side: answers hash-first download requests with the SHA-256 of a file. Digests
+// are cached in memory by (device, inode, size, mtime), so asking again for an unchanged
+// file - under any name - costs one stat.
+class FileHashService {
+public:
+    using SendFunction = FileSender::SendFunction;
+
+    explicit FileHashService(SendFunction send);
+    ~FileHashService();
+
+    void request(uint32_t id, const std::string& path);
+    void cancelAll();
+
+private:
+    struct Job {
+        uint32_t id;
+        std::string path;
+    };
+    using Key = std::tuple<uint64_t, uint64_t, uint64_t, int64_t>;
+
+    void run();
+    FileHashInfo hash(const Job& job);
+
+    SendFunction m_send;
+    std::thread m_worker;
+    std::mutex m_mutex;
+    std::condition_variable m_cv;
+    std::deque<Job> m_jobs;
+    bool m_stop = false;
+
+    // Only touched by the worker
+    std::map<Key, std::string> m_cache;
+    uint64_t m_hits = 0;
+    uint64_t m_misses = 0;
+};
+
+// Client side: a content-addressed store of finished downloads under
+// "<download_path>/.uremote-cas/objects/<2 hex>/<sha256>". Before downloading, the client
+// asks the server for the file's hash; if the store already has that content it is placed
+// at the destination with a reflink, a hardlink or, failing both, a local copy, and nothing
+// crosses the network. Objects are verified against the size and mtime recorded when they
+// were added, so one edited in place through a hardlink is evicted rather than served.
+// Placing, adding and the index are worked on a thread of its own, as a copy of a large
+// file would stall the UI; lookups come back to the UI thread as events.
+class ContentStore {
+public:
+    struct Event {
+        FileHashInfo info;
+        std::string local_path;
+        bool restored = false;      // placed at local_path; otherwise it has to be downloaded
+    };
+
+    ~ContentStore();
+
+    // Loads the index of the store rooted at `root`, creating it on first use
+    void open(const std::string& root);
+
+    // Queues placing the content described by `info` at `local_path`, answered by an event;
+    // false when the store cannot have it, and nothing is queued
+    bool lookup(const FileHashInfo& info, const std::string& local_path);
+    // Events produced by the worker since the last call, in order
+    std::vector<Event> popEvents();
+    // Adds the download `id` to the store once it completes, if its bytes hash to info.hash
+    void expect(uint32_t id, const FileHashInfo& info, const std::string& local_path);
+    // Drops the expectation if the server sends a different version than the one it hashed
+    void onHeader(const FileTransferHeader& header);
+    // `sha256` is the digest the download was verified with, empty if it was not
+    void onCompleted(uint32_t id, bool success, const std::string& sha256);
+    // Drops what is expected or queued for `id`; a lookup already being worked on is still answered
+    void forget(uint32_t id);
+    void forgetAll();
+
+    uint64_t hits() const { return m_hits; }
+    uint64_t misses() const { return m_misses; }
+    uint64_t bytesSaved() const { return m_bytes_saved; }
+
+private:
+    struct Object {
+        uint64_t size = 0;
+        int64_t mtime_ns = 0;
+    };
+    struct Expected {
+        FileHashInfo info;
+        std::string local_path;
+    };
+    struct Job {
+        enum class Kind { OPEN, LOOKUP, ADD };
+        Kind kind = Kind::LOOKUP;
+        std::string root;           // OPEN only
+        Expected file;
+    };
+
+    void push(Job&& job);
+    void run();
+    void load(const std::string& root);
+    bool place(const Expected& file);
+    void add(const Expected& file);
+    std::string objectPath(const std::string& hash) const;
+    bool verify(const std::string& hash, const Object& object) const;
+    void evict(const std::string& hash);
+    void save();
+
+    // UI thread only
+    bool m_open = false;
+    std::unordered_map<uint32_t, Expected> m_expected;
+
+    std::thread m_worker;
+    std::mutex m_mutex;
+    std::condition_variable m_cv;
+    std::deque<Job> m_jobs;
+    std::vector<Event> m_events;
+    bool m_stop = false;
+    std::atomic<uint64_t> m_hits{ 0 };
+    std::atomic<uint64_t> m_misses{ 0 };
+    std::atomic<uint64_t> m_bytes_saved{ 0 };
+
+    // Worker only
+    std::string m_root;
+    std::unordered_map<std::string, Object> m_objects;
+    bool m_dirty = false;           // the index on disk is behind
+};
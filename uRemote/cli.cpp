@@ -1,5 +1,5 @@
 #include "cli.h"
-#include <iostream>
+#include "logger.h"
 #include <array>
 #include <chrono>
 
@@ -11,7 +11,8 @@ ProcessManager::~ProcessManager() {
 }
 
 #ifdef _WIN32
-bool ProcessManager::start(const std::string& command) {
+// The pipes are read on threads of their own; io_context is only used on POSIX
+bool ProcessManager::start(boost::asio::io_context& io_context, const std::string& command) {
     if (state == ProcessState::Running) {
         return false;
     }
@@ -110,14 +111,12 @@ void ProcessManager::readOutput() {
 
                 checkMarker(output);
 
-                {
-                    std::lock_guard<std::mutex> lock(outputMutex);
-                    if (output.length())
-                        outputQueue.push({ output, false });
-                    if (expectingCompletion == false)
-						pushSignal(SignalType::CMD_IDLE);
-                    std::cout << "cmd push output: " << output << std::endl;
+                if (output.length()) {
+                    std::vector<uint8_t> data(output.begin(), output.end());
+                    deliver(data);
                 }
+                if (expectingCompletion == false)
+                    pushSignal(SignalType::CMD_IDLE);
 
                 if (outputCallback) {
                     outputCallback(output, false);
@@ -143,12 +142,9 @@ void ProcessManager::readError() {
 
                 checkMarker(output);
 
-                {
-                    std::lock_guard<std::mutex> lock(outputMutex);
-                    if (output.length()) {
-                        outputQueue.push({ output, false });
-                        std::cout << "cmd push output" << output << "to queue" << std::endl;
-                    }
+                if (output.length()) {
+                    std::vector<uint8_t> data(output.begin(), output.end());
+                    deliver(data);
                 }
 
                 if (outputCallback) {
@@ -167,16 +163,27 @@ bool ProcessManager::sendCommand(const std::string& command) {
 
 	expectingCompletion = true;
     pushSignal(SignalType::CMD_BUSY);
-    std::cout << "cmd busy, pushed signal" << std::endl;
+    LOG_DEBUG("cmd busy, pushed signal");
 
     std::string cmd = command + " & echo " + endMarker + "\n";
-	std::cout << "cmd received command: " << cmd << std::endl;
+	LOG_DEBUG("cmd received command: {}", command);
     DWORD bytesWritten;
     BOOL success = WriteFile(hChildStdinWr, cmd.c_str(), static_cast<DWORD>(cmd.length()), &bytesWritten, NULL);
 
     return success && (bytesWritten == cmd.length());
 }
 
+bool ProcessManager::interrupt() {
+    // cmd.exe reads pipes, not a console, so there is no Ctrl-C to deliver
+    return false;
+}
+
+bool ProcessManager::resize(uint16_t columns, uint16_t rows) {
+    m_columns = columns;
+    m_rows = rows;
+    return false;
+}
+
 bool ProcessManager::isRunning() const {
     if (hProcess) {
         DWORD exitCode;
@@ -223,15 +230,26 @@ void ProcessManager::cleanup() {
 #ifndef _WIN32
 #include <cstring>
 #include <fcntl.h>
+#include <future>
+#ifdef __linux__
+#include <sys/syscall.h>
+#endif
 
+// Bytes taken from the pty per read; each read is handed to the sink as one piece
+constexpr size_t PTY_READ_SIZE = 4096;
+// How long a shell that ignores SIGHUP gets before it is killed
+constexpr auto PTY_EXIT_GRACE = std::chrono::seconds(1);
 
-bool ProcessManager::start(const std::string& command) {
+bool ProcessManager::start(boost::asio::io_context& io_context, const std::string& command) {
     if (state == ProcessState::Running) {
         return false;
     }
 
-    // Create pseudo-terminal
-    if (openpty(&master_fd, &slave_fd, NULL, NULL, NULL) == -1) {
+    // Create pseudo-terminal, of the size the client's screen is kept at
+    struct winsize size = {};
+    size.ws_row = m_rows;
+    size.ws_col = m_columns;
+    if (openpty(&master_fd, &slave_fd, NULL, NULL, &size) == -1) {
         state = ProcessState::Error;
         return false;
     }
@@ -260,6 +278,9 @@ bool ProcessManager::start(const std::string& command) {
         // Close slave fd as it's duplicated
         close(slave_fd);
 
+        // What TerminalEmulator understands
+        setenv("TERM", "xterm-256color", 1);
+
         // Execute shell
         if (command.empty()) {
             const char* shell = getenv("SHELL");
@@ -275,103 +296,165 @@ bool ProcessManager::start(const std::string& command) {
     }
     else { // Parent process
         close(slave_fd);
+        fcntl(master_fd, F_SETFD, FD_CLOEXEC);
 
-        // Set non-blocking mode for reading
-        int flags = fcntl(master_fd, F_GETFL, 0);
-        fcntl(master_fd, F_SETFL, flags | O_NONBLOCK);
-
-        // Start reader thread
+        // From here on the master belongs to the io thread, which reads it as output arrives
+        m_io_context = &io_context;
+        m_master = std::make_unique<boost::asio::posix::stream_descriptor>(io_context, master_fd);
+        master_fd = -1;
+        m_writing = false;
+        m_write_queue.clear();
         state = ProcessState::Running;
         shouldStop = false;
-        readThread = std::thread(&ProcessManager::readOutput, this);
+#ifdef SYS_pidfd_open
+        // The child's exit is reported by a pidfd turning readable; without one (before Linux
+        // 5.3, or elsewhere) by the master failing to read once the slave side is closed
+        int pidfd = static_cast<int>(syscall(SYS_pidfd_open, pid, 0));
+        if (pidfd >= 0) {
+            m_exit = std::make_unique<boost::asio::posix::stream_descriptor>(io_context, pidfd);
+            m_exit->async_wait(boost::asio::posix::stream_descriptor::wait_read,
+                [this](const boost::system::error_code& error) {
+                    if (!error && m_exit) onExit();
+                });
+        }
+#endif
+        boost::asio::post(io_context, [this]() { readOutput(); });
 
         return true;
     }
 }
 
+// Runs on the io thread; the buffer read into becomes the frame's payload as it is
 void ProcessManager::readOutput() {
-    constexpr size_t bufferSize = 4096;
-    std::array<char, bufferSize> buffer;
-
-    while (!shouldStop) {
-        fd_set readfds;
-        FD_ZERO(&readfds);
-        FD_SET(master_fd, &readfds);
-
-        struct timeval timeout;
-        timeout.tv_sec = 0;
-        timeout.tv_usec = 100000; // 100ms
-
-        int ready = select(master_fd + 1, &readfds, NULL, NULL, &timeout);
-
-        if (ready > 0 && FD_ISSET(master_fd, &readfds)) {
-            ssize_t bytesRead = read(master_fd, buffer.data(), bufferSize - 1);
-
-            if (bytesRead > 0) {
-                buffer[bytesRead] = '\0';
-                std::string output(buffer.data());
-
-                checkMarker(output);
-
-                {
-                    std::lock_guard<std::mutex> lock(outputMutex);
-                    outputQueue.push({ output, false });
-                }
-
-                if (outputCallback) {
-                    outputCallback(output, false);
-                }
+    if (!m_master || !m_master->is_open()) return;
+    auto buffer = std::make_shared<std::vector<uint8_t>>(PTY_READ_SIZE);
+    m_master->async_read_some(boost::asio::buffer(*buffer),
+        [this, buffer](const boost::system::error_code& error, size_t bytesRead) {
+            // Closed by stop(), which may have been queued ahead of this completion
+            if (error == boost::asio::error::operation_aborted || !m_master) return;
+            if (error) { // EOF, or EIO once the child is gone
+                onExit();
+                return;
             }
-            else if (bytesRead == 0) { // EOF reached
-                break;
+            buffer->resize(bytesRead);
+            if (outputCallback) {
+                outputCallback(std::string(buffer->begin(), buffer->end()), false);
             }
-        }
-        else if (ready < 0) { // Error
-            break;
-        }
-
-        // Check if process is still alive
-        int status;
-        if (waitpid(pid, &status, WNOHANG) == pid) {
-            break;
-        }
-    }
+            deliver(*buffer);
+            readOutput();
+        });
+}
 
+void ProcessManager::onExit() {
+    if (state != ProcessState::Running) return;
     state = ProcessState::Stopped;
+    LOG_INFO("cmd process {} exited", pid);
+    // The child is reaped by stop(), so its pid cannot be reused before then
+    boost::system::error_code ec;
+    if (m_master) m_master->close(ec);
+    if (m_exit) m_exit->close(ec);
+}
+
+void ProcessManager::writeNext() {
+    if (m_write_queue.empty() || !m_master || !m_master->is_open()) {
+        m_writing = false;
+        return;
+    }
+    m_writing = true;
+    boost::asio::async_write(*m_master, boost::asio::buffer(m_write_queue.front()),
+        [this](const boost::system::error_code& error, size_t) {
+            if (error == boost::asio::error::operation_aborted || !m_master) return;
+            m_write_queue.pop_front();
+            writeNext();
+        });
 }
 
 bool ProcessManager::sendCommand(const std::string& command) {
-    if (state != ProcessState::Running || master_fd == -1) {
+    if (state != ProcessState::Running || !m_io_context) {
         return false;
     }
 
-    std::string cmd = command + "\n";
-    ssize_t written = write(master_fd, cmd.c_str(), cmd.length());
+    boost::asio::post(*m_io_context, [this, cmd = command + "\n"]() mutable {
+        m_write_queue.push_back(std::move(cmd));
+        if (!m_writing) writeNext();
+    });
+    return true;
+}
 
-    return written == static_cast<ssize_t>(cmd.length());
+bool ProcessManager::interrupt() {
+    if (state != ProcessState::Running || !m_io_context) {
+        return false;
+    }
+
+    // ^C makes the line discipline signal the foreground job; it skips the input waiting
+    // behind the write in progress
+    boost::asio::post(*m_io_context, [this]() {
+        m_write_queue.insert(m_writing && !m_write_queue.empty() ? m_write_queue.begin() + 1 : m_write_queue.begin(), std::string("\x03"));
+        if (!m_writing) writeNext();
+    });
+    return true;
 }
 
-bool ProcessManager::isRunning() const {
-    if (pid > 0) {
-        int status;
-        return waitpid(pid, &status, WNOHANG) == 0;
+bool ProcessManager::resize(uint16_t columns, uint16_t rows) {
+    if (state != ProcessState::Running || !m_io_context) {
+        m_columns = columns;
+        m_rows = rows;
+        return state != ProcessState::Running;
     }
-    return false;
+
+    boost::asio::post(*m_io_context, [this, columns, rows]() {
+        if (!m_master || !m_master->is_open()) return;
+        struct winsize size = {};
+        size.ws_row = rows;
+        size.ws_col = columns;
+        ioctl(m_master->native_handle(), TIOCSWINSZ, &size);
+    });
+    return true;
+}
+
+bool ProcessManager::isRunning() const {
+    return state == ProcessState::Running;
 }
 
 void ProcessManager::stop() {
     shouldStop = true;
 
+    // The descriptors are the io thread's, so they are closed there while it runs. Completions
+    // already queued, and those the close aborts, still refer to this object: a second post,
+    // queued behind them, tells when they have all run.
+    if (m_io_context && !m_io_context->stopped()) {
+        auto closed = std::make_shared<std::promise<void>>();
+        std::future<void> done = closed->get_future();
+        boost::asio::post(*m_io_context, [this, closed]() {
+            m_master.reset();
+            m_exit.reset();
+            boost::asio::post(*m_io_context, [closed]() { closed->set_value(); });
+        });
+        while (done.wait_for(std::chrono::milliseconds(10)) != std::future_status::ready && !m_io_context->stopped()) {}
+    }
+    m_master.reset();
+    m_exit.reset();
+    m_io_context = nullptr;
+
     if (pid > 0) {
+        // An interactive shell ignores SIGTERM but not the hangup of its terminal
+        kill(pid, SIGHUP);
         kill(pid, SIGTERM);
 
         // Wait for process to terminate
         int status;
-        waitpid(pid, &status, 0);
+        auto deadline = std::chrono::steady_clock::now() + PTY_EXIT_GRACE;
+        while (waitpid(pid, &status, WNOHANG) == 0) {
+            if (std::chrono::steady_clock::now() >= deadline) {
+                kill(pid, SIGKILL);
+                waitpid(pid, &status, 0);
+                break;
+            }
+            std::this_thread::sleep_for(std::chrono::milliseconds(10));
+        }
+        pid = -1;
     }
 
-    if (readThread.joinable()) readThread.join();
-
     state = ProcessState::Stopped;
 }
 
@@ -384,18 +467,14 @@ void ProcessManager::cleanup() {
 }
 #endif
 
-std::vector<std::string> ProcessManager::getOutput() {
+void ProcessManager::deliver(const std::vector<uint8_t>& output) {
     std::lock_guard<std::mutex> lock(outputMutex);
-    std::vector<std::string> result;
+    if (outputSink) outputSink(output);
+}
 
-    while (!outputQueue.empty()) {
-        result.push_back(outputQueue.front());
-        outputQueue.pop();
-    }
-    if (result.size()) {
-        std::cout << "cmd pop " << result.size() << " outputs from queue" << std::endl;
-    }
-    return result;
+void ProcessManager::setOutputSink(std::function<void(const std::vector<uint8_t>&)> sink) {
+    std::lock_guard<std::mutex> lock(outputMutex);
+    outputSink = std::move(sink);
 }
 
 void ProcessManager::setOutputCallback(std::function<void(const std::string&, bool)> callback) {
@@ -8,6 +8,8 @@
 #include <queue>
 #include <atomic>
 #include <functional>
+#include <memory>
+#include <boost/asio.hpp>
 
 #ifdef _WIN32
 #include <windows.h>
@@ -20,6 +22,10 @@
 
 #include "uRemote.h"
 
+// Size a pty is opened at unless resize() says otherwise
+constexpr uint16_t TERMINAL_COLUMNS = 80;
+constexpr uint16_t TERMINAL_ROWS = 24;
+
 enum class ProcessState {
     NotStarted,
     Running,
@@ -32,11 +38,18 @@ public:
     ProcessManager();
     ~ProcessManager();
 
-    bool start(const std::string& command = "");
+    // On POSIX the pty is read and written on io_context's thread, which must outlive it:
+    // stop() before the io_context is destroyed
+    bool start(boost::asio::io_context& io_context, const std::string& command = "");
 
     bool sendCommand(const std::string& command);
 
-    std::vector<std::string> getOutput();
+    // Sends ^C to the shell ahead of any input still waiting
+    bool interrupt();
+
+    // Sets the pty's size, which signals SIGWINCH to the program in front; before start(), the
+    // size it is opened at. Windows pipes have no size, so there it always returns false.
+    bool resize(uint16_t columns, uint16_t rows);
 
     bool isRunning() const;
 
@@ -44,6 +57,10 @@ public:
 
     void setOutputCallback(std::function<void(const std::string&, bool)> callback);
 
+    // Takes output as it is read, on the thread that reads it; it must keep up, as nothing
+    // is held back for it
+    void setOutputSink(std::function<void(const std::vector<uint8_t>&)> sink);
+
     ProcessState getState() const;
 
     bool busy() const;
@@ -62,19 +79,32 @@ private:
     int master_fd = -1;
     int slave_fd = -1;
     pid_t pid = -1;
+
+    // Only touched on the io thread once started
+    boost::asio::io_context* m_io_context = nullptr;
+    std::unique_ptr<boost::asio::posix::stream_descriptor> m_master;
+    std::unique_ptr<boost::asio::posix::stream_descriptor> m_exit;  // pidfd of the child
+    std::deque<std::string> m_write_queue;
+    bool m_writing = false;
+
+    void onExit();
+    void writeNext();
 #endif
 
     std::thread readThread;
     std::thread errorThread;
     std::mutex outputMutex;
-    std::queue<std::string> outputQueue;
     std::atomic<ProcessState> state{ ProcessState::NotStarted };
+    uint16_t m_columns = TERMINAL_COLUMNS;
+    uint16_t m_rows = TERMINAL_ROWS;
     std::atomic<bool> shouldStop{ false };
     std::function<void(const std::string&, bool)> outputCallback;
+    std::function<void(const std::vector<uint8_t>&)> outputSink;     // under outputMutex
     const std::string endMarker = "__PROCESS_MANAGER_EOF__";
     bool expectingCompletion = false;
 
     void checkMarker(std::string& output);
+    void deliver(const std::vector<uint8_t>& output);
     void readOutput();
     void readError();
     void cleanup();
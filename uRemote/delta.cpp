@@ -0,0 +1,278 @@
+#include "delta.h"
+#include <algorithm>
+#include <cmath>
+#include <cstring>
+
+#define XXH_INLINE_ALL
+#include <xxhash.h>
+
+// Size of each sequential read while signing or scanning
+constexpr size_t DELTA_READ_SIZE = 1024 * 1024;
+
+uint32_t deltaBlockSize(uint64_t size) {
+    uint64_t block = static_cast<uint64_t>(std::sqrt(static_cast<double>(size)));
+    block = (block + 1023) & ~uint64_t(1023);
+    return static_cast<uint32_t>(std::clamp<uint64_t>(block, DELTA_MIN_BLOCK_SIZE, DELTA_MAX_BLOCK_SIZE));
+}
+
+void RollingChecksum::reset(const uint8_t* data, size_t length) {
+    m_a = 0;
+    m_b = 0;
+    m_length = length;
+    for (size_t i = 0; i < length; ++i) {
+        m_a += data[i];
+        m_b += m_a;
+    }
+}
+
+DeltaStrongHash deltaStrongHash(const uint8_t* data, size_t length) {
+    XXH128_hash_t hash = XXH3_128bits(data, length);
+    return { hash.low64, hash.high64 };
+}
+
+size_t DeltaSignature::blockLength(size_t index) const {
+    if (index + 1 < weak.size()) return block_size;
+    return static_cast<size_t>(basis_size - static_cast<uint64_t>(block_size) * index);
+}
+
+static void putLE(uint8_t* out, uint64_t value, int bytes) {
+    for (int i = 0; i < bytes; ++i)
+        out[i] = static_cast<uint8_t>(value >> (8 * i));
+}
+
+static uint64_t getLE(const uint8_t* in, int bytes) {
+    uint64_t value = 0;
+    for (int i = bytes - 1; i >= 0; --i)
+        value = (value << 8) | in[i];
+    return value;
+}
+
+std::vector<uint8_t> DeltaSignature::serialize() const {
+    std::vector<uint8_t> data(weak.size() * 20);
+    for (size_t i = 0; i < weak.size(); ++i) {
+        uint8_t* out = data.data() + i * 20;
+        putLE(out, weak[i], 4);
+        putLE(out + 4, strong[i].low, 8);
+        putLE(out + 12, strong[i].high, 8);
+    }
+    return data;
+}
+
+bool DeltaSignature::deserialize(const std::vector<uint8_t>& data, uint32_t block_size, uint64_t basis_size, DeltaSignature& signature) {
+    if (block_size == 0 || data.size() % 20 != 0) return false;
+    size_t count = data.size() / 20;
+    if (count != (basis_size + block_size - 1) / block_size) return false;
+    signature.block_size = block_size;
+    signature.basis_size = basis_size;
+    signature.weak.resize(count);
+    signature.strong.resize(count);
+    for (size_t i = 0; i < count; ++i) {
+        const uint8_t* in = data.data() + i * 20;
+        signature.weak[i] = static_cast<uint32_t>(getLE(in, 4));
+        signature.strong[i] = { getLE(in + 4, 8), getLE(in + 12, 8) };
+    }
+    return true;
+}
+
+bool computeDeltaSignature(const DeltaReadFunction& read, uint64_t size, uint32_t block_size, DeltaSignature& signature) {
+    signature.block_size = block_size;
+    signature.basis_size = size;
+    size_t count = static_cast<size_t>((size + block_size - 1) / block_size);
+    signature.weak.clear();
+    signature.strong.clear();
+    signature.weak.reserve(count);
+    signature.strong.reserve(count);
+
+    // Whole blocks per read so no block straddles two reads
+    size_t read_size = std::max<size_t>(DELTA_READ_SIZE / block_size, 1) * block_size;
+    std::vector<uint8_t> buffer(read_size);
+    RollingChecksum checksum;
+    uint64_t offset = 0;
+    while (offset < size) {
+        size_t want = static_cast<size_t>(std::min<uint64_t>(read_size, size - offset));
+        int64_t n = read(buffer.data(), want, offset);
+        if (n != static_cast<int64_t>(want)) return false;
+        for (size_t pos = 0; pos < want; pos += block_size) {
+            size_t length = std::min<size_t>(block_size, want - pos);
+            checksum.reset(buffer.data() + pos, length);
+            signature.weak.push_back(checksum.value());
+            signature.strong.push_back(deltaStrongHash(buffer.data() + pos, length));
+        }
+        offset += want;
+    }
+    return true;
+}
+
+DeltaScanner::DeltaScanner(const DeltaSignature& signature, DeltaReadFunction read, uint64_t size, size_t max_literal)
+    : m_signature(signature), m_read(std::move(read)), m_size(size), m_max_literal(max_literal) {
+    m_index.reserve(signature.blockCount());
+    m_filter.assign((size_t(1) << DELTA_FILTER_BITS) / 64, 0);
+    for (size_t i = 0; i < signature.blockCount(); ++i) {
+        m_index.emplace_back(signature.weak[i], static_cast<uint32_t>(i));
+        uint32_t slot = (signature.weak[i] * 0x9E3779B1u) >> (32 - DELTA_FILTER_BITS);
+        m_filter[slot / 64] |= uint64_t(1) << (slot % 64);
+    }
+    std::sort(m_index.begin(), m_index.end());
+    m_buffer.resize(signature.block_size + DELTA_READ_SIZE);
+    m_literal.reserve(max_literal);
+}
+
+bool DeltaScanner::fill() {
+    // Drop everything before the window and top the buffer up
+    size_t keep = static_cast<size_t>(m_buffer_start + m_buffer_length - m_pos);
+    if (keep > 0)
+        std::memmove(m_buffer.data(), m_buffer.data() + (m_pos - m_buffer_start), keep);
+    m_buffer_start = m_pos;
+    m_buffer_length = keep;
+    while (m_buffer_length < m_buffer.size() && m_buffer_start + m_buffer_length < m_size) {
+        size_t want = static_cast<size_t>(std::min<uint64_t>(m_buffer.size() - m_buffer_length, m_size - m_buffer_start - m_buffer_length));
+        int64_t n = m_read(m_buffer.data() + m_buffer_length, want, m_buffer_start + m_buffer_length);
+        if (n < 0) {
+            m_failed = true;
+            return false;
+        }
+        if (n == 0) {
+            // File shrank while scanning; describe what is there
+            m_size = m_buffer_start + m_buffer_length;
+            break;
+        }
+        m_buffer_length += static_cast<size_t>(n);
+    }
+    return true;
+}
+
+int64_t DeltaScanner::findMatch(const uint8_t* window, size_t length, uint32_t weak) {
+    bool have_strong = false;
+    DeltaStrongHash strong;
+    auto matches = [&](uint32_t block) {
+        if (m_signature.weak[block] != weak || m_signature.blockLength(block) != length) return false;
+        if (!have_strong) {
+            strong = deltaStrongHash(window, length);
+            have_strong = true;
+        }
+        return m_signature.strong[block] == strong;
+    };
+
+    // Continuing the current run keeps the copy instructions long
+    uint32_t preferred = m_run_block + m_run_count;
+    if (m_run_count > 0 && preferred < m_signature.blockCount() && matches(preferred))
+        return preferred;
+
+    if (!filterHit(weak)) return -1;
+    auto range = std::equal_range(m_index.begin(), m_index.end(), std::make_pair(weak, uint32_t(0)),
+        [](const auto& a, const auto& b) { return a.first < b.first; });
+    for (auto it = range.first; it != range.second; ++it) {
+        if (matches(it->second)) return it->second;
+    }
+    return -1;
+}
+
+bool DeltaScanner::emitLiteral(DeltaOp& op) {
+    if (m_literal.empty()) return false;
+    op.kind = DeltaOp::Kind::LITERAL;
+    op.offset = m_literal_start;
+    op.data.swap(m_literal);
+    op.length = op.data.size();
+    m_literal.clear();
+    return true;
+}
+
+bool DeltaScanner::emitRun(DeltaOp& op) {
+    if (m_run_count == 0) return false;
+    op.kind = DeltaOp::Kind::COPY;
+    op.offset = m_run_start;
+    op.data.clear();
+    op.block = m_run_block;
+    op.count = m_run_count;
+    op.length = m_run_length;
+    m_run_count = 0;
+    return true;
+}
+
+bool DeltaScanner::next(DeltaOp& op) {
+    const uint32_t block_size = m_signature.block_size;
+    const size_t last_length = m_signature.blockCount() ? m_signature.blockLength(m_signature.blockCount() - 1) : 0;
+    // Bound the receiver's work per copy instruction
+    const uint64_t max_run = std::max<uint64_t>(m_max_literal * 4, block_size);
+
+    for (;;) {
+        if (m_failed) return false;
+        if (m_pos >= m_size)
+            return emitRun(op) || emitLiteral(op);
+
+        uint64_t need = std::min<uint64_t>(block_size + 1, m_size - m_pos);
+        if (m_pos + need > m_buffer_start + m_buffer_length) {
+            if (!fill()) return false;
+            continue;
+        }
+
+        const uint8_t* window = m_buffer.data() + (m_pos - m_buffer_start);
+        size_t length = static_cast<size_t>(std::min<uint64_t>(block_size, m_size - m_pos));
+        int64_t match = -1;
+        if (length == block_size) {
+            if (!m_have_checksum) {
+                m_checksum.reset(window, length);
+                m_have_checksum = true;
+            }
+            if (m_run_count == 0) {
+                // Fast path: slide over bytes whose checksum cannot match any block
+                size_t index = static_cast<size_t>(m_pos - m_buffer_start);
+                uint64_t slide_end = std::min<uint64_t>(m_buffer_start + m_buffer_length, m_size);
+                size_t max_steps = static_cast<size_t>(std::min<uint64_t>(slide_end - m_pos - block_size, m_max_literal - m_literal.size()));
+                // Locals, so the compiler keeps the checksum in registers despite uint8_t aliasing
+                const uint8_t* buffer = m_buffer.data();
+                const uint64_t* filter = m_filter.data();
+                RollingChecksum checksum = m_checksum;
+                size_t steps = 0;
+                for (; steps < max_steps; ++steps) {
+                    uint32_t slot = (checksum.value() * 0x9E3779B1u) >> (32 - DELTA_FILTER_BITS);
+                    if ((filter[slot / 64] >> (slot % 64)) & 1) break;
+                    checksum.roll(buffer[index + steps], buffer[index + steps + block_size]);
+                }
+                m_checksum = checksum;
+                if (steps > 0) {
+                    if (m_literal.empty()) m_literal_start = m_pos;
+                    m_literal.insert(m_literal.end(), buffer + index, buffer + index + steps);
+                    m_literal_bytes += steps;
+                    m_pos += steps;
+                    if (m_literal.size() >= m_max_literal) return emitLiteral(op);
+                    continue;
+                }
+            }
+            match = findMatch(window, length, m_checksum.value());
+        } else if (length == last_length) {
+            // The tail can only match the basis' short last block, at exactly one position
+            RollingChecksum tail;
+            tail.reset(window, length);
+            match = findMatch(window, length, tail.value());
+        }
+
+        if (match >= 0) {
+            if (!m_literal.empty()) return emitLiteral(op);
+            if (m_run_count > 0 && (static_cast<uint32_t>(match) != m_run_block + m_run_count || m_run_length + length > max_run))
+                return emitRun(op);
+            if (m_run_count == 0) {
+                m_run_block = static_cast<uint32_t>(match);
+                m_run_start = m_pos;
+                m_run_length = 0;
+            }
+            ++m_run_count;
+            m_run_length += length;
+            m_matched_bytes += length;
+            m_pos += length;
+            m_have_checksum = false;
+            continue;
+        }
+
+        if (m_run_count > 0) return emitRun(op);
+        if (m_literal.empty()) m_literal_start = m_pos;
+        m_literal.push_back(window[0]);
+        ++m_literal_bytes;
+        if (m_have_checksum && m_pos + block_size < m_size)
+            m_checksum.roll(window[0], window[block_size]);
+        else
+            m_have_checksum = false;
+        ++m_pos;
+        if (m_literal.size() >= m_max_literal) return emitLiteral(op);
+    }
+}
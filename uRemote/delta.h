@@ -0,0 +1,130 @@
+#pragma once
+#include <cstdint>
+#include <cstddef>
+#include <vector>
+#include <functional>
+
+// rsync-style delta encoding. The receiver describes the copy it already has as a list of
+// per-block signatures (a rolling weak checksum plus a 128-bit XXH3 strong hash); the sender
+// slides a window over its version of the file and emits block references wherever a block
+// matches and literal bytes everywhere else.
+
+constexpr uint32_t DELTA_MIN_BLOCK_SIZE = 2 * 1024;
+constexpr uint32_t DELTA_MAX_BLOCK_SIZE = 128 * 1024;
+// Smaller files are cheaper to send whole than to sign
+constexpr uint64_t DELTA_MIN_FILE_SIZE = 1024 * 1024;
+// log2 of the scanner's weak checksum filter size in bits
+constexpr uint32_t DELTA_FILTER_BITS = 20;
+
+// Positional read: returns bytes read (0 at end of file) or -1 on error
+using DeltaReadFunction = std::function<int64_t(uint8_t* buffer, size_t length, uint64_t offset)>;
+
+// Block size for a basis file of `size` bytes: about sqrt(size), so a 2 GB file gets ~46 KB
+// blocks and ~1 MB of signatures
+uint32_t deltaBlockSize(uint64_t size);
+
+// Adler-style checksum that can be rolled forward one byte at a time
+class RollingChecksum {
+public:
+    void reset(const uint8_t* data, size_t length);
+    void roll(uint8_t out, uint8_t in) {
+        m_a += in - out;
+        m_b += m_a - static_cast<uint32_t>(m_length) * out;
+    }
+    uint32_t value() const { return (m_a & 0xffff) | (m_b << 16); }
+
+private:
+    uint32_t m_a = 0;
+    uint32_t m_b = 0;
+    size_t m_length = 0;
+};
+
+struct DeltaStrongHash {
+    uint64_t low = 0;
+    uint64_t high = 0;
+    bool operator==(const DeltaStrongHash& other) const { return low == other.low && high == other.high; }
+};
+
+DeltaStrongHash deltaStrongHash(const uint8_t* data, size_t length);
+
+struct DeltaSignature {
+    uint32_t block_size = 0;
+    uint64_t basis_size = 0;
+    std::vector<uint32_t> weak;
+    std::vector<DeltaStrongHash> strong;
+
+    size_t blockCount() const { return weak.size(); }
+    size_t blockLength(size_t index) const;
+
+    // Packed little-endian [weak u32][strong 16 bytes] per block
+    std::vector<uint8_t> serialize() const;
+    static bool deserialize(const std::vector<uint8_t>& data, uint32_t block_size, uint64_t basis_size, DeltaSignature& signature);
+};
+
+// Reads `size` bytes through `read` and signs every block; false on a read error
+bool computeDeltaSignature(const DeltaReadFunction& read, uint64_t size, uint32_t block_size, DeltaSignature& signature);
+
+struct DeltaOp {
+    enum class Kind {
+        LITERAL,
+        COPY
+    };
+    Kind kind = Kind::LITERAL;
+    uint64_t offset = 0;          // position in the new file
+    std::vector<uint8_t> data;    // LITERAL
+    uint32_t block = 0;           // COPY: first basis block
+    uint32_t count = 0;           // COPY: consecutive blocks
+    uint64_t length = 0;          // bytes produced in the new file
+};
+
+// Streams the delta of a file against a signature in file order. Memory use is bounded by
+// the read window plus `max_literal`, independent of the file size.
+class DeltaScanner {
+public:
+    DeltaScanner(const DeltaSignature& signature, DeltaReadFunction read, uint64_t size, size_t max_literal);
+
+    // Produces the next instruction; false once the whole file is described or a read failed
+    bool next(DeltaOp& op);
+    bool failed() const { return m_failed; }
+
+    uint64_t literalBytes() const { return m_literal_bytes; }
+    uint64_t matchedBytes() const { return m_matched_bytes; }
+
+private:
+    bool fill();
+    bool filterHit(uint32_t weak) const {
+        uint32_t slot = (weak * 0x9E3779B1u) >> (32 - DELTA_FILTER_BITS);
+        return (m_filter[slot / 64] >> (slot % 64)) & 1;
+    }
+    int64_t findMatch(const uint8_t* window, size_t length, uint32_t weak);
+    bool emitLiteral(DeltaOp& op);
+    bool emitRun(DeltaOp& op);
+
+    const DeltaSignature& m_signature;
+    DeltaReadFunction m_read;
+    uint64_t m_size;
+    size_t m_max_literal;
+
+    // weak checksum -> block, sorted for equal_range, behind a bit filter that rejects most misses
+    std::vector<std::pair<uint32_t, uint32_t>> m_index;
+    std::vector<uint64_t> m_filter;
+
+    std::vector<uint8_t> m_buffer;
+    uint64_t m_buffer_start = 0;  // file offset of m_buffer[0]
+    size_t m_buffer_length = 0;
+
+    uint64_t m_pos = 0;           // start of the current window
+    RollingChecksum m_checksum;
+    bool m_have_checksum = false;
+
+    std::vector<uint8_t> m_literal;
+    uint64_t m_literal_start = 0;
+    uint32_t m_run_block = 0;
+    uint32_t m_run_count = 0;
+    uint64_t m_run_start = 0;
+    uint64_t m_run_length = 0;
+
+    uint64_t m_literal_bytes = 0;
+    uint64_t m_matched_bytes = 0;
+    bool m_failed = false;
+};
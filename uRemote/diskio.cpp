@@ -0,0 +1,280 @@
+#include "diskio.h"
+#include "logger.h"
+#include <deque>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <atomic>
+#include <algorithm>
+#include <cstring>
+
+#ifdef __linux__
+#include <linux/io_uring.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+#include <unistd.h>
+#include <cerrno>
+#include <ctime>
+#endif
+
+DiskReader::DiskReader(size_t buffer_count, size_t buffer_size)
+    : m_buffer_count(buffer_count), m_buffer_size(buffer_size), m_memory(buffer_count * buffer_size) {
+    m_free.reserve(buffer_count);
+    for (size_t i = buffer_count; i > 0; --i)
+        m_free.push_back(i - 1);
+}
+
+bool DiskReader::read(NativeFile file, uint32_t id, uint64_t offset, size_t length) {
+    if (m_free.empty()) return false;
+    Request request;
+    request.file = file;
+    request.id = id;
+    request.offset = offset;
+    request.length = std::min(length, m_buffer_size);
+    request.buffer = m_free.back();
+    m_free.pop_back();
+    queue(request);
+    return true;
+}
+
+// Fallback backend: blocking reads on a small thread pool
+class PoolDiskReader : public DiskReader {
+public:
+    PoolDiskReader(size_t buffer_count, size_t buffer_size, size_t threads) : DiskReader(buffer_count, buffer_size) {
+        for (size_t i = 0; i < std::max<size_t>(threads, 1); ++i)
+            m_threads.emplace_back(&PoolDiskReader::run, this);
+    }
+
+    ~PoolDiskReader() override {
+        {
+            std::lock_guard<std::mutex> lock(m_mutex);
+            m_stop = true;
+        }
+        m_request_cv.notify_all();
+        for (auto& thread : m_threads)
+            thread.join();
+    }
+
+    const char* name() const override { return "pread pool"; }
+
+    void submit() override {
+        if (m_staged.empty()) return;
+        {
+            std::lock_guard<std::mutex> lock(m_mutex);
+            for (const auto& request : m_staged)
+                m_requests.push_back(request);
+        }
+        m_staged.clear();
+        m_request_cv.notify_all();
+    }
+
+    void wait(std::vector<Completion>& completions, std::chrono::milliseconds timeout) override {
+        std::unique_lock<std::mutex> lock(m_mutex);
+        m_done_cv.wait_for(lock, timeout, [this]() { return !m_done.empty(); });
+        for (const auto& completion : m_done)
+            completions.push_back(completion);
+        m_done.clear();
+    }
+
+protected:
+    void queue(const Request& request) override {
+        m_staged.push_back(request);
+    }
+
+private:
+    void run() {
+        for (;;) {
+            Request request;
+            {
+                std::unique_lock<std::mutex> lock(m_mutex);
+                m_request_cv.wait(lock, [this]() { return m_stop || !m_requests.empty(); });
+                if (m_stop) return;
+                request = m_requests.front();
+                m_requests.pop_front();
+            }
+            Completion completion;
+            completion.id = request.id;
+            completion.offset = request.offset;
+            completion.buffer = request.buffer;
+            completion.result = readFileAt(request.file, mutableBuffer(request.buffer), request.length, request.offset);
+            {
+                std::lock_guard<std::mutex> lock(m_mutex);
+                m_done.push_back(completion);
+            }
+            m_done_cv.notify_one();
+        }
+    }
+
+    std::vector<std::thread> m_threads;
+    std::vector<Request> m_staged;
+    std::mutex m_mutex;
+    std::condition_variable m_request_cv;
+    std::condition_variable m_done_cv;
+    std::deque<Request> m_requests;
+    std::vector<Completion> m_done;
+    bool m_stop = false;
+};
+
+#ifdef __linux__
+// io_uring backend on the raw system calls. The pool is registered once, so reads skip the
+// per-operation page pinning, and every read queued between two submit() calls goes to the
+// kernel in a single io_uring_enter.
+class UringDiskReader : public DiskReader {
+public:
+    UringDiskReader(size_t buffer_count, size_t buffer_size) : DiskReader(buffer_count, buffer_size) {
+    }
+
+    ~UringDiskReader() override {
+        // Reads still in flight write into m_memory; let them land before it is freed
+        while (m_inflight > 0 && m_ring_fd >= 0) {
+            std::vector<Completion> ignored;
+            wait(ignored, std::chrono::milliseconds(100));
+        }
+        if (m_sqes) munmap(m_sqes, m_sqes_size);
+        if (m_cq_ring && m_cq_ring != m_sq_ring) munmap(m_cq_ring, m_cq_ring_size);
+        if (m_sq_ring) munmap(m_sq_ring, m_sq_ring_size);
+        if (m_ring_fd >= 0) ::close(m_ring_fd);
+    }
+
+    // False when the kernel lacks io_uring, forbids it, or predates timed waits
+    bool init() {
+        io_uring_params params{};
+        m_ring_fd = static_cast<int>(::syscall(__NR_io_uring_setup, static_cast<unsigned>(m_buffer_count), &params));
+        if (m_ring_fd < 0) return false;
+        if (!(params.features & IORING_FEAT_EXT_ARG)) return false;
+
+        m_sq_ring_size = params.sq_off.array + params.sq_entries * sizeof(uint32_t);
+        m_cq_ring_size = params.cq_off.cqes + params.cq_entries * sizeof(io_uring_cqe);
+        bool single_mmap = params.features & IORING_FEAT_SINGLE_MMAP;
+        if (single_mmap) m_sq_ring_size = m_cq_ring_size = std::max(m_sq_ring_size, m_cq_ring_size);
+        m_sq_ring = map(m_sq_ring_size, IORING_OFF_SQ_RING);
+        if (!m_sq_ring) return false;
+        m_cq_ring = single_mmap ? m_sq_ring : map(m_cq_ring_size, IORING_OFF_CQ_RING);
+        if (!m_cq_ring) return false;
+        m_sqes_size = params.sq_entries * sizeof(io_uring_sqe);
+        m_sqes = static_cast<io_uring_sqe*>(map(m_sqes_size, IORING_OFF_SQES));
+        if (!m_sqes) return false;
+
+        auto* sq = static_cast<uint8_t*>(m_sq_ring);
+        m_sq_tail = reinterpret_cast<std::atomic<uint32_t>*>(sq + params.sq_off.tail);
+        m_sq_mask = *reinterpret_cast<uint32_t*>(sq + params.sq_off.ring_mask);
+        m_sq_array = reinterpret_cast<uint32_t*>(sq + params.sq_off.array);
+        auto* cq = static_cast<uint8_t*>(m_cq_ring);
+        m_cq_head = reinterpret_cast<std::atomic<uint32_t>*>(cq + params.cq_off.head);
+        m_cq_tail = reinterpret_cast<std::atomic<uint32_t>*>(cq + params.cq_off.tail);
+        m_cq_mask = *reinterpret_cast<uint32_t*>(cq + params.cq_off.ring_mask);
+        m_cqes = reinterpret_cast<io_uring_cqe*>(cq + params.cq_off.cqes);
+        m_local_tail = m_sq_tail->load(std::memory_order_relaxed);
+
+        std::vector<iovec> iovecs(m_buffer_count);
+        for (size_t i = 0; i < m_buffer_count; ++i)
+            iovecs[i] = { mutableBuffer(i), m_buffer_size };
+        // Registration can fail under a low RLIMIT_MEMLOCK; plain READ still beats the pool then
+        m_fixed = ::syscall(__NR_io_uring_register, m_ring_fd, IORING_REGISTER_BUFFERS, iovecs.data(), static_cast<unsigned>(iovecs.size())) == 0;
+        if (!m_fixed) LOG_WARN("io_uring: could not register read buffers ({}), using unregistered reads", std::strerror(errno));
+        m_requests.resize(m_buffer_count);
+        return true;
+    }
+
+    const char* name() const override { return m_fixed ? "io_uring (fixed buffers)" : "io_uring"; }
+
+    void submit() override {
+        uint32_t pending = m_local_tail - m_sq_tail->load(std::memory_order_relaxed);
+        if (pending == 0) return;
+        m_sq_tail->store(m_local_tail, std::memory_order_release);
+        while (pending > 0) {
+            long n = ::syscall(__NR_io_uring_enter, m_ring_fd, pending, 0, 0, nullptr, 0);
+            if (n < 0) {
+                if (errno == EINTR || errno == EAGAIN || errno == EBUSY) continue;
+                LOG_ERROR("io_uring: submit failed: {}", std::strerror(errno));
+                break;
+            }
+            pending -= static_cast<uint32_t>(n);
+        }
+    }
+
+    void wait(std::vector<Completion>& completions, std::chrono::milliseconds timeout) override {
+        if (reap(completions) > 0 || m_inflight == 0) return;
+        __kernel_timespec ts{};
+        ts.tv_sec = timeout.count() / 1000;
+        ts.tv_nsec = (timeout.count() % 1000) * 1000000;
+        io_uring_getevents_arg arg{};
+        arg.ts = reinterpret_cast<uint64_t>(&ts);
+        ::syscall(__NR_io_uring_enter, m_ring_fd, 0, 1, IORING_ENTER_GETEVENTS | IORING_ENTER_EXT_ARG, &arg, sizeof(arg));
+        reap(completions);
+    }
+
+protected:
+    void queue(const Request& request) override {
+        // One operation per pool buffer, and the ring has as many entries, so it never overflows
+        uint32_t index = m_local_tail & m_sq_mask;
+        io_uring_sqe& sqe = m_sqes[index];
+        std::memset(&sqe, 0, sizeof(sqe));
+        sqe.opcode = m_fixed ? IORING_OP_READ_FIXED : IORING_OP_READ;
+        sqe.fd = request.file;
+        sqe.off = request.offset;
+        sqe.addr = reinterpret_cast<uint64_t>(mutableBuffer(request.buffer));
+        sqe.len = static_cast<uint32_t>(request.length);
+        if (m_fixed) sqe.buf_index = static_cast<uint16_t>(request.buffer);
+        sqe.user_data = request.buffer;
+        m_sq_array[index] = index;
+        m_requests[request.buffer] = request;
+        ++m_local_tail;
+        ++m_inflight;
+    }
+
+private:
+    void* map(size_t size, uint64_t offset) {
+        void* ptr = ::mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, m_ring_fd, static_cast<off_t>(offset));
+        return ptr == MAP_FAILED ? nullptr : ptr;
+    }
+
+    size_t reap(std::vector<Completion>& completions) {
+        uint32_t head = m_cq_head->load(std::memory_order_relaxed);
+        uint32_t tail = m_cq_tail->load(std::memory_order_acquire);
+        size_t count = 0;
+        for (; head != tail; ++head, ++count) {
+            const io_uring_cqe& cqe = m_cqes[head & m_cq_mask];
+            const Request& request = m_requests[static_cast<size_t>(cqe.user_data)];
+            Completion completion;
+            completion.id = request.id;
+            completion.offset = request.offset;
+            completion.buffer = request.buffer;
+            completion.result = cqe.res < 0 ? -1 : cqe.res;
+            completions.push_back(completion);
+            --m_inflight;
+        }
+        m_cq_head->store(head, std::memory_order_release);
+        return count;
+    }
+
+    int m_ring_fd = -1;
+    bool m_fixed = false;
+    void* m_sq_ring = nullptr;
+    void* m_cq_ring = nullptr;
+    size_t m_sq_ring_size = 0;
+    size_t m_cq_ring_size = 0;
+    io_uring_sqe* m_sqes = nullptr;
+    size_t m_sqes_size = 0;
+    std::atomic<uint32_t>* m_sq_tail = nullptr;
+    uint32_t* m_sq_array = nullptr;
+    uint32_t m_sq_mask = 0;
+    uint32_t m_local_tail = 0;
+    std::atomic<uint32_t>* m_cq_head = nullptr;
+    std::atomic<uint32_t>* m_cq_tail = nullptr;
+    uint32_t m_cq_mask = 0;
+    io_uring_cqe* m_cqes = nullptr;
+    std::vector<Request> m_requests;    // by buffer index
+    size_t m_inflight = 0;
+};
+#endif
+
+std::unique_ptr<DiskReader> DiskReader::create(size_t buffer_count, size_t buffer_size, size_t threads) {
+#ifdef __linux__
+    auto uring = std::make_unique<UringDiskReader>(buffer_count, buffer_size);
+    if (uring->init()) return uring;
+    LOG_INFO("io_uring unavailable, reading files on {} threads", threads);
+#endif
+    return std::make_unique<PoolDiskReader>(buffer_count, buffer_size, threads);
+}
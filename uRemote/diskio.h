@@ -0,0 +1,59 @@
+#pragma once
+#include <cstdint>
+#include <cstddef>
+#include <vector>
+#include <memory>
+#include <chrono>
+
+#include "transfer.h"
+
+// Asynchronous positional reads into a fixed pool of equally sized buffers, so one thread can
+// keep many file streams' disk reads in flight while it sends. On Linux the pool is registered
+// with an io_uring and reads are submitted in batches as READ_FIXED operations; elsewhere, or
+// when io_uring is unavailable, a few threads run pread.
+class DiskReader {
+public:
+    struct Completion {
+        uint32_t id = 0;        // caller's stream id
+        uint64_t offset = 0;
+        int64_t result = 0;     // bytes read, 0 at end of file, -1 on error
+        size_t buffer = 0;      // pool buffer holding the data until release()
+    };
+
+    // io_uring when the kernel allows it, otherwise a pread thread pool
+    static std::unique_ptr<DiskReader> create(size_t buffer_count, size_t buffer_size, size_t threads);
+    virtual ~DiskReader() = default;
+
+    virtual const char* name() const = 0;
+
+    size_t bufferSize() const { return m_buffer_size; }
+    size_t freeBuffers() const { return m_free.size(); }
+    // Queues a read of up to bufferSize() bytes; false when no buffer is free. The file must
+    // stay open until the read completes.
+    bool read(NativeFile file, uint32_t id, uint64_t offset, size_t length);
+    // Starts everything queued since the last call, in one batch where the backend allows it
+    virtual void submit() = 0;
+    // Appends finished reads, waiting up to `timeout` if none are ready
+    virtual void wait(std::vector<Completion>& completions, std::chrono::milliseconds timeout) = 0;
+
+    const uint8_t* buffer(size_t index) const { return m_memory.data() + index * m_buffer_size; }
+    void release(size_t index) { m_free.push_back(index); }
+
+protected:
+    struct Request {
+        NativeFile file;
+        uint32_t id = 0;
+        uint64_t offset = 0;
+        size_t length = 0;
+        size_t buffer = 0;
+    };
+
+    DiskReader(size_t buffer_count, size_t buffer_size);
+    uint8_t* mutableBuffer(size_t index) { return m_memory.data() + index * m_buffer_size; }
+    virtual void queue(const Request& request) = 0;
+
+    size_t m_buffer_count;
+    size_t m_buffer_size;
+    std::vector<uint8_t> m_memory;
+    std::vector<size_t> m_free;
+};
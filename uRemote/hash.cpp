@@ -0,0 +1,87 @@
+#include "hash.h"
+#include <openssl/evp.h>
+#include <chrono>
+
+#define XXH_INLINE_ALL
+#include <xxhash.h>
+
+Sha256::Sha256() : m_ctx(EVP_MD_CTX_new()) {
+    reset();
+}
+
+Sha256::~Sha256() {
+    EVP_MD_CTX_free(m_ctx);
+}
+
+void Sha256::reset() {
+    EVP_DigestInit_ex(m_ctx, EVP_sha256(), nullptr);
+}
+
+void Sha256::update(const uint8_t* data, size_t length) {
+    EVP_DigestUpdate(m_ctx, data, length);
+}
+
+std::string Sha256::finishHex() {
+    unsigned char digest[EVP_MAX_MD_SIZE];
+    unsigned int length = 0;
+    EVP_DigestFinal_ex(m_ctx, digest, &length);
+    return toHex(digest, length);
+}
+
+std::string toHex(const uint8_t* data, size_t length) {
+    static const char digits[] = "0123456789abcdef";
+    std::string hex(length * 2, '0');
+    for (size_t i = 0; i < length; ++i) {
+        hex[2 * i] = digits[data[i] >> 4];
+        hex[2 * i + 1] = digits[data[i] & 0xf];
+    }
+    return hex;
+}
+
+const char* hashAlgorithmName(HashAlgorithm algorithm) {
+    switch (algorithm) {
+    case HashAlgorithm::XXH3: return "xxh3";
+    case HashAlgorithm::SHA256: return "sha256";
+    default: return "none";
+    }
+}
+
+HashAlgorithm parseHashAlgorithm(const std::string& name) {
+    if (name == "xxh3") return HashAlgorithm::XXH3;
+    if (name == "sha256") return HashAlgorithm::SHA256;
+    return HashAlgorithm::NONE;
+}
+
+struct StreamingHash::Xxh3State {
+    XXH3_state_t state;
+};
+
+StreamingHash::StreamingHash(HashAlgorithm algorithm) : m_algorithm(algorithm) {
+    if (algorithm == HashAlgorithm::XXH3) {
+        m_xxh3 = std::make_unique<Xxh3State>();
+        XXH3_128bits_reset(&m_xxh3->state);
+    } else if (algorithm == HashAlgorithm::SHA256) {
+        m_sha256 = std::make_unique<Sha256>();
+    }
+}
+
+StreamingHash::~StreamingHash() = default;
+
+void StreamingHash::update(const uint8_t* data, size_t length) {
+    auto started = std::chrono::steady_clock::now();
+    if (m_xxh3)
+        XXH3_128bits_update(&m_xxh3->state, data, length);
+    else if (m_sha256)
+        m_sha256->update(data, length);
+    m_seconds += std::chrono::duration<double>(std::chrono::steady_clock::now() - started).count();
+}
+
+std::string StreamingHash::finishHex() {
+    if (m_xxh3) {
+        XXH128_canonical_t canonical;
+        XXH128_canonicalFromHash(&canonical, XXH3_128bits_digest(&m_xxh3->state));
+        return toHex(canonical.digest, sizeof(canonical.digest));
+    }
+    if (m_sha256) return m_sha256->finishHex();
+    return std::string();
+}
@@ -0,0 +1,59 @@
+#pragma once
+#include <cstdint>
+#include <cstddef>
+#include <string>
+#include <memory>
+
+// Incremental SHA-256 over OpenSSL's EVP interface, which picks the SHA-NI/AVX2
+// implementation for the running CPU.
+class Sha256 {
+public:
+    Sha256();
+    ~Sha256();
+    Sha256(const Sha256&) = delete;
+    Sha256& operator=(const Sha256&) = delete;
+
+    void update(const uint8_t* data, size_t length);
+    // Lowercase hex digest; the object must be reset() before reuse
+    std::string finishHex();
+    void reset();
+
+private:
+    struct evp_md_ctx_st* m_ctx;
+};
+
+std::string toHex(const uint8_t* data, size_t length);
+
+// End-to-end check of a download: both sides hash the bytes of the transfer as they stream
+enum class HashAlgorithm {
+    NONE,
+    XXH3,      // XXH3-128, fast enough to never limit the transfer
+    SHA256
+};
+
+// "none", "xxh3" or "sha256"; unknown names parse as NONE
+const char* hashAlgorithmName(HashAlgorithm algorithm);
+HashAlgorithm parseHashAlgorithm(const std::string& name);
+
+class StreamingHash {
+public:
+    explicit StreamingHash(HashAlgorithm algorithm);
+    ~StreamingHash();
+    StreamingHash(const StreamingHash&) = delete;
+    StreamingHash& operator=(const StreamingHash&) = delete;
+
+    HashAlgorithm algorithm() const { return m_algorithm; }
+    void update(const uint8_t* data, size_t length);
+    // Lowercase hex digest of everything passed to update()
+    std::string finishHex();
+    // Time spent in update(), for throughput logs
+    double seconds() const { return m_seconds; }
+
+private:
+    struct Xxh3State;
+
+    HashAlgorithm m_algorithm;
+    std::unique_ptr<Xxh3State> m_xxh3;
+    std::unique_ptr<Sha256> m_sha256;
+    double m_seconds = 0.0;
+};
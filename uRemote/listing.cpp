@@ -0,0 +1,687 @@
+#include "listing.h"
+#include "logger.h"
+#include <atomic>
+#include <thread>
+#include <random>
+#include <unordered_set>
+#ifdef __linux__
+#include <sys/inotify.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#include <dirent.h>
+#endif
+
+#ifdef __linux__
+namespace {
+
+struct LinuxDirent64 {
+    uint64_t d_ino;
+    int64_t d_off;
+    unsigned short d_reclen;
+    unsigned char d_type;
+    char d_name[1];
+};
+
+// Fills in type, size and modification time of `info.name` below the directory `dir`,
+// following symlinks as std::filesystem does. A dangling symlink keeps the entry's own type.
+void statEntry(int dir, FileInfo& info, unsigned char type) {
+#ifdef STATX_TYPE
+    struct statx st;
+    // Cached attributes are fine for a listing and save network filesystems a round trip
+    if (statx(dir, info.name.c_str(), AT_STATX_DONT_SYNC, STATX_TYPE | STATX_SIZE | STATX_MTIME, &st) == 0) {
+        info.isDirectory = S_ISDIR(st.stx_mode);
+        info.size = info.isDirectory ? 0 : st.stx_size;
+        info.modified = st.stx_mtime.tv_sec;
+        return;
+    }
+#else
+    struct stat st;
+    if (fstatat(dir, info.name.c_str(), &st, 0) == 0) {
+        info.isDirectory = S_ISDIR(st.st_mode);
+        info.size = info.isDirectory ? 0 : st.st_size;
+        info.modified = st.st_mtime;
+        return;
+    }
+#endif
+    info.isDirectory = type == DT_DIR;
+}
+
+// Names and types come in batches from getdents64, then one statx per entry. The first
+// LISTING_PROBE_ENTRIES are stat'ed in turn and timed; if that was slow, the rest are
+// spread over a few threads so the round trips overlap.
+bool listLinux(const std::string& path, std::vector<FileInfo>& files, unsigned& threads_used) {
+    int dir = open(path.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (dir < 0) return false;
+    std::vector<unsigned char> types;
+    std::vector<char> buffer(256 * 1024);
+    for (;;) {
+        long n = syscall(SYS_getdents64, dir, buffer.data(), buffer.size());
+        if (n < 0) {
+            close(dir);
+            return false;
+        }
+        if (n == 0) break;
+        for (long offset = 0; offset < n;) {
+            const auto* entry = reinterpret_cast<const LinuxDirent64*>(buffer.data() + offset);
+            offset += entry->d_reclen;
+            const char* name = entry->d_name;
+            if (name[0] == '.' && (name[1] == '\0' || (name[1] == '.' && name[2] == '\0'))) continue;
+            files.emplace_back();
+            files.back().name = name;
+            types.push_back(entry->d_type);
+        }
+    }
+
+    size_t probe = std::min(files.size(), LISTING_PROBE_ENTRIES);
+    auto started = std::chrono::steady_clock::now();
+    for (size_t i = 0; i < probe; ++i)
+        statEntry(dir, files[i], types[i]);
+    auto per_entry = (std::chrono::steady_clock::now() - started) / static_cast<int64_t>(std::max<size_t>(probe, 1));
+
+    size_t rest = files.size() - probe;
+    threads_used = 1;
+    if (per_entry > LISTING_SLOW_STAT && rest > LISTING_PROBE_ENTRIES) {
+        threads_used = static_cast<unsigned>(std::min<size_t>(LISTING_MAX_THREADS, rest / LISTING_PROBE_ENTRIES));
+        std::atomic<size_t> next{ probe };
+        auto work = [&]() {
+            constexpr size_t batch = 16;
+            for (;;) {
+                size_t first = next.fetch_add(batch);
+                if (first >= files.size()) break;
+                for (size_t i = first; i < std::min(first + batch, files.size()); ++i)
+                    statEntry(dir, files[i], types[i]);
+            }
+        };
+        std::vector<std::thread> pool;
+        for (unsigned i = 1; i < threads_used; ++i)
+            pool.emplace_back(work);
+        work();
+        for (auto& thread : pool)
+            thread.join();
+    } else {
+        for (size_t i = probe; i < files.size(); ++i)
+            statEntry(dir, files[i], types[i]);
+    }
+    close(dir);
+    return true;
+}
+
+} // namespace
+#else
+static bool listPortable(const std::filesystem::path& dir, std::vector<FileInfo>& files) {
+    std::error_code ec;
+    for (auto it = std::filesystem::directory_iterator(dir, ec); !ec && it != std::filesystem::directory_iterator(); it.increment(ec)) {
+        FileInfo info;
+        info.name = it->path().filename().string();
+        std::error_code entry_ec;
+        info.isDirectory = it->is_directory(entry_ec);
+        if (!info.isDirectory) {
+            uint64_t size = it->file_size(entry_ec);
+            info.size = entry_ec ? 0 : size;
+        }
+        auto time = it->last_write_time(entry_ec);
+        if (!entry_ec)
+            info.modified = std::chrono::system_clock::to_time_t(std::chrono::clock_cast<std::chrono::system_clock>(time));
+        files.push_back(std::move(info));
+    }
+    return !ec;
+}
+#endif
+
+bool listingOrder(const FileRef& a, const FileRef& b) {
+    if (a.isDirectory != b.isDirectory) {
+        return a.isDirectory > b.isDirectory;
+    }
+    return a.name < b.name;
+}
+
+std::pair<bool, DirectoryListing> getDirectoryListing(const std::string& path) {
+    DirectoryListing listing;
+    listing.path = path;
+    std::error_code ec;
+    std::filesystem::path dir(path);
+    if (path.empty()) {
+        dir = std::filesystem::current_path(ec);
+        listing.path = dir.string();
+    }
+    if (!std::filesystem::is_directory(dir, ec)) {
+        return {false, listing};
+    }
+
+    auto started = std::chrono::steady_clock::now();
+    unsigned threads = 1;
+    std::vector<FileInfo> files;
+#ifdef __linux__
+    bool success = listLinux(dir.string(), files, threads);
+#else
+    bool success = listPortable(dir, files);
+#endif
+    if (!success) {
+        LOG_ERROR("Error listing directory {}: {}", listing.path, std::strerror(errno));
+        return {false, listing};
+    }
+
+    std::sort(files.begin(), files.end(), [](const FileInfo& a, const FileInfo& b) { return listingOrder(a, b); });
+    size_t name_bytes = 0;
+    for (const auto& file : files) name_bytes += file.name.size();
+    listing.files.reserve(files.size(), name_bytes);
+    for (const auto& file : files) listing.files.push_back(file);
+    LOG_DEBUG("listed {} entries of {} in {} ms on {} threads", listing.files.size(), listing.path,
+        std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - started).count(), threads);
+    return {true, listing};
+}
+
+ListingService::ListingService(SendFunction send) : m_send(std::move(send)) {
+    // 31 bits: BSON stores integers signed, and cannot take a version with the top bit set
+    m_epoch = static_cast<uint64_t>(std::random_device{}() & 0x7fffffff) << 32;
+}
+
+ListingService::~ListingService() {
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        m_stop = true;
+        m_jobs.clear();
+        m_prefetches.clear();
+    }
+    m_cv.notify_all();
+    if (m_worker.joinable()) m_worker.join();
+#ifdef __linux__
+    if (m_fd >= 0) close(m_fd);
+#endif
+}
+
+void ListingService::request(const FilesystemRequest& request) {
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        if (!request.prefetch) {
+            m_jobs.push_back(request);
+        } else {
+            auto queued = std::find_if(m_prefetches.begin(), m_prefetches.end(),
+                [&](const FilesystemRequest& other) { return other.path == request.path; });
+            if (queued != m_prefetches.end()) m_prefetches.erase(queued);
+            m_prefetches.push_back(request);
+            if (m_prefetches.size() > LISTING_PREFETCH_QUEUE) m_prefetches.pop_front();
+        }
+        start();
+    }
+    m_cv.notify_one();
+}
+
+void ListingService::start() {
+    if (m_worker.joinable()) return;
+#ifdef __linux__
+    m_fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+    if (m_fd < 0) LOG_WARN("listing cache: inotify unavailable ({}), every listing is read again", std::strerror(errno));
+#endif
+    m_worker = std::thread(&ListingService::run, this);
+}
+
+bool ListingService::superseded() {
+    std::lock_guard<std::mutex> lock(m_mutex);
+    return !m_jobs.empty() || m_stop;
+}
+
+void ListingService::run() {
+    for (;;) {
+        FilesystemRequest job;
+        bool have_job = false;
+        std::optional<std::vector<std::string>> watch;
+        {
+            std::unique_lock<std::mutex> lock(m_mutex);
+            auto ready = [this]() { return m_stop || !m_jobs.empty() || !m_prefetches.empty() || m_watch_changed; };
+            // While directories are watched, wake up now and then to look for their changes
+            if (m_watched.empty()) m_cv.wait(lock, ready);
+            else m_cv.wait_for(lock, LISTING_PUSH_POLL, ready);
+            if (m_stop) break;
+            if (m_watch_changed) {
+                watch = std::move(m_watch_paths);
+                m_watch_paths.clear();
+                m_watch_changed = false;
+            }
+            // What the user waits for goes first; of the guesses, the latest
+            if (!m_jobs.empty()) {
+                job = std::move(m_jobs.front());
+                m_jobs.pop_front();
+                have_job = true;
+            } else if (!m_prefetches.empty()) {
+                job = std::move(m_prefetches.back());
+                m_prefetches.pop_back();
+                have_job = true;
+            }
+        }
+        if (watch) applyWatch(std::move(*watch));
+        if (have_job) respond(job);
+        if (!m_watched.empty()) pushChanges();
+    }
+}
+
+void ListingService::drainEvents() {
+#ifdef __linux__
+    if (m_fd < 0) return;
+    alignas(inotify_event) char buffer[16 * 1024];
+    auto now = std::chrono::steady_clock::now();
+    auto changed = [](Entry& entry, std::chrono::steady_clock::time_point now) {
+        entry.stale = true;
+        if (!entry.changed) entry.changed_first = now;
+        entry.changed = true;
+        entry.changed_last = now;
+    };
+    for (;;) {
+        ssize_t n = read(m_fd, buffer, sizeof(buffer));
+        if (n <= 0) break;
+        for (char* p = buffer; p < buffer + n;) {
+            const auto* event = reinterpret_cast<const inotify_event*>(p);
+            p += sizeof(inotify_event) + event->len;
+            if (event->mask & IN_Q_OVERFLOW) {
+                for (auto& [path, entry] : m_entries) changed(entry, now);
+                continue;
+            }
+            auto watch = m_watches.find(event->wd);
+            if (watch == m_watches.end()) continue;
+            auto it = m_entries.find(watch->second);
+            if (it != m_entries.end()) {
+                changed(it->second, now);
+                if (event->mask & IN_IGNORED) it->second.wd = -1;
+            }
+            if (event->mask & IN_IGNORED) m_watches.erase(watch);
+        }
+    }
+#endif
+}
+
+void ListingService::forget(std::unordered_map<std::string, Entry>::iterator it) {
+#ifdef __linux__
+    if (it->second.wd >= 0) {
+        inotify_rm_watch(m_fd, it->second.wd);
+        m_watches.erase(it->second.wd);
+    }
+#endif
+    m_entries.erase(it);
+}
+
+ListingService::Entry* ListingService::current(const std::string& path, bool& listed) {
+    auto it = m_entries.find(path);
+    listed = false;
+    if (it == m_entries.end() || it->second.stale || it->second.wd < 0) {
+        if (it == m_entries.end()) it = m_entries.emplace(path, Entry()).first;
+        Entry& entry = it->second;
+#ifdef __linux__
+        // Watch before reading, so a change made meanwhile marks the new listing stale
+        if (entry.wd < 0 && m_fd >= 0) {
+            entry.wd = inotify_add_watch(m_fd, path.c_str(), IN_CREATE | IN_DELETE | IN_MOVED_FROM | IN_MOVED_TO | IN_MODIFY | IN_ATTRIB |
+                IN_CLOSE_WRITE | IN_DELETE_SELF | IN_MOVE_SELF | IN_ONLYDIR | IN_EXCL_UNLINK);
+            if (entry.wd >= 0) m_watches[entry.wd] = path;
+        }
+#endif
+        entry.stale = false;
+        auto [success, listing] = getDirectoryListing(path);
+        if (!success) {
+            forget(it);
+            return nullptr;
+        }
+        if (entry.listing.version == 0 || listing.files != entry.listing.files) {
+            if (entry.listing.version) {
+                entry.previous = std::move(entry.listing.files);
+                entry.previous_version = entry.listing.version;
+            }
+            entry.listing = std::move(listing);
+            entry.listing.version = m_epoch | ++m_counter;
+            entry.listing.total = entry.listing.files.size();
+            entry.pages.clear();
+        }
+        listed = true;
+    }
+    it->second.last_used = ++m_clock;
+    return &it->second;
+}
+
+void ListingService::difference(const Entry& entry, DirectoryDiff& diff) {
+    // Both sides are sorted the same way, so one merge pass finds the differences
+    const auto& before = entry.previous;
+    const auto& after = entry.listing.files;
+    size_t i = 0, j = 0;
+    while (i < before.size() || j < after.size()) {
+        if (j == after.size() || (i < before.size() && listingOrder(before[i], after[j]))) {
+            diff.removed.emplace_back(before.name(i++));
+        } else if (i == before.size() || listingOrder(after[j], before[i])) {
+            diff.changed.push_back(after[j++]);
+        } else {
+            if (!(before[i] == after[j])) diff.changed.push_back(after[j]);
+            ++i;
+            ++j;
+        }
+    }
+}
+
+void ListingService::respond(const FilesystemRequest& request) {
+    drainEvents();
+    std::string path = request.path;
+    if (path.empty()) {
+        std::error_code ec;
+        path = std::filesystem::current_path(ec).string();
+    }
+
+    bool listed = false;
+    Entry* found = current(path, listed);
+    if (!found) {
+        if (request.prefetch) return;
+        NetworkMessage response;
+        response.fromError("Path not found: " + request.path);
+        m_send(std::move(response));
+        return;
+    }
+    Entry& entry = *found;
+
+    DirectoryDiff diff;
+    diff.path = entry.listing.path;
+    diff.base_version = request.version;
+    diff.version = entry.listing.version;
+    diff.prefetch = request.prefetch;
+    bool send_diff = request.version == entry.listing.version;
+    if (!send_diff && request.version && request.version == entry.previous_version) {
+        difference(entry, diff);
+        // A diff touching most of the directory is no smaller than the listing
+        send_diff = (diff.changed.size() + diff.removed.size()) * 2 < entry.listing.files.size();
+    }
+
+    size_t bytes = 0;
+    size_t pages = 0;
+    if (send_diff) {
+        NetworkMessage response;
+        response.fromDirectoryDiff(diff);
+        bytes = response.data.size();
+        pages = 1;
+        m_send(std::move(response));
+        entry.sent_version = entry.listing.version;
+    } else if (request.prefetch) {
+        // Not worth the link while the user may be waiting for something else
+        if (entry.listing.files.size() > LISTING_PAGE_ENTRIES) {
+            LOG_DEBUG("listing {}: not prefetched, {} entries", path, entry.listing.files.size());
+            return;
+        }
+        DirectoryListing listing = entry.listing;
+        listing.prefetch = true;
+        NetworkMessage response;
+        response.type = MessageType::FILESYSTEM_RESPONSE;
+        response.data = json::to_bson(listing.toJson());
+        bytes = response.data.size();
+        pages = 1;
+        m_send(std::move(response));
+        entry.sent_version = entry.listing.version;
+    } else {
+        const auto& files = entry.listing.files;
+        size_t count = std::max<size_t>(1, (files.size() + LISTING_PAGE_ENTRIES - 1) / LISTING_PAGE_ENTRIES);
+        for (; pages < count; ++pages) {
+            // The client only shows the newest listing it asked for
+            if (pages > 0 && superseded()) break;
+            if (entry.pages.size() == pages) {
+                DirectoryListing page;
+                page.path = entry.listing.path;
+                page.version = entry.listing.version;
+                page.offset = pages * LISTING_PAGE_ENTRIES;
+                page.total = files.size();
+                size_t end = std::min(files.size(), static_cast<size_t>(page.offset) + LISTING_PAGE_ENTRIES);
+                page.files.append(files, page.offset, end);
+                entry.pages.push_back(json::to_bson(page.toJson()));
+            }
+            NetworkMessage response;
+            response.type = MessageType::FILESYSTEM_RESPONSE;
+            response.data = entry.pages[pages];
+            bytes += response.data.size();
+            m_send(std::move(response));
+        }
+        if (pages == count) entry.sent_version = entry.listing.version;
+    }
+    std::string kind = !send_diff ? "full" : diff.changed.empty() && diff.removed.empty() ? "not modified" : "diff";
+    if (request.prefetch) kind += " prefetch";
+    LOG_DEBUG("listing {}: {} ({} entries, {}), {} bytes in {} frames", path, kind, entry.listing.files.size(),
+        listed ? "read" : "cached", bytes, pages);
+
+    evict();
+}
+
+void ListingService::evict() {
+    // Watched directories stay, however long ago they were asked for
+    while (m_entries.size() > LISTING_CACHE_ENTRIES + m_watched.size()) {
+        auto oldest = m_entries.end();
+        for (auto it = m_entries.begin(); it != m_entries.end(); ++it) {
+            if (m_watched.count(it->first)) continue;
+            if (oldest == m_entries.end() || it->second.last_used < oldest->second.last_used) oldest = it;
+        }
+        if (oldest == m_entries.end()) break;
+        forget(oldest);
+    }
+}
+
+void ListingService::watch(const std::vector<std::string>& paths) {
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        if (paths.empty() && !m_worker.joinable()) return;
+        m_watch_paths.assign(paths.begin(), paths.begin() + std::min(paths.size(), LISTING_MAX_WATCHED));
+        m_watch_changed = true;
+        start();
+    }
+    m_cv.notify_one();
+}
+
+void ListingService::applyWatch(std::vector<std::string> paths) {
+    m_watched = std::unordered_set<std::string>(paths.begin(), paths.end());
+    // A directory watched before it was ever listed gets its listing now, so the first
+    // change can already be sent as a diff
+    for (const auto& path : m_watched) {
+        bool listed = false;
+        current(path, listed);
+    }
+    evict();
+    LOG_DEBUG("listing: {} directories watched for the client", m_watched.size());
+}
+
+void ListingService::pushChanges() {
+    drainEvents();
+    auto now = std::chrono::steady_clock::now();
+    if (m_fd < 0 && now - m_polled >= LISTING_PUSH_POLL_FALLBACK) {
+        // Without change notifications, watched directories are read again now and then
+        m_polled = now;
+        for (const auto& path : m_watched) {
+            auto it = m_entries.find(path);
+            if (it == m_entries.end() || it->second.changed) continue;
+            it->second.changed = true;
+            it->second.changed_first = it->second.changed_last = now - LISTING_PUSH_QUIET;
+        }
+    }
+    for (const auto& path : m_watched) {
+        auto it = m_entries.find(path);
+        if (it == m_entries.end() || !it->second.changed) continue;
+        Entry& entry = it->second;
+        // Wait for a burst of changes to settle, but not forever for one that never does
+        if (now - entry.changed_last < LISTING_PUSH_QUIET && now - entry.changed_first < LISTING_PUSH_MAX_DELAY) continue;
+        entry.changed = false;
+        uint64_t held = entry.sent_version;
+
+        DirectoryDiff diff;
+        diff.path = path;
+        diff.pushed = true;
+        bool listed = false;
+        Entry* read = current(path, listed);
+        if (read) {
+            if (read->listing.version == held) continue;
+            diff.path = read->listing.path;
+            diff.version = read->listing.version;
+            // The client holds what was last sent; anything else it has to ask for again
+            if (held && held == read->previous_version) {
+                diff.base_version = held;
+                difference(*read, diff);
+                // Past half the directory, the paged listing it asks for instead is no bigger
+                if ((diff.changed.size() + diff.removed.size()) * 2 >= read->listing.files.size()) {
+                    diff = DirectoryDiff();
+                    diff.path = read->listing.path;
+                    diff.version = read->listing.version;
+                    diff.pushed = true;
+                }
+            }
+            read->sent_version = read->listing.version;
+        }
+        NetworkMessage message;
+        message.fromDirectoryDiff(diff);
+        LOG_DEBUG("listing {}: pushed {} changed, {} removed ({} bytes)", path, diff.changed.size(), diff.removed.size(), message.data.size());
+        m_send(std::move(message));
+    }
+}
+
+FileTreeService::FileTreeService(SendFunction send) : m_send(std::move(send)) {
+}
+
+FileTreeService::~FileTreeService() {
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        m_stop = true;
+        m_jobs.clear();
+    }
+    m_cv.notify_all();
+    if (m_worker.joinable()) m_worker.join();
+}
+
+void FileTreeService::request(const std::string& path) {
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        m_jobs.push_back(path);
+        if (!m_worker.joinable())
+            m_worker = std::thread(&FileTreeService::run, this);
+    }
+    m_cv.notify_one();
+}
+
+void FileTreeService::cancelAll() {
+    std::lock_guard<std::mutex> lock(m_mutex);
+    m_jobs.clear();
+}
+
+void FileTreeService::run() {
+    for (;;) {
+        std::string path;
+        {
+            std::unique_lock<std::mutex> lock(m_mutex);
+            m_cv.wait(lock, [this]() { return m_stop || !m_jobs.empty(); });
+            if (m_stop) break;
+            path = std::move(m_jobs.front());
+            m_jobs.pop_front();
+        }
+        auto started = std::chrono::steady_clock::now();
+        auto [success, tree] = getFileTree(path);
+        NetworkMessage response;
+        if (success) {
+            LOG_DEBUG("file tree of {}: {} files in {} ms", path, tree.files.size(),
+                std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now() - started).count());
+            response.fromFileTreeResponse(tree);
+        } else {
+            response.fromError("Path not found: " + path);
+        }
+        m_send(std::move(response));
+    }
+}
+
+uint64_t RemoteListings::version(const std::string& path) const {
+    auto it = m_listings.find(path);
+    return it == m_listings.end() ? 0 : it->second.listing.version;
+}
+
+const DirectoryListing* RemoteListings::fresh(const std::string& path) {
+    auto it = m_listings.find(path);
+    if (it == m_listings.end() || std::chrono::steady_clock::now() - it->second.received > LISTING_CLIENT_TTL) return nullptr;
+    it->second.last_used = ++m_clock;
+    return &it->second.listing;
+}
+
+void RemoteListings::store(DirectoryListing&& listing) {
+    Held& held = m_listings[listing.path];
+    held.listing = std::move(listing);
+    held.listing.prefetch = false;
+    held.last_used = ++m_clock;
+    held.received = std::chrono::steady_clock::now();
+    while (m_listings.size() > LISTING_CLIENT_ENTRIES) {
+        auto oldest = std::min_element(m_listings.begin(), m_listings.end(),
+            [](const auto& a, const auto& b) { return a.second.last_used < b.second.last_used; });
+        m_listings.erase(oldest);
+    }
+}
+
+const DirectoryListing* RemoteListings::apply(const DirectoryDiff& diff) {
+    auto it = m_listings.find(diff.path);
+    if (it == m_listings.end() || it->second.listing.version != diff.base_version) return nullptr;
+    Held& held = it->second;
+    held.last_used = ++m_clock;
+    held.received = std::chrono::steady_clock::now();
+    if (diff.version == diff.base_version) return &held.listing;
+
+    // Entries kept and entries changed are both in listing order, so one merge rebuilds it
+    const FileTable& before = held.listing.files;
+    const FileTable& changed = diff.changed;
+    std::unordered_set<std::string_view> replaced(diff.removed.begin(), diff.removed.end());
+    for (size_t i = 0; i < changed.size(); ++i) replaced.insert(changed.name(i));
+    FileTable files;
+    files.reserve(before.size() + changed.size(), 0);
+    size_t i = 0, j = 0;
+    while (i < before.size() || j < changed.size()) {
+        if (i < before.size() && replaced.count(before.name(i))) {
+            ++i;
+        } else if (j == changed.size() || (i < before.size() && listingOrder(before[i], changed[j]))) {
+            files.push_back(before[i++]);
+        } else {
+            files.push_back(changed[j++]);
+        }
+    }
+    held.listing.files = std::move(files);
+    held.listing.version = diff.version;
+    held.listing.total = held.listing.files.size();
+    return &held.listing;
+}
+
+ListingPrefetcher::ListingPrefetcher(SendFunction send) : m_send(std::move(send)) {}
+
+void ListingPrefetcher::want(const std::string& path) {
+    if (path.empty() || m_in_flight.count(path)) return;
+    auto queued = std::find(m_wanted.begin(), m_wanted.end(), path);
+    if (queued != m_wanted.end()) {
+        if (queued + 1 == m_wanted.end()) return;
+        m_wanted.erase(queued);
+    }
+    m_wanted.push_back(path);
+    if (m_wanted.size() > LISTING_PREFETCH_QUEUE) m_wanted.pop_front();
+}
+
+void ListingPrefetcher::foreground(bool pending) {
+    m_foreground = pending;
+    m_foreground_since = std::chrono::steady_clock::now();
+}
+
+void ListingPrefetcher::received(const std::string& path) {
+    m_in_flight.erase(path);
+}
+
+void ListingPrefetcher::update(RemoteListings& listings) {
+    auto now = std::chrono::steady_clock::now();
+    for (auto it = m_in_flight.begin(); it != m_in_flight.end();) {
+        if (now - it->second > LISTING_PREFETCH_TIMEOUT) it = m_in_flight.erase(it);
+        else ++it;
+    }
+    // A reply that never came must not hold prefetching off for good
+    if (m_foreground && now - m_foreground_since < LISTING_PREFETCH_TIMEOUT) return;
+
+    while (!m_wanted.empty() && m_in_flight.size() < LISTING_PREFETCH_IN_FLIGHT) {
+        std::string path = std::move(m_wanted.back());
+        m_wanted.pop_back();
+        if (listings.fresh(path)) continue;
+        NetworkMessage request;
+        request.fromFilesystemRequest(path, listings.version(path), true);
+        m_send(std::move(request));
+        m_in_flight[path] = now;
+    }
+}
+
+void ListingPrefetcher::clear() {
+    m_wanted.clear();
+    m_in_flight.clear();
+    m_foreground = false;
+}
@@ -0,0 +1,199 @@
+#pragma once
+#include "uRemote.h"
+#include "network.h"
+#include "transfer.h"
+#include <unordered_map>
+#include <unordered_set>
+#include <optional>
+
+// Entries whose metadata is fetched one by one before deciding whether the filesystem is slow
+// enough to fetch the rest in parallel
+constexpr size_t LISTING_PROBE_ENTRIES = 64;
+// Mean time per metadata call above which the rest are spread over several threads (NFS, SMB)
+constexpr auto LISTING_SLOW_STAT = std::chrono::microseconds(20);
+constexpr unsigned LISTING_MAX_THREADS = 16;
+// Directories whose listings the server keeps, and the client
+constexpr size_t LISTING_CACHE_ENTRIES = 64;
+constexpr size_t LISTING_CLIENT_ENTRIES = 32;
+// Entries per FILESYSTEM_RESPONSE page; the client shows the first page while the rest stream in
+constexpr size_t LISTING_PAGE_ENTRIES = 2000;
+// Prefetching: how long a held listing may be shown without waiting for the server, how long
+// the mouse must rest on a directory before it is fetched, how many prefetches may be
+// outstanding, and how long one is waited for (the server drops those it will not answer)
+constexpr auto LISTING_CLIENT_TTL = std::chrono::seconds(30);
+constexpr auto LISTING_HOVER_DELAY = std::chrono::milliseconds(150);
+constexpr size_t LISTING_PREFETCH_IN_FLIGHT = 2;
+constexpr auto LISTING_PREFETCH_TIMEOUT = std::chrono::seconds(10);
+constexpr size_t LISTING_PREFETCH_QUEUE = 8;
+// Pushed changes: how often the worker looks for them while directories are watched, how
+// long a directory must stay quiet before its changes go out and the most they are held
+// back by one that keeps changing, and how often watched directories are read again where
+// there are no change notifications
+constexpr auto LISTING_PUSH_POLL = std::chrono::milliseconds(50);
+constexpr auto LISTING_PUSH_QUIET = std::chrono::milliseconds(150);
+constexpr auto LISTING_PUSH_MAX_DELAY = std::chrono::milliseconds(1000);
+constexpr auto LISTING_PUSH_POLL_FALLBACK = std::chrono::seconds(2);
+constexpr size_t LISTING_MAX_WATCHED = 256;
+
+// Entries of a directory, directories first, then by name. On Linux the names and types
+// come from getdents64 in large batches and the rest from one statx per entry asking only
+// for type, size and modification time, with cached attributes allowed; elsewhere from
+// std::filesystem, whose directory entries already carry them on Windows. `path` empty
+// lists the current directory.
+std::pair<bool, DirectoryListing> getDirectoryListing(const std::string& path);
+
+// Ordering of listings: directories first, then by name
+bool listingOrder(const FileRef& a, const FileRef& b);
+
+// Server side: answers FILESYSTEM_REQUEST on its own thread from the recent listings it
+// keeps by path, each with a version tag and its pages already encoded. Listings are sent in
+// pages of LISTING_PAGE_ENTRIES, sorted, so the client can show the top of a huge directory
+// while the rest arrives; a newer request stops the pages of the one before. On Linux each
+// cached directory is watched with inotify, and a listing is only read again after a change
+// was reported; elsewhere every request reads it again, which still lets unchanged
+// directories be answered with the small "not modified" frame. A listing that reads the
+// same as before keeps its version. The one before the latest is kept as well, so a client
+// one version behind gets just the entries that changed. Prefetch requests wait until no
+// other request does, never stop another's pages, and are dropped quietly when the
+// directory cannot be read or needs more than one page.
+//
+// The client may also have directories watched: their changes are pushed as FILESYSTEM_DIFF
+// frames marked `pushed`, once a burst of changes settles, against the version the client
+// was last sent. Watched directories are kept in the cache for as long as they are watched.
+class ListingService {
+public:
+    using SendFunction = FileSender::SendFunction;
+
+    explicit ListingService(SendFunction send);
+    ~ListingService();
+
+    void request(const FilesystemRequest& request);
+    // Replaces the set of directories whose changes are pushed to the client
+    void watch(const std::vector<std::string>& paths);
+
+private:
+    struct Entry {
+        DirectoryListing listing;
+        std::vector<std::vector<uint8_t>> pages;    // FILESYSTEM_RESPONSE payloads, encoded as first sent
+        FileTable previous;                         // listing at `previous_version`
+        uint64_t previous_version = 0;
+        bool stale = true;
+        int wd = -1;
+        uint64_t last_used = 0;
+        uint64_t sent_version = 0;                  // what the client was last sent in full
+        // Changes not yet pushed: when the first and the latest were seen
+        bool changed = false;
+        std::chrono::steady_clock::time_point changed_first;
+        std::chrono::steady_clock::time_point changed_last;
+    };
+
+    // Starts the worker; called with m_mutex held
+    void start();
+    void run();
+    void respond(const FilesystemRequest& request);
+    // The entry for `path`, read again unless a watch vouches for what is held; nullptr if
+    // the directory cannot be read. `listed` tells whether it was read.
+    Entry* current(const std::string& path, bool& listed);
+    // Fills `diff` with how entry.previous became entry.listing
+    static void difference(const Entry& entry, DirectoryDiff& diff);
+    void applyWatch(std::vector<std::string> paths);
+    void pushChanges();
+    void evict();
+    // Whether a newer request is waiting, making the rest of the current one pointless
+    bool superseded();
+    void drainEvents();
+    void forget(std::unordered_map<std::string, Entry>::iterator it);
+
+    SendFunction m_send;
+    std::thread m_worker;
+    std::mutex m_mutex;
+    std::condition_variable m_cv;
+    std::deque<FilesystemRequest> m_jobs;
+    std::deque<FilesystemRequest> m_prefetches;     // newest last, at most LISTING_PREFETCH_QUEUE
+    std::vector<std::string> m_watch_paths;         // handed to the worker when m_watch_changed
+    bool m_watch_changed = false;
+    bool m_stop = false;
+
+    // Only touched by the worker
+    std::unordered_map<std::string, Entry> m_entries;
+    std::unordered_map<int, std::string> m_watches;
+    int m_fd = -1;
+    uint64_t m_epoch = 0;       // random high half of versions, so a restarted server matches none
+    uint64_t m_counter = 0;
+    uint64_t m_clock = 0;
+    std::unordered_set<std::string> m_watched;
+    std::chrono::steady_clock::time_point m_polled;
+};
+
+// Server side: answers FILE_TREE_REQUEST, the files below a folder the client downloads, on
+// its own thread, as walking a large tree would stall everything else the server does.
+class FileTreeService {
+public:
+    using SendFunction = FileSender::SendFunction;
+
+    explicit FileTreeService(SendFunction send);
+    ~FileTreeService();
+
+    void request(const std::string& path);
+    void cancelAll();
+
+private:
+    void run();
+
+    SendFunction m_send;
+    std::thread m_worker;
+    std::mutex m_mutex;
+    std::condition_variable m_cv;
+    std::deque<std::string> m_jobs;
+    bool m_stop = false;
+};
+
+// Client side: the listings received for recently visited directories, so requests can
+// carry the version already held and replies can be diffs.
+class RemoteListings {
+public:
+    uint64_t version(const std::string& path) const;
+    // The listing held for `path` if it arrived or was confirmed within LISTING_CLIENT_TTL
+    const DirectoryListing* fresh(const std::string& path);
+    // Keeps a complete listing
+    void store(DirectoryListing&& listing);
+    // The listing `diff` leads to, or nullptr when its base is not the version held
+    const DirectoryListing* apply(const DirectoryDiff& diff);
+    void clear() { m_listings.clear(); }
+
+private:
+    struct Held {
+        DirectoryListing listing;
+        uint64_t last_used = 0;
+        std::chrono::steady_clock::time_point received;
+    };
+    std::unordered_map<std::string, Held> m_listings;
+    uint64_t m_clock = 0;
+};
+
+// Client side: asks ahead for the listings the user is likely to open next, the directory
+// under the mouse and the parent, so that opening one shows the held listing in the same
+// frame while the server confirms it. Requests go out only while no listing the user asked
+// for is on its way, at most LISTING_PREFETCH_IN_FLIGHT at a time, newest wish first, and not
+// for directories held fresh already.
+class ListingPrefetcher {
+public:
+    using SendFunction = FileSender::SendFunction;
+
+    explicit ListingPrefetcher(SendFunction send);
+
+    void want(const std::string& path);
+    // A listing the user asked for was requested, or its reply arrived
+    void foreground(bool pending);
+    void received(const std::string& path);
+    // Sends what may be sent now; called once a frame
+    void update(RemoteListings& listings);
+    void clear();
+
+private:
+    SendFunction m_send;
+    std::deque<std::string> m_wanted;
+    std::unordered_map<std::string, std::chrono::steady_clock::time_point> m_in_flight;
+    bool m_foreground = false;
+    std::chrono::steady_clock::time_point m_foreground_since;
+};
@@ -0,0 +1,148 @@
+#include "logger.h"
+#include <chrono>
+#include <cstdio>
+#include <ctime>
+
+Logger& Logger::instance() {
+    // Intentionally leaked so that logging from global destructors stays safe
+    static Logger* logger = new Logger();
+    return *logger;
+}
+
+Logger::Logger() : m_cells(new Cell[LOG_RING_CAPACITY]) {
+    static_assert((LOG_RING_CAPACITY & (LOG_RING_CAPACITY - 1)) == 0, "ring capacity must be a power of two");
+    for (size_t i = 0; i < LOG_RING_CAPACITY; ++i) {
+        m_cells[i].sequence.store(i, std::memory_order_relaxed);
+    }
+    m_drain_thread = std::thread(&Logger::drain, this);
+}
+
+Logger::Cell* Logger::acquire(size_t& pos) {
+    pos = m_enqueue_pos.load(std::memory_order_relaxed);
+    for (;;) {
+        Cell& cell = m_cells[pos & (LOG_RING_CAPACITY - 1)];
+        size_t seq = cell.sequence.load(std::memory_order_acquire);
+        intptr_t diff = static_cast<intptr_t>(seq) - static_cast<intptr_t>(pos);
+        if (diff == 0) {
+            if (m_enqueue_pos.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed))
+                return &cell;
+        } else if (diff < 0) { // Ring is full
+            return nullptr;
+        } else {
+            pos = m_enqueue_pos.load(std::memory_order_relaxed);
+        }
+    }
+}
+
+uint64_t Logger::now() {
+    return std::chrono::duration_cast<std::chrono::microseconds>(
+        std::chrono::system_clock::now().time_since_epoch()).count();
+}
+
+void Logger::setMinLevel(LogLevel level) {
+    m_min_level.store(level, std::memory_order_relaxed);
+}
+
+uint64_t Logger::droppedCount() const {
+    return m_dropped.load(std::memory_order_relaxed);
+}
+
+void Logger::shutdown() {
+    if (!m_running.exchange(false)) return;
+    if (m_drain_thread.joinable()) m_drain_thread.join();
+}
+
+void Logger::format(const LogRecord& record, std::string& out) {
+    static const char* level_names[] = { "TRACE", "DEBUG", "INFO", "WARN", "ERROR", "OFF" };
+
+    std::time_t seconds = static_cast<std::time_t>(record.timestamp_us / 1000000);
+    std::tm tm_buf{};
+#ifdef _WIN32
+    localtime_s(&tm_buf, &seconds);
+#else
+    localtime_r(&seconds, &tm_buf);
+#endif
+    char prefix[48];
+    int n = std::snprintf(prefix, sizeof(prefix), "%02d:%02d:%02d.%03u [%s] ",
+        tm_buf.tm_hour, tm_buf.tm_min, tm_buf.tm_sec,
+        static_cast<unsigned>((record.timestamp_us / 1000) % 1000),
+        level_names[static_cast<int>(record.level)]);
+    out.append(prefix, n > 0 ? n : 0);
+
+    // Substitute each "{}" with the next captured argument
+    size_t next_arg = 0;
+    for (const char* p = record.format; *p; ++p) {
+        if (p[0] == '{' && p[1] == '}') {
+            ++p;
+            if (next_arg >= record.arg_count) continue;
+            const LogRecord::Arg& arg = record.args[next_arg++];
+            char num[32];
+            switch (arg.kind) {
+            case LogRecord::ArgKind::INT:
+                out.append(num, std::snprintf(num, sizeof(num), "%lld", static_cast<long long>(arg.i)));
+                break;
+            case LogRecord::ArgKind::UINT:
+                out.append(num, std::snprintf(num, sizeof(num), "%llu", static_cast<unsigned long long>(arg.u)));
+                break;
+            case LogRecord::ArgKind::DOUBLE:
+                out.append(num, std::snprintf(num, sizeof(num), "%g", arg.d));
+                break;
+            case LogRecord::ArgKind::BOOL:
+                out.append(arg.b ? "true" : "false");
+                break;
+            case LogRecord::ArgKind::STR:
+                out.append(record.text.data() + arg.offset, arg.length);
+                break;
+            }
+        } else {
+            out.push_back(*p);
+        }
+    }
+    out.push_back('\n');
+}
+
+void Logger::drain() {
+    std::string out_batch;
+    std::string err_batch;
+    uint64_t reported_drops = 0;
+
+    for (;;) {
+        bool running = m_running.load(std::memory_order_acquire);
+        size_t drained = 0;
+
+        for (;;) {
+            Cell& cell = m_cells[m_dequeue_pos & (LOG_RING_CAPACITY - 1)];
+            size_t seq = cell.sequence.load(std::memory_order_acquire);
+            if (static_cast<intptr_t>(seq) - static_cast<intptr_t>(m_dequeue_pos + 1) < 0)
+                break; // Empty
+            format(cell.record, cell.record.level >= LogLevel::WARN ? err_batch : out_batch);
+            cell.sequence.store(m_dequeue_pos + LOG_RING_CAPACITY, std::memory_order_release);
+            ++m_dequeue_pos;
+            ++drained;
+        }
+
+        uint64_t drops = m_dropped.load(std::memory_order_relaxed);
+        if (drops != reported_drops) {
+            char note[64];
+            int n = std::snprintf(note, sizeof(note), "[WARN] logger dropped %llu records\n",
+                static_cast<unsigned long long>(drops - reported_drops));
+            err_batch.append(note, n > 0 ? n : 0);
+            reported_drops = drops;
+        }
+
+        // One write and flush per batch instead of one per line
+        if (!out_batch.empty()) {
+            std::fwrite(out_batch.data(), 1, out_batch.size(), stdout);
+            std::fflush(stdout);
+            out_batch.clear();
+        }
+        if (!err_batch.empty()) {
+            std::fwrite(err_batch.data(), 1, err_batch.size(), stderr);
+            err_batch.clear();
+        }
+
+        if (!running) break;
+        if (drained == 0)
+            std::this_thread::sleep_for(std::chrono::milliseconds(5));
+    }
+}
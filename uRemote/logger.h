@@ -0,0 +1,165 @@
+#pragma once
+#include <atomic>
+#include <array>
+#include <cstdint>
+#include <cstring>
+#include <memory>
+#include <string>
+#include <string_view>
+#include <thread>
+#include <type_traits>
+
+enum class LogLevel : uint8_t {
+    TRACE,
+    DEBUG,
+    INFO,
+    WARN,
+    ERR,
+    OFF
+};
+
+// Levels below this are compiled out entirely (0 = TRACE ... 5 = OFF)
+#ifndef LOG_ACTIVE_LEVEL
+#define LOG_ACTIVE_LEVEL 1
+#endif
+
+constexpr size_t LOG_MAX_ARGS = 6;
+constexpr size_t LOG_TEXT_CAPACITY = 192;
+constexpr size_t LOG_RING_CAPACITY = 4096; // must be a power of two
+
+// A captured, not yet formatted log statement. Arguments are copied by value;
+// string arguments are truncated into the inline text pool so pushing never allocates.
+struct LogRecord {
+    enum class ArgKind : uint8_t { INT, UINT, DOUBLE, BOOL, STR };
+    struct Arg {
+        ArgKind kind;
+        uint16_t offset; // STR: position in text
+        uint16_t length; // STR: length in text
+        union {
+            int64_t i;
+            uint64_t u;
+            double d;
+            bool b;
+        };
+    };
+
+    const char* format = nullptr; // must be a string literal
+    LogLevel level = LogLevel::INFO;
+    uint8_t arg_count = 0;
+    uint16_t text_used = 0;
+    uint64_t timestamp_us = 0;
+    std::array<Arg, LOG_MAX_ARGS> args;
+    std::array<char, LOG_TEXT_CAPACITY> text;
+
+    void addString(const char* str, size_t len) {
+        if (arg_count >= LOG_MAX_ARGS) return;
+        Arg& arg = args[arg_count++];
+        arg.kind = ArgKind::STR;
+        size_t room = LOG_TEXT_CAPACITY - text_used;
+        size_t n = len < room ? len : room;
+        std::memcpy(text.data() + text_used, str, n);
+        arg.offset = text_used;
+        arg.length = static_cast<uint16_t>(n);
+        text_used += static_cast<uint16_t>(n);
+    }
+
+    template<typename T>
+    void add(const T& value) {
+        if constexpr (std::is_same_v<T, bool>) {
+            if (arg_count >= LOG_MAX_ARGS) return;
+            Arg& arg = args[arg_count++];
+            arg.kind = ArgKind::BOOL;
+            arg.b = value;
+        } else if constexpr (std::is_enum_v<T>) {
+            add(static_cast<std::underlying_type_t<T>>(value));
+        } else if constexpr (std::is_integral_v<T> && std::is_signed_v<T>) {
+            if (arg_count >= LOG_MAX_ARGS) return;
+            Arg& arg = args[arg_count++];
+            arg.kind = ArgKind::INT;
+            arg.i = value;
+        } else if constexpr (std::is_integral_v<T>) {
+            if (arg_count >= LOG_MAX_ARGS) return;
+            Arg& arg = args[arg_count++];
+            arg.kind = ArgKind::UINT;
+            arg.u = value;
+        } else if constexpr (std::is_floating_point_v<T>) {
+            if (arg_count >= LOG_MAX_ARGS) return;
+            Arg& arg = args[arg_count++];
+            arg.kind = ArgKind::DOUBLE;
+            arg.d = value;
+        } else if constexpr (std::is_convertible_v<const T&, std::string_view>) {
+            std::string_view sv(value);
+            addString(sv.data(), sv.size());
+        } else {
+            static_assert(std::is_arithmetic_v<T>, "unsupported log argument type");
+        }
+    }
+};
+
+// Asynchronous leveled logger. Producers push records into a bounded lock-free ring;
+// a background thread formats and writes them. When the ring is full records are dropped
+// and counted instead of blocking the caller.
+class Logger {
+public:
+    static Logger& instance();
+
+    template<typename... Args>
+    void log(LogLevel level, const char* format, const Args&... args) {
+        if (level < m_min_level.load(std::memory_order_relaxed)) return;
+        size_t pos;
+        Cell* cell = acquire(pos);
+        if (!cell) {
+            m_dropped.fetch_add(1, std::memory_order_relaxed);
+            return;
+        }
+        LogRecord* record = &cell->record;
+        record->format = format;
+        record->level = level;
+        record->arg_count = 0;
+        record->text_used = 0;
+        record->timestamp_us = now();
+        (record->add(args), ...);
+        cell->sequence.store(pos + 1, std::memory_order_release);
+    }
+
+    void setMinLevel(LogLevel level);
+    uint64_t droppedCount() const;
+
+    // Drain everything queued so far and stop the background thread
+    void shutdown();
+
+private:
+    struct Cell {
+        std::atomic<size_t> sequence;
+        LogRecord record;
+    };
+
+    Logger();
+    ~Logger() = delete;
+
+    Cell* acquire(size_t& pos);
+    static uint64_t now();
+    void drain();
+    static void format(const LogRecord& record, std::string& out);
+
+    std::unique_ptr<Cell[]> m_cells;
+    alignas(64) std::atomic<size_t> m_enqueue_pos{ 0 };
+    alignas(64) size_t m_dequeue_pos = 0;
+    alignas(64) std::atomic<uint64_t> m_dropped{ 0 };
+    std::atomic<LogLevel> m_min_level{ static_cast<LogLevel>(LOG_ACTIVE_LEVEL) };
+    std::atomic<bool> m_running{ true };
+    std::thread m_drain_thread;
+};
+
+#define URLOG_AT(lvl, ...) \
+    do { \
+        if constexpr (static_cast<int>(lvl) >= LOG_ACTIVE_LEVEL) \
+            Logger::instance().log(lvl, __VA_ARGS__); \
+    } while (0)
+
+// Usage: LOG_INFO("received {} bytes from {}", size, host);
+#define LOG_TRACE(...) URLOG_AT(LogLevel::TRACE, __VA_ARGS__)
+#define LOG_DEBUG(...) URLOG_AT(LogLevel::DEBUG, __VA_ARGS__)
+#define LOG_INFO(...)  URLOG_AT(LogLevel::INFO, __VA_ARGS__)
+#define LOG_WARN(...)  URLOG_AT(LogLevel::WARN, __VA_ARGS__)
+#define LOG_ERROR(...) URLOG_AT(LogLevel::ERR, __VA_ARGS__)
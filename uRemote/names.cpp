@@ -0,0 +1,560 @@
+#include "names.h"
+#include "logger.h"
+#ifdef __linux__
+#include <sys/inotify.h>
+#include <unistd.h>
+#endif
+
+// Changes are written to disk once the index has been quiet this long
+constexpr auto NAME_INDEX_SAVE_DELAY = std::chrono::seconds(30);
+// Roots that are not fully watched are rescanned this often
+constexpr auto NAME_INDEX_RESCAN_INTERVAL = std::chrono::minutes(15);
+constexpr uint32_t NAME_INDEX_MAGIC = 0x494e5255; // "URNI"
+constexpr uint32_t NAME_INDEX_VERSION = 1;
+
+static char lowerAscii(char c) {
+    return c >= 'A' && c <= 'Z' ? static_cast<char>(c - 'A' + 'a') : c;
+}
+
+static std::string lowerAscii(std::string_view text) {
+    std::string lower(text);
+    std::transform(lower.begin(), lower.end(), lower.begin(), [](char c) { return lowerAscii(c); });
+    return lower;
+}
+
+static uint32_t trigram(const char* p) {
+    return static_cast<uint8_t>(lowerAscii(p[0])) | static_cast<uint8_t>(lowerAscii(p[1])) << 8 | static_cast<uint32_t>(static_cast<uint8_t>(lowerAscii(p[2]))) << 16;
+}
+
+// Whether position `i` of `name` starts a word: after a separator, a lower-to-upper case
+// change or a letter-to-digit change
+static bool wordStart(std::string_view name, size_t i) {
+    if (i == 0) return true;
+    char previous = name[i - 1];
+    char current = name[i];
+    if (std::strchr("._- ", previous)) return true;
+    if (previous >= 'a' && previous <= 'z' && current >= 'A' && current <= 'Z') return true;
+    return !(previous >= '0' && previous <= '9') && current >= '0' && current <= '9';
+}
+
+// Score of `name` for a fuzzy `query` (already lowercase): every query character must appear
+// in order; consecutive characters and word starts score higher, gaps lower. -1 if no match.
+static int fuzzyScore(std::string_view name, std::string_view query) {
+    int score = 0;
+    size_t position = 0;
+    size_t last = std::string_view::npos;
+    for (char q : query) {
+        size_t found = position;
+        while (found < name.size() && lowerAscii(name[found]) != q) ++found;
+        if (found == name.size()) return -1;
+        score += 1;
+        if (wordStart(name, found)) score += 8;
+        if (last != std::string_view::npos) {
+            if (found == last + 1) score += 5;
+            else score -= static_cast<int>(std::min<size_t>(found - last - 1, 3));
+        }
+        last = found;
+        position = found + 1;
+    }
+    return score;
+}
+
+uint32_t NameIndex::append(uint32_t parent, std::string_view name, uint8_t flags) {
+    if (name.size() > UINT16_MAX || m_names.size() + name.size() > UINT32_MAX) return NONE;
+    uint32_t id = static_cast<uint32_t>(m_entries.size());
+    Entry entry;
+    entry.parent = parent;
+    entry.name_offset = static_cast<uint32_t>(m_names.size());
+    entry.name_length = static_cast<uint16_t>(name.size());
+    entry.flags = flags;
+    if (parent != NONE) {
+        entry.next_sibling = m_entries[parent].first_child;
+        m_entries[parent].first_child = id;
+    }
+    m_names.append(name);
+    m_entries.push_back(entry);
+    ++m_live;
+    if (!(flags & ROOT)) indexTrigrams(id);
+    return id;
+}
+
+void NameIndex::indexTrigrams(uint32_t id) {
+    std::string_view text = name(m_entries[id]);
+    for (size_t i = 0; i + 3 <= text.size(); ++i) {
+        auto& ids = m_trigrams[trigram(text.data() + i)];
+        // Ids only grow, so the lists stay sorted; a name repeating a trigram is listed once
+        if (ids.empty() || ids.back() != id) ids.push_back(id);
+    }
+}
+
+uint32_t NameIndex::addRoot(const std::string& path) {
+    uint32_t id = append(NONE, path, DIRECTORY | ROOT);
+    if (id != NONE) m_roots.push_back(id);
+    return id;
+}
+
+uint32_t NameIndex::add(uint32_t parent, std::string_view name, bool directory) {
+    uint32_t existing = child(parent, name);
+    if (existing != NONE) return existing;
+    return addNew(parent, name, directory);
+}
+
+uint32_t NameIndex::addNew(uint32_t parent, std::string_view name, bool directory) {
+    return append(parent, name, directory ? DIRECTORY : 0);
+}
+
+uint32_t NameIndex::child(uint32_t parent, std::string_view name) const {
+    for (uint32_t id = m_entries[parent].first_child; id != NONE; id = m_entries[id].next_sibling) {
+        if (this->name(m_entries[id]) == name) return id;
+    }
+    return NONE;
+}
+
+void NameIndex::remove(uint32_t id, std::vector<uint32_t>& directories) {
+    Entry& entry = m_entries[id];
+    if (entry.flags & (DEAD | ROOT)) return;
+    // Unlink from the parent's children
+    uint32_t* link = &m_entries[entry.parent].first_child;
+    while (*link != NONE && *link != id) link = &m_entries[*link].next_sibling;
+    if (*link == id) *link = entry.next_sibling;
+
+    std::vector<uint32_t> pending{ id };
+    while (!pending.empty()) {
+        uint32_t current = pending.back();
+        pending.pop_back();
+        Entry& dead = m_entries[current];
+        dead.flags |= DEAD;
+        --m_live;
+        ++m_dead;
+        if (dead.flags & DIRECTORY) directories.push_back(current);
+        for (uint32_t c = dead.first_child; c != NONE; c = m_entries[c].next_sibling)
+            pending.push_back(c);
+    }
+}
+
+std::string NameIndex::path(uint32_t id) const {
+    std::vector<uint32_t> chain;
+    for (uint32_t current = id; current != NONE; current = m_entries[current].parent)
+        chain.push_back(current);
+    std::filesystem::path result;
+    for (auto it = chain.rbegin(); it != chain.rend(); ++it)
+        result /= std::string(name(m_entries[*it]));
+    return result.string();
+}
+
+bool NameIndex::isDirectory(uint32_t id) const {
+    return m_entries[id].flags & DIRECTORY;
+}
+
+std::vector<std::string> NameIndex::rootPaths() const {
+    std::vector<std::string> paths;
+    for (uint32_t root : m_roots) paths.emplace_back(name(m_entries[root]));
+    return paths;
+}
+
+std::vector<uint32_t> NameIndex::find(const std::string& query, bool fuzzy, size_t limit, uint64_t& total) const {
+    struct Hit {
+        int rank;       // lower is better
+        uint16_t length;
+        uint32_t id;
+        bool operator<(const Hit& other) const { return std::tie(rank, length, id) < std::tie(other.rank, other.length, other.id); }
+    };
+    std::vector<Hit> hits;
+    total = 0;
+    std::string needle = lowerAscii(query);
+    if (needle.empty()) return {};
+
+    auto consider = [&](uint32_t id) {
+        const Entry& entry = m_entries[id];
+        if (entry.flags & (DEAD | ROOT)) return;
+        std::string_view text = name(entry);
+        int rank;
+        if (fuzzy) {
+            int score = fuzzyScore(text, needle);
+            if (score < 0) return;
+            rank = -score;
+        } else {
+            if (text.size() < needle.size()) return;
+            std::string lower = lowerAscii(text);
+            size_t at = lower.find(needle);
+            if (at == std::string::npos) return;
+            // Whole name first, then prefixes, then word starts, then anywhere
+            rank = lower.size() == needle.size() ? 0 : at == 0 ? 1 : wordStart(text, at) ? 2 : 3;
+        }
+        hits.push_back({ rank, entry.name_length, id });
+    };
+
+    if (!fuzzy && needle.size() >= 3) {
+        // Candidates are the names holding every trigram of the query
+        std::vector<const std::vector<uint32_t>*> lists;
+        for (size_t i = 0; i + 3 <= needle.size(); ++i) {
+            auto it = m_trigrams.find(trigram(needle.data() + i));
+            if (it == m_trigrams.end()) return {};
+            lists.push_back(&it->second);
+        }
+        std::sort(lists.begin(), lists.end(), [](auto a, auto b) { return a->size() < b->size(); });
+        std::vector<uint32_t> candidates = *lists[0];
+        std::vector<uint32_t> narrowed;
+        for (size_t i = 1; i < lists.size() && !candidates.empty(); ++i) {
+            narrowed.clear();
+            std::set_intersection(candidates.begin(), candidates.end(), lists[i]->begin(), lists[i]->end(), std::back_inserter(narrowed));
+            candidates.swap(narrowed);
+        }
+        for (uint32_t id : candidates) consider(id);
+    } else {
+        for (uint32_t id = 0; id < m_entries.size(); ++id) consider(id);
+    }
+
+    total = hits.size();
+    size_t keep = std::min(limit, hits.size());
+    std::partial_sort(hits.begin(), hits.begin() + keep, hits.end());
+    std::vector<uint32_t> ids;
+    ids.reserve(keep);
+    for (size_t i = 0; i < keep; ++i) ids.push_back(hits[i].id);
+    return ids;
+}
+
+size_t NameIndex::memoryBytes() const {
+    size_t bytes = m_entries.capacity() * sizeof(Entry) + m_names.capacity() + m_roots.capacity() * sizeof(uint32_t);
+    bytes += m_trigrams.bucket_count() * sizeof(void*);
+    for (const auto& [key, ids] : m_trigrams)
+        bytes += sizeof(key) + sizeof(ids) + 2 * sizeof(void*) + ids.capacity() * sizeof(uint32_t);
+    return bytes;
+}
+
+std::vector<uint32_t> NameIndex::compact() {
+    std::vector<uint32_t> remap(m_entries.size(), NONE);
+    NameIndex fresh;
+    fresh.m_entries.reserve(m_live);
+    fresh.m_names.reserve(m_names.size());
+    for (uint32_t id = 0; id < m_entries.size(); ++id) {
+        const Entry& entry = m_entries[id];
+        if (entry.flags & DEAD) continue;
+        // Parents come before their children, so theirs is already mapped
+        uint32_t parent = entry.parent == NONE ? NONE : remap[entry.parent];
+        remap[id] = fresh.append(parent, name(entry), entry.flags);
+    }
+    for (uint32_t root : m_roots) fresh.m_roots.push_back(remap[root]);
+    *this = std::move(fresh);
+    return remap;
+}
+
+bool NameIndex::save(const std::string& file) const {
+    std::string temporary = file + ".tmp";
+    {
+        std::ofstream out(temporary, std::ios::binary | std::ios::trunc);
+        if (!out) return false;
+        auto write = [&out](const auto& value) { out.write(reinterpret_cast<const char*>(&value), sizeof(value)); };
+        write(NAME_INDEX_MAGIC);
+        write(NAME_INDEX_VERSION);
+        write(static_cast<uint64_t>(m_live));
+        // Live entries in id order, parents renumbered to skip the dead
+        std::vector<uint32_t> remap(m_entries.size(), NONE);
+        uint32_t next = 0;
+        for (uint32_t id = 0; id < m_entries.size(); ++id) {
+            const Entry& entry = m_entries[id];
+            if (entry.flags & DEAD) continue;
+            remap[id] = next++;
+            write(entry.parent == NONE ? NONE : remap[entry.parent]);
+            write(entry.flags);
+            write(entry.name_length);
+            out.write(m_names.data() + entry.name_offset, entry.name_length);
+        }
+        if (!out) return false;
+    }
+    std::error_code ec;
+    std::filesystem::rename(temporary, file, ec);
+    return !ec;
+}
+
+bool NameIndex::load(const std::string& file) {
+    std::ifstream in(file, std::ios::binary);
+    if (!in) return false;
+    auto read = [&in](auto& value) { return static_cast<bool>(in.read(reinterpret_cast<char*>(&value), sizeof(value))); };
+    uint32_t magic = 0, version = 0;
+    uint64_t count = 0;
+    if (!read(magic) || !read(version) || !read(count) || magic != NAME_INDEX_MAGIC || version != NAME_INDEX_VERSION) return false;
+
+    NameIndex loaded;
+    loaded.m_entries.reserve(count);
+    std::string name;
+    for (uint64_t i = 0; i < count; ++i) {
+        uint32_t parent = NONE;
+        uint8_t flags = 0;
+        uint16_t length = 0;
+        if (!read(parent) || !read(flags) || !read(length)) return false;
+        if (parent != NONE && parent >= loaded.m_entries.size()) return false;
+        name.resize(length);
+        if (!in.read(name.data(), length)) return false;
+        uint32_t id = loaded.append(parent, name, flags & (DIRECTORY | ROOT));
+        if (id == NONE) return false;
+        if (flags & ROOT) loaded.m_roots.push_back(id);
+    }
+    *this = std::move(loaded);
+    return true;
+}
+
+NameIndexService::Watcher::~Watcher() {
+#ifdef __linux__
+    if (fd >= 0) close(fd);
+#endif
+}
+
+NameIndexService::NameIndexService(SendFunction send) : m_send(std::move(send)) {
+}
+
+NameIndexService::~NameIndexService() {
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        m_stop = true;
+        m_jobs.clear();
+    }
+    m_shutdown = true;
+    m_cv.notify_all();
+    if (m_worker.joinable()) m_worker.join();
+    if (m_builder.joinable()) m_builder.join();
+}
+
+void NameIndexService::start(const std::vector<std::string>& roots, const std::string& file) {
+    if (m_worker.joinable() || roots.empty()) return;
+    m_roots = roots;
+    m_file = file;
+    m_worker = std::thread(&NameIndexService::run, this);
+}
+
+void NameIndexService::query(const NameQuery& query) {
+    if (!m_worker.joinable()) {
+        NameResults results;
+        results.id = query.id;
+        results.error = "The server has no name index; list directories to index under \"name_index_roots\" in its config";
+        NetworkMessage msg;
+        msg.fromNameResults(results);
+        m_send(std::move(msg));
+        return;
+    }
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        // Only the newest query matters; the user has typed on since the older ones
+        m_jobs.clear();
+        m_jobs.push_back(query);
+    }
+    m_cv.notify_one();
+}
+
+void NameIndexService::run() {
+    auto index = std::make_unique<NameIndex>();
+    if (index->load(m_file) && index->rootPaths() == m_roots) {
+        LOG_INFO("name index: loaded {} names from {} ({} MB)", index->size(), m_file, index->memoryBytes() >> 20);
+        m_index = std::move(index);
+    }
+    startBuild();
+
+    for (;;) {
+        std::optional<NameQuery> job;
+        std::unique_ptr<NameIndex> built;
+        {
+            std::unique_lock<std::mutex> lock(m_mutex);
+            // Wake up now and then to pick up change notifications
+            m_cv.wait_for(lock, std::chrono::milliseconds(50), [this]() { return m_stop || !m_jobs.empty() || m_built; });
+            if (m_stop) break;
+            if (m_built) {
+                built = std::move(m_built);
+                m_watcher = std::move(m_built_watcher);
+                m_build_seconds = m_built_seconds;
+            }
+            if (!m_jobs.empty()) {
+                job = std::move(m_jobs.front());
+                m_jobs.pop_front();
+            }
+        }
+        auto now = std::chrono::steady_clock::now();
+        if (built) {
+            m_builder.join();
+            m_index = std::move(built);
+            m_scanned = now;
+            m_dirty = true;
+            m_changed = now - NAME_INDEX_SAVE_DELAY;
+            LOG_INFO("name index: {} names below {} roots in {} s, {} MB{}", m_index->size(), m_roots.size(), m_build_seconds,
+                m_index->memoryBytes() >> 20, m_watcher ? (m_watcher->complete ? ", watching for changes" : ", watch limit reached") : "");
+        }
+        if (m_watcher && !applyChanges()) {
+            LOG_WARN("name index: change notifications were lost, rescanning");
+            startBuild();
+        }
+        if (job) answer(*job);
+        if (m_index && m_index->needsCompaction()) compact();
+        if (m_dirty && now - m_changed >= NAME_INDEX_SAVE_DELAY) {
+            if (!m_index->save(m_file)) LOG_WARN("name index: could not write {}", m_file);
+            m_dirty = false;
+        }
+        if (!m_building && (!m_watcher || !m_watcher->complete) && now - m_scanned >= NAME_INDEX_RESCAN_INTERVAL)
+            startBuild();
+    }
+    if (m_dirty && m_index) m_index->save(m_file);
+}
+
+void NameIndexService::startBuild() {
+    if (m_building) return;
+    if (m_builder.joinable()) m_builder.join();
+    m_building = true;
+    m_builder = std::thread(&NameIndexService::build, this, m_roots);
+}
+
+void NameIndexService::build(std::vector<std::string> roots) {
+    auto started = std::chrono::steady_clock::now();
+    auto index = std::make_unique<NameIndex>();
+    std::unique_ptr<Watcher> watcher;
+#ifdef __linux__
+    watcher = std::make_unique<Watcher>();
+    watcher->fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+    if (watcher->fd < 0) {
+        LOG_WARN("name index: inotify unavailable ({}), falling back to periodic rescans", std::strerror(errno));
+        watcher.reset();
+    }
+#endif
+    for (const auto& root : roots) {
+        uint32_t id = index->addRoot(root);
+        if (id != NameIndex::NONE) scan(*index, watcher.get(), id, m_shutdown);
+    }
+    double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - started).count();
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        m_built = std::move(index);
+        m_built_watcher = std::move(watcher);
+        m_built_seconds = seconds;
+        m_building = false;
+    }
+    m_cv.notify_one();
+}
+
+void NameIndexService::scan(NameIndex& index, Watcher* watcher, uint32_t directory, const std::atomic<bool>& stop) {
+    std::vector<uint32_t> pending{ directory };
+    while (!pending.empty() && !stop) {
+        uint32_t current = pending.back();
+        pending.pop_back();
+        std::string path = index.path(current);
+        // Watch before listing so nothing created in between is missed
+        if (watcher) watch(*watcher, current, path);
+        // Entries created after the watch may be listed and reported both; only then look them up
+        bool fresh = !index.hasChildren(current);
+        std::error_code ec;
+        auto options = std::filesystem::directory_options::skip_permission_denied;
+        for (auto it = std::filesystem::directory_iterator(path, options, ec); !ec && it != std::filesystem::directory_iterator(); it.increment(ec)) {
+            std::error_code entry_ec;
+            // Symlinked directories are indexed by name but not followed
+            bool is_directory = !it->is_symlink(entry_ec) && it->is_directory(entry_ec);
+            std::string name = it->path().filename().string();
+            uint32_t id = fresh ? index.addNew(current, name, is_directory) : index.add(current, name, is_directory);
+            if (id != NameIndex::NONE && is_directory) pending.push_back(id);
+        }
+    }
+}
+
+void NameIndexService::watch(Watcher& watcher, uint32_t directory, const std::string& path) {
+#ifdef __linux__
+    if (!watcher.complete) return;
+    int wd = inotify_add_watch(watcher.fd, path.c_str(), IN_CREATE | IN_DELETE | IN_MOVED_FROM | IN_MOVED_TO | IN_ONLYDIR | IN_DONT_FOLLOW | IN_EXCL_UNLINK);
+    if (wd < 0) {
+        if (errno == ENOSPC) {
+            LOG_WARN("name index: inotify watch limit reached at {}; raise fs.inotify.max_user_watches to watch everything", path);
+            watcher.complete = false;
+        }
+        return;
+    }
+    // A directory reachable twice (bind mounts) keeps its first entry
+    if (watcher.directories.emplace(wd, directory).second) watcher.watches[directory] = wd;
+#endif
+}
+
+void NameIndexService::unwatch(Watcher& watcher, uint32_t directory) {
+#ifdef __linux__
+    auto it = watcher.watches.find(directory);
+    if (it == watcher.watches.end()) return;
+    inotify_rm_watch(watcher.fd, it->second);
+    watcher.directories.erase(it->second);
+    watcher.watches.erase(it);
+#endif
+}
+
+bool NameIndexService::applyChanges() {
+#ifdef __linux__
+    if (!m_index) return true;
+    alignas(inotify_event) char buffer[64 * 1024];
+    std::vector<uint32_t> removed;
+    bool lost = false;
+    for (;;) {
+        ssize_t n = read(m_watcher->fd, buffer, sizeof(buffer));
+        if (n <= 0) break;
+        for (char* p = buffer; p < buffer + n;) {
+            const auto* event = reinterpret_cast<const inotify_event*>(p);
+            p += sizeof(inotify_event) + event->len;
+            if (event->mask & IN_Q_OVERFLOW) {
+                lost = true;
+                continue;
+            }
+            auto it = m_watcher->directories.find(event->wd);
+            if (it == m_watcher->directories.end()) continue;
+            uint32_t directory = it->second;
+            if (event->mask & IN_IGNORED) {
+                m_watcher->watches.erase(directory);
+                m_watcher->directories.erase(it);
+                continue;
+            }
+            if (!event->len) continue;
+            std::string_view name(event->name);
+            if (event->mask & (IN_CREATE | IN_MOVED_TO)) {
+                bool is_directory = event->mask & IN_ISDIR;
+                uint32_t id = m_index->add(directory, name, is_directory);
+                if (id != NameIndex::NONE && is_directory) scan(*m_index, m_watcher.get(), id, m_shutdown);
+            } else if (event->mask & (IN_DELETE | IN_MOVED_FROM)) {
+                uint32_t id = m_index->child(directory, name);
+                if (id == NameIndex::NONE) continue;
+                removed.clear();
+                m_index->remove(id, removed);
+                for (uint32_t gone : removed) unwatch(*m_watcher, gone);
+            }
+            m_dirty = true;
+            m_changed = std::chrono::steady_clock::now();
+        }
+    }
+    return !lost;
+#else
+    return true;
+#endif
+}
+
+void NameIndexService::compact() {
+    std::vector<uint32_t> remap = m_index->compact();
+    if (!m_watcher) return;
+    m_watcher->watches.clear();
+    for (auto it = m_watcher->directories.begin(); it != m_watcher->directories.end();) {
+        uint32_t id = remap[it->second];
+        if (id == NameIndex::NONE) {
+            it = m_watcher->directories.erase(it);
+            continue;
+        }
+        it->second = id;
+        m_watcher->watches[id] = it->first;
+        ++it;
+    }
+}
+
+void NameIndexService::answer(const NameQuery& query) {
+    NameResults results;
+    results.id = query.id;
+    results.building = m_building;
+    results.roots = m_roots;
+    results.build_seconds = m_build_seconds;
+    if (m_index) {
+        auto started = std::chrono::steady_clock::now();
+        uint32_t limit = query.limit ? std::min(query.limit, NAME_QUERY_MAX_LIMIT) : NAME_QUERY_DEFAULT_LIMIT;
+        for (uint32_t id : m_index->find(query.query, query.fuzzy, limit, results.total))
+            results.matches.push_back({ m_index->path(id), m_index->isDirectory(id) });
+        results.query_ms = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - started).count();
+        results.entries = m_index->size();
+        results.memory_bytes = m_index->memoryBytes();
+    }
+    NetworkMessage msg;
+    msg.fromNameResults(results);
+    m_send(std::move(msg));
+}
@@ -0,0 +1,137 @@
+#pragma once
+#include "uRemote.h"
+#include "network.h"
+#include "transfer.h"
+#include <atomic>
+#include <optional>
+#include <string_view>
+
+// Matches sent for a query that does not ask for a limit, and the most it may ask for
+constexpr uint32_t NAME_QUERY_DEFAULT_LIMIT = 500;
+constexpr uint32_t NAME_QUERY_MAX_LIMIT = 5000;
+// The index is written here, next to the config, so a restarted server can answer at once
+constexpr const char* NAME_INDEX_FILE = "name_index.bin";
+
+// Every name below a set of root directories. Entries form a tree (parent links into one
+// array, names packed into one string), so a path costs a few bytes plus its own name rather
+// than a full copy of its directory's path. Substring queries go through a trigram index:
+// each lowercased three-byte sequence maps to the sorted ids of the names holding it, and a
+// query only looks at names in the intersection of its trigrams' lists. Removed entries are
+// marked dead and skipped until compact() renumbers the survivors.
+class NameIndex {
+public:
+    static constexpr uint32_t NONE = UINT32_MAX;
+
+    uint32_t addRoot(const std::string& path);
+    // Adds `name` below directory `parent`, or returns the entry already there
+    uint32_t add(uint32_t parent, std::string_view name, bool directory);
+    uint32_t child(uint32_t parent, std::string_view name) const;
+    // Like add, for a directory known not to hold `name` yet; skips the lookup
+    uint32_t addNew(uint32_t parent, std::string_view name, bool directory);
+    bool hasChildren(uint32_t directory) const { return m_entries[directory].first_child != NONE; }
+    // Removes the entry and everything below it; appends the directories removed to `directories`
+    void remove(uint32_t id, std::vector<uint32_t>& directories);
+
+    std::string path(uint32_t id) const;
+    bool isDirectory(uint32_t id) const;
+    const std::vector<uint32_t>& roots() const { return m_roots; }
+    std::vector<std::string> rootPaths() const;
+
+    // Best `limit` matches, ranked; `total` receives how many there were in all
+    std::vector<uint32_t> find(const std::string& query, bool fuzzy, size_t limit, uint64_t& total) const;
+
+    size_t size() const { return m_live; }
+    size_t memoryBytes() const;
+    bool needsCompaction() const { return m_dead > 4096 && m_dead > m_live / 4; }
+    // Drops dead entries; returns each old id's new id, or NONE for the dropped
+    std::vector<uint32_t> compact();
+
+    bool save(const std::string& file) const;
+    bool load(const std::string& file);
+
+private:
+    enum : uint8_t { DIRECTORY = 1, DEAD = 2, ROOT = 4 };
+    struct Entry {
+        uint32_t parent = NONE;
+        uint32_t first_child = NONE;
+        uint32_t next_sibling = NONE;
+        uint32_t name_offset = 0;
+        uint16_t name_length = 0;
+        uint8_t flags = 0;
+    };
+
+    uint32_t append(uint32_t parent, std::string_view name, uint8_t flags);
+    std::string_view name(const Entry& entry) const { return std::string_view(m_names).substr(entry.name_offset, entry.name_length); }
+    void indexTrigrams(uint32_t id);
+
+    std::vector<Entry> m_entries;
+    std::string m_names;
+    std::vector<uint32_t> m_roots;
+    std::unordered_map<uint32_t, std::vector<uint32_t>> m_trigrams;
+    size_t m_live = 0;
+    size_t m_dead = 0;
+};
+
+// Server side: keeps a NameIndex of the configured roots and answers NAME_QUERY messages from
+// it. The index is loaded from disk on start and serves queries while a fresh scan of the
+// roots runs beside it. On Linux every indexed directory is watched with inotify, so
+// creations, deletions and renames show up in the index as they happen; elsewhere, or when
+// the watch limit is reached, the roots are rescanned periodically. The index is written
+// back to disk shortly after it changes.
+class NameIndexService {
+public:
+    using SendFunction = FileSender::SendFunction;
+
+    explicit NameIndexService(SendFunction send);
+    ~NameIndexService();
+
+    // Starts indexing `roots`; does nothing if it already is
+    void start(const std::vector<std::string>& roots, const std::string& file);
+    void query(const NameQuery& query);
+
+private:
+    // Directories being watched for changes
+    struct Watcher {
+        int fd = -1;
+        std::unordered_map<int, uint32_t> directories;  // watch descriptor to directory entry
+        std::unordered_map<uint32_t, int> watches;      // and back
+        bool complete = true;                           // false once a watch could not be added
+        ~Watcher();
+    };
+
+    void run();
+    // Full scan of the roots into a fresh index; runs on its own thread
+    void build(std::vector<std::string> roots);
+    // Adds everything below `directory` to `index`, watching each directory found
+    static void scan(NameIndex& index, Watcher* watcher, uint32_t directory, const std::atomic<bool>& stop);
+    static void watch(Watcher& watcher, uint32_t directory, const std::string& path);
+    static void unwatch(Watcher& watcher, uint32_t directory);
+    void startBuild();
+    void answer(const NameQuery& query);
+    // Applies pending change notifications; false if some were lost and a rescan is needed
+    bool applyChanges();
+    void compact();
+
+    SendFunction m_send;
+    std::vector<std::string> m_roots;
+    std::string m_file;
+    std::thread m_worker;
+    std::thread m_builder;
+    std::mutex m_mutex;
+    std::condition_variable m_cv;
+    std::deque<NameQuery> m_jobs;
+    std::unique_ptr<NameIndex> m_built;     // handed over by the builder
+    std::unique_ptr<Watcher> m_built_watcher;
+    double m_built_seconds = 0;
+    std::atomic<bool> m_building{ false };
+    std::atomic<bool> m_shutdown{ false };
+    bool m_stop = false;
+
+    // Only touched by the worker
+    std::unique_ptr<NameIndex> m_index;
+    std::unique_ptr<Watcher> m_watcher;
+    double m_build_seconds = 0;
+    bool m_dirty = false;
+    std::chrono::steady_clock::time_point m_changed;
+    std::chrono::steady_clock::time_point m_scanned;
+};
@@ -1,6 +1,7 @@
 #include "network.h"
 #include "Server.h"
 #include "Client.h"
+#include "logger.h"
 
 NetworkManager::~NetworkManager() {
     stopAll();
@@ -21,8 +22,8 @@ void NetworkManager::startServer(const std::string& port, const std::string& pas
         handleConnectionState("Server", state, info);
     });
 
-    m_server->setMessageCallback([this](const NetworkMessage& message) { 
-        handleMessage("Server", message);
+    m_server->setMessageCallback([this](NetworkMessage&& message) { 
+        handleMessage("Server", std::move(message));
     });
 
     m_server->setErrorCallback([this](const std::string& error) { 
@@ -48,8 +49,8 @@ void NetworkManager::startClient(const std::string& host, const std::string& por
         handleConnectionState("Client", state, info);
     });
 
-    m_client->setMessageCallback([this](const NetworkMessage& message)
-        { handleMessage("Client", message); });
+    m_client->setMessageCallback([this](NetworkMessage&& message)
+        { handleMessage("Client", std::move(message)); });
 
     m_client->setErrorCallback([this](const std::string& error)
         { handleError("Client", error); });
@@ -58,49 +59,135 @@ void NetworkManager::startClient(const std::string& host, const std::string& por
     updateConnectionInfo("Connecting to " + host + ":" + port + "...");
 }
 
-void NetworkManager::handleMessage(const std::string& type, const NetworkMessage& message) {
+void NetworkManager::handleMessage(const std::string& type, NetworkMessage&& message) {
+    auto handler = m_message_handlers.find(message.type);
+    if (handler != m_message_handlers.end() && handler->second(message)) {
+        LOG_TRACE("{} handled message of type {} on the io thread", type, static_cast<int>(message.type));
+        return;
+    }
     if (message.type == MessageType::TEXT) {
         std::string msg_str = message.toString();
         std::string display_msg = type + " received: " + msg_str;
         addLocalMessage(display_msg);
-        std::cout << "received text message: " << msg_str << std::endl;
+        LOG_DEBUG("received text message: {}", msg_str);
     } else if (message.type == MessageType::COMMAND) {
-        pushNetworkMessage(message);
-		std::cout << "pushed command message: " << message.toString() << std::endl;
+        LOG_DEBUG("pushed command message ({} bytes)", message.data.size());
+        pushNetworkMessage(std::move(message));
     } else if (message.type == MessageType::TERMIAL_OUTPUT) {
-        pushNetworkMessage(message);
-		std::cout << "pushed terminal output message: " << message.toString() << std::endl;
+        LOG_TRACE("pushed terminal output message ({} bytes)", message.data.size());
+        pushNetworkMessage(std::move(message));
     } else if (message.type == MessageType::SIGNAL) {
-		pushNetworkMessage(message);
+        pushNetworkMessage(std::move(message));
     } else if (message.type == MessageType::FILESYSTEM_REQUEST) {
-        pushNetworkMessage(message);
-		std::cout << "pushed filesystem request message: " << message.toFilesystemRequest() << std::endl;
+        LOG_DEBUG("pushed filesystem request message ({} bytes)", message.data.size());
+        pushNetworkMessage(std::move(message));
     } else if (message.type == MessageType::FILESYSTEM_RESPONSE) {
-        pushNetworkMessage(message);
-		std::cout << "pushed filesystem response message" << std::endl;
+        LOG_DEBUG("pushed filesystem response message ({} bytes)", message.data.size());
+        pushNetworkMessage(std::move(message));
+    } else if (message.type == MessageType::FILESYSTEM_DIFF) {
+        LOG_DEBUG("pushed filesystem diff message ({} bytes)", message.data.size());
+        pushNetworkMessage(std::move(message));
     } else if (message.type == MessageType::ERR) {
-        pushNetworkMessage(message);
-		std::cout << "pushed error message: " << message.toError() << std::endl;
+        LOG_DEBUG("pushed error message ({} bytes)", message.data.size());
+        pushNetworkMessage(std::move(message));
     } else if (message.type == MessageType::FILE_CONTENT_REQUEST) {
-        pushNetworkMessage(message);
-		std::cout << "pushed file content request message: " << message.toFileContentRequest() << std::endl;
+        LOG_DEBUG("pushed file content request message ({} bytes)", message.data.size());
+        pushNetworkMessage(std::move(message));
     } else if (message.type == MessageType::FILE_CONTENT_RESPONSE) {
-        pushNetworkMessage(message);
-        std::cout << "pushed file content response message" << std::endl;
+        LOG_DEBUG("pushed file content response message ({} bytes)", message.data.size());
+        pushNetworkMessage(std::move(message));
     } else if (message.type == MessageType::FILE_DOWNLOAD_REQUEST) {
-        pushNetworkMessage(message);
-        std::cout << "pushed file download request message: " << message.toFileDownloadRequest() << std::endl;
+        LOG_DEBUG("pushed file download request message ({} bytes)", message.data.size());
+        pushNetworkMessage(std::move(message));
     } else if (message.type == MessageType::FILE_DOWNLOAD_RESPONSE) {
-        pushNetworkMessage(message);
-        std::cout << "pushed file download response message" << std::endl;
+        LOG_DEBUG("pushed file download response message ({} bytes)", message.data.size());
+        pushNetworkMessage(std::move(message));
+    } else if (message.type == MessageType::FILE_DOWNLOAD_CHUNK) {
+        LOG_TRACE("pushed file download chunk message ({} bytes)", message.data.size());
+        pushNetworkMessage(std::move(message));
+    } else if (message.type == MessageType::FILE_DOWNLOAD_COPY) {
+        LOG_TRACE("pushed file download copy message");
+        pushNetworkMessage(std::move(message));
+    } else if (message.type == MessageType::FILE_DOWNLOAD_END) {
+        LOG_DEBUG("pushed file download end message");
+        pushNetworkMessage(std::move(message));
+    } else if (message.type == MessageType::FILE_DOWNLOAD_CANCEL) {
+        LOG_DEBUG("pushed file download cancel message");
+        pushNetworkMessage(std::move(message));
+    } else if (message.type == MessageType::FILE_TREE_REQUEST) {
+        LOG_DEBUG("pushed file tree request message ({} bytes)", message.data.size());
+        pushNetworkMessage(std::move(message));
+    } else if (message.type == MessageType::FILE_TREE_RESPONSE) {
+        LOG_DEBUG("pushed file tree response message ({} bytes)", message.data.size());
+        pushNetworkMessage(std::move(message));
+    } else if (message.type == MessageType::FILE_HASH_REQUEST) {
+        LOG_DEBUG("pushed file hash request message ({} bytes)", message.data.size());
+        pushNetworkMessage(std::move(message));
+    } else if (message.type == MessageType::FILE_HASH_RESPONSE) {
+        LOG_DEBUG("pushed file hash response message ({} bytes)", message.data.size());
+        pushNetworkMessage(std::move(message));
+    } else if (message.type == MessageType::FILE_LINES_REQUEST) {
+        LOG_DEBUG("pushed file lines request message ({} bytes)", message.data.size());
+        pushNetworkMessage(std::move(message));
+    } else if (message.type == MessageType::FILE_LINES_RESPONSE) {
+        LOG_DEBUG("pushed file lines response message ({} bytes)", message.data.size());
+        pushNetworkMessage(std::move(message));
+    } else if (message.type == MessageType::SEARCH_REQUEST) {
+        LOG_DEBUG("pushed search request message ({} bytes)", message.data.size());
+        pushNetworkMessage(std::move(message));
+    } else if (message.type == MessageType::SEARCH_RESULTS) {
+        LOG_DEBUG("pushed search results message ({} bytes)", message.data.size());
+        pushNetworkMessage(std::move(message));
+    } else if (message.type == MessageType::SEARCH_CANCEL) {
+        LOG_DEBUG("pushed search cancel message");
+        pushNetworkMessage(std::move(message));
+    } else if (message.type == MessageType::NAME_QUERY) {
+        LOG_DEBUG("pushed name query message ({} bytes)", message.data.size());
+        pushNetworkMessage(std::move(message));
+    } else if (message.type == MessageType::NAME_RESULTS) {
+        LOG_DEBUG("pushed name results message ({} bytes)", message.data.size());
+        pushNetworkMessage(std::move(message));
+    } else if (message.type == MessageType::DISK_USAGE_REQUEST) {
+        LOG_DEBUG("pushed disk usage request message ({} bytes)", message.data.size());
+        pushNetworkMessage(std::move(message));
+    } else if (message.type == MessageType::DISK_USAGE_RESULTS) {
+        LOG_DEBUG("pushed disk usage results message ({} bytes)", message.data.size());
+        pushNetworkMessage(std::move(message));
+    } else if (message.type == MessageType::DISK_USAGE_CANCEL) {
+        LOG_DEBUG("pushed disk usage cancel message");
+        pushNetworkMessage(std::move(message));
+    } else if (message.type == MessageType::TERMINAL_ACK) {
+        LOG_TRACE("pushed terminal ack message");
+        pushNetworkMessage(std::move(message));
+    } else if (message.type == MessageType::TERMINAL_UPDATE) {
+        LOG_TRACE("pushed terminal update message ({} bytes)", message.data.size());
+        pushNetworkMessage(std::move(message));
+    } else if (message.type == MessageType::TERMINAL_CONTROL) {
+        LOG_DEBUG("pushed terminal control message");
+        pushNetworkMessage(std::move(message));
+    } else if (message.type == MessageType::FILESYSTEM_WATCH) {
+        LOG_DEBUG("pushed filesystem watch message ({} bytes)", message.data.size());
+        pushNetworkMessage(std::move(message));
+    } else if (message.type == MessageType::FILE_UPLOAD_BEGIN) {
+        LOG_DEBUG("pushed file upload begin message ({} bytes)", message.data.size());
+        pushNetworkMessage(std::move(message));
+    } else if (message.type == MessageType::FILE_UPLOAD_CHUNK) {
+        LOG_TRACE("pushed file upload chunk message ({} bytes)", message.data.size());
+        pushNetworkMessage(std::move(message));
+    } else if (message.type == MessageType::FILE_UPLOAD_END) {
+        LOG_DEBUG("pushed file upload end message");
+        pushNetworkMessage(std::move(message));
+    } else if (message.type == MessageType::FILE_UPLOAD_ACK) {
+        LOG_TRACE("pushed file upload ack message");
+        pushNetworkMessage(std::move(message));
     } else if (message.type == MessageType::SCREENSHOT_REQUEST) {
-        pushNetworkMessage(message);
-        std::cout << "pushed screenshot request message" << std::endl;
+        LOG_DEBUG("pushed screenshot request message");
+        pushNetworkMessage(std::move(message));
     } else if (message.type == MessageType::SCREENSHOT_RESPONSE) {
-        pushNetworkMessage(message);
-        std::cout << "pushed screenshot response message" << std::endl;
+        LOG_DEBUG("pushed screenshot response message ({} bytes)", message.data.size());
+        pushNetworkMessage(std::move(message));
     } else if (message.type == MessageType::AUTH_REQUEST) {
-		std::cout << "received auth request message" << std::endl;
+		LOG_INFO("received auth request message");
         if (type == "Server") {
             std::string client_password = message.toAuthRequest();
             bool auth_success = (client_password == m_server_password);
@@ -112,7 +199,7 @@ void NetworkManager::handleMessage(const std::string& type, const NetworkMessage
             } 
         }
     } else if (message.type == MessageType::AUTH_RESPONSE) {
-		std::cout << "received auth response message" << std::endl;
+		LOG_INFO("received auth response message");
         if (type == "Client") {
             bool auth_success = message.toAuthResponse();
             if (auth_success) {
@@ -153,14 +240,18 @@ std::vector<SignalType> NetworkManager::popSignals() {
     return signals;
 }
 
-void NetworkManager::pushNetworkMessage(const NetworkMessage& msg) {
+void NetworkManager::pushNetworkMessage(NetworkMessage&& msg) {
     std::lock_guard<std::mutex> lock(m_message_mutex);
-    m_message_queue.push_back(msg);
+    m_message_queue.push_back(std::move(msg));
+}
+
+void NetworkManager::setMessageHandler(MessageType type, MessageHandler handler) {
+    m_message_handlers[type] = std::move(handler);
 }
 
 std::vector<NetworkMessage> NetworkManager::popNetworkMessages() {
     std::lock_guard<std::mutex> lock(m_message_mutex);
-    std::vector<NetworkMessage> messages(m_message_queue.begin(), m_message_queue.end());
+    std::vector<NetworkMessage> messages(std::make_move_iterator(m_message_queue.begin()), std::make_move_iterator(m_message_queue.end()));
     m_message_queue.clear();
     return messages;
 }
@@ -169,29 +260,49 @@ void NetworkManager::sendMessage(const std::string& message) {
     if (m_server && m_server->isConnected()) {
         m_server->send(message);
         addLocalMessage("Sent to client: " + message);
-        std::cout << "sent message to client: " << message << std::endl;
+        LOG_DEBUG("sent message to client: {}", message);
     } else if (m_client && m_client->isConnected()) {
         m_client->send(message);
         addLocalMessage("Sent to server: " + message);
-        std::cout << "sent message to server: " << message << std::endl;
+        LOG_DEBUG("sent message to server: {}", message);
     } else {
         addLocalMessage("Not connected - message not sent: " + message);
-        std::cout << "not connected - message not sent: " << message << std::endl;
+        LOG_WARN("not connected - message not sent: {}", message);
     }
 }
 
 void NetworkManager::sendMessage(const NetworkMessage& message) {
+    sendMessage(NetworkMessage(message));
+}
+
+void NetworkManager::sendMessage(NetworkMessage&& message) {
+    // Only chat text is echoed to the message panel; binary payloads are never stringified
+    bool is_text = message.type == MessageType::TEXT;
     if (m_server && m_server->isConnected()) {
-        m_server->send(message);
-        addLocalMessage("Sent to client: " + message.toString());
+        if (is_text) addLocalMessage("Sent to client: " + message.toString());
+        m_server->send(std::move(message));
     } else if (m_client && m_client->isConnected()) {
-        m_client->send(message);
-        addLocalMessage("Sent to server: " + message.toString());
+        if (is_text) addLocalMessage("Sent to server: " + message.toString());
+        m_client->send(std::move(message));
     } else {
-        addLocalMessage("Not connected - message not sent: " + message.toString());
+        addLocalMessage(is_text ? "Not connected - message not sent: " + message.toString() : "Not connected - message not sent");
     }
 }
 
+boost::asio::io_context* NetworkManager::ioContext() const {
+    if (m_server) return m_server_io_context.get();
+    if (m_client) return m_client_io_context.get();
+    return nullptr;
+}
+
+bool NetworkManager::waitForSendCapacity(size_t limit, std::chrono::milliseconds timeout) {
+    if (m_server && m_server->isConnected())
+        return m_server->waitForWriteCapacity(limit, timeout);
+    if (m_client && m_client->isConnected())
+        return m_client->waitForWriteCapacity(limit, timeout);
+    return false;
+}
+
 std::vector<std::string> NetworkManager::getMessages() {
     std::lock_guard<std::mutex> lock(m_received_messages_mutex);
     std::vector<std::string> messages(m_received_messages.begin(), m_received_messages.end());
@@ -231,13 +342,13 @@ void NetworkManager::handleConnectionState(const std::string &type, ConnectionSt
     std::string message = type + " state: " + info;
     addLocalMessage(message);
 
-    std::cout << "handle connection state - " << message << std::endl;
+    LOG_INFO("handle connection state - {}", message);
 }
 
 void NetworkManager::handleError(const std::string &type, const std::string &error) {
     std::string error_msg = type + " error: " + error;
     addLocalMessage(error_msg);
-    std::cerr << "handle error - " << error_msg << std::endl;
+    LOG_ERROR("handle error - {}", error_msg);
 }
 
 void NetworkManager::setConnectionState(ConnectionState state) {
@@ -8,6 +8,9 @@
 #include <mutex>
 #include <condition_variable>
 #include <iostream>
+#include <array>
+#include <chrono>
+#include <unordered_map>
 
 #ifdef _WIN32
 #include <iphlpapi.h>
@@ -60,13 +63,71 @@ enum class MessageType {
     SCREENSHOT_RESPONSE,
     AUTH_REQUEST,
     AUTH_RESPONSE,
-    ERR
+    ERR,
+    // The value is the frame's type byte on the wire: new types go after this point
+    FILE_DOWNLOAD_CHUNK,
+    FILE_DOWNLOAD_END,
+    FILE_DOWNLOAD_COPY,
+    FILE_DOWNLOAD_CANCEL,
+    FILE_TREE_REQUEST,
+    FILE_TREE_RESPONSE,
+    FILE_HASH_REQUEST,
+    FILE_HASH_RESPONSE,
+    FILE_LINES_REQUEST,
+    FILE_LINES_RESPONSE,
+    SEARCH_REQUEST,
+    SEARCH_RESULTS,
+    SEARCH_CANCEL,
+    NAME_QUERY,
+    NAME_RESULTS,
+    FILESYSTEM_DIFF,
+    DISK_USAGE_REQUEST,
+    DISK_USAGE_RESULTS,
+    DISK_USAGE_CANCEL,
+    FILESYSTEM_WATCH,
+    TERMINAL_ACK,
+    TERMINAL_UPDATE,
+    TERMINAL_CONTROL,
+    FILE_UPLOAD_BEGIN,
+    FILE_UPLOAD_CHUNK,
+    FILE_UPLOAD_END,
+    FILE_UPLOAD_ACK
+};
+
+// Binary header of a file chunk frame: transfer id (4 bytes) + offset (8 bytes), network byte order
+constexpr size_t FILE_CHUNK_HEADER_SIZE = 12;
+
+struct FileChunkView {
+    uint32_t id = 0;
+    uint64_t offset = 0;
+    const uint8_t* data = nullptr;
+    size_t size = 0;
+};
+
+// Delta transfer instruction: the next `length` bytes of the file are `count` blocks of the
+// client's own copy starting at block `block`
+struct FileBlockCopy {
+    uint32_t id = 0;
+    uint64_t offset = 0;
+    uint32_t block = 0;
+    uint32_t count = 0;
+};
+
+// Bytes of an open file that follow a frame's in-memory data on the wire. The connection
+// hands them to the kernel (sendfile) so they never pass through user space; `fd` is a
+// descriptor of its own, closed once the last frame referencing it is written.
+struct FileSlice {
+    std::shared_ptr<const int> fd;
+    uint64_t offset = 0;
+    size_t length = 0;
 };
 
 // Message structure
 struct NetworkMessage {
 	MessageType type;
     std::vector<uint8_t> data;
+    // Zero-copy tail of the payload; empty for all but file chunk frames
+    FileSlice file_slice;
     std::string toString() const {
         return std::string(data.begin(), data.end());
     }
@@ -85,12 +146,19 @@ struct NetworkMessage {
     DirectoryListing toDirectoryListing() const {
         return DirectoryListing::fromJson(json::from_bson(data));
     }
-    void fromFilesystemRequest(const std::string& path = "") {
+    void fromFilesystemRequest(const std::string& path = "", uint64_t version = 0, bool prefetch = false) {
         type = MessageType::FILESYSTEM_REQUEST;
-        data.assign(path.begin(), path.end());
+        data = json::to_bson(FilesystemRequest{ path, version, prefetch }.toJson());
     }
-    std::string toFilesystemRequest() const {
-        return std::string(data.begin(), data.end());
+    FilesystemRequest toFilesystemRequest() const {
+        return FilesystemRequest::fromJson(json::from_bson(data));
+    }
+    void fromDirectoryDiff(const DirectoryDiff& diff) {
+        type = MessageType::FILESYSTEM_DIFF;
+        data = json::to_bson(diff.toJson());
+    }
+    DirectoryDiff toDirectoryDiff() const {
+        return DirectoryDiff::fromJson(json::from_bson(data));
     }
     void fromFileContentRequest(const std::string& path) {
         type = MessageType::FILE_CONTENT_REQUEST;
@@ -99,12 +167,12 @@ struct NetworkMessage {
     std::string toFileContentRequest() const {
         return std::string(data.begin(), data.end());
     }
-    void fromFileDownloadRequest(const std::string& path) {
+    void fromFileDownloadRequest(const FileDownloadRequest& request) {
         type = MessageType::FILE_DOWNLOAD_REQUEST;
-        data.assign(path.begin(), path.end());
+        data = json::to_bson(request.toJson());
     }
-    std::string toFileDownloadRequest() const {
-        return std::string(data.begin(), data.end());
+    FileDownloadRequest toFileDownloadRequest() const {
+        return FileDownloadRequest::fromJson(json::from_bson(data));
     }
     void fromFileContentResponse(const FileResponse& response) {
         type = MessageType::FILE_CONTENT_RESPONSE;
@@ -113,12 +181,236 @@ struct NetworkMessage {
     FileResponse toFileContentResponse() const {
         return FileResponse::fromJson(json::from_bson(data));
     }
-    void fromFileDownloadResponse(const FileResponse& response) {
+    void fromFileDownloadResponse(const FileTransferHeader& header) {
         type = MessageType::FILE_DOWNLOAD_RESPONSE;
-        data = json::to_bson(response.toJson());
+        data = json::to_bson(header.toJson());
     }
-    FileResponse toFileDownloadResponse() const {
-        return FileResponse::fromJson(json::from_bson(data));
+    FileTransferHeader toFileDownloadResponse() const {
+        return FileTransferHeader::fromJson(json::from_bson(data));
+    }
+    // Reserves room for `capacity` payload bytes; fill chunkPayload() and then call setChunkPayloadSize()
+    void fromFileChunk(MessageType chunk_type, uint32_t id, uint64_t offset, size_t capacity) {
+        type = chunk_type;
+        data.resize(FILE_CHUNK_HEADER_SIZE + capacity);
+        uint32_t net_id = htonl(id);
+        std::memcpy(data.data(), &net_id, 4);
+        for (int i = 0; i < 8; ++i)
+            data[4 + i] = static_cast<uint8_t>(offset >> (56 - 8 * i));
+    }
+    uint8_t* chunkPayload() {
+        return data.data() + FILE_CHUNK_HEADER_SIZE;
+    }
+    void setChunkPayloadSize(size_t size) {
+        data.resize(FILE_CHUNK_HEADER_SIZE + size);
+    }
+    FileChunkView toFileChunk() const {
+        FileChunkView chunk;
+        if (data.size() < FILE_CHUNK_HEADER_SIZE) return chunk;
+        uint32_t net_id;
+        std::memcpy(&net_id, data.data(), 4);
+        chunk.id = ntohl(net_id);
+        for (int i = 0; i < 8; ++i)
+            chunk.offset = (chunk.offset << 8) | data[4 + i];
+        chunk.data = data.data() + FILE_CHUNK_HEADER_SIZE;
+        chunk.size = data.size() - FILE_CHUNK_HEADER_SIZE;
+        return chunk;
+    }
+    // Same header as a chunk frame, with the block index and count as the payload
+    void fromFileBlockCopy(uint32_t id, uint64_t offset, uint32_t block, uint32_t count) {
+        fromFileChunk(MessageType::FILE_DOWNLOAD_COPY, id, offset, 8);
+        uint32_t net_block = htonl(block);
+        uint32_t net_count = htonl(count);
+        std::memcpy(chunkPayload(), &net_block, 4);
+        std::memcpy(chunkPayload() + 4, &net_count, 4);
+    }
+    FileBlockCopy toFileBlockCopy() const {
+        FileBlockCopy copy;
+        FileChunkView chunk = toFileChunk();
+        if (chunk.size < 8) return copy;
+        uint32_t net_block, net_count;
+        std::memcpy(&net_block, chunk.data, 4);
+        std::memcpy(&net_count, chunk.data + 4, 4);
+        copy.id = chunk.id;
+        copy.offset = chunk.offset;
+        copy.block = ntohl(net_block);
+        copy.count = ntohl(net_count);
+        return copy;
+    }
+    void fromFileDownloadEnd(const FileTransferEnd& end) {
+        type = MessageType::FILE_DOWNLOAD_END;
+        data = json::to_bson(end.toJson());
+    }
+    FileTransferEnd toFileDownloadEnd() const {
+        return FileTransferEnd::fromJson(json::from_bson(data));
+    }
+    void fromFileDownloadCancel(uint32_t id) {
+        type = MessageType::FILE_DOWNLOAD_CANCEL;
+        data = json::to_bson(json{ {"id", id} });
+    }
+    uint32_t toFileDownloadCancel() const {
+        return json::from_bson(data).value("id", 0u);
+    }
+    void fromFileTreeRequest(const std::string& path) {
+        type = MessageType::FILE_TREE_REQUEST;
+        data.assign(path.begin(), path.end());
+    }
+    std::string toFileTreeRequest() const {
+        return std::string(data.begin(), data.end());
+    }
+    void fromFileTreeResponse(const FileTree& tree) {
+        type = MessageType::FILE_TREE_RESPONSE;
+        data = json::to_bson(tree.toJson());
+    }
+    FileTree toFileTreeResponse() const {
+        return FileTree::fromJson(json::from_bson(data));
+    }
+    void fromFileHashRequest(uint32_t id, const std::string& path) {
+        type = MessageType::FILE_HASH_REQUEST;
+        data = json::to_bson(json{ {"id", id}, {"path", path} });
+    }
+    std::pair<uint32_t, std::string> toFileHashRequest() const {
+        json j = json::from_bson(data);
+        return { j.value("id", 0u), j.value("path", "") };
+    }
+    void fromFileHashResponse(const FileHashInfo& info) {
+        type = MessageType::FILE_HASH_RESPONSE;
+        data = json::to_bson(info.toJson());
+    }
+    FileHashInfo toFileHashResponse() const {
+        return FileHashInfo::fromJson(json::from_bson(data));
+    }
+    void fromFileLinesRequest(const FileLinesRequest& request) {
+        type = MessageType::FILE_LINES_REQUEST;
+        data = json::to_bson(request.toJson());
+    }
+    FileLinesRequest toFileLinesRequest() const {
+        return FileLinesRequest::fromJson(json::from_bson(data));
+    }
+    void fromFileLinesResponse(const FileLines& lines) {
+        type = MessageType::FILE_LINES_RESPONSE;
+        data = json::to_bson(lines.toJson());
+    }
+    FileLines toFileLinesResponse() const {
+        return FileLines::fromJson(json::from_bson(data));
+    }
+    void fromSearchRequest(const SearchRequest& request) {
+        type = MessageType::SEARCH_REQUEST;
+        data = json::to_bson(request.toJson());
+    }
+    SearchRequest toSearchRequest() const {
+        return SearchRequest::fromJson(json::from_bson(data));
+    }
+    void fromSearchResults(const SearchResults& results) {
+        type = MessageType::SEARCH_RESULTS;
+        data = json::to_bson(results.toJson());
+    }
+    SearchResults toSearchResults() const {
+        return SearchResults::fromJson(json::from_bson(data));
+    }
+    void fromSearchCancel(uint32_t id) {
+        type = MessageType::SEARCH_CANCEL;
+        data = json::to_bson(json{ {"id", id} });
+    }
+    uint32_t toSearchCancel() const {
+        return json::from_bson(data).value("id", 0u);
+    }
+    void fromNameQuery(const NameQuery& query) {
+        type = MessageType::NAME_QUERY;
+        data = json::to_bson(query.toJson());
+    }
+    NameQuery toNameQuery() const {
+        return NameQuery::fromJson(json::from_bson(data));
+    }
+    void fromNameResults(const NameResults& results) {
+        type = MessageType::NAME_RESULTS;
+        data = json::to_bson(results.toJson());
+    }
+    NameResults toNameResults() const {
+        return NameResults::fromJson(json::from_bson(data));
+    }
+    void fromDiskUsageRequest(const DiskUsageRequest& request) {
+        type = MessageType::DISK_USAGE_REQUEST;
+        data = json::to_bson(request.toJson());
+    }
+    DiskUsageRequest toDiskUsageRequest() const {
+        return DiskUsageRequest::fromJson(json::from_bson(data));
+    }
+    void fromDiskUsageResults(const DiskUsageResults& results) {
+        type = MessageType::DISK_USAGE_RESULTS;
+        data = json::to_bson(results.toJson());
+    }
+    DiskUsageResults toDiskUsageResults() const {
+        return DiskUsageResults::fromJson(json::from_bson(data));
+    }
+    void fromDiskUsageCancel(uint32_t id) {
+        type = MessageType::DISK_USAGE_CANCEL;
+        data = json::to_bson(json{ {"id", id} });
+    }
+    uint32_t toDiskUsageCancel() const {
+        return json::from_bson(data).value("id", 0u);
+    }
+    // Directories whose changes the server should push; replaces the set sent before
+    void fromFilesystemWatch(const std::vector<std::string>& paths) {
+        type = MessageType::FILESYSTEM_WATCH;
+        data = json::to_bson(json{ {"paths", paths} });
+    }
+    std::vector<std::string> toFilesystemWatch() const {
+        return json::from_bson(data).value("paths", std::vector<std::string>());
+    }
+    // The screen state the client holds of a terminal session; 0 asks for the whole screen
+    void fromTerminalAck(uint32_t session, uint64_t state) {
+        type = MessageType::TERMINAL_ACK;
+        data = json::to_bson(json{ {"session", session}, {"state", state} });
+    }
+    std::pair<uint32_t, uint64_t> toTerminalAck() const {
+        json j = json::from_bson(data);
+        return { j.value("session", 0u), j.value("state", uint64_t(0)) };
+    }
+    // A line typed into a terminal session
+    void fromTerminalInput(uint32_t session, const std::string& input) {
+        type = MessageType::COMMAND;
+        data = json::to_bson(json{ {"session", session}, {"input", input} });
+    }
+    std::pair<uint32_t, std::string> toTerminalInput() const {
+        json j = json::from_bson(data);
+        return { j.value("session", 0u), j.value("input", "") };
+    }
+    void fromTerminalUpdate(const TerminalUpdate& update) {
+        type = MessageType::TERMINAL_UPDATE;
+        data = json::to_bson(update.toJson());
+    }
+    TerminalUpdate toTerminalUpdate() const {
+        return TerminalUpdate::fromJson(json::from_bson(data));
+    }
+    void fromTerminalControl(const TerminalControl& control) {
+        type = MessageType::TERMINAL_CONTROL;
+        data = json::to_bson(control.toJson());
+    }
+    TerminalControl toTerminalControl() const {
+        return TerminalControl::fromJson(json::from_bson(data));
+    }
+    // Upload frames reuse the download header/chunk/end layouts in the other direction;
+    // the header's filename is the destination path on the server
+    void fromFileUploadBegin(const FileTransferHeader& header) {
+        type = MessageType::FILE_UPLOAD_BEGIN;
+        data = json::to_bson(header.toJson());
+    }
+    FileTransferHeader toFileUploadBegin() const {
+        return FileTransferHeader::fromJson(json::from_bson(data));
+    }
+    void fromFileUploadEnd(const FileTransferEnd& end) {
+        type = MessageType::FILE_UPLOAD_END;
+        data = json::to_bson(end.toJson());
+    }
+    FileTransferEnd toFileUploadEnd() const {
+        return FileTransferEnd::fromJson(json::from_bson(data));
+    }
+    void fromFileUploadAck(const FileUploadAck& ack) {
+        type = MessageType::FILE_UPLOAD_ACK;
+        data = json::to_bson(ack.toJson());
+    }
+    FileUploadAck toFileUploadAck() const {
+        return FileUploadAck::fromJson(json::from_bson(data));
     }
     void fromScreenshotRequest() {
         type = MessageType::SCREENSHOT_REQUEST;
@@ -160,6 +452,17 @@ struct NetworkMessage {
     std::string toError() const {
         return std::string(data.begin(), data.end());
     }
+    size_t payloadSize() const {
+        return data.size() + file_slice.length;
+    }
+    // Frame header: type (1 byte) + size (4 bytes in network byte order)
+    std::array<uint8_t, 5> header() const {
+        std::array<uint8_t, 5> head;
+        head[0] = static_cast<uint8_t>(type);
+        uint32_t net_size = htonl(static_cast<uint32_t>(payloadSize()));
+        std::memcpy(head.data() + 1, &net_size, 4);
+        return head;
+    }
     std::vector<uint8_t> serialize() const {
         std::vector<uint8_t> buffer;
 
@@ -180,8 +483,10 @@ struct NetworkMessage {
 
 // Callback types
 using ConnectionCallback = std::function<void(ConnectionState, const std::string&)>;
-using MessageCallback = std::function<void(const NetworkMessage&)>;
+using MessageCallback = std::function<void(NetworkMessage&&)>;
 using ErrorCallback = std::function<void(const std::string&)>;
+// Takes a message on the io thread it arrived on; false leaves it to popNetworkMessages
+using MessageHandler = std::function<bool(const NetworkMessage&)>;
 
 
 class NetworkManager {
@@ -202,6 +507,7 @@ private:
     // Thread-safe event queue
     std::deque<NetworkMessage> m_message_queue;
     std::mutex m_message_mutex;
+    std::unordered_map<MessageType, MessageHandler> m_message_handlers;
 
     // Connection status
     std::atomic<ConnectionState> m_connection_state{ ConnectionState::DISCONNECTED };
@@ -224,11 +530,20 @@ public:
     void pushSignal(SignalType signal);
     std::vector<SignalType> popSignals();
 
-    void pushNetworkMessage(const NetworkMessage& msg);
+    void pushNetworkMessage(NetworkMessage&& msg);
     std::vector<NetworkMessage> popNetworkMessages();
+    // Messages of `type` go to `handler` as they arrive, a frame ahead of the queue; for those
+    // that must not wait on the main thread. Set before starting the server or client.
+    void setMessageHandler(MessageType type, MessageHandler handler);
 
     void sendMessage(const std::string& message);
     void sendMessage(const NetworkMessage& message);
+    void sendMessage(NetworkMessage&& message);
+    // The io_context of the server or client started last, for I/O that should run on its thread;
+    // nullptr when neither is
+    boost::asio::io_context* ioContext() const;
+    // Blocks until the outgoing queue holds at most `limit` bytes; false on timeout or when disconnected
+    bool waitForSendCapacity(size_t limit, std::chrono::milliseconds timeout);
     std::vector<std::string> getMessages();
     void clearMessages();
     ConnectionState getConnectionState() const;
@@ -239,7 +554,7 @@ public:
 
 private:
     void handleConnectionState(const std::string& type, ConnectionState state, const std::string& info);
-    void handleMessage(const std::string& type, const NetworkMessage& message);
+    void handleMessage(const std::string& type, NetworkMessage&& message);
     void handleError(const std::string& type, const std::string& error);
     void setConnectionState(ConnectionState state);
     void updateConnectionInfo(const std::string& info);
@@ -0,0 +1,579 @@
+#include "search.h"
+#include "logger.h"
+#include <random>
+
+// Size of each read while scanning a file
+constexpr size_t SEARCH_READ_SIZE = 1024 * 1024;
+// A NUL byte this early marks a file as binary
+constexpr size_t SEARCH_BINARY_PROBE = 8192;
+// The regex only runs on lines up to this long; std::regex recurses per character
+constexpr size_t SEARCH_MAX_REGEX_LINE = 64 * 1024;
+// Results are sent at least this often while a search runs
+constexpr auto SEARCH_FLUSH_INTERVAL = std::chrono::milliseconds(100);
+
+static char lowerAscii(char c) {
+    return c >= 'A' && c <= 'Z' ? static_cast<char>(c - 'A' + 'a') : c;
+}
+
+static bool isAlphaAscii(char c) {
+    return (c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z');
+}
+
+// Rough frequency of a byte in source code and logs; memchr works best on rare bytes
+static int byteFrequency(char c) {
+    static const char common[] = " etaoinsrhldcu";
+    if (std::strchr(common, lowerAscii(c)) && c != '\0') return 10;
+    if (c >= 'a' && c <= 'z') return 6;
+    if (std::strchr("();.,_=\"'\t/", c) && c != '\0') return 5;
+    if ((c >= 'A' && c <= 'Z') || (c >= '0' && c <= '9')) return 4;
+    return 1;
+}
+
+LiteralFinder::LiteralFinder(const std::string& needle, bool case_sensitive) : m_needle(needle), m_case_sensitive(case_sensitive) {
+    if (!m_case_sensitive)
+        std::transform(m_needle.begin(), m_needle.end(), m_needle.begin(), lowerAscii);
+    int best = INT32_MAX;
+    for (size_t i = 0; i < m_needle.size(); ++i) {
+        int frequency = byteFrequency(m_needle[i]);
+        // Ignoring case means looking for two bytes instead of one
+        if (!m_case_sensitive && isAlphaAscii(m_needle[i])) frequency *= 2;
+        if (frequency < best) {
+            best = frequency;
+            m_rare = i;
+        }
+    }
+    if (!m_needle.empty()) {
+        m_rare_lower = m_needle[m_rare];
+        m_rare_upper = (!m_case_sensitive && m_rare_lower >= 'a' && m_rare_lower <= 'z') ? static_cast<char>(m_rare_lower - 'a' + 'A') : m_rare_lower;
+    }
+}
+
+bool LiteralFinder::matchesAt(const char* candidate) const {
+    if (m_case_sensitive) return std::memcmp(candidate, m_needle.data(), m_needle.size()) == 0;
+    for (size_t i = 0; i < m_needle.size(); ++i) {
+        if (lowerAscii(candidate[i]) != m_needle[i]) return false;
+    }
+    return true;
+}
+
+const char* LiteralFinder::find(const char* begin, const char* end) const {
+    if (m_needle.empty()) return begin;
+    if (static_cast<size_t>(end - begin) < m_needle.size()) return nullptr;
+    // The rare byte can only sit in [first, last)
+    const char* first = begin + m_rare;
+    const char* last = end - (m_needle.size() - m_rare) + 1;
+    if (m_rare_upper == m_rare_lower) {
+        for (const char* p = first; p < last;) {
+            const char* hit = static_cast<const char*>(std::memchr(p, m_rare_lower, last - p));
+            if (!hit) return nullptr;
+            if (matchesAt(hit - m_rare)) return hit - m_rare;
+            p = hit + 1;
+        }
+        return nullptr;
+    }
+    // Both cases: remember where each byte occurs next so neither is searched for twice
+    const char* next_lower = nullptr;
+    const char* next_upper = nullptr;
+    for (const char* p = first; p < last;) {
+        if (next_lower != last && next_lower < p) {
+            next_lower = static_cast<const char*>(std::memchr(p, m_rare_lower, last - p));
+            if (!next_lower) next_lower = last;
+        }
+        if (next_upper != last && next_upper < p) {
+            next_upper = static_cast<const char*>(std::memchr(p, m_rare_upper, last - p));
+            if (!next_upper) next_upper = last;
+        }
+        const char* hit = std::min(next_lower, next_upper);
+        if (hit == last) return nullptr;
+        if (matchesAt(hit - m_rare)) return hit - m_rare;
+        p = hit + 1;
+    }
+    return nullptr;
+}
+
+std::string requiredLiteral(const std::string& pattern) {
+    // An alternation can match without any particular run
+    if (pattern.find('|') != std::string::npos) return "";
+    std::string best;
+    std::string run;
+    auto endRun = [&]() {
+        if (run.size() > best.size()) best = run;
+        run.clear();
+    };
+    for (size_t i = 0; i < pattern.size(); ++i) {
+        char c = pattern[i];
+        switch (c) {
+        case '\\':
+            // \d, \w, \b and friends are classes; an escaped symbol is itself
+            if (i + 1 < pattern.size() && !std::isalnum(static_cast<unsigned char>(pattern[i + 1]))) {
+                run += pattern[++i];
+            } else {
+                // Whatever else it stands for ends the run, along with its operands: the
+                // digits of \xHH and \uHHHH, the letter of \cX, and those of \0 or a backreference
+                endRun();
+                char kind = ++i < pattern.size() ? pattern[i] : '\0';
+                size_t operands = kind == 'x' ? 2 : kind == 'u' ? 4 : kind == 'c' ? 1 : 0;
+                auto operand = [kind](char next) {
+                    unsigned char u = static_cast<unsigned char>(next);
+                    return kind == 'c' ? std::isalpha(u) != 0 : std::isxdigit(u) != 0;
+                };
+                for (; operands > 0 && i + 1 < pattern.size() && operand(pattern[i + 1]); --operands) ++i;
+                if (std::isdigit(static_cast<unsigned char>(kind))) {
+                    while (i + 1 < pattern.size() && std::isdigit(static_cast<unsigned char>(pattern[i + 1]))) ++i;
+                }
+            }
+            break;
+        case '[':
+            endRun();
+            for (++i; i < pattern.size() && pattern[i] != ']'; ++i) {
+                if (pattern[i] == '\\') ++i;
+            }
+            break;
+        case '(': {
+            // Groups may be optional or repeated; nothing inside is certain
+            endRun();
+            int depth = 1;
+            for (++i; i < pattern.size() && depth > 0; ++i) {
+                if (pattern[i] == '\\') ++i;
+                else if (pattern[i] == '(') ++depth;
+                else if (pattern[i] == ')') --depth;
+            }
+            --i;
+            break;
+        }
+        case '*':
+        case '?':
+        case '{':
+            // The character before is optional
+            if (!run.empty()) run.pop_back();
+            endRun();
+            if (c == '{') {
+                while (i < pattern.size() && pattern[i] != '}') ++i;
+            }
+            break;
+        case '+':
+        case '.':
+        case '^':
+        case '$':
+        case ')':
+            endRun();
+            break;
+        default:
+            run += c;
+            break;
+        }
+    }
+    endRun();
+    return best;
+}
+
+bool globMatch(const char* pattern, const char* name) {
+    const char* star = nullptr;
+    const char* resume = nullptr;
+    while (*name) {
+        if (*pattern == '*') {
+            star = pattern++;
+            resume = name;
+        } else if (*pattern == '?' || lowerAscii(*pattern) == lowerAscii(*name)) {
+            ++pattern;
+            ++name;
+        } else if (star) {
+            pattern = star + 1;
+            name = ++resume;
+        } else {
+            return false;
+        }
+    }
+    while (*pattern == '*') ++pattern;
+    return *pattern == '\0';
+}
+
+// Start of the line holding position `pos - 1`, not going below `floor`
+static const char* lineStart(const char* floor, const char* pos) {
+    while (pos > floor && pos[-1] != '\n') --pos;
+    return pos;
+}
+
+// Start of the line `count` lines before the line starting at `pos`
+static const char* linesBack(const char* floor, const char* pos, size_t count) {
+    for (size_t i = 0; i < count && pos > floor; ++i)
+        pos = lineStart(floor, pos - 1);
+    return pos;
+}
+
+static std::string clipLine(const char* begin, const char* end) {
+    if (end > begin && end[-1] == '\r') --end;
+    return std::string(begin, std::min<size_t>(end - begin, SEARCH_MAX_LINE_BYTES));
+}
+
+struct SearchService::Search {
+    struct Task {
+        std::filesystem::path path;
+        bool directory = false;
+    };
+    struct Queue {
+        std::mutex mutex;
+        std::deque<Task> tasks;
+    };
+
+    SearchRequest request;
+    std::unique_ptr<LiteralFinder> literal;
+    std::unique_ptr<std::regex> regex;
+    std::vector<std::string> include;
+    std::vector<std::string> exclude;
+    std::atomic<bool>* abort = nullptr;
+
+    std::vector<std::unique_ptr<Queue>> queues;
+    std::atomic<size_t> outstanding{ 0 };
+
+    std::mutex results_mutex;
+    std::vector<SearchMatch> pending;
+    size_t total_matches = 0;
+    bool truncated = false;
+    std::atomic<uint64_t> files_scanned{ 0 };
+    std::atomic<uint64_t> files_skipped{ 0 };
+    std::atomic<uint64_t> bytes_scanned{ 0 };
+
+    bool stopped() const { return abort->load(std::memory_order_relaxed); }
+
+    void push(size_t worker, Task&& task) {
+        ++outstanding;
+        Queue& queue = *queues[worker];
+        std::lock_guard<std::mutex> lock(queue.mutex);
+        queue.tasks.push_back(std::move(task));
+    }
+
+    // Newest task of our own, else the oldest of someone else's
+    bool pop(size_t worker, std::mt19937& random, Task& task) {
+        {
+            Queue& own = *queues[worker];
+            std::lock_guard<std::mutex> lock(own.mutex);
+            if (!own.tasks.empty()) {
+                task = std::move(own.tasks.back());
+                own.tasks.pop_back();
+                return true;
+            }
+        }
+        size_t start = random() % queues.size();
+        for (size_t i = 0; i < queues.size(); ++i) {
+            Queue& victim = *queues[(start + i) % queues.size()];
+            std::lock_guard<std::mutex> lock(victim.mutex);
+            if (!victim.tasks.empty()) {
+                task = std::move(victim.tasks.front());
+                victim.tasks.pop_front();
+                return true;
+            }
+        }
+        return false;
+    }
+
+    bool wanted(const std::string& name, bool directory) const {
+        for (const auto& glob : exclude) {
+            if (globMatch(glob.c_str(), name.c_str())) return false;
+        }
+        if (directory) return name != ".git" && name != ".svn" && name != ".hg";
+        if (include.empty()) return true;
+        for (const auto& glob : include) {
+            if (globMatch(glob.c_str(), name.c_str())) return true;
+        }
+        return false;
+    }
+
+    void report(std::vector<SearchMatch>& matches) {
+        if (matches.empty()) return;
+        std::lock_guard<std::mutex> lock(results_mutex);
+        for (auto& match : matches) {
+            if (total_matches >= SEARCH_MAX_MATCHES) {
+                truncated = true;
+                abort->store(true);
+                break;
+            }
+            pending.push_back(std::move(match));
+            ++total_matches;
+        }
+        matches.clear();
+    }
+
+    void visit(size_t worker, const std::filesystem::path& directory) {
+        std::error_code ec;
+        auto options = std::filesystem::directory_options::skip_permission_denied;
+        for (auto it = std::filesystem::directory_iterator(directory, options, ec); !ec && it != std::filesystem::directory_iterator(); it.increment(ec)) {
+            if (stopped()) return;
+            std::error_code entry_ec;
+            // Symlinked directories could loop
+            if (it->is_symlink(entry_ec) && it->is_directory(entry_ec)) continue;
+            bool is_directory = it->is_directory(entry_ec);
+            if (!is_directory && !it->is_regular_file(entry_ec)) continue;
+            if (!wanted(it->path().filename().string(), is_directory)) continue;
+            push(worker, { it->path(), is_directory });
+        }
+    }
+
+    // Whether the line [begin, end) matches, given it holds the literal when there is one
+    bool lineMatches(const char* begin, const char* end) const {
+        if (!regex) return true;
+        if (static_cast<size_t>(end - begin) > SEARCH_MAX_REGEX_LINE) return false;
+        return std::regex_search(begin, end, *regex);
+    }
+
+    void scan(const std::filesystem::path& path, std::vector<char>& buffer, std::vector<SearchMatch>& matches) {
+        uint64_t size = 0;
+        int64_t mtime = 0;
+        NativeFile file = openFileForRead(path.string(), size, mtime);
+        if (!isValidNativeFile(file)) return;
+        if (request.max_file_size && size > request.max_file_size) {
+            closeNativeFile(file);
+            ++files_skipped;
+            return;
+        }
+
+        const size_t context = request.context;
+        char* data = buffer.data();
+        size_t length = 0;          // bytes in the buffer
+        size_t searched = 0;        // bytes before this are only kept as context
+        size_t counted = 0;         // line breaks before this offset are in `line_number`
+        uint64_t line_number = 1;
+        uint64_t offset = 0;
+        for (bool first = true; !stopped(); first = false) {
+            int64_t n = readFileAt(file, reinterpret_cast<uint8_t*>(data + length), buffer.size() - length, offset);
+            if (n < 0) break;
+            if (first && std::memchr(data, '\0', std::min<size_t>(static_cast<size_t>(n), SEARCH_BINARY_PROBE))) {
+                closeNativeFile(file);
+                ++files_skipped;
+                return;
+            }
+            offset += static_cast<uint64_t>(n);
+            length += static_cast<size_t>(n);
+            bool eof = n == 0 || offset >= size;
+
+            // Search only lines with `context` complete lines after them; the rest waits for the next block
+            const char* end = data + length;
+            const char* limit = end;
+            if (!eof) {
+                const char* complete = lineStart(data, end);
+                limit = linesBack(data + searched, complete, context);
+                if (limit <= data + searched) {
+                    if (length < buffer.size()) continue;
+                    // Lines longer than the buffer are searched in pieces; the last bytes of one
+                    // that could start the literal are searched again with the next
+                    limit = complete > data + searched ? complete : end;
+                    if (limit == end && literal)
+                        limit = std::max<const char*>(data + searched, end - std::min(literal->size() - 1, length / 2));
+                }
+            }
+
+            for (const char* pos = data + searched; pos < limit && !stopped();) {
+                const char* hit = pos;
+                if (literal) {
+                    hit = literal->find(pos, end);
+                    if (!hit || hit >= limit) break;
+                }
+                const char* begin = lineStart(data, hit);
+                const char* line_end = static_cast<const char*>(std::memchr(hit, '\n', end - hit));
+                if (!line_end) line_end = end;
+                if (lineMatches(begin, line_end)) {
+                    line_number += std::count(static_cast<const char*>(data) + counted, begin, '\n');
+                    counted = begin - data;
+                    SearchMatch match;
+                    match.path = path.string();
+                    match.line = line_number;
+                    match.text = clipLine(begin, line_end);
+                    const char* before = begin;
+                    for (size_t i = 0; i < context && before > data; ++i) {
+                        const char* previous = lineStart(data, before - 1);
+                        match.before.insert(match.before.begin(), clipLine(previous, before - 1));
+                        before = previous;
+                    }
+                    const char* after = line_end;
+                    for (size_t i = 0; i < context && after + 1 < end; ++i) {
+                        const char* next_end = static_cast<const char*>(std::memchr(after + 1, '\n', end - after - 1));
+                        if (!next_end) next_end = end;
+                        match.after.push_back(clipLine(after + 1, next_end));
+                        after = next_end;
+                    }
+                    matches.push_back(std::move(match));
+                }
+                pos = line_end + 1;
+            }
+            if (eof) break;
+
+            // Keep the unsearched tail and the context lines before it
+            line_number += std::count(static_cast<const char*>(data) + counted, limit, '\n');
+            const char* keep = linesBack(data, limit, context);
+            if (keep == data && length == buffer.size()) keep = limit;
+            size_t dropped = keep - data;
+            std::memmove(data, keep, length - dropped);
+            length -= dropped;
+            searched = limit - keep;
+            counted = searched;
+        }
+        closeNativeFile(file);
+        ++files_scanned;
+        bytes_scanned += size;
+    }
+
+    void work(size_t worker) {
+        std::mt19937 random(static_cast<unsigned>(worker * 7919 + 1));
+        std::vector<char> buffer(SEARCH_READ_SIZE);
+        std::vector<SearchMatch> matches;
+        Task task;
+        while (outstanding > 0 && !stopped()) {
+            if (!pop(worker, random, task)) {
+                // Others are still listing directories that may hold work for us
+                std::this_thread::sleep_for(std::chrono::microseconds(200));
+                continue;
+            }
+            if (task.directory) visit(worker, task.path);
+            else scan(task.path, buffer, matches);
+            report(matches);
+            --outstanding;
+        }
+    }
+};
+
+SearchService::SearchService(SendFunction send) : m_send(std::move(send)) {
+}
+
+SearchService::~SearchService() {
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        m_stop = true;
+        m_jobs.clear();
+    }
+    m_abort = true;
+    m_cv.notify_all();
+    if (m_worker.joinable()) m_worker.join();
+}
+
+void SearchService::request(const SearchRequest& request) {
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        // A new search replaces whatever the client asked for before
+        m_jobs.clear();
+        if (m_running) m_abort = true;
+        m_jobs.push_back(request);
+        if (!m_worker.joinable())
+            m_worker = std::thread(&SearchService::run, this);
+    }
+    m_cv.notify_one();
+}
+
+void SearchService::cancel(uint32_t id) {
+    std::lock_guard<std::mutex> lock(m_mutex);
+    m_jobs.erase(std::remove_if(m_jobs.begin(), m_jobs.end(), [id](const SearchRequest& job) { return job.id == id; }), m_jobs.end());
+    if (m_running == id) m_abort = true;
+}
+
+void SearchService::cancelAll() {
+    std::lock_guard<std::mutex> lock(m_mutex);
+    m_jobs.clear();
+    if (m_running) m_abort = true;
+}
+
+void SearchService::run() {
+    for (;;) {
+        SearchRequest job;
+        {
+            std::unique_lock<std::mutex> lock(m_mutex);
+            m_running = 0;
+            m_cv.wait(lock, [this]() { return m_stop || !m_jobs.empty(); });
+            if (m_stop) break;
+            job = std::move(m_jobs.front());
+            m_jobs.pop_front();
+            m_running = job.id;
+            m_abort = false;
+        }
+        search(job);
+    }
+}
+
+void SearchService::search(const SearchRequest& request) {
+    auto started = std::chrono::steady_clock::now();
+    auto elapsed = [&]() { return std::chrono::duration<double>(std::chrono::steady_clock::now() - started).count(); };
+    auto fail = [&](const std::string& error) {
+        SearchResults results;
+        results.id = request.id;
+        results.done = true;
+        results.error = error;
+        NetworkMessage msg;
+        msg.fromSearchResults(results);
+        m_send(std::move(msg));
+    };
+
+    Search search;
+    search.request = request;
+    search.request.context = std::min(request.context, SEARCH_MAX_CONTEXT);
+    search.abort = &m_abort;
+    if (request.pattern.empty()) return fail("Empty search pattern");
+    std::error_code ec;
+    if (!std::filesystem::is_directory(request.root, ec)) return fail("Not a directory: " + request.root);
+
+    std::string literal = request.pattern;
+    if (request.regex) {
+        try {
+            auto flags = std::regex::ECMAScript | std::regex::optimize;
+            if (!request.case_sensitive) flags |= std::regex::icase;
+            search.regex = std::make_unique<std::regex>(request.pattern, flags);
+        } catch (const std::regex_error& e) {
+            return fail(std::string("Invalid regex: ") + e.what());
+        }
+        literal = requiredLiteral(request.pattern);
+    }
+    if (!literal.empty()) search.literal = std::make_unique<LiteralFinder>(literal, request.case_sensitive);
+
+    std::string glob;
+    std::istringstream globs(request.globs);
+    while (std::getline(globs, glob, ';')) {
+        std::istringstream parts(glob);
+        std::string part;
+        while (std::getline(parts, part, ',')) {
+            part.erase(0, part.find_first_not_of(" \t"));
+            part.erase(part.find_last_not_of(" \t") + 1);
+            if (part.empty()) continue;
+            if (part[0] == '!') search.exclude.push_back(part.substr(1));
+            else search.include.push_back(part);
+        }
+    }
+
+    size_t threads = std::max(2u, std::thread::hardware_concurrency());
+    for (size_t i = 0; i < threads; ++i)
+        search.queues.push_back(std::make_unique<Search::Queue>());
+    search.push(0, { std::filesystem::path(request.root), true });
+    LOG_INFO("search {}: '{}' below {} on {} threads ({}{})", request.id, request.pattern, request.root, threads,
+        request.regex ? "regex" : "literal", request.regex && !literal.empty() ? ", prefilter '" + literal + "'" : "");
+
+    std::vector<std::thread> pool;
+    for (size_t i = 0; i < threads; ++i)
+        pool.emplace_back(&Search::work, &search, i);
+
+    // Stream what has been found until the pool runs out of work
+    auto flush = [&](bool done) {
+        SearchResults results;
+        results.id = request.id;
+        {
+            std::lock_guard<std::mutex> lock(search.results_mutex);
+            results.matches.swap(search.pending);
+            results.truncated = search.truncated;
+        }
+        results.files_scanned = search.files_scanned;
+        results.files_skipped = search.files_skipped;
+        results.bytes_scanned = search.bytes_scanned;
+        results.seconds = elapsed();
+        results.done = done;
+        NetworkMessage msg;
+        msg.fromSearchResults(results);
+        m_send(std::move(msg));
+    };
+    while (search.outstanding > 0 && !search.stopped()) {
+        std::this_thread::sleep_for(SEARCH_FLUSH_INTERVAL);
+        flush(false);
+    }
+    for (auto& thread : pool)
+        thread.join();
+    flush(true);
+
+    double seconds = elapsed();
+    LOG_INFO("search {}: {} matches in {} files ({} bytes, {} skipped) in {} s, {} MB/s{}", request.id, search.total_matches,
+        search.files_scanned.load(), search.bytes_scanned.load(), search.files_skipped.load(), seconds,
+        static_cast<uint64_t>(seconds > 0 ? search.bytes_scanned / seconds / 1e6 : 0.0), search.truncated ? " (match limit reached)" : "");
+}
@@ -0,0 +1,74 @@
+#pragma once
+#include "uRemote.h"
+#include "network.h"
+#include "transfer.h"
+#include <regex>
+#include <atomic>
+
+// A search stops after this many matches
+constexpr size_t SEARCH_MAX_MATCHES = 10000;
+// Matched and context lines are cut to this many bytes
+constexpr size_t SEARCH_MAX_LINE_BYTES = 512;
+// Most context lines a request may ask for on each side of a match
+constexpr uint32_t SEARCH_MAX_CONTEXT = 5;
+
+// Finds a fixed string, optionally ignoring ASCII case. Candidates come from memchr on the
+// pattern's rarest byte, which the C library runs with vector instructions, and are then
+// confirmed with a full comparison.
+class LiteralFinder {
+public:
+    LiteralFinder(const std::string& needle, bool case_sensitive);
+
+    // First occurrence in [begin, end), or nullptr
+    const char* find(const char* begin, const char* end) const;
+    bool empty() const { return m_needle.empty(); }
+    size_t size() const { return m_needle.size(); }
+
+private:
+    bool matchesAt(const char* candidate) const;
+
+    std::string m_needle;
+    bool m_case_sensitive;
+    size_t m_rare = 0;      // index of the byte memchr looks for
+    char m_rare_upper = 0;
+    char m_rare_lower = 0;
+};
+
+// Server side: searches the files below a directory for a literal or a regex and streams
+// matches back in SEARCH_RESULTS batches. Directories and files are tasks on a pool of
+// work-stealing threads: each thread pushes what it finds onto its own deque, works from
+// the back of it and, when it runs dry, steals from the front of another's. Files are read
+// in blocks; regex searches only run the regex on lines holding a literal the pattern
+// cannot match without, when it has one. Binary files (a NUL in the first block) are skipped.
+class SearchService {
+public:
+    using SendFunction = FileSender::SendFunction;
+
+    explicit SearchService(SendFunction send);
+    ~SearchService();
+
+    void request(const SearchRequest& request);
+    void cancel(uint32_t id);
+    void cancelAll();
+
+private:
+    struct Search;
+
+    void run();
+    void search(const SearchRequest& request);
+
+    SendFunction m_send;
+    std::thread m_worker;
+    std::mutex m_mutex;
+    std::condition_variable m_cv;
+    std::deque<SearchRequest> m_jobs;
+    uint32_t m_running = 0;             // id of the search in progress, under m_mutex
+    std::atomic<bool> m_abort{ false }; // tells the running search's threads to stop
+    bool m_stop = false;
+};
+
+// Longest run of plain characters every match of `pattern` must contain, or "" if none is
+// certain; lets a regex search skip lines cheaply
+std::string requiredLiteral(const std::string& pattern);
+// Whether `name` matches a shell-style pattern with '*' and '?'
+bool globMatch(const char* pattern, const char* name);
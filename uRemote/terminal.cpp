@@ -0,0 +1,761 @@
+#include "terminal.h"
+#include "logger.h"
+
+void TerminalGrid::diff(const TerminalGrid& from, TerminalUpdate& update) const {
+    update.columns = columns;
+    update.rows = rows;
+    update.cursor_row = cursor_row;
+    update.cursor_column = cursor_column;
+    update.cursor_visible = cursor_visible;
+    bool whole = from.columns != columns || from.rows != rows;
+    for (uint16_t row = 0; row < rows; ++row) {
+        uint16_t column = 0;
+        while (column < columns) {
+            if (!whole && at(row, column) == from.at(row, column)) {
+                ++column;
+                continue;
+            }
+            // A run header costs less than one cell, so runs are never bridged over equal cells
+            TerminalSpan span;
+            span.row = row;
+            span.column = column;
+            while (column < columns && (whole || !(at(row, column) == from.at(row, column))))
+                span.cells.push_back(at(row, column++));
+            update.spans.push_back(std::move(span));
+        }
+    }
+}
+
+bool TerminalGrid::apply(const TerminalUpdate& update) {
+    if (update.columns != columns || update.rows != rows) return false;
+    for (const auto& span : update.spans) {
+        if (span.row >= rows || span.column + span.cells.size() > columns) return false;
+    }
+    for (const auto& span : update.spans)
+        std::copy(span.cells.begin(), span.cells.end(), cells.begin() + size_t(span.row) * columns + span.column);
+    cursor_row = std::min<uint16_t>(update.cursor_row, rows - 1);
+    cursor_column = std::min<uint16_t>(update.cursor_column, columns - 1);
+    cursor_visible = update.cursor_visible;
+    return true;
+}
+
+TerminalEmulator::TerminalEmulator(uint16_t columns, uint16_t rows)
+    : m_main(columns, rows), m_alt(columns, rows), m_bottom(rows - 1) {
+}
+
+void TerminalEmulator::feed(const uint8_t* data, size_t size) {
+    for (size_t i = 0; i < size; ++i) {
+        uint8_t byte = data[i];
+        switch (m_state) {
+        case State::GROUND:
+            if (m_utf8_left) {
+                if ((byte & 0xC0) == 0x80) {
+                    m_utf8 = (m_utf8 << 6) | (byte & 0x3F);
+                    if (--m_utf8_left == 0) print(m_utf8);
+                    continue;
+                }
+                m_utf8_left = 0;
+                print(0xFFFD);
+            }
+            if (byte < 0x20 || byte == 0x7F) control(byte);
+            else if (byte < 0x80) print(byte);
+            else if ((byte & 0xE0) == 0xC0) { m_utf8 = byte & 0x1F; m_utf8_left = 1; }
+            else if ((byte & 0xF0) == 0xE0) { m_utf8 = byte & 0x0F; m_utf8_left = 2; }
+            else if ((byte & 0xF8) == 0xF0) { m_utf8 = byte & 0x07; m_utf8_left = 3; }
+            else print(0xFFFD);
+            break;
+        case State::ESCAPE:
+            escape(byte);
+            break;
+        case State::CHARSET:
+            if (m_charset_target == '(') m_cursor.line_drawing = byte == '0';
+            m_state = State::GROUND;
+            break;
+        case State::CSI:
+            if (byte >= '0' && byte <= '9') {
+                if (m_params.empty()) m_params.push_back(0);
+                m_params.back() = std::min(m_params.back() * 10 + (byte - '0'), 65535);
+            } else if (byte == ';' || byte == ':') {
+                if (m_params.empty()) m_params.push_back(0);
+                if (m_params.size() < 32) m_params.push_back(0);
+            } else if (byte == '?' || byte == '>' || byte == '=' || byte == '<') {
+                m_private = static_cast<char>(byte);
+            } else if (byte >= 0x40 && byte <= 0x7E) {
+                csi(byte);
+                m_state = State::GROUND;
+            } else if (byte == 0x1B) {
+                m_state = State::ESCAPE;
+            } else if (byte < 0x20) {
+                control(byte);
+            }
+            break;
+        case State::STRING:
+            // OSC, DCS and the like end at BEL or ST; nothing in them changes the screen
+            if (byte == 0x07) m_state = State::GROUND;
+            else if (byte == 0x1B) m_state = State::STRING_ESCAPE;
+            break;
+        case State::STRING_ESCAPE:
+            m_state = byte == '\\' ? State::GROUND : State::STRING;
+            break;
+        }
+    }
+    TerminalGrid& g = grid();
+    g.cursor_row = m_cursor.row;
+    g.cursor_column = m_cursor.column;
+}
+
+TerminalCell TerminalEmulator::blank() const {
+    // Erased cells take the current background, as xterm's do
+    TerminalCell cell;
+    cell.bg = m_cursor.pen.bg;
+    cell.attrs = TerminalCell::DEFAULT_FG | (m_cursor.pen.attrs & TerminalCell::DEFAULT_BG);
+    return cell;
+}
+
+void TerminalEmulator::print(uint32_t ch) {
+    // Combining marks would need the cell before them; they are dropped
+    if (ch >= 0x300 && ch < 0x370) return;
+    if (m_cursor.line_drawing && ch >= 0x60 && ch <= 0x7E) {
+        static const char16_t dec[] = u"◆▒␉␌␍␊°±␤␋┘┐┌└┼⎺"
+                                      u"⎻─⎼⎽├┤┴┬│≤≥π≠£·";
+        ch = dec[ch - 0x60];
+    }
+    TerminalGrid& g = grid();
+    if (m_wrap_pending) {
+        m_wrap_pending = false;
+        m_cursor.column = 0;
+        lineFeed();
+    }
+    TerminalCell cell = m_cursor.pen;
+    cell.ch = ch;
+    g.at(m_cursor.row, m_cursor.column) = cell;
+    if (m_cursor.column + 1 < g.columns) ++m_cursor.column;
+    else if (m_autowrap) m_wrap_pending = true;
+}
+
+void TerminalEmulator::control(uint8_t byte) {
+    switch (byte) {
+    case '\r':
+        m_cursor.column = 0;
+        m_wrap_pending = false;
+        break;
+    case '\n':
+    case '\v':
+    case '\f':
+        lineFeed();
+        m_wrap_pending = false;
+        break;
+    case '\b':
+        if (m_cursor.column > 0) --m_cursor.column;
+        m_wrap_pending = false;
+        break;
+    case '\t':
+        m_cursor.column = std::min<uint16_t>((m_cursor.column / 8 + 1) * 8, grid().columns - 1);
+        m_wrap_pending = false;
+        break;
+    case 0x0E:  // SO and SI switch to G1 and back; only G0 is modeled
+    case 0x0F:
+        break;
+    case 0x1B:
+        m_state = State::ESCAPE;
+        break;
+    default:    // BEL and the rest
+        break;
+    }
+}
+
+void TerminalEmulator::escape(uint8_t byte) {
+    m_state = State::GROUND;
+    switch (byte) {
+    case '[':
+        m_params.clear();
+        m_private = 0;
+        m_state = State::CSI;
+        break;
+    case ']':
+    case 'P':
+    case '_':
+    case '^':
+    case 'X':
+        m_state = State::STRING;
+        break;
+    case '(':
+    case ')':
+    case '*':
+    case '+':
+        m_charset_target = byte;
+        m_state = State::CHARSET;
+        break;
+    case '7':
+        m_saved = m_cursor;
+        break;
+    case '8':
+        m_cursor = m_saved;
+        moveTo(m_cursor.row, m_cursor.column);
+        break;
+    case 'D':
+        lineFeed();
+        break;
+    case 'E':
+        m_cursor.column = 0;
+        lineFeed();
+        break;
+    case 'M':
+        reverseIndex();
+        break;
+    case 'c':
+        reset();
+        break;
+    default:    // keypad modes, ST left over, and the rest
+        break;
+    }
+}
+
+int TerminalEmulator::param(size_t i, int fallback) const {
+    return i < m_params.size() && m_params[i] ? m_params[i] : fallback;
+}
+
+void TerminalEmulator::csi(uint8_t final) {
+    TerminalGrid& g = grid();
+    int row = m_cursor.row, column = m_cursor.column;
+    int n = param(0, 1);
+    if (m_private && final != 'h' && final != 'l') return;   // queries and settings without effect on the screen
+    switch (final) {
+    case 'A': moveTo(std::max(row - n, row >= m_top ? int(m_top) : 0), column); break;
+    case 'B': moveTo(std::min(row + n, row <= m_bottom ? int(m_bottom) : g.rows - 1), column); break;
+    case 'C': moveTo(row, column + n); break;
+    case 'D': moveTo(row, column - n); break;
+    case 'E': moveTo(std::min(row + n, int(m_bottom)), 0); break;
+    case 'F': moveTo(std::max(row - n, int(m_top)), 0); break;
+    case 'G':
+    case '`': moveTo(row, n - 1); break;
+    case 'd': moveTo(n - 1, column); break;
+    case 'H':
+    case 'f': moveTo(param(0, 1) - 1, param(1, 1) - 1); break;
+    case 'J': {
+        int mode = param(0, 0);
+        if (mode == 0) {
+            eraseCells(row, column, g.columns);
+            for (int r = row + 1; r < g.rows; ++r) eraseCells(r, 0, g.columns);
+        } else if (mode == 1) {
+            for (int r = 0; r < row; ++r) eraseCells(r, 0, g.columns);
+            eraseCells(row, 0, column + 1);
+        } else {
+            for (int r = 0; r < g.rows; ++r) eraseCells(r, 0, g.columns);
+        }
+        break;
+    }
+    case 'K': {
+        int mode = param(0, 0);
+        if (mode == 0) eraseCells(row, column, g.columns);
+        else if (mode == 1) eraseCells(row, 0, column + 1);
+        else eraseCells(row, 0, g.columns);
+        break;
+    }
+    case 'L':
+        if (row >= m_top && row <= m_bottom) scrollDown(row, m_bottom, n);
+        m_cursor.column = 0;
+        break;
+    case 'M':
+        if (row >= m_top && row <= m_bottom) scrollUp(row, m_bottom, n);
+        m_cursor.column = 0;
+        break;
+    case '@': {
+        n = std::min(n, g.columns - column);
+        TerminalCell* line = &g.at(row, 0);
+        std::move_backward(line + column, line + g.columns - n, line + g.columns);
+        std::fill(line + column, line + column + n, blank());
+        break;
+    }
+    case 'P': {
+        n = std::min(n, g.columns - column);
+        TerminalCell* line = &g.at(row, 0);
+        std::move(line + column + n, line + g.columns, line + column);
+        std::fill(line + g.columns - n, line + g.columns, blank());
+        break;
+    }
+    case 'X': eraseCells(row, column, std::min(column + n, int(g.columns))); break;
+    case 'S': scrollUp(m_top, m_bottom, n); break;
+    case 'T': scrollDown(m_top, m_bottom, n); break;
+    case 'm': sgr(); break;
+    case 'r': {
+        int top = param(0, 1) - 1, bottom = param(1, g.rows) - 1;
+        if (top < bottom && bottom < g.rows) {
+            m_top = static_cast<uint16_t>(top);
+            m_bottom = static_cast<uint16_t>(bottom);
+        }
+        moveTo(0, 0);
+        break;
+    }
+    case 's': m_saved = m_cursor; break;
+    case 'u':
+        m_cursor = m_saved;
+        moveTo(m_cursor.row, m_cursor.column);
+        break;
+    case 'h': setMode(true); break;
+    case 'l': setMode(false); break;
+    default: break;
+    }
+    m_wrap_pending = m_wrap_pending && final == 'm';
+}
+
+void TerminalEmulator::sgr() {
+    TerminalCell& pen = m_cursor.pen;
+    if (m_params.empty()) m_params.push_back(0);
+    // 38/48 take 5;n for the palette or 2;r;g;b, mapped onto the 6x6x6 cube
+    auto color = [this](size_t& i) -> int {
+        if (param(i + 1, 0) == 5 && i + 2 < m_params.size()) {
+            i += 2;
+            return m_params[i] & 0xFF;
+        }
+        if (param(i + 1, 0) == 2 && i + 4 < m_params.size()) {
+            auto cube = [](int v) { return v < 48 ? 0 : v < 115 ? 1 : (v - 35) / 40; };
+            int index = 16 + 36 * cube(m_params[i + 2]) + 6 * cube(m_params[i + 3]) + cube(m_params[i + 4]);
+            i += 4;
+            return index;
+        }
+        return -1;
+    };
+    for (size_t i = 0; i < m_params.size(); ++i) {
+        int p = m_params[i];
+        if (p == 0) pen = TerminalCell();
+        else if (p == 1) pen.attrs |= TerminalCell::BOLD;
+        else if (p == 3) pen.attrs |= TerminalCell::ITALIC;
+        else if (p == 4) pen.attrs |= TerminalCell::UNDERLINE;
+        else if (p == 7) pen.attrs |= TerminalCell::REVERSE;
+        else if (p == 22) pen.attrs &= ~TerminalCell::BOLD;
+        else if (p == 23) pen.attrs &= ~TerminalCell::ITALIC;
+        else if (p == 24) pen.attrs &= ~TerminalCell::UNDERLINE;
+        else if (p == 27) pen.attrs &= ~TerminalCell::REVERSE;
+        else if (p >= 30 && p <= 37) { pen.fg = static_cast<uint8_t>(p - 30); pen.attrs &= ~TerminalCell::DEFAULT_FG; }
+        else if (p >= 90 && p <= 97) { pen.fg = static_cast<uint8_t>(p - 90 + 8); pen.attrs &= ~TerminalCell::DEFAULT_FG; }
+        else if (p == 39) { pen.fg = TerminalCell().fg; pen.attrs |= TerminalCell::DEFAULT_FG; }
+        else if (p >= 40 && p <= 47) { pen.bg = static_cast<uint8_t>(p - 40); pen.attrs &= ~TerminalCell::DEFAULT_BG; }
+        else if (p >= 100 && p <= 107) { pen.bg = static_cast<uint8_t>(p - 100 + 8); pen.attrs &= ~TerminalCell::DEFAULT_BG; }
+        else if (p == 49) { pen.bg = TerminalCell().bg; pen.attrs |= TerminalCell::DEFAULT_BG; }
+        else if (p == 38 || p == 48) {
+            int index = color(i);
+            if (index < 0) break;
+            if (p == 38) { pen.fg = static_cast<uint8_t>(index); pen.attrs &= ~TerminalCell::DEFAULT_FG; }
+            else { pen.bg = static_cast<uint8_t>(index); pen.attrs &= ~TerminalCell::DEFAULT_BG; }
+        }
+    }
+}
+
+void TerminalEmulator::setMode(bool on) {
+    if (m_private != '?') return;   // ANSI modes (insert, newline) are not modeled
+    for (int mode : m_params) {
+        switch (mode) {
+        case 7: m_autowrap = on; break;
+        case 25: grid().cursor_visible = on; break;
+        case 47:
+        case 1047: switchScreen(on, false); break;
+        case 1049: switchScreen(on, true); break;
+        default: break;
+        }
+    }
+}
+
+void TerminalEmulator::switchScreen(bool alternate, bool save_cursor) {
+    if (alternate == m_alternate) return;
+    if (alternate && save_cursor) m_saved = m_cursor;
+    bool visible = grid().cursor_visible;
+    m_alternate = alternate;
+    grid().cursor_visible = visible;
+    if (alternate) {
+        for (auto& cell : m_alt.cells) cell = blank();
+    } else if (save_cursor) {
+        m_cursor = m_saved;
+    }
+    m_wrap_pending = false;
+    moveTo(m_cursor.row, m_cursor.column);
+}
+
+void TerminalEmulator::lineFeed() {
+    if (m_cursor.row == m_bottom) scrollUp(m_top, m_bottom, 1);
+    else if (m_cursor.row + 1 < grid().rows) ++m_cursor.row;
+}
+
+void TerminalEmulator::reverseIndex() {
+    if (m_cursor.row == m_top) scrollDown(m_top, m_bottom, 1);
+    else if (m_cursor.row > 0) --m_cursor.row;
+}
+
+void TerminalEmulator::scrollUp(uint16_t top, uint16_t bottom, uint16_t count) {
+    TerminalGrid& g = grid();
+    count = std::min<uint16_t>(count, bottom - top + 1);
+    auto first = g.cells.begin() + size_t(top) * g.columns;
+    auto end = g.cells.begin() + size_t(bottom + 1) * g.columns;
+    std::move(first + size_t(count) * g.columns, end, first);
+    std::fill(end - size_t(count) * g.columns, end, blank());
+}
+
+void TerminalEmulator::scrollDown(uint16_t top, uint16_t bottom, uint16_t count) {
+    TerminalGrid& g = grid();
+    count = std::min<uint16_t>(count, bottom - top + 1);
+    auto first = g.cells.begin() + size_t(top) * g.columns;
+    auto end = g.cells.begin() + size_t(bottom + 1) * g.columns;
+    std::move_backward(first, end - size_t(count) * g.columns, end);
+    std::fill(first, first + size_t(count) * g.columns, blank());
+}
+
+void TerminalEmulator::eraseCells(uint16_t row, uint16_t from, uint16_t to) {
+    TerminalGrid& g = grid();
+    if (from >= to) return;
+    std::fill(g.cells.begin() + size_t(row) * g.columns + from, g.cells.begin() + size_t(row) * g.columns + to, blank());
+}
+
+void TerminalEmulator::moveTo(int row, int column) {
+    const TerminalGrid& g = grid();
+    m_cursor.row = static_cast<uint16_t>(std::clamp(row, 0, g.rows - 1));
+    m_cursor.column = static_cast<uint16_t>(std::clamp(column, 0, g.columns - 1));
+    m_wrap_pending = false;
+}
+
+void TerminalEmulator::resize(uint16_t columns, uint16_t rows) {
+    if (columns == m_main.columns && rows == m_main.rows) return;
+    // Lines above the cursor go so that its line stays on screen
+    uint16_t shift = m_cursor.row >= rows ? m_cursor.row - rows + 1 : 0;
+    auto fit = [columns, rows](const TerminalGrid& from, uint16_t skip) {
+        TerminalGrid to(columns, rows);
+        to.cursor_visible = from.cursor_visible;
+        uint16_t copy = std::min(columns, from.columns);
+        for (uint16_t row = 0; row < rows && row + skip < from.rows; ++row)
+            std::copy_n(&from.at(row + skip, 0), copy, &to.at(row, 0));
+        return to;
+    };
+    m_main = fit(m_main, m_alternate ? 0 : shift);
+    m_alt = fit(m_alt, m_alternate ? shift : 0);
+    m_top = 0;
+    m_bottom = rows - 1;
+    moveTo(m_cursor.row - shift, m_cursor.column);
+    m_saved.row = std::min<uint16_t>(m_saved.row, rows - 1);
+    m_saved.column = std::min<uint16_t>(m_saved.column, columns - 1);
+    TerminalGrid& g = grid();
+    g.cursor_row = m_cursor.row;
+    g.cursor_column = m_cursor.column;
+}
+
+void TerminalEmulator::reset() {
+    uint16_t columns = m_main.columns, rows = m_main.rows;
+    *this = TerminalEmulator(columns, rows);
+}
+
+TerminalSync::TerminalSync(uint32_t session, uint16_t columns, uint16_t rows, SendFunction send)
+    : m_session(session), m_send(std::move(send)), m_emulator(columns, rows), m_acked(columns, rows) {
+}
+
+void TerminalSync::feed(const std::vector<uint8_t>& output) {
+    std::lock_guard<std::mutex> lock(m_mutex);
+    m_emulator.feed(output.data(), output.size());
+    if (!m_sent_state) sendUpdate();
+}
+
+void TerminalSync::acknowledge(uint64_t state) {
+    std::lock_guard<std::mutex> lock(m_mutex);
+    if (state == 0) {
+        m_acked = TerminalGrid(m_acked.columns, m_acked.rows);
+        m_acked_state = 0;
+    } else if (state == m_sent_state) {
+        m_acked = std::move(m_sent);
+        m_acked_state = state;
+    } else {
+        return;     // for an update superseded by a reset
+    }
+    m_sent_state = 0;
+    sendUpdate();
+}
+
+void TerminalSync::reset() {
+    std::lock_guard<std::mutex> lock(m_mutex);
+    m_acked = TerminalGrid(m_acked.columns, m_acked.rows);
+    m_acked_state = 0;
+    m_sent_state = 0;
+    sendUpdate();
+}
+
+void TerminalSync::resize(uint16_t columns, uint16_t rows) {
+    std::lock_guard<std::mutex> lock(m_mutex);
+    m_emulator.resize(columns, rows);
+    if (!m_sent_state) sendUpdate();
+}
+
+void TerminalSync::sendUpdate() {
+    const TerminalGrid& screen = m_emulator.screen();
+    TerminalUpdate update;
+    screen.diff(m_acked, update);
+    if (update.spans.empty() && screen.cursor_row == m_acked.cursor_row && screen.cursor_column == m_acked.cursor_column &&
+        screen.cursor_visible == m_acked.cursor_visible && m_acked_state)
+        return;
+    update.session = m_session;
+    update.base = m_acked_state;
+    update.state = ++m_next_state;
+    m_sent = screen;
+    m_sent_state = update.state;
+    NetworkMessage message;
+    message.fromTerminalUpdate(update);
+    LOG_TRACE("terminal {} update {} on {}: {} spans, {} bytes", m_session, update.state, update.base, update.spans.size(), message.data.size());
+    m_send(std::move(message));
+}
+
+TerminalSessions::TerminalSessions(SendFunction send) : m_send(std::move(send)) {
+}
+
+void TerminalSessions::open(uint32_t session, uint16_t columns, uint16_t rows, boost::asio::io_context* io_context) {
+    size_t open_sessions;
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        if (m_sessions.count(session)) return;
+        open_sessions = m_sessions.size();
+    }
+    if (!io_context || open_sessions >= TERMINAL_MAX_SESSIONS) {
+        LOG_WARN("terminal session {} refused, {} open", session, open_sessions);
+        sendControl(session, TerminalControl::CLOSE);
+        return;
+    }
+    columns = std::clamp(columns, TERMINAL_MIN_COLUMNS, TERMINAL_MAX_COLUMNS);
+    rows = std::clamp(rows, TERMINAL_MIN_ROWS, TERMINAL_MAX_ROWS);
+
+    Session entry;
+    entry.sync = std::make_unique<TerminalSync>(session, columns, rows, m_send);
+    entry.process = std::make_unique<ProcessManager>();
+    // Output is run through the screen emulator on the io thread as it is read; the client
+    // is sent how the screen changed, not the output
+    entry.process->setOutputSink([sync = entry.sync.get()](const std::vector<uint8_t>& output) {
+        sync->feed(output);
+    });
+    entry.process->resize(columns, rows);
+    // The blank screen first, so the client has one to apply diffs to
+    entry.sync->reset();
+    if (!entry.process->start(*io_context)) {
+        LOG_ERROR("terminal session {} could not start a shell", session);
+        sendControl(session, TerminalControl::CLOSE);
+        return;
+    }
+    LOG_INFO("terminal session {} opened at {}x{}", session, columns, rows);
+    std::lock_guard<std::mutex> lock(m_mutex);
+    m_sessions.emplace(session, std::move(entry));
+}
+
+bool TerminalSessions::input(uint32_t session, const std::string& line) {
+    std::lock_guard<std::mutex> lock(m_mutex);
+    auto it = m_sessions.find(session);
+    if (it == m_sessions.end()) return false;
+    it->second.process->sendCommand(line);
+    return true;
+}
+
+bool TerminalSessions::interrupt(uint32_t session) {
+    std::lock_guard<std::mutex> lock(m_mutex);
+    auto it = m_sessions.find(session);
+    if (it == m_sessions.end()) return false;
+    it->second.process->interrupt();
+    return true;
+}
+
+bool TerminalSessions::resize(uint32_t session, uint16_t columns, uint16_t rows) {
+    std::lock_guard<std::mutex> lock(m_mutex);
+    auto it = m_sessions.find(session);
+    if (it == m_sessions.end()) return false;
+    columns = std::clamp(columns, TERMINAL_MIN_COLUMNS, TERMINAL_MAX_COLUMNS);
+    rows = std::clamp(rows, TERMINAL_MIN_ROWS, TERMINAL_MAX_ROWS);
+    LOG_DEBUG("terminal session {} resized to {}x{}", session, columns, rows);
+    // The screen first: what the program draws after SIGWINCH is meant for the new size
+    it->second.sync->resize(columns, rows);
+    it->second.process->resize(columns, rows);
+    return true;
+}
+
+bool TerminalSessions::acknowledge(uint32_t session, uint64_t state) {
+    std::lock_guard<std::mutex> lock(m_mutex);
+    auto it = m_sessions.find(session);
+    if (it == m_sessions.end()) return false;
+    it->second.sync->acknowledge(state);
+    return true;
+}
+
+void TerminalSessions::close(uint32_t session) {
+    Session closed;
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        auto it = m_sessions.find(session);
+        if (it == m_sessions.end()) return;
+        closed = std::move(it->second);
+        m_sessions.erase(it);
+    }
+    LOG_INFO("terminal session {} closed", session);
+    // The shell is stopped as its ProcessManager goes, with the lock released
+}
+
+void TerminalSessions::closeAll() {
+    std::unordered_map<uint32_t, Session> sessions;
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        sessions.swap(m_sessions);
+    }
+    sessions.clear();
+}
+
+void TerminalSessions::update() {
+    std::vector<Session> ended;
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        for (auto it = m_sessions.begin(); it != m_sessions.end();) {
+            for (SignalType signal : it->second.process->popSignals()) {
+                if (signal == SignalType::CMD_BUSY) sendControl(it->first, TerminalControl::BUSY);
+                else if (signal == SignalType::CMD_IDLE) sendControl(it->first, TerminalControl::IDLE);
+            }
+            if (it->second.process->isRunning()) {
+                ++it;
+                continue;
+            }
+            LOG_INFO("terminal session {} ended", it->first);
+            sendControl(it->first, TerminalControl::CLOSE);
+            ended.push_back(std::move(it->second));
+            it = m_sessions.erase(it);
+        }
+    }
+}
+
+void TerminalSessions::sendControl(uint32_t session, uint8_t action) {
+    TerminalControl control;
+    control.session = session;
+    control.action = action;
+    NetworkMessage message;
+    message.fromTerminalControl(control);
+    m_send(std::move(message));
+}
+
+uint64_t RemoteTerminal::apply(const TerminalUpdate& update) {
+    // A full screen applies to any, a diff only to the state it was made against
+    bool fits = update.state && (update.base == 0 || update.base == state) &&
+        update.columns <= TERMINAL_MAX_COLUMNS && update.rows <= TERMINAL_MAX_ROWS;
+    // A diff to another size carries every cell
+    if (fits && (update.base == 0 || update.columns != screen.columns || update.rows != screen.rows))
+        screen = TerminalGrid(update.columns, update.rows);
+    state = fits && screen.apply(update) ? update.state : 0;
+    return state;
+}
+
+bool RemoteTerminal::fit(uint16_t panel_columns, uint16_t panel_rows) {
+    auto now = std::chrono::steady_clock::now();
+    if (panel_columns != wanted_columns || panel_rows != wanted_rows) {
+        wanted_columns = panel_columns;
+        wanted_rows = panel_rows;
+        wanted_since = now;
+    }
+    if ((wanted_columns == columns && wanted_rows == rows) || now - wanted_since < TERMINAL_RESIZE_DELAY)
+        return false;
+    columns = wanted_columns;
+    rows = wanted_rows;
+    return true;
+}
+
+// xterm's palette: 16 named colors, a 6x6x6 cube and 24 grays
+static ImU32 terminalColor(uint8_t index) {
+    static const uint8_t named[16][3] = {
+        { 0, 0, 0 }, { 205, 0, 0 }, { 0, 205, 0 }, { 205, 205, 0 }, { 0, 0, 238 }, { 205, 0, 205 }, { 0, 205, 205 }, { 229, 229, 229 },
+        { 127, 127, 127 }, { 255, 0, 0 }, { 0, 255, 0 }, { 255, 255, 0 }, { 92, 92, 255 }, { 255, 0, 255 }, { 0, 255, 255 }, { 255, 255, 255 },
+    };
+    if (index < 16)
+        return IM_COL32(named[index][0], named[index][1], named[index][2], 255);
+    if (index < 232) {
+        static const uint8_t levels[6] = { 0, 95, 135, 175, 215, 255 };
+        int cube = index - 16;
+        return IM_COL32(levels[cube / 36], levels[cube / 6 % 6], levels[cube % 6], 255);
+    }
+    uint8_t gray = uint8_t(8 + (index - 232) * 10);
+    return IM_COL32(gray, gray, gray, 255);
+}
+
+// The character itself when the font has it; box drawing falls back to ASCII lines
+static uint32_t drawableChar(ImFont* font, uint32_t ch) {
+    if (ch < 0x80 || (ch <= IM_UNICODE_CODEPOINT_MAX && font->FindGlyphNoFallback(ImWchar(ch))))
+        return ch;
+    if (ch >= 0x2500 && ch <= 0x257F) {
+        switch (ch) {
+        case 0x2500: case 0x2501: case 0x2504: case 0x2505: case 0x2508: case 0x2509: case 0x254C: case 0x254D: case 0x2550:
+            return '-';
+        case 0x2502: case 0x2503: case 0x2506: case 0x2507: case 0x250A: case 0x250B: case 0x254E: case 0x254F: case 0x2551:
+            return '|';
+        default:
+            return '+';
+        }
+    }
+    return '?';
+}
+
+static void appendUtf8(std::string& out, uint32_t ch) {
+    if (ch < 0x80) {
+        out += char(ch);
+    } else if (ch < 0x800) {
+        out += char(0xC0 | (ch >> 6));
+        out += char(0x80 | (ch & 0x3F));
+    } else if (ch < 0x10000) {
+        out += char(0xE0 | (ch >> 12));
+        out += char(0x80 | ((ch >> 6) & 0x3F));
+        out += char(0x80 | (ch & 0x3F));
+    } else {
+        out += char(0xF0 | (ch >> 18));
+        out += char(0x80 | ((ch >> 12) & 0x3F));
+        out += char(0x80 | ((ch >> 6) & 0x3F));
+        out += char(0x80 | (ch & 0x3F));
+    }
+}
+
+void drawTerminal(const TerminalGrid& screen) {
+    ImFont* font = ImGui::GetFont();
+    ImDrawList* draw = ImGui::GetWindowDrawList();
+    const ImVec2 origin = ImGui::GetCursorScreenPos();
+    const float cell_width = ImGui::CalcTextSize("M").x;
+    const float cell_height = ImGui::GetTextLineHeight();
+    const ImU32 default_fg = ImGui::GetColorU32(ImGuiCol_Text);
+    const ImU32 default_bg = ImGui::GetColorU32(ImGuiCol_WindowBg);
+
+    std::string text;
+    for (uint16_t row = 0; row < screen.rows; ++row) {
+        // One run of cells drawn alike at a time
+        for (uint16_t column = 0; column < screen.columns;) {
+            const TerminalCell& first = screen.at(row, column);
+            uint16_t end = column + 1;
+            while (end < screen.columns) {
+                const TerminalCell& cell = screen.at(row, end);
+                if (cell.fg != first.fg || cell.bg != first.bg || cell.attrs != first.attrs)
+                    break;
+                ++end;
+            }
+            bool default_back = first.attrs & TerminalCell::DEFAULT_BG;
+            ImU32 fg = first.attrs & TerminalCell::DEFAULT_FG ? default_fg : terminalColor(first.fg);
+            ImU32 bg = default_back ? default_bg : terminalColor(first.bg);
+            if (first.attrs & TerminalCell::REVERSE) {
+                std::swap(fg, bg);
+                default_back = false;
+            }
+            ImVec2 from(origin.x + column * cell_width, origin.y + row * cell_height);
+            ImVec2 to(origin.x + end * cell_width, from.y + cell_height);
+            if (!default_back)
+                draw->AddRectFilled(from, to, bg);
+
+            // Cell by cell, so glyphs wider or narrower than the font's "M" keep to the grid
+            for (uint16_t i = column; i < end; ++i) {
+                uint32_t ch = drawableChar(font, screen.at(row, i).ch);
+                if (ch == ' ')
+                    continue;
+                text.clear();
+                appendUtf8(text, ch);
+                ImVec2 at(origin.x + i * cell_width, from.y);
+                draw->AddText(at, fg, text.data(), text.data() + text.size());
+                if (first.attrs & TerminalCell::BOLD)
+                    draw->AddText(ImVec2(at.x + 1, at.y), fg, text.data(), text.data() + text.size());
+            }
+            if (first.attrs & TerminalCell::UNDERLINE)
+                draw->AddLine(ImVec2(from.x, to.y - 1), ImVec2(to.x, to.y - 1), fg);
+            column = end;
+        }
+    }
+    if (screen.cursor_visible && screen.cursor_row < screen.rows && screen.cursor_column < screen.columns) {
+        ImVec2 from(origin.x + screen.cursor_column * cell_width, origin.y + screen.cursor_row * cell_height);
+        draw->AddRect(from, ImVec2(from.x + cell_width, from.y + cell_height), default_fg);
+    }
+    ImGui::Dummy(ImVec2(screen.columns * cell_width, screen.rows * cell_height));
+}
@@ -0,0 +1,194 @@
+#pragma once
+#include "uRemote.h"
+#include "network.h"
+#include "transfer.h"
+#include "cli.h"
+#include <unordered_map>
+
+// Terminal sessions a server runs at once, and the sizes a client may ask for
+constexpr size_t TERMINAL_MAX_SESSIONS = 64;
+constexpr uint16_t TERMINAL_MIN_COLUMNS = 20;
+constexpr uint16_t TERMINAL_MAX_COLUMNS = 500;
+constexpr uint16_t TERMINAL_MIN_ROWS = 5;
+constexpr uint16_t TERMINAL_MAX_ROWS = 200;
+// How long the client's panel must keep a new size before the session is resized to it
+constexpr auto TERMINAL_RESIZE_DELAY = std::chrono::milliseconds(100);
+
+// A screen of cells and its cursor, as the client shows it
+struct TerminalGrid {
+    uint16_t columns = 0;
+    uint16_t rows = 0;
+    std::vector<TerminalCell> cells;    // row by row
+    uint16_t cursor_row = 0;
+    uint16_t cursor_column = 0;
+    bool cursor_visible = true;
+
+    TerminalGrid() = default;
+    TerminalGrid(uint16_t columns, uint16_t rows) : columns(columns), rows(rows), cells(size_t(columns) * rows) {}
+
+    TerminalCell& at(uint16_t row, uint16_t column) { return cells[size_t(row) * columns + column]; }
+    const TerminalCell& at(uint16_t row, uint16_t column) const { return cells[size_t(row) * columns + column]; }
+    // Fills `update` with the runs of cells that differ from `from`, and this grid's size and
+    // cursor; every cell when the sizes differ
+    void diff(const TerminalGrid& from, TerminalUpdate& update) const;
+    // False when the update does not fit the grid, which is then left as it was
+    bool apply(const TerminalUpdate& update);
+};
+
+// VT100/xterm screen emulator for a shell's output: cursor movement, erasing, scroll regions,
+// insert and delete, SGR attributes with 256 colors, the alternate screen and the DEC line
+// drawing set. What it does not model (queries, mouse and keypad modes, titles) is parsed
+// and dropped, and every character takes one cell.
+class TerminalEmulator {
+public:
+    TerminalEmulator(uint16_t columns = TERMINAL_COLUMNS, uint16_t rows = TERMINAL_ROWS);
+
+    void feed(const uint8_t* data, size_t size);
+    const TerminalGrid& screen() const { return m_alternate ? m_alt : m_main; }
+    // Keeps the top left of both screens, or the rows up to the cursor where it would fall
+    // off the bottom; the scroll region becomes the whole screen
+    void resize(uint16_t columns, uint16_t rows);
+
+private:
+    enum class State { GROUND, ESCAPE, CHARSET, CSI, STRING, STRING_ESCAPE };
+    struct Cursor {
+        uint16_t row = 0;
+        uint16_t column = 0;
+        TerminalCell pen;
+        bool line_drawing = false;
+    };
+
+    TerminalGrid& grid() { return m_alternate ? m_alt : m_main; }
+    TerminalCell blank() const;
+    void print(uint32_t ch);
+    void control(uint8_t byte);
+    void escape(uint8_t byte);
+    void csi(uint8_t final);
+    void sgr();
+    void setMode(bool on);
+    void lineFeed();
+    void reverseIndex();
+    void scrollUp(uint16_t top, uint16_t bottom, uint16_t count);
+    void scrollDown(uint16_t top, uint16_t bottom, uint16_t count);
+    void eraseCells(uint16_t row, uint16_t from, uint16_t to);
+    void moveTo(int row, int column);
+    void switchScreen(bool alternate, bool save_cursor);
+    void reset();
+    int param(size_t i, int fallback) const;
+
+    TerminalGrid m_main;
+    TerminalGrid m_alt;
+    bool m_alternate = false;
+    Cursor m_cursor;
+    Cursor m_saved;
+    bool m_wrap_pending = false;
+    bool m_autowrap = true;
+    uint16_t m_top = 0;                 // scroll region, inclusive
+    uint16_t m_bottom = 0;
+
+    State m_state = State::GROUND;
+    std::vector<int> m_params;
+    char m_private = 0;                 // '?', '>' or '=' after CSI
+    uint8_t m_charset_target = 0;       // '(' or ')' awaiting its charset
+    uint32_t m_utf8 = 0;                // code point being decoded
+    int m_utf8_left = 0;
+};
+
+// Server side: runs the shell's output through a TerminalEmulator and keeps the client's copy
+// of the screen in step, as mosh does: an update carries only the cells that differ from the
+// state the client last acknowledged, and the next one goes out when that one is. However
+// much a program writes meanwhile, what crosses the link is bounded by the screen size.
+class TerminalSync {
+public:
+    using SendFunction = FileSender::SendFunction;
+
+    TerminalSync(uint32_t session, uint16_t columns, uint16_t rows, SendFunction send);
+
+    void feed(const std::vector<uint8_t>& output);
+    // The client holds `state`; 0 asks for the whole screen again
+    void acknowledge(uint64_t state);
+    // A new client, holding a blank screen: it is sent the whole screen
+    void reset();
+    // The next update carries every cell, at the new size
+    void resize(uint16_t columns, uint16_t rows);
+
+private:
+    void sendUpdate();
+
+    uint32_t m_session;
+    SendFunction m_send;
+    std::mutex m_mutex;
+    TerminalEmulator m_emulator;
+    TerminalGrid m_acked;               // the client's screen, at m_acked_state
+    uint64_t m_acked_state = 0;
+    TerminalGrid m_sent;                // the screen the update in flight leads to
+    uint64_t m_sent_state = 0;          // 0 when none is in flight
+    uint64_t m_next_state = 0;
+};
+
+// Server side: the client's terminal sessions, each a shell on a pty of its own, of the size
+// the client's panel has, with its own TerminalSync. On POSIX every pty is read and written on
+// the network io thread, which also runs the emulators, so dozens of busy shells take no
+// thread of their own; Windows keeps a pair of pipe reader threads per shell. Input, resizes
+// and acknowledgements may come from any thread, the network io thread included; the rest is
+// called on the main thread, and never stops a shell while holding the session lock, as
+// stopping waits for the io thread.
+class TerminalSessions {
+public:
+    using SendFunction = FileSender::SendFunction;
+
+    explicit TerminalSessions(SendFunction send);
+
+    // Starts a shell for `session`, read on io_context; the client is sent CLOSE when it
+    // cannot be, or TERMINAL_MAX_SESSIONS are open
+    void open(uint32_t session, uint16_t columns, uint16_t rows, boost::asio::io_context* io_context);
+    // False when `session` is not open
+    bool input(uint32_t session, const std::string& line);
+    bool interrupt(uint32_t session);
+    bool resize(uint32_t session, uint16_t columns, uint16_t rows);
+    bool acknowledge(uint32_t session, uint64_t state);
+    void close(uint32_t session);
+    // Stops every shell; before the io_context goes away
+    void closeAll();
+    // Tells the client of shells that exited, and of commands starting and completing where
+    // the shell reports them; called once a frame
+    void update();
+
+private:
+    struct Session {
+        std::unique_ptr<TerminalSync> sync;
+        std::unique_ptr<ProcessManager> process;    // after sync, whose feed its output calls
+    };
+
+    void sendControl(uint32_t session, uint8_t action);
+
+    SendFunction m_send;
+    std::mutex m_mutex;
+    std::unordered_map<uint32_t, Session> m_sessions;   // under m_mutex
+};
+
+// Client side: one terminal session, its screen as the server last updated it, and the size
+// its panel asks for
+struct RemoteTerminal {
+    uint32_t session = 0;
+    TerminalGrid screen;
+    uint64_t state = 0;                 // 0 when the screen has to be sent again
+    uint16_t columns = TERMINAL_COLUMNS;    // size the server was last asked for
+    uint16_t rows = TERMINAL_ROWS;
+    uint16_t wanted_columns = TERMINAL_COLUMNS;
+    uint16_t wanted_rows = TERMINAL_ROWS;
+    std::chrono::steady_clock::time_point wanted_since;
+    bool busy = false;
+    bool exited = false;
+    bool open = true;                   // false once its tab is closed
+    char input[256] = "";
+
+    // Applies an update for this session; returns the state to acknowledge
+    uint64_t apply(const TerminalUpdate& update);
+    // The panel offers `panel_columns` by `panel_rows`; true when the server should now be asked to resize
+    bool fit(uint16_t panel_columns, uint16_t panel_rows);
+};
+
+// Client side: draws the screen at the cursor, one font "M" wide and a line high per cell,
+// and takes its size in the layout
+void drawTerminal(const TerminalGrid& screen);
@@ -0,0 +1,1700 @@
+#include "transfer.h"
+#include "diskio.h"
+#include "logger.h"
+#include <algorithm>
+#include <cerrno>
+
+#ifndef _WIN32
+#include <fcntl.h>
+#include <sys/stat.h>
+#endif
+
+#ifdef _WIN32
+NativeFile openFileForRead(const std::string& path, uint64_t& size, int64_t& mtime) {
+    HANDLE file = CreateFileA(path.c_str(), GENERIC_READ, FILE_SHARE_READ | FILE_SHARE_WRITE, NULL,
+        OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL | FILE_FLAG_SEQUENTIAL_SCAN, NULL);
+    if (file == INVALID_HANDLE_VALUE) return file;
+    LARGE_INTEGER file_size;
+    FILETIME write_time;
+    if (!GetFileSizeEx(file, &file_size) || !GetFileTime(file, NULL, NULL, &write_time)) {
+        CloseHandle(file);
+        return INVALID_HANDLE_VALUE;
+    }
+    size = static_cast<uint64_t>(file_size.QuadPart);
+    // FILETIME counts 100ns ticks since 1601-01-01
+    uint64_t ticks = (static_cast<uint64_t>(write_time.dwHighDateTime) << 32) | write_time.dwLowDateTime;
+    mtime = static_cast<int64_t>(ticks / 10000000ULL) - 11644473600LL;
+    return file;
+}
+
+NativeFile openFileForWrite(const std::string& path, bool truncate) {
+    return CreateFileA(path.c_str(), GENERIC_WRITE, FILE_SHARE_READ, NULL, truncate ? CREATE_ALWAYS : OPEN_ALWAYS, FILE_ATTRIBUTE_NORMAL, NULL);
+}
+
+bool syncNativeFile(NativeFile file) {
+    return FlushFileBuffers(file) != 0;
+}
+
+void flushNativeFileRange(NativeFile file, uint64_t offset, uint64_t length, bool wait) {
+    // The cache manager writes behind on its own; there is no per-range control
+    (void)file;
+    (void)offset;
+    (void)length;
+    (void)wait;
+}
+
+bool preallocateNativeFile(NativeFile file, uint64_t size) {
+    FILE_ALLOCATION_INFO info = {};
+    info.AllocationSize.QuadPart = static_cast<LONGLONG>(size);
+    return SetFileInformationByHandle(file, FileAllocationInfo, &info, sizeof(info)) != 0;
+}
+
+void closeNativeFile(NativeFile file) {
+    if (file != INVALID_HANDLE_VALUE) CloseHandle(file);
+}
+
+bool isValidNativeFile(NativeFile file) {
+    return file != INVALID_HANDLE_VALUE;
+}
+
+std::shared_ptr<const int> shareNativeFile(NativeFile file) {
+    return nullptr;
+}
+
+bool fileIdentity(NativeFile file, FileIdentity& identity) {
+    BY_HANDLE_FILE_INFORMATION info;
+    if (!GetFileInformationByHandle(file, &info)) return false;
+    identity.device = info.dwVolumeSerialNumber;
+    identity.inode = (static_cast<uint64_t>(info.nFileIndexHigh) << 32) | info.nFileIndexLow;
+    identity.size = (static_cast<uint64_t>(info.nFileSizeHigh) << 32) | info.nFileSizeLow;
+    uint64_t ticks = (static_cast<uint64_t>(info.ftLastWriteTime.dwHighDateTime) << 32) | info.ftLastWriteTime.dwLowDateTime;
+    identity.mtime_ns = static_cast<int64_t>(ticks) * 100;
+    return true;
+}
+
+int64_t readFileAt(NativeFile file, uint8_t* buffer, size_t length, uint64_t offset) {
+    OVERLAPPED overlapped = {};
+    overlapped.Offset = static_cast<DWORD>(offset);
+    overlapped.OffsetHigh = static_cast<DWORD>(offset >> 32);
+    DWORD bytes_read = 0;
+    if (!ReadFile(file, buffer, static_cast<DWORD>(length), &bytes_read, &overlapped)) {
+        return GetLastError() == ERROR_HANDLE_EOF ? 0 : -1;
+    }
+    return bytes_read;
+}
+
+bool writeFileAt(NativeFile file, const uint8_t* buffer, size_t length, uint64_t offset) {
+    OVERLAPPED overlapped = {};
+    overlapped.Offset = static_cast<DWORD>(offset);
+    overlapped.OffsetHigh = static_cast<DWORD>(offset >> 32);
+    DWORD bytes_written = 0;
+    return WriteFile(file, buffer, static_cast<DWORD>(length), &bytes_written, &overlapped) && bytes_written == length;
+}
+#else
+NativeFile openFileForRead(const std::string& path, uint64_t& size, int64_t& mtime) {
+    int fd = ::open(path.c_str(), O_RDONLY | O_CLOEXEC);
+    if (fd < 0) return -1;
+    struct stat st;
+    if (fstat(fd, &st) != 0 || !S_ISREG(st.st_mode)) {
+        ::close(fd);
+        return -1;
+    }
+    size = static_cast<uint64_t>(st.st_size);
+    mtime = static_cast<int64_t>(st.st_mtime);
+#ifdef POSIX_FADV_SEQUENTIAL
+    posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+#endif
+    return fd;
+}
+
+NativeFile openFileForWrite(const std::string& path, bool truncate) {
+    return ::open(path.c_str(), O_WRONLY | O_CREAT | O_CLOEXEC | (truncate ? O_TRUNC : 0), 0644);
+}
+
+bool syncNativeFile(NativeFile file) {
+#ifdef __APPLE__
+    return ::fsync(file) == 0;
+#else
+    return ::fdatasync(file) == 0;
+#endif
+}
+
+void flushNativeFileRange(NativeFile file, uint64_t offset, uint64_t length, bool wait) {
+#if defined(__linux__)
+    unsigned flags = wait ? SYNC_FILE_RANGE_WAIT_BEFORE | SYNC_FILE_RANGE_WRITE | SYNC_FILE_RANGE_WAIT_AFTER : SYNC_FILE_RANGE_WRITE;
+    if (::sync_file_range(file, static_cast<off_t>(offset), static_cast<off_t>(length), flags) == 0 && wait)
+        ::posix_fadvise(file, static_cast<off_t>(offset), static_cast<off_t>(length), POSIX_FADV_DONTNEED);
+#else
+    (void)file;
+    (void)offset;
+    (void)length;
+    (void)wait;
+#endif
+}
+
+bool preallocateNativeFile(NativeFile file, uint64_t size) {
+    if (size == 0) return true;
+#if defined(__linux__)
+    if (::fallocate(file, 0, 0, static_cast<off_t>(size)) == 0) return true;
+    // Filesystems without fallocate support (e.g. some network mounts) just write sparsely
+    return errno == EOPNOTSUPP || errno == ENOSYS;
+#elif defined(__APPLE__)
+    return true;
+#else
+    int err = ::posix_fallocate(file, 0, static_cast<off_t>(size));
+    return err == 0 || err == EOPNOTSUPP || err == EINVAL;
+#endif
+}
+
+void closeNativeFile(NativeFile file) {
+    if (file >= 0) ::close(file);
+}
+
+bool isValidNativeFile(NativeFile file) {
+    return file >= 0;
+}
+
+std::shared_ptr<const int> shareNativeFile(NativeFile file) {
+    int fd = ::fcntl(file, F_DUPFD_CLOEXEC, 0);
+    if (fd < 0) return nullptr;
+    return std::shared_ptr<const int>(new int(fd), [](const int* fd) {
+        ::close(*fd);
+        delete fd;
+    });
+}
+
+bool fileIdentity(NativeFile file, FileIdentity& identity) {
+    struct stat st;
+    if (fstat(file, &st) != 0) return false;
+    identity.device = static_cast<uint64_t>(st.st_dev);
+    identity.inode = static_cast<uint64_t>(st.st_ino);
+    identity.size = static_cast<uint64_t>(st.st_size);
+#ifdef __APPLE__
+    identity.mtime_ns = static_cast<int64_t>(st.st_mtimespec.tv_sec) * 1000000000 + st.st_mtimespec.tv_nsec;
+#else
+    identity.mtime_ns = static_cast<int64_t>(st.st_mtim.tv_sec) * 1000000000 + st.st_mtim.tv_nsec;
+#endif
+    return true;
+}
+
+int64_t readFileAt(NativeFile file, uint8_t* buffer, size_t length, uint64_t offset) {
+    size_t total = 0;
+    while (total < length) {
+        ssize_t n = ::pread(file, buffer + total, length - total, static_cast<off_t>(offset + total));
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            return -1;
+        }
+        if (n == 0) break;
+        total += static_cast<size_t>(n);
+    }
+    return static_cast<int64_t>(total);
+}
+
+bool writeFileAt(NativeFile file, const uint8_t* buffer, size_t length, uint64_t offset) {
+    size_t total = 0;
+    while (total < length) {
+        ssize_t n = ::pwrite(file, buffer + total, length - total, static_cast<off_t>(offset + total));
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            return false;
+        }
+        total += static_cast<size_t>(n);
+    }
+    return true;
+}
+#endif
+
+FileSender::FileSender(SendFunction send, CapacityFunction wait_capacity, ConnectedFunction connected)
+    : m_send(std::move(send)), m_wait_capacity(std::move(wait_capacity)), m_connected(std::move(connected)) {
+}
+
+FileSender::~FileSender() {
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        m_stop = true;
+    }
+    m_cv.notify_all();
+    if (m_worker.joinable()) m_worker.join();
+}
+
+void FileSender::start(const FileDownloadRequest& request) {
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        m_pending.push_back(request);
+        if (!m_worker.joinable())
+            m_worker = std::thread(&FileSender::run, this);
+    }
+    m_cv.notify_one();
+}
+
+void FileSender::setZeroCopy(bool enabled) {
+    m_zero_copy = enabled;
+}
+
+void FileSender::cancel(uint32_t id) {
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        auto it = std::find_if(m_pending.begin(), m_pending.end(), [id](const FileDownloadRequest& r) { return r.id == id; });
+        if (it != m_pending.end())
+            m_pending.erase(it);
+        else
+            m_cancel_ids.insert(id);
+    }
+    m_cv.notify_one();
+}
+
+void FileSender::cancelAll() {
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        m_pending.clear();
+        m_cancel_all = true;
+    }
+    m_cv.notify_one();
+}
+
+// Feeds a transfer's integrity digest, if it has one
+static void updateHash(StreamingHash* hash, const uint8_t* data, size_t length) {
+    if (hash && length > 0) hash->update(data, length);
+}
+
+bool FileSender::open(const FileDownloadRequest& request, Transfer& transfer) {
+    transfer.id = request.id;
+    transfer.path = request.path;
+    int64_t mtime = 0;
+    transfer.file = openFileForRead(request.path, transfer.size, mtime);
+    if (!isValidNativeFile(transfer.file)) {
+        FileTransferEnd end;
+        end.id = request.id;
+        end.error = "Failed to read file: " + request.path;
+        NetworkMessage msg;
+        msg.fromFileDownloadEnd(end);
+        m_send(std::move(msg));
+        return false;
+    }
+
+    // Resume only if the file is still the one the client has a partial copy of
+    uint64_t start = request.offset;
+    uint64_t length = request.length;
+    bool has_identity = request.expect_size != 0 || request.expect_mtime != 0;
+    if (has_identity && (request.expect_size != transfer.size || request.expect_mtime != mtime)) {
+        LOG_INFO("download {}: {} changed since the partial copy, restarting", request.id, request.path);
+        start = 0;
+        length = 0;
+    }
+    start = std::min(start, transfer.size);
+    transfer.start = transfer.offset = start;
+    transfer.end = (length == 0 || length > transfer.size - start) ? transfer.size : start + length;
+
+    HashAlgorithm algorithm = parseHashAlgorithm(request.hash_algorithm);
+    if (algorithm != HashAlgorithm::NONE)
+        transfer.hash = std::make_unique<StreamingHash>(algorithm);
+    transfer.cpu_started = std::clock();
+
+    // Delta mode: describe the file against the client's signatures instead of sending it whole
+    transfer.started = std::chrono::steady_clock::now();
+    if (!request.delta_signatures.empty() && transfer.start == 0 && transfer.end == transfer.size) {
+        auto signature = std::make_unique<DeltaSignature>();
+        bool valid = request.delta_block_size >= DELTA_MIN_BLOCK_SIZE && request.delta_block_size <= DELTA_MAX_BLOCK_SIZE
+            && DeltaSignature::deserialize(request.delta_signatures, request.delta_block_size, request.delta_basis_size, *signature);
+        if (valid) {
+            NativeFile file = transfer.file;
+            // The scanner reads the file exactly once, front to back, so its reads feed the digest
+            StreamingHash* hash = transfer.hash.get();
+            transfer.signature = std::move(signature);
+            transfer.scanner = std::make_unique<DeltaScanner>(*transfer.signature,
+                [file, hash](uint8_t* buffer, size_t length, uint64_t offset) {
+                    int64_t n = readFileAt(file, buffer, length, offset);
+                    if (n > 0) updateHash(hash, buffer, static_cast<size_t>(n));
+                    return n;
+                },
+                transfer.size, FILE_CHUNK_SIZE);
+        } else {
+            LOG_WARN("download {}: ignoring malformed delta signatures", request.id);
+        }
+    }
+#ifdef __linux__
+    if (!transfer.scanner && m_zero_copy)
+        transfer.shared_file = shareNativeFile(transfer.file);
+#endif
+    // Data only enters user space when it is sent from memory or hashed
+    transfer.read_ahead = !transfer.scanner && (!transfer.shared_file || transfer.hash);
+    transfer.read_offset = transfer.start;
+
+    FileTransferHeader header;
+    header.id = request.id;
+    header.filename = std::filesystem::path(request.path).filename().string();
+    header.size = transfer.size;
+    header.mtime = mtime;
+    header.offset = transfer.start;
+    header.length = transfer.end - transfer.start;
+    NetworkMessage msg;
+    msg.fromFileDownloadResponse(header);
+    m_send(std::move(msg));
+    LOG_INFO("download {} started: {} bytes {}-{} of {}", transfer.id, transfer.path, transfer.start, transfer.end, transfer.size);
+    return true;
+}
+
+bool FileSender::sendDelta(Transfer& transfer) {
+    DeltaOp op;
+    if (!transfer.scanner->next(op)) {
+        if (transfer.scanner->failed()) return false;
+        // Everything is described; shorter than expected if the file shrank
+        transfer.end = transfer.offset;
+        return true;
+    }
+    NetworkMessage msg;
+    if (op.kind == DeltaOp::Kind::LITERAL) {
+        msg.fromFileChunk(MessageType::FILE_DOWNLOAD_CHUNK, transfer.id, op.offset, op.data.size());
+        std::memcpy(msg.chunkPayload(), op.data.data(), op.data.size());
+    } else {
+        msg.fromFileBlockCopy(transfer.id, op.offset, op.block, op.count);
+    }
+    transfer.offset = op.offset + op.length;
+    m_send(std::move(msg));
+    return true;
+}
+
+// Chunk frame whose payload the connection sends straight from the file
+bool FileSender::sendFileSlice(Transfer& transfer) {
+    size_t length = static_cast<size_t>(std::min<uint64_t>(FILE_CHUNK_SIZE, transfer.end - transfer.offset));
+    NetworkMessage msg;
+    msg.fromFileChunk(MessageType::FILE_DOWNLOAD_CHUNK, transfer.id, transfer.offset, 0);
+    msg.file_slice = { transfer.shared_file, transfer.offset, length };
+    transfer.offset += length;
+    m_send(std::move(msg));
+    return true;
+}
+
+void FileSender::fillReadAhead(Transfer& transfer) {
+    while (transfer.read_ahead && transfer.read_offset < transfer.end && transfer.inflight + transfer.ready.size() < transfer.readahead) {
+        size_t length = static_cast<size_t>(std::min<uint64_t>(FILE_CHUNK_SIZE, transfer.end - transfer.read_offset));
+        if (!m_disk->read(transfer.file, transfer.id, transfer.read_offset, length)) break;
+        transfer.read_offset += length;
+        ++transfer.inflight;
+    }
+}
+
+void FileSender::collectReads(std::vector<Transfer>& active, std::chrono::milliseconds timeout) {
+    std::vector<DiskReader::Completion> completions;
+    m_disk->wait(completions, timeout);
+    for (const auto& completion : completions) {
+        auto it = std::find_if(active.begin(), active.end(), [&](const Transfer& transfer) { return transfer.id == completion.id; });
+        if (it == active.end()) {
+            // The transfer finished or was cancelled while this read was in flight
+            m_disk->release(completion.buffer);
+            continue;
+        }
+        --it->inflight;
+        it->ready[completion.offset] = { completion.result, completion.buffer };
+    }
+}
+
+// Sends the chunk at the transfer's offset from its read-ahead buffer; the caller checks it is ready
+bool FileSender::sendReadAhead(Transfer& transfer) {
+    auto it = transfer.ready.find(transfer.offset);
+    if (it == transfer.ready.end()) return true; // empty file
+    Transfer::ReadyChunk chunk = it->second;
+    transfer.ready.erase(it);
+    if (chunk.result < 0) {
+        m_disk->release(chunk.buffer);
+        return false;
+    }
+
+    size_t expected = static_cast<size_t>(std::min<uint64_t>(FILE_CHUNK_SIZE, transfer.end - transfer.offset));
+    size_t n = static_cast<size_t>(chunk.result);
+    const uint8_t* data = m_disk->buffer(chunk.buffer);
+    NetworkMessage msg;
+    if (n > 0) {
+        updateHash(transfer.hash.get(), data, n);
+        if (transfer.shared_file) {
+            msg.fromFileChunk(MessageType::FILE_DOWNLOAD_CHUNK, transfer.id, transfer.offset, 0);
+            msg.file_slice = { transfer.shared_file, transfer.offset, n };
+        } else {
+            msg.fromFileChunk(MessageType::FILE_DOWNLOAD_CHUNK, transfer.id, transfer.offset, n);
+            std::memcpy(msg.chunkPayload(), data, n);
+        }
+    }
+    m_disk->release(chunk.buffer);
+    transfer.offset += n;
+    if (n < expected) {
+        // File shrank while streaming; report what was sent and drop later reads
+        transfer.end = transfer.offset;
+    }
+    if (n > 0) m_send(std::move(msg));
+    return true;
+}
+
+bool FileSender::sendChunk(Transfer& transfer) {
+    if (transfer.scanner) return sendDelta(transfer);
+    if (transfer.read_ahead) return sendReadAhead(transfer);
+    return sendFileSlice(transfer);
+}
+
+void FileSender::finish(Transfer& transfer, bool success, const std::string& error) {
+    for (const auto& [offset, chunk] : transfer.ready)
+        m_disk->release(chunk.buffer);
+    transfer.ready.clear();
+    // Reads still in flight are dropped when they complete
+    closeNativeFile(transfer.file);
+    if (transfer.scanner) {
+        double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - transfer.started).count();
+        uint64_t scanned = transfer.scanner->literalBytes() + transfer.scanner->matchedBytes();
+        LOG_INFO("download {} delta: {} literal bytes, {} bytes matched, scanned at {} MB/s", transfer.id,
+            transfer.scanner->literalBytes(), transfer.scanner->matchedBytes(), seconds > 0 ? scanned / seconds / 1e6 : 0.0);
+    }
+    if (!m_connected()) return;
+    FileTransferEnd end;
+    end.id = transfer.id;
+    end.success = success;
+    end.bytes = transfer.offset - transfer.start;
+    end.error = error;
+    if (success && transfer.hash) {
+        end.hash = transfer.hash->finishHex();
+        LOG_INFO("download {} {}: {} at {} MB/s", transfer.id, hashAlgorithmName(transfer.hash->algorithm()), end.hash,
+            transfer.hash->seconds() > 0 ? end.bytes / transfer.hash->seconds() / 1e6 : 0.0);
+    }
+    NetworkMessage msg;
+    msg.fromFileDownloadEnd(end);
+    m_send(std::move(msg));
+
+    // Process CPU time covers the I/O thread too, so this is the whole cost of the send path
+    double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - transfer.started).count();
+    double cpu_seconds = static_cast<double>(std::clock() - transfer.cpu_started) / CLOCKS_PER_SEC;
+    LOG_INFO("download {} finished: {} bytes, success={}, {} MB/s, {} CPU ns/byte ({})", transfer.id, end.bytes, success,
+        seconds > 0 ? end.bytes / seconds / 1e6 : 0.0, end.bytes ? cpu_seconds * 1e9 / end.bytes : 0.0,
+        transfer.scanner ? "delta" : transfer.shared_file ? "zero-copy" : "buffered");
+}
+
+void FileSender::run() {
+    std::vector<Transfer> active;
+    m_disk = DiskReader::create(FILE_READ_BUFFERS, FILE_CHUNK_SIZE, FILE_READ_THREADS);
+    LOG_INFO("file sender reading with {}", m_disk->name());
+
+    for (;;) {
+        std::deque<FileDownloadRequest> requests;
+        std::unordered_set<uint32_t> cancel_ids;
+        bool cancel = false;
+        bool stop = false;
+        {
+            std::unique_lock<std::mutex> lock(m_mutex);
+            m_cv.wait(lock, [this, &active]() { return m_stop || m_cancel_all || !m_pending.empty() || !active.empty(); });
+            stop = m_stop;
+            cancel = m_cancel_all;
+            m_cancel_all = false;
+            requests.swap(m_pending);
+            cancel_ids.swap(m_cancel_ids);
+        }
+
+        for (size_t i = 0; i < active.size() && !cancel_ids.empty();) {
+            if (cancel_ids.count(active[i].id)) {
+                finish(active[i], false, "Transfer cancelled");
+                active.erase(active.begin() + i);
+            } else {
+                ++i;
+            }
+        }
+
+        if (stop || cancel || !m_connected()) {
+            for (auto& transfer : active)
+                finish(transfer, false, "Transfer cancelled");
+            active.clear();
+            if (stop) break;
+        }
+
+        for (const auto& request : requests) {
+            Transfer transfer;
+            if (open(request, transfer))
+                active.push_back(std::move(transfer));
+        }
+
+        // Keep every stream's read-ahead window full, submitted to the disk as one batch
+        for (auto& transfer : active)
+            fillReadAhead(transfer);
+        m_disk->submit();
+        collectReads(active, std::chrono::milliseconds(0));
+
+        // Round-robin one chunk per transfer so small files are not stuck behind large ones
+        bool sent = false;
+        bool starved = false;
+        for (size_t i = 0; i < active.size();) {
+            Transfer& transfer = active[i];
+            if (transfer.read_ahead && transfer.offset < transfer.end && !transfer.ready.count(transfer.offset)) {
+                // Waiting on the disk: a deeper window keeps more of this stream's reads queued
+                if (transfer.stalled_at != transfer.offset) {
+                    transfer.stalled_at = transfer.offset;
+                    transfer.readahead = std::min(transfer.readahead * 2, FILE_READAHEAD_MAX);
+                }
+                starved = true;
+                ++i;
+                continue;
+            }
+            if (!m_wait_capacity(FILE_SEND_HIGH_WATERMARK))
+                break; // Socket still saturated or gone; re-check cancellation first
+
+            sent = true;
+            if (!sendChunk(transfer)) {
+                finish(transfer, false, "Read error: " + transfer.path);
+                active.erase(active.begin() + i);
+            } else if (transfer.offset >= transfer.end) {
+                finish(transfer, true, "");
+                active.erase(active.begin() + i);
+            } else {
+                ++i;
+            }
+        }
+        if (starved && !sent)
+            collectReads(active, std::chrono::milliseconds(20));
+    }
+}
+
+FileUploader::FileUploader(SendFunction send, CapacityFunction wait_capacity, ConnectedFunction connected)
+    : m_send(std::move(send)), m_wait_capacity(std::move(wait_capacity)), m_connected(std::move(connected)) {
+}
+
+FileUploader::~FileUploader() {
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        m_stop = true;
+    }
+    m_cv.notify_all();
+    if (m_worker.joinable()) m_worker.join();
+}
+
+void FileUploader::start(uint32_t id, const std::string& local_path, const std::string& remote_path) {
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        Upload upload;
+        upload.id = id;
+        upload.local_path = local_path;
+        upload.remote_path = remote_path;
+        upload.progress.id = id;
+        upload.progress.name = std::filesystem::path(local_path).filename().string();
+        upload.sample_time = std::chrono::steady_clock::now();
+        m_uploads.push_back(std::move(upload));
+        if (!m_worker.joinable())
+            m_worker = std::thread(&FileUploader::run, this);
+    }
+    m_cv.notify_one();
+}
+
+void FileUploader::onAck(const FileUploadAck& ack) {
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        auto it = std::find_if(m_uploads.begin(), m_uploads.end(), [&ack](const Upload& u) { return u.id == ack.id; });
+        if (it == m_uploads.end() || it->progress.done) return;
+        Progress& progress = it->progress;
+        progress.acked = std::max(progress.acked, ack.bytes);
+
+        auto now = std::chrono::steady_clock::now();
+        double elapsed = std::chrono::duration<double>(now - it->sample_time).count();
+        if (elapsed >= 0.25) {
+            double instant = (progress.acked - it->sample_bytes) / elapsed;
+            progress.rate = progress.rate == 0.0 ? instant : 0.7 * progress.rate + 0.3 * instant;
+            it->sample_time = now;
+            it->sample_bytes = progress.acked;
+        }
+        if (ack.done) {
+            progress.done = true;
+            progress.success = ack.success;
+            progress.rate = 0.0;
+            progress.message = ack.success ? "Uploaded to " + it->remote_path : ack.error;
+        }
+    }
+    m_cv.notify_one();
+}
+
+void FileUploader::cancel(uint32_t id) {
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        auto it = std::find_if(m_uploads.begin(), m_uploads.end(), [id](const Upload& u) { return u.id == id; });
+        if (it != m_uploads.end() && !it->progress.done) it->cancelled = true;
+    }
+    m_cv.notify_one();
+}
+
+void FileUploader::cancelAll() {
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        m_cancel_all = true;
+    }
+    m_cv.notify_one();
+}
+
+std::vector<FileUploader::Progress> FileUploader::progress() {
+    std::lock_guard<std::mutex> lock(m_mutex);
+    std::vector<Progress> result;
+    result.reserve(m_uploads.size());
+    for (const auto& upload : m_uploads)
+        result.push_back(upload.progress);
+    return result;
+}
+
+void FileUploader::clearFinished() {
+    std::lock_guard<std::mutex> lock(m_mutex);
+    m_uploads.erase(std::remove_if(m_uploads.begin(), m_uploads.end(), [](const Upload& u) {
+        return u.progress.done && !u.opened;
+    }), m_uploads.end());
+}
+
+void FileUploader::finish(Upload& upload, bool success, const std::string& message, bool notify_server) {
+    if (upload.opened) {
+        closeNativeFile(upload.file);
+        upload.opened = false;
+    }
+    upload.ended = true;
+    if (notify_server && m_connected()) {
+        FileTransferEnd end;
+        end.id = upload.id;
+        end.success = success;
+        end.bytes = upload.offset;
+        end.error = message;
+        NetworkMessage msg;
+        msg.fromFileUploadEnd(end);
+        m_send(std::move(msg));
+    }
+    if (!success && !upload.progress.done) {
+        upload.progress.done = true;
+        upload.progress.success = false;
+        upload.progress.rate = 0.0;
+        upload.progress.message = message;
+    }
+}
+
+void FileUploader::run() {
+    // The worker owns file handles and offsets; the UI thread only reads and writes `progress`.
+    // Entries are only removed by clearFinished() once done and closed, so the worker never
+    // touches an entry that may disappear while the lock is released for I/O.
+    for (;;) {
+        std::vector<uint32_t> ready;
+        {
+            std::unique_lock<std::mutex> lock(m_mutex);
+            auto collect = [this, &ready]() {
+                ready.clear();
+                for (auto& upload : m_uploads) {
+                    if (upload.progress.done) {
+                        if (upload.opened) ready.push_back(upload.id); // closed by the server side
+                        continue;
+                    }
+                    if (upload.ended) continue;
+                    if (upload.cancelled || !upload.opened || upload.progress.acked + FILE_UPLOAD_WINDOW > upload.offset)
+                        ready.push_back(upload.id);
+                }
+                return !ready.empty();
+            };
+            m_cv.wait(lock, [this, &collect]() { return m_stop || m_cancel_all || collect(); });
+            if (m_stop) {
+                for (auto& upload : m_uploads) {
+                    if (upload.opened) closeNativeFile(upload.file);
+                    upload.opened = false;
+                }
+                break;
+            }
+            if (m_cancel_all || !m_connected()) {
+                m_cancel_all = false;
+                for (auto& upload : m_uploads) {
+                    if (!upload.progress.done) finish(upload, false, "Upload cancelled", false);
+                    else if (upload.opened) finish(upload, upload.progress.success, "", false);
+                }
+                continue;
+            }
+        }
+
+        for (uint32_t id : ready) {
+            if (!m_wait_capacity(FILE_SEND_HIGH_WATERMARK))
+                break; // Socket still saturated or gone; re-check cancellation first
+
+            Upload* upload = nullptr;
+            bool cancelled = false;
+            bool done = false;
+            {
+                std::lock_guard<std::mutex> lock(m_mutex);
+                auto it = std::find_if(m_uploads.begin(), m_uploads.end(), [id](const Upload& u) { return u.id == id; });
+                if (it == m_uploads.end()) continue;
+                upload = &*it;
+                cancelled = upload->cancelled;
+                done = upload->progress.done;
+            }
+            // Safe without the lock: clearFinished() skips entries that are still open or not done
+            if (done) {
+                std::lock_guard<std::mutex> lock(m_mutex);
+                finish(*upload, upload->progress.success, "", false);
+                continue;
+            }
+            if (cancelled) {
+                std::lock_guard<std::mutex> lock(m_mutex);
+                finish(*upload, false, "Upload cancelled", true);
+                continue;
+            }
+
+            if (!upload->opened) {
+                int64_t mtime = 0;
+                uint64_t size = 0;
+                NativeFile file = openFileForRead(upload->local_path, size, mtime);
+                std::lock_guard<std::mutex> lock(m_mutex);
+                if (!isValidNativeFile(file)) {
+                    finish(*upload, false, "Failed to read file: " + upload->local_path, false);
+                    continue;
+                }
+                upload->file = file;
+                upload->opened = true;
+                upload->size = size;
+                upload->progress.size = size;
+
+                FileTransferHeader header;
+                header.id = upload->id;
+                header.filename = upload->remote_path;
+                header.size = size;
+                header.mtime = mtime;
+                header.length = size;
+                NetworkMessage msg;
+                msg.fromFileUploadBegin(header);
+                m_send(std::move(msg));
+                LOG_INFO("upload {} started: {} -> {} ({} bytes)", upload->id, upload->local_path, upload->remote_path, size);
+                if (size == 0) finish(*upload, true, "", true);
+                continue;
+            }
+
+            size_t length = static_cast<size_t>(std::min<uint64_t>(FILE_CHUNK_SIZE, upload->size - upload->offset));
+            NetworkMessage msg;
+            msg.fromFileChunk(MessageType::FILE_UPLOAD_CHUNK, upload->id, upload->offset, length);
+            int64_t n = readFileAt(upload->file, msg.chunkPayload(), length, upload->offset);
+            std::lock_guard<std::mutex> lock(m_mutex);
+            if (n <= 0) {
+                finish(*upload, false, n < 0 ? "Read error: " + upload->local_path : "File shrank while uploading: " + upload->local_path, true);
+                continue;
+            }
+            msg.setChunkPayloadSize(static_cast<size_t>(n));
+            upload->offset += static_cast<uint64_t>(n);
+            m_send(std::move(msg));
+            if (upload->offset >= upload->size)
+                finish(*upload, true, "", true);
+        }
+    }
+}
+
+UploadReceiver::~UploadReceiver() {
+    abortAll();
+}
+
+std::string UploadReceiver::tempPath(const std::string& path) {
+    return path + ".upload";
+}
+
+FileUploadAck UploadReceiver::fail(uint32_t id, const std::string& error) {
+    FileUploadAck ack;
+    ack.id = id;
+    ack.done = true;
+    ack.error = error;
+    auto it = m_uploads.find(id);
+    if (it != m_uploads.end()) {
+        ack.bytes = it->second.next_offset;
+        closeNativeFile(it->second.file);
+        std::error_code ec;
+        std::filesystem::remove(tempPath(it->second.header.filename), ec);
+        m_uploads.erase(it);
+    }
+    LOG_WARN("upload {} failed: {}", id, error);
+    return ack;
+}
+
+std::optional<FileUploadAck> UploadReceiver::begin(const FileTransferHeader& header) {
+    if (m_uploads.count(header.id))
+        return fail(header.id, "Duplicate upload id");
+
+    Upload upload;
+    upload.header = header;
+    upload.file = openFileForWrite(tempPath(header.filename));
+    if (!isValidNativeFile(upload.file)) {
+        FileUploadAck ack;
+        ack.id = header.id;
+        ack.done = true;
+        ack.error = "Failed to create file: " + header.filename;
+        return ack;
+    }
+    m_uploads[header.id] = std::move(upload);
+    if (!preallocateNativeFile(m_uploads[header.id].file, header.size))
+        return fail(header.id, "Not enough space for " + header.filename);
+    LOG_INFO("upload {} started: {} ({} bytes)", header.id, header.filename, header.size);
+    return std::nullopt;
+}
+
+std::optional<FileUploadAck> UploadReceiver::write(const FileChunkView& chunk) {
+    auto it = m_uploads.find(chunk.id);
+    if (it == m_uploads.end()) return std::nullopt; // Already failed; the client stops on the ack
+
+    Upload& upload = it->second;
+    if (chunk.offset != upload.next_offset || upload.next_offset + chunk.size > upload.header.size)
+        return fail(chunk.id, "Out of order data for " + upload.header.filename);
+    if (!writeFileAt(upload.file, chunk.data, chunk.size, chunk.offset))
+        return fail(chunk.id, "Failed to write " + upload.header.filename);
+    upload.next_offset += chunk.size;
+
+    if (upload.next_offset - upload.acked < FILE_UPLOAD_ACK_INTERVAL) return std::nullopt;
+    upload.acked = upload.next_offset;
+    FileUploadAck ack;
+    ack.id = chunk.id;
+    ack.bytes = upload.acked;
+    return ack;
+}
+
+std::optional<FileUploadAck> UploadReceiver::end(const FileTransferEnd& end) {
+    auto it = m_uploads.find(end.id);
+    if (it == m_uploads.end()) return std::nullopt;
+
+    Upload& upload = it->second;
+    if (!end.success)
+        return fail(end.id, end.error.empty() ? "Upload cancelled" : end.error);
+    if (upload.next_offset != upload.header.size)
+        return fail(end.id, "Upload incomplete: " + upload.header.filename);
+    if (!syncNativeFile(upload.file))
+        return fail(end.id, "Failed to flush " + upload.header.filename);
+    closeNativeFile(upload.file);
+
+    // Readers of the destination see either the old file or the complete new one
+    std::error_code ec;
+    std::string temp = tempPath(upload.header.filename);
+    std::filesystem::rename(temp, upload.header.filename, ec);
+    if (ec) {
+        std::filesystem::remove(temp, ec);
+        FileUploadAck ack;
+        ack.id = end.id;
+        ack.done = true;
+        ack.error = "Failed to replace " + upload.header.filename;
+        m_uploads.erase(it);
+        return ack;
+    }
+
+    FileUploadAck ack;
+    ack.id = end.id;
+    ack.bytes = upload.next_offset;
+    ack.done = true;
+    ack.success = true;
+    LOG_INFO("upload {} finished: {} ({} bytes)", end.id, upload.header.filename, upload.next_offset);
+    m_uploads.erase(it);
+    return ack;
+}
+
+void UploadReceiver::abortAll() {
+    for (auto& [id, upload] : m_uploads) {
+        closeNativeFile(upload.file);
+        std::error_code ec;
+        std::filesystem::remove(tempPath(upload.header.filename), ec);
+    }
+    m_uploads.clear();
+}
+
+FileReceiver::~FileReceiver() {
+    abortAll();
+    {
+        std::unique_lock<std::mutex> lock(m_mutex);
+        // The checkpoints are written before the writer goes
+        m_idle_cv.wait(lock, [this]() { return m_jobs.empty() && !m_busy; });
+        m_stop = true;
+    }
+    m_cv.notify_all();
+    if (m_worker.joinable()) m_worker.join();
+}
+
+std::string FileReceiver::partPath(const std::string& final_path) {
+    return final_path + ".part";
+}
+
+std::string FileReceiver::checkpointPath(const std::string& final_path) {
+    return final_path + ".part.json";
+}
+
+void FileReceiver::setHashAlgorithm(HashAlgorithm algorithm) {
+    m_hash_algorithm = algorithm;
+}
+
+void FileReceiver::setDeltaEnabled(bool enabled) {
+    m_delta_enabled = enabled;
+}
+
+void FileReceiver::setSyncOnFinish(bool enabled) {
+    m_sync_on_finish = enabled;
+}
+
+void FileReceiver::closeTransfer(Transfer& transfer) {
+    closeNativeFile(transfer.file);
+    if (transfer.basis_open) {
+        closeNativeFile(transfer.basis);
+        transfer.basis_open = false;
+    }
+}
+
+FileDownloadRequest FileReceiver::prepare(uint32_t id, const std::string& remote_path, const std::string& local_path, const std::string& host) {
+    Requested target;
+    target.remote_path = remote_path;
+    target.host = host;
+    target.final_path = local_path;
+
+    FileDownloadRequest request;
+    request.id = id;
+    request.path = remote_path;
+
+    std::ifstream file(checkpointPath(target.final_path));
+    if (file.is_open()) {
+        try {
+            json cp = json::parse(file);
+            uint64_t committed = cp.value("committed", uint64_t(0));
+            std::error_code ec;
+            uint64_t part_size = std::filesystem::file_size(partPath(target.final_path), ec);
+            if (cp.value("remote_path", "") == remote_path && cp.value("host", "") == host && !ec && part_size >= committed) {
+                request.offset = committed;
+                request.expect_size = cp.value("size", uint64_t(0));
+                request.expect_mtime = cp.value("mtime", int64_t(0));
+                LOG_INFO("download {}: resuming {} at offset {}", id, remote_path, committed);
+            }
+        } catch (const std::exception& e) {
+            LOG_WARN("ignoring unreadable checkpoint for {}: {}", remote_path, e.what());
+        }
+    }
+
+    // Re-downloading over an existing copy: the server then sends only what changed.
+    // Signatures are filled in by DeltaSigner off the UI thread.
+    if (m_delta_enabled && request.offset == 0) {
+        uint64_t size = 0;
+        int64_t mtime = 0;
+        NativeFile basis = openFileForRead(target.final_path, size, mtime);
+        if (isValidNativeFile(basis)) {
+            closeNativeFile(basis);
+            if (size >= DELTA_MIN_FILE_SIZE) {
+                target.delta_block_size = request.delta_block_size = deltaBlockSize(size);
+                target.basis_size = request.delta_basis_size = size;
+                target.basis_mtime = mtime;
+            }
+        }
+    }
+
+    if (m_hash_algorithm != HashAlgorithm::NONE) {
+        target.hash_algorithm = m_hash_algorithm;
+        request.hash_algorithm = hashAlgorithmName(m_hash_algorithm);
+    }
+
+    std::lock_guard<std::mutex> lock(m_mutex);
+    m_requested[id] = std::move(target);
+    return request;
+}
+
+void FileReceiver::setRequestHash(FileDownloadRequest& request, HashAlgorithm algorithm) {
+    std::lock_guard<std::mutex> lock(m_mutex);
+    auto it = m_requested.find(request.id);
+    if (it == m_requested.end()) return;
+    it->second.hash_algorithm = algorithm;
+    request.hash_algorithm = algorithm != HashAlgorithm::NONE ? hashAlgorithmName(algorithm) : "";
+}
+
+std::string FileReceiver::localPath(uint32_t id) const {
+    std::lock_guard<std::mutex> lock(m_mutex);
+    auto it = m_requested.find(id);
+    return it != m_requested.end() ? it->second.final_path : std::string();
+}
+
+void FileReceiver::release(uint32_t id) {
+    std::lock_guard<std::mutex> lock(m_mutex);
+    m_requested.erase(id);
+}
+
+void FileReceiver::post(NetworkMessage&& message) {
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        Job job;
+        job.message = std::move(message);
+        m_queued_bytes += job.message.data.size();
+        m_jobs.push_back(std::move(job));
+        if (!m_worker.joinable())
+            m_worker = std::thread(&FileReceiver::run, this);
+    }
+    m_cv.notify_one();
+}
+
+std::vector<FileReceiver::Event> FileReceiver::popEvents() {
+    std::lock_guard<std::mutex> lock(m_event_mutex);
+    std::vector<Event> events;
+    events.swap(m_events);
+    return events;
+}
+
+uint64_t FileReceiver::queuedBytes() const {
+    std::lock_guard<std::mutex> lock(m_mutex);
+    return m_queued_bytes;
+}
+
+void FileReceiver::emit(Event&& event) {
+    std::lock_guard<std::mutex> lock(m_event_mutex);
+    // Chunks arrive far faster than frames are drawn; fold consecutive progress together
+    if (event.kind == Event::Kind::PROGRESS && !m_events.empty()) {
+        Event& last = m_events.back();
+        if (last.kind == Event::Kind::PROGRESS && last.id == event.id) {
+            last.result.bytes += event.result.bytes;
+            return;
+        }
+    }
+    m_events.push_back(std::move(event));
+}
+
+bool FileReceiver::isIgnored(uint32_t id) {
+    std::lock_guard<std::mutex> lock(m_mutex);
+    return m_ignored.count(id) > 0;
+}
+
+void FileReceiver::run() {
+    for (;;) {
+        Job job;
+        {
+            std::unique_lock<std::mutex> lock(m_mutex);
+            m_busy = false;
+            m_idle_cv.notify_all();
+            m_cv.wait(lock, [this]() { return m_stop || !m_jobs.empty(); });
+            if (m_stop) break;
+            job = std::move(m_jobs.front());
+            m_jobs.pop_front();
+            m_queued_bytes -= job.message.data.size();
+            m_busy = true;
+        }
+        process(job);
+    }
+}
+
+void FileReceiver::process(Job& job) {
+    if (job.kind == Job::Kind::CANCEL) {
+        cancelTransfer(job);
+        return;
+    }
+    if (job.kind == Job::Kind::ABORT) {
+        abortTransfers();
+        return;
+    }
+
+    const NetworkMessage& msg = job.message;
+    Event event;
+    switch (msg.type) {
+    case MessageType::FILE_DOWNLOAD_RESPONSE:
+        event.header = msg.toFileDownloadResponse();
+        event.id = event.header.id;
+        event.result = begin(event.header);
+        if (!event.result.finished) {
+            event.kind = Event::Kind::STARTED;
+            emit(std::move(event));
+            return;
+        }
+        break;
+    case MessageType::FILE_DOWNLOAD_CHUNK: {
+        FileChunkView chunk = msg.toFileChunk();
+        event.id = chunk.id;
+        event.result = write(chunk);
+        break;
+    }
+    case MessageType::FILE_DOWNLOAD_COPY: {
+        FileBlockCopy block = msg.toFileBlockCopy();
+        event.id = block.id;
+        event.result = copy(block);
+        break;
+    }
+    case MessageType::FILE_DOWNLOAD_END: {
+        FileTransferEnd transfer_end = msg.toFileDownloadEnd();
+        event.id = transfer_end.id;
+        event.result = end(transfer_end);
+        LOG_INFO("Client download {} finished with {} bytes: {}", transfer_end.id, transfer_end.bytes, event.result.message);
+        break;
+    }
+    default:
+        LOG_WARN("download writer ignored message type {}", msg.type);
+        return;
+    }
+    if (event.result.finished) {
+        event.kind = Event::Kind::FINISHED;
+        emit(std::move(event));
+    } else if (event.result.bytes > 0) {
+        emit(std::move(event));
+    }
+}
+
+std::vector<std::pair<std::string, std::string>> FileReceiver::pendingDownloads(const std::string& download_path, const std::string& host) {
+    std::vector<std::pair<std::string, std::string>> downloads;
+    std::error_code ec;
+    auto options = std::filesystem::directory_options::skip_permission_denied;
+    for (auto it = std::filesystem::recursive_directory_iterator(download_path, options, ec); !ec && it != std::filesystem::recursive_directory_iterator(); it.increment(ec)) {
+        std::string name = it->path().filename().string();
+        // The content store keeps its own files below the download folder
+        if (name == ".uremote-cas" && it->is_directory(ec)) {
+            it.disable_recursion_pending();
+            continue;
+        }
+        if (name.size() <= 10 || name.compare(name.size() - 10, 10, ".part.json") != 0) continue;
+        std::ifstream file(it->path());
+        try {
+            json cp = json::parse(file);
+            if (cp.value("host", "") == host) {
+                std::string local_path = it->path().string();
+                downloads.emplace_back(cp.value("remote_path", ""), local_path.substr(0, local_path.size() - 10));
+            }
+        } catch (...) {
+        }
+    }
+    return downloads;
+}
+
+bool FileReceiver::checkpoint(Transfer& transfer) {
+    // Data must be durable before the checkpoint claims it
+    if (!syncNativeFile(transfer.file)) return false;
+
+    json cp;
+    cp["remote_path"] = transfer.target.remote_path;
+    cp["host"] = transfer.target.host;
+    cp["size"] = transfer.header.size;
+    cp["mtime"] = transfer.header.mtime;
+    cp["committed"] = transfer.next_offset;
+
+    std::string path = checkpointPath(transfer.target.final_path);
+    std::string tmp_path = path + ".tmp";
+    {
+        std::ofstream file(tmp_path, std::ios::trunc);
+        if (!file.is_open()) return false;
+        file << cp.dump();
+        if (!file) return false;
+    }
+    std::error_code ec;
+    std::filesystem::rename(tmp_path, path, ec);
+    if (ec) return false;
+    transfer.committed = transfer.next_offset;
+    return true;
+}
+
+FileReceiver::Result FileReceiver::fail(uint32_t id, const std::string& message) {
+    Result result;
+    result.finished = true;
+    result.message = message;
+    auto it = m_transfers.find(id);
+    if (it != m_transfers.end()) {
+        // Keep the partial file and its checkpoint so the download can be resumed
+        result.filename = it->second.header.filename;
+        checkpoint(it->second);
+        closeTransfer(it->second);
+        m_transfers.erase(it);
+    }
+    return result;
+}
+
+FileReceiver::Result FileReceiver::begin(const FileTransferHeader& header) {
+    Result result;
+    result.filename = header.filename;
+    Requested target;
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        if (m_ignored.count(header.id)) return result;
+        auto req = m_requested.find(header.id);
+        if (req == m_requested.end()) {
+            result.finished = true;
+            result.message = "Unexpected download: " + header.filename;
+            return result;
+        }
+        target = std::move(req->second);
+        m_requested.erase(req);
+    }
+
+    std::error_code ec;
+    std::filesystem::create_directories(std::filesystem::path(target.final_path).parent_path(), ec);
+
+    Transfer transfer;
+    transfer.header = header;
+    transfer.target = std::move(target);
+    // A transfer that starts at 0 (fresh or restarted because the remote file changed) overwrites any partial copy
+    transfer.file = openFileForWrite(partPath(transfer.target.final_path), header.offset == 0);
+    if (!isValidNativeFile(transfer.file)) {
+        result.finished = true;
+        result.message = "Failed to save file: " + header.filename;
+        return result;
+    }
+    // Claim the space now: a full disk fails the download here instead of part way through
+    if (!preallocateNativeFile(transfer.file, header.size)) {
+        closeNativeFile(transfer.file);
+        result.finished = true;
+        result.message = "Not enough space for " + header.filename;
+        return result;
+    }
+    transfer.next_offset = transfer.flushed = transfer.written_back = header.offset;
+    if (transfer.target.hash_algorithm != HashAlgorithm::NONE)
+        transfer.hash = std::make_unique<StreamingHash>(transfer.target.hash_algorithm);
+    checkpoint(transfer);
+    m_transfers[header.id] = std::move(transfer);
+    return result;
+}
+
+void FileReceiver::writeBehind(Transfer& transfer) {
+    if (transfer.next_offset - transfer.flushed < FILE_WRITE_BEHIND_WINDOW) return;
+    // Start the window just written and wait for the one before it, which has had a whole
+    // window's worth of time to reach the disk
+    flushNativeFileRange(transfer.file, transfer.flushed, transfer.next_offset - transfer.flushed, false);
+    if (transfer.flushed > transfer.written_back)
+        flushNativeFileRange(transfer.file, transfer.written_back, transfer.flushed - transfer.written_back, true);
+    transfer.written_back = transfer.flushed;
+    transfer.flushed = transfer.next_offset;
+}
+
+FileReceiver::Result FileReceiver::write(const FileChunkView& chunk) {
+    if (isIgnored(chunk.id)) return {};
+    auto it = m_transfers.find(chunk.id);
+    if (it == m_transfers.end()) return {};
+
+    Transfer& transfer = it->second;
+    if (chunk.offset != transfer.next_offset)
+        return fail(chunk.id, "Out of order data for " + transfer.header.filename);
+    if (!writeFileAt(transfer.file, chunk.data, chunk.size, chunk.offset))
+        return fail(chunk.id, "Failed to save file: " + transfer.header.filename);
+    updateHash(transfer.hash.get(), chunk.data, chunk.size);
+    transfer.next_offset += chunk.size;
+    writeBehind(transfer);
+
+    if (transfer.next_offset - transfer.committed >= FILE_CHECKPOINT_INTERVAL)
+        checkpoint(transfer);
+
+    Result result;
+    result.filename = transfer.header.filename;
+    result.bytes = chunk.size;
+    return result;
+}
+
+FileReceiver::Result FileReceiver::copy(const FileBlockCopy& copy) {
+    if (isIgnored(copy.id)) return {};
+    auto it = m_transfers.find(copy.id);
+    if (it == m_transfers.end()) return {};
+
+    Transfer& transfer = it->second;
+    const Requested& target = transfer.target;
+    if (copy.offset != transfer.next_offset)
+        return fail(copy.id, "Out of order data for " + transfer.header.filename);
+    if (!transfer.basis_open) {
+        if (target.delta_block_size == 0)
+            return fail(copy.id, "Unexpected block reference for " + transfer.header.filename);
+        uint64_t size = 0;
+        int64_t mtime = 0;
+        transfer.basis = openFileForRead(target.final_path, size, mtime);
+        if (!isValidNativeFile(transfer.basis))
+            return fail(copy.id, "Local copy disappeared: " + target.final_path);
+        transfer.basis_open = true;
+        if (size != target.basis_size || mtime != target.basis_mtime)
+            return fail(copy.id, "Local copy changed during download: " + target.final_path);
+    }
+
+    uint64_t source = static_cast<uint64_t>(copy.block) * target.delta_block_size;
+    if (copy.count == 0 || source >= target.basis_size)
+        return fail(copy.id, "Invalid block reference for " + transfer.header.filename);
+    uint64_t length = std::min<uint64_t>(static_cast<uint64_t>(copy.count) * target.delta_block_size, target.basis_size - source);
+    if (transfer.next_offset + length > transfer.header.size)
+        return fail(copy.id, "Invalid block reference for " + transfer.header.filename);
+
+    m_copy_buffer.resize(FILE_CHUNK_SIZE);
+    for (uint64_t done = 0; done < length;) {
+        size_t n = static_cast<size_t>(std::min<uint64_t>(FILE_CHUNK_SIZE, length - done));
+        if (readFileAt(transfer.basis, m_copy_buffer.data(), n, source + done) != static_cast<int64_t>(n))
+            return fail(copy.id, "Failed to read local copy: " + target.final_path);
+        if (!writeFileAt(transfer.file, m_copy_buffer.data(), n, transfer.next_offset + done))
+            return fail(copy.id, "Failed to save file: " + transfer.header.filename);
+        updateHash(transfer.hash.get(), m_copy_buffer.data(), n);
+        done += n;
+    }
+    transfer.next_offset += length;
+    transfer.copied += length;
+    writeBehind(transfer);
+
+    if (transfer.next_offset - transfer.committed >= FILE_CHECKPOINT_INTERVAL)
+        checkpoint(transfer);
+
+    Result result;
+    result.filename = transfer.header.filename;
+    result.bytes = length;
+    return result;
+}
+
+FileReceiver::Result FileReceiver::end(const FileTransferEnd& end) {
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        m_requested.erase(end.id);
+        if (m_ignored.erase(end.id)) return {};
+    }
+    auto it = m_transfers.find(end.id);
+    if (it == m_transfers.end()) {
+        Result result;
+        result.finished = true;
+        result.message = end.error.empty() ? "Download failed" : end.error;
+        return result;
+    }
+
+    Transfer& transfer = it->second;
+    if (!end.success || transfer.next_offset != transfer.header.offset + end.bytes || transfer.next_offset != transfer.header.size)
+        return fail(end.id, end.error.empty() ? "Download incomplete: " + transfer.header.filename : end.error);
+
+    Result result;
+    result.finished = true;
+    result.filename = transfer.header.filename;
+    result.remote_path = transfer.target.remote_path;
+    // Without this a crash soon after the rename can leave the final name on incomplete data
+    if (m_sync_on_finish && !syncNativeFile(transfer.file))
+        return fail(end.id, "Failed to flush " + transfer.header.filename);
+    closeTransfer(transfer);
+
+    std::error_code ec;
+    if (transfer.hash) {
+        const char* algorithm = hashAlgorithmName(transfer.hash->algorithm());
+        std::string digest = transfer.hash->finishHex();
+        if (end.hash.empty()) {
+            LOG_WARN("download {}: server sent no {} digest, {} is unverified", end.id, algorithm, transfer.header.filename);
+        } else if (end.hash != digest) {
+            // No way to tell which bytes are bad, so nothing is kept for a resume
+            LOG_ERROR("download {}: {} mismatch for {}: expected {}, got {}", end.id, algorithm, transfer.header.filename, end.hash, digest);
+            std::filesystem::remove(partPath(transfer.target.final_path), ec);
+            std::filesystem::remove(checkpointPath(transfer.target.final_path), ec);
+            result.corrupt = true;
+            result.message = std::string("Integrity check failed (") + algorithm + "): " + transfer.header.filename;
+            m_transfers.erase(it);
+            return result;
+        } else {
+            LOG_INFO("download {}: {} verified, hashed at {} MB/s", end.id, algorithm,
+                transfer.hash->seconds() > 0 ? end.bytes / transfer.hash->seconds() / 1e6 : 0.0);
+            // A resumed transfer's digest covers only what this session wrote
+            if (transfer.hash->algorithm() == HashAlgorithm::SHA256 && transfer.header.offset == 0)
+                result.sha256 = digest;
+        }
+    }
+    if (transfer.copied > 0)
+        LOG_INFO("download {}: reused {} of {} bytes from the local copy", end.id, transfer.copied, transfer.header.size);
+
+    std::filesystem::rename(partPath(transfer.target.final_path), transfer.target.final_path, ec);
+    if (ec) {
+        result.message = "Failed to save file: " + transfer.header.filename;
+    } else {
+        std::filesystem::remove(checkpointPath(transfer.target.final_path), ec);
+        result.success = true;
+        result.message = "Download completed: " + transfer.header.filename;
+    }
+    m_transfers.erase(it);
+    return result;
+}
+
+void FileReceiver::cancel(uint32_t id, bool discard) {
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        m_ignored.insert(id);
+        Job job;
+        job.kind = Job::Kind::CANCEL;
+        job.id = id;
+        job.discard = discard;
+        // The final path of a request that never started is only known here
+        auto req = m_requested.find(id);
+        if (req != m_requested.end()) {
+            job.final_path = req->second.final_path;
+            m_requested.erase(req);
+        }
+        m_jobs.push_back(std::move(job));
+        if (!m_worker.joinable())
+            m_worker = std::thread(&FileReceiver::run, this);
+    }
+    m_cv.notify_one();
+}
+
+void FileReceiver::cancelTransfer(const Job& job) {
+    std::string final_path = job.final_path;
+    auto it = m_transfers.find(job.id);
+    if (it != m_transfers.end()) {
+        final_path = it->second.target.final_path;
+        if (!job.discard) checkpoint(it->second);
+        closeTransfer(it->second);
+        m_transfers.erase(it);
+    }
+    if (job.discard && !final_path.empty()) {
+        std::error_code ec;
+        std::filesystem::remove(partPath(final_path), ec);
+        std::filesystem::remove(checkpointPath(final_path), ec);
+    }
+}
+
+void FileReceiver::abortAll() {
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        m_jobs.clear();
+        m_queued_bytes = 0;
+        m_requested.clear();
+        m_ignored.clear();
+        if (m_worker.joinable()) {
+            Job job;
+            job.kind = Job::Kind::ABORT;
+            m_jobs.push_back(std::move(job));
+        }
+    }
+    if (m_worker.joinable()) {
+        m_cv.notify_one();
+        return;
+    }
+    // Nothing was ever received, so nothing needs a checkpoint
+    Event event;
+    event.kind = Event::Kind::ABORTED;
+    emit(std::move(event));
+}
+
+void FileReceiver::abortTransfers() {
+    size_t checkpointed = 0;
+    for (auto& [id, transfer] : m_transfers) {
+        if (checkpoint(transfer)) ++checkpointed;
+        closeTransfer(transfer);
+    }
+    LOG_INFO("Client aborted {} downloads, {} checkpointed", m_transfers.size(), checkpointed);
+    m_transfers.clear();
+    Event event;
+    event.kind = Event::Kind::ABORTED;
+    event.result.message = std::to_string(checkpointed) + " downloads checkpointed";
+    emit(std::move(event));
+}
+
+void DownloadQueue::setMaxActive(size_t max_active) {
+    m_max_active = max_active < 1 ? 1 : max_active;
+}
+
+size_t DownloadQueue::maxActive() const {
+    return m_max_active;
+}
+
+void DownloadQueue::enqueue(const std::string& remote_path, const std::string& local_path, uint64_t size_hint) {
+    for (const auto& entry : m_entries) {
+        bool unfinished = entry.state == State::QUEUED || entry.state == State::ACTIVE || entry.state == State::PAUSED;
+        if (unfinished && entry.local_path == local_path) return;
+    }
+    Entry entry;
+    entry.key = m_next_key++;
+    entry.remote_path = remote_path;
+    entry.local_path = local_path;
+    entry.name = std::filesystem::path(local_path).filename().string();
+    entry.size = size_hint;
+    m_entries.push_back(std::move(entry));
+}
+
+std::vector<FileDownloadRequest> DownloadQueue::pump(FileReceiver& receiver, const std::string& host, uint32_t& next_transfer_id) {
+    std::vector<FileDownloadRequest> requests;
+    if (m_held) return requests;
+    size_t active = 0;
+    for (const auto& entry : m_entries) {
+        if (entry.state == State::ACTIVE) ++active;
+    }
+    for (auto& entry : m_entries) {
+        if (active >= m_max_active) break;
+        if (entry.state != State::QUEUED) continue;
+        entry.transfer_id = next_transfer_id++;
+        entry.state = State::ACTIVE;
+        entry.rate = 0.0;
+        entry.sample_time = std::chrono::steady_clock::now();
+        entry.sample_bytes = entry.received;
+        requests.push_back(receiver.prepare(entry.transfer_id, entry.remote_path, entry.local_path, host));
+        ++active;
+    }
+    return requests;
+}
+
+DownloadQueue::Entry* DownloadQueue::findByTransfer(uint32_t transfer_id) {
+    if (transfer_id == 0) return nullptr;
+    for (auto& entry : m_entries) {
+        if (entry.transfer_id == transfer_id && entry.state == State::ACTIVE) return &entry;
+    }
+    return nullptr;
+}
+
+DownloadQueue::Entry* DownloadQueue::findByKey(uint64_t key) {
+    for (auto& entry : m_entries) {
+        if (entry.key == key) return &entry;
+    }
+    return nullptr;
+}
+
+void DownloadQueue::onStarted(const FileTransferHeader& header) {
+    Entry* entry = findByTransfer(header.id);
+    if (!entry) return;
+    entry->size = header.size;
+    entry->received = header.offset;
+    entry->sample_bytes = header.offset;
+    entry->sample_time = std::chrono::steady_clock::now();
+}
+
+void DownloadQueue::onProgress(uint32_t transfer_id, uint64_t bytes) {
+    Entry* entry = findByTransfer(transfer_id);
+    if (!entry) return;
+    entry->received += bytes;
+
+    // Exponentially smoothed rate, sampled at most four times a second
+    auto now = std::chrono::steady_clock::now();
+    double elapsed = std::chrono::duration<double>(now - entry->sample_time).count();
+    if (elapsed >= 0.25) {
+        double instant = (entry->received - entry->sample_bytes) / elapsed;
+        entry->rate = entry->rate == 0.0 ? instant : 0.7 * entry->rate + 0.3 * instant;
+        entry->sample_time = now;
+        entry->sample_bytes = entry->received;
+    }
+}
+
+void DownloadQueue::onFinished(uint32_t transfer_id, bool success, const std::string& message) {
+    Entry* entry = findByTransfer(transfer_id);
+    if (!entry) return;
+    entry->state = success ? State::COMPLETED : State::FAILED;
+    entry->transfer_id = 0;
+    entry->rate = 0.0;
+    entry->message = message;
+    if (success) entry->received = entry->size;
+}
+
+void DownloadQueue::onDisconnected() {
+    m_held = true;
+    for (auto& entry : m_entries) {
+        if (entry.state == State::ACTIVE) {
+            entry.state = State::QUEUED;
+            entry.transfer_id = 0;
+            entry.rate = 0.0;
+        }
+    }
+}
+
+void DownloadQueue::onAborted() {
+    m_held = false;
+}
+
+uint32_t DownloadQueue::pause(uint64_t key) {
+    Entry* entry = findByKey(key);
+    if (!entry || (entry->state != State::ACTIVE && entry->state != State::QUEUED)) return 0;
+    uint32_t transfer_id = entry->state == State::ACTIVE ? entry->transfer_id : 0;
+    entry->state = State::PAUSED;
+    entry->transfer_id = 0;
+    entry->rate = 0.0;
+    return transfer_id;
+}
+
+uint32_t DownloadQueue::cancel(uint64_t key) {
+    Entry* entry = findByKey(key);
+    if (!entry || entry->state == State::COMPLETED || entry->state == State::CANCELLED) return 0;
+    uint32_t transfer_id = entry->state == State::ACTIVE ? entry->transfer_id : 0;
+    entry->state = State::CANCELLED;
+    entry->transfer_id = 0;
+    entry->rate = 0.0;
+    return transfer_id;
+}
+
+void DownloadQueue::resume(uint64_t key) {
+    Entry* entry = findByKey(key);
+    if (entry && (entry->state == State::PAUSED || entry->state == State::FAILED)) {
+        entry->state = State::QUEUED;
+        entry->message.clear();
+    }
+}
+
+void DownloadQueue::clearFinished() {
+    m_entries.erase(std::remove_if(m_entries.begin(), m_entries.end(), [](const Entry& entry) {
+        return entry.state == State::COMPLETED || entry.state == State::CANCELLED;
+    }), m_entries.end());
+}
+
+const std::deque<DownloadQueue::Entry>& DownloadQueue::entries() const {
+    return m_entries;
+}
+
+double DownloadQueue::totalRate() const {
+    double rate = 0.0;
+    for (const auto& entry : m_entries) {
+        if (entry.state == State::ACTIVE) rate += entry.rate;
+    }
+    return rate;
+}
+
+uint64_t DownloadQueue::remainingBytes() const {
+    uint64_t remaining = 0;
+    for (const auto& entry : m_entries) {
+        if ((entry.state == State::ACTIVE || entry.state == State::QUEUED) && entry.size > entry.received)
+            remaining += entry.size - entry.received;
+    }
+    return remaining;
+}
+
+bool DownloadQueue::empty() const {
+    return m_entries.empty();
+}
+
+DeltaSigner::DeltaSigner(SendFunction send) : m_send(std::move(send)) {
+}
+
+DeltaSigner::~DeltaSigner() {
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        m_stop = true;
+    }
+    m_cv.notify_all();
+    if (m_worker.joinable()) m_worker.join();
+}
+
+void DeltaSigner::submit(const FileDownloadRequest& request, const std::string& basis_path) {
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        m_jobs.push_back({ request, basis_path });
+        m_cancelled.erase(request.id);
+        if (!m_worker.joinable())
+            m_worker = std::thread(&DeltaSigner::run, this);
+    }
+    m_cv.notify_one();
+}
+
+void DeltaSigner::cancel(uint32_t id) {
+    std::lock_guard<std::mutex> lock(m_mutex);
+    auto it = std::find_if(m_jobs.begin(), m_jobs.end(), [id](const Job& job) { return job.request.id == id; });
+    if (it != m_jobs.end())
+        m_jobs.erase(it);
+    else if (m_current == id)
+        m_cancelled.insert(id);
+}
+
+void DeltaSigner::cancelAll() {
+    std::lock_guard<std::mutex> lock(m_mutex);
+    m_jobs.clear();
+    if (m_current) m_cancelled.insert(m_current);
+}
+
+void DeltaSigner::run() {
+    for (;;) {
+        Job job;
+        {
+            std::unique_lock<std::mutex> lock(m_mutex);
+            m_cv.wait(lock, [this]() { return m_stop || !m_jobs.empty(); });
+            if (m_stop) break;
+            job = std::move(m_jobs.front());
+            m_jobs.pop_front();
+            m_current = job.request.id;
+        }
+
+        FileDownloadRequest& request = job.request;
+        auto started = std::chrono::steady_clock::now();
+        uint64_t size = 0;
+        int64_t mtime = 0;
+        NativeFile file = openFileForRead(job.basis_path, size, mtime);
+        DeltaSignature signature;
+        bool signed_ok = isValidNativeFile(file) && size == request.delta_basis_size
+            && computeDeltaSignature([file](uint8_t* buffer, size_t length, uint64_t offset) { return readFileAt(file, buffer, length, offset); },
+                size, request.delta_block_size, signature);
+        closeNativeFile(file);
+
+        if (signed_ok) {
+            request.delta_signatures = signature.serialize();
+            double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - started).count();
+            LOG_INFO("download {}: signed {} bytes in {} blocks at {} MB/s ({} signature bytes)", request.id, size,
+                signature.blockCount(), seconds > 0 ? size / seconds / 1e6 : 0.0, request.delta_signatures.size());
+        } else {
+            // Fall back to a full transfer; the receiver ignores its basis when no block references arrive
+            LOG_WARN("download {}: could not sign {}, requesting the whole file", request.id, job.basis_path);
+            request.delta_block_size = 0;
+            request.delta_basis_size = 0;
+        }
+
+        {
+            std::lock_guard<std::mutex> lock(m_mutex);
+            m_current = 0;
+            if (m_cancelled.erase(request.id)) continue;
+        }
+        NetworkMessage msg;
+        msg.fromFileDownloadRequest(request);
+        m_send(std::move(msg));
+    }
+}
@@ -0,0 +1,485 @@
+#pragma once
+#include <string>
+#include <vector>
+#include <deque>
+#include <list>
+#include <unordered_map>
+#include <unordered_set>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <atomic>
+#include <functional>
+#include <chrono>
+#include <optional>
+#include <memory>
+#include <ctime>
+#include <map>
+
+#include "network.h"
+#include "delta.h"
+#include "hash.h"
+
+#ifdef _WIN32
+using NativeFile = HANDLE;
+#else
+using NativeFile = int;
+#endif
+
+// Payload bytes per chunk frame; also the size of each disk read
+constexpr size_t FILE_CHUNK_SIZE = 512 * 1024;
+// Maximum bytes queued on the socket by the sender before it waits
+constexpr size_t FILE_SEND_HIGH_WATERMARK = 8 * 1024 * 1024;
+// Chunk buffers shared by all downloads the server is reading ahead for
+constexpr size_t FILE_READ_BUFFERS = 64;
+// Read-ahead per download, in chunks: starts small and doubles while the stream waits on the disk
+constexpr size_t FILE_READAHEAD_MIN = 2;
+constexpr size_t FILE_READAHEAD_MAX = 16;
+// Threads of the pread fallback when io_uring is unavailable
+constexpr size_t FILE_READ_THREADS = 4;
+// The client makes received data durable and records it in the checkpoint this often
+constexpr uint64_t FILE_CHECKPOINT_INTERVAL = 16 * 1024 * 1024;
+// The client starts writeback of each download every this many bytes and waits for the
+// previous window, so a stream never has more than two windows of dirty pages
+constexpr uint64_t FILE_WRITE_BEHIND_WINDOW = 8 * 1024 * 1024;
+
+// Thin wrappers around positional file I/O
+NativeFile openFileForRead(const std::string& path, uint64_t& size, int64_t& mtime);
+NativeFile openFileForWrite(const std::string& path, bool truncate = true);
+bool syncNativeFile(NativeFile file);
+// Starts writeback of a written range without waiting; with `wait`, blocks until the range is
+// on disk and drops it from the page cache. A no-op where the platform has no such control
+void flushNativeFileRange(NativeFile file, uint64_t offset, uint64_t length, bool wait);
+// Reserves disk space for `size` bytes up front so a large write fails early and stays contiguous
+bool preallocateNativeFile(NativeFile file, uint64_t size);
+void closeNativeFile(NativeFile file);
+bool isValidNativeFile(NativeFile file);
+// Device, inode/file index, size and full-resolution mtime of an open file
+struct FileIdentity {
+    uint64_t device = 0;
+    uint64_t inode = 0;
+    uint64_t size = 0;
+    int64_t mtime_ns = 0;
+    bool operator==(const FileIdentity& other) const {
+        return device == other.device && inode == other.inode && size == other.size && mtime_ns == other.mtime_ns;
+    }
+};
+bool fileIdentity(NativeFile file, FileIdentity& identity);
+// Independent descriptor of `file` for FileSlice frames, closed with its last reference; null where unsupported
+std::shared_ptr<const int> shareNativeFile(NativeFile file);
+int64_t readFileAt(NativeFile file, uint8_t* buffer, size_t length, uint64_t offset);
+bool writeFileAt(NativeFile file, const uint8_t* buffer, size_t length, uint64_t offset);
+
+class DiskReader;
+
+// Server side: streams requested files as header, fixed-size chunks and an end frame.
+// A single worker interleaves active transfers chunk by chunk and pauses whenever the
+// socket's outgoing queue exceeds FILE_SEND_HIGH_WATERMARK, so memory stays O(chunk size).
+// Disk reads run ahead of the sends through a DiskReader, so one thread overlaps the reads
+// of every active download with the network.
+class FileSender {
+public:
+    using SendFunction = std::function<void(NetworkMessage&&)>;
+    using CapacityFunction = std::function<bool(size_t limit)>;
+    using ConnectedFunction = std::function<bool()>;
+
+    FileSender(SendFunction send, CapacityFunction wait_capacity, ConnectedFunction connected);
+    ~FileSender();
+
+    void start(const FileDownloadRequest& request);
+    void cancel(uint32_t id);
+    void cancelAll();
+    // Let the kernel copy chunk data from the page cache to the socket where the platform allows
+    void setZeroCopy(bool enabled);
+
+private:
+    struct Transfer {
+        uint32_t id = 0;
+        std::string path;
+        NativeFile file;
+        uint64_t size = 0;
+        uint64_t start = 0;
+        uint64_t offset = 0;
+        uint64_t end = 0;
+        // Delta mode only
+        std::unique_ptr<DeltaSignature> signature;
+        std::unique_ptr<DeltaScanner> scanner;
+        std::chrono::steady_clock::time_point started;
+        // Integrity digest of the bytes read, when requested
+        std::unique_ptr<StreamingHash> hash;
+        // Zero-copy mode only
+        std::shared_ptr<const int> shared_file;
+        std::clock_t cpu_started = 0;
+        // Chunks read ahead through m_disk, for transfers that need the data in user space
+        struct ReadyChunk {
+            int64_t result = 0;
+            size_t buffer = 0;
+        };
+        bool read_ahead = false;
+        uint64_t read_offset = 0;   // next offset to request from the disk
+        size_t inflight = 0;
+        size_t readahead = FILE_READAHEAD_MIN;
+        uint64_t stalled_at = UINT64_MAX;
+        std::map<uint64_t, ReadyChunk> ready;
+    };
+
+    void run();
+    bool open(const FileDownloadRequest& request, Transfer& transfer);
+    bool sendDelta(Transfer& transfer);
+    bool sendChunk(Transfer& transfer);
+    bool sendFileSlice(Transfer& transfer);
+    bool sendReadAhead(Transfer& transfer);
+    void fillReadAhead(Transfer& transfer);
+    // Hands finished disk reads to their transfers, waiting up to `timeout` for one
+    void collectReads(std::vector<Transfer>& active, std::chrono::milliseconds timeout);
+    void finish(Transfer& transfer, bool success, const std::string& error);
+
+    SendFunction m_send;
+    CapacityFunction m_wait_capacity;
+    ConnectedFunction m_connected;
+
+    std::thread m_worker;
+    std::mutex m_mutex;
+    std::condition_variable m_cv;
+    std::deque<FileDownloadRequest> m_pending;
+    std::unordered_set<uint32_t> m_cancel_ids;
+    bool m_cancel_all = false;
+    bool m_stop = false;
+    std::atomic<bool> m_zero_copy{ true };
+    // Worker only; created with the worker
+    std::unique_ptr<DiskReader> m_disk;
+};
+
+// Client side: writes download frames to disk on a background writer thread, so a slow
+// disk never stalls the UI. Data goes to "<name>.part" next to a "<name>.part.json"
+// checkpoint holding the remote identity (path, size, mtime) and the last durable offset,
+// so an interrupted transfer continues from there after a reconnect or an application
+// restart. The part file is preallocated, written behind in FILE_WRITE_BEHIND_WINDOW
+// steps, optionally synced, and renamed into place once complete. Outcomes come back to
+// the UI thread as events.
+class FileReceiver {
+public:
+    struct Result {
+        bool finished = false;
+        bool success = false;
+        std::string filename;
+        std::string message;
+        uint64_t bytes = 0;     // file bytes produced by this frame
+        bool corrupt = false;   // the integrity check failed and the data was discarded
+        std::string remote_path;
+        std::string sha256;     // of the whole file, when SHA-256 verified it from the first byte
+    };
+
+    struct Event {
+        enum class Kind { STARTED, PROGRESS, FINISHED, ABORTED };
+        Kind kind = Kind::PROGRESS;
+        uint32_t id = 0;
+        FileTransferHeader header;  // STARTED only
+        Result result;              // bytes written since the last event, or the outcome
+    };
+
+    ~FileReceiver();
+
+    // Offer the existing local copy as a delta basis when re-downloading a file
+    void setDeltaEnabled(bool enabled);
+    // Digest both sides compute over the streamed bytes; NONE disables the check
+    void setHashAlgorithm(HashAlgorithm algorithm);
+    // Flush each finished file to disk before renaming it into place
+    void setSyncOnFinish(bool enabled);
+
+    // Builds the request that saves `remote_path` as `local_path`, resuming from a matching checkpoint if there is one
+    FileDownloadRequest prepare(uint32_t id, const std::string& remote_path, const std::string& local_path, const std::string& host);
+    // Verifies a prepared request with `algorithm` instead of the one set for all downloads
+    void setRequestHash(FileDownloadRequest& request, HashAlgorithm algorithm);
+    // (remote path, local path) of interrupted downloads from `host` found below `download_path`
+    static std::vector<std::pair<std::string, std::string>> pendingDownloads(const std::string& download_path, const std::string& host);
+    // Local destination of a prepared request
+    std::string localPath(uint32_t id) const;
+    // Forgets a prepared request that will not be sent
+    void release(uint32_t id);
+
+    // Queues a FILE_DOWNLOAD_RESPONSE, _CHUNK, _COPY or _END frame for the writer
+    void post(NetworkMessage&& message);
+    // Events produced by the writer since the last call, in order
+    std::vector<Event> popEvents();
+    // Bytes received but not yet written
+    uint64_t queuedBytes() const;
+    // Stops receiving `id`; late frames for it are ignored. Partial data is kept unless `discard`
+    void cancel(uint32_t id, bool discard);
+    // Checkpoints and closes every active transfer on the writer, keeping partial files for a
+    // later resume, and reports ABORTED once that is done. Frames not yet written are dropped.
+    void abortAll();
+
+private:
+    struct Requested {
+        std::string remote_path;
+        std::string final_path;
+        std::string host;
+        // Identity of the local copy offered as a delta basis
+        uint32_t delta_block_size = 0;
+        uint64_t basis_size = 0;
+        int64_t basis_mtime = 0;
+        HashAlgorithm hash_algorithm = HashAlgorithm::NONE;
+    };
+
+    struct Transfer {
+        FileTransferHeader header;
+        Requested target;
+        NativeFile file;
+        NativeFile basis;
+        bool basis_open = false;
+        uint64_t next_offset = 0;
+        uint64_t committed = 0;
+        uint64_t copied = 0;
+        // Write-behind: writeback was started below `flushed` and has finished below `written_back`
+        uint64_t flushed = 0;
+        uint64_t written_back = 0;
+        std::unique_ptr<StreamingHash> hash;
+    };
+
+    struct Job {
+        enum class Kind { FRAME, CANCEL, ABORT };
+        Kind kind = Kind::FRAME;
+        NetworkMessage message;
+        uint32_t id = 0;            // CANCEL only
+        bool discard = false;
+        std::string final_path;
+    };
+
+    void run();
+    void process(Job& job);
+    void emit(Event&& event);
+    Result begin(const FileTransferHeader& header);
+    Result write(const FileChunkView& chunk);
+    Result copy(const FileBlockCopy& copy);
+    Result end(const FileTransferEnd& end);
+    void cancelTransfer(const Job& job);
+    void abortTransfers();
+    bool isIgnored(uint32_t id);
+    void writeBehind(Transfer& transfer);
+
+    static void closeTransfer(Transfer& transfer);
+
+    static std::string partPath(const std::string& final_path);
+    static std::string checkpointPath(const std::string& final_path);
+    bool checkpoint(Transfer& transfer);
+    Result fail(uint32_t id, const std::string& message);
+
+    // UI thread only
+    bool m_delta_enabled = true;
+    HashAlgorithm m_hash_algorithm = HashAlgorithm::XXH3;
+    std::atomic<bool> m_sync_on_finish{ true };
+
+    // Shared between the UI thread and the writer
+    mutable std::mutex m_mutex;
+    std::unordered_map<uint32_t, Requested> m_requested;
+    std::unordered_set<uint32_t> m_ignored;
+
+    std::thread m_worker;
+    std::condition_variable m_cv;
+    std::condition_variable m_idle_cv;
+    std::deque<Job> m_jobs;
+    uint64_t m_queued_bytes = 0;
+    bool m_busy = false;
+    bool m_stop = false;
+    std::mutex m_event_mutex;
+    std::vector<Event> m_events;
+
+    // Worker only
+    std::unordered_map<uint32_t, Transfer> m_transfers;
+    std::vector<uint8_t> m_copy_buffer;
+};
+
+// Client side: computes the block signatures of a delta request's local basis on a worker
+// thread, so hashing a multi-GB file never stalls the UI, and then sends the request.
+class DeltaSigner {
+public:
+    using SendFunction = FileSender::SendFunction;
+
+    explicit DeltaSigner(SendFunction send);
+    ~DeltaSigner();
+
+    void submit(const FileDownloadRequest& request, const std::string& basis_path);
+    // Drops the request if it has not been sent yet
+    void cancel(uint32_t id);
+    void cancelAll();
+
+private:
+    struct Job {
+        FileDownloadRequest request;
+        std::string basis_path;
+    };
+
+    void run();
+
+    SendFunction m_send;
+    std::thread m_worker;
+    std::mutex m_mutex;
+    std::condition_variable m_cv;
+    std::deque<Job> m_jobs;
+    std::unordered_set<uint32_t> m_cancelled;
+    uint32_t m_current = 0;
+    bool m_stop = false;
+};
+
+// Bytes an upload may have in flight beyond the server's last acknowledgement
+constexpr uint64_t FILE_UPLOAD_WINDOW = 16 * 1024 * 1024;
+// The server acknowledges an upload every this many written bytes
+constexpr uint64_t FILE_UPLOAD_ACK_INTERVAL = 4 * 1024 * 1024;
+
+// Client side: streams local files to the server as begin, chunk and end frames.
+// A single worker interleaves uploads chunk by chunk. Each upload may run at most
+// FILE_UPLOAD_WINDOW ahead of the bytes the server has acknowledged as written, so
+// neither side buffers more than that however large the file is.
+class FileUploader {
+public:
+    using SendFunction = FileSender::SendFunction;
+    using CapacityFunction = FileSender::CapacityFunction;
+    using ConnectedFunction = FileSender::ConnectedFunction;
+
+    struct Progress {
+        uint32_t id = 0;
+        std::string name;
+        uint64_t size = 0;
+        uint64_t acked = 0;
+        double rate = 0.0;  // bytes per second, smoothed
+        bool done = false;
+        bool success = false;
+        std::string message;
+    };
+
+    FileUploader(SendFunction send, CapacityFunction wait_capacity, ConnectedFunction connected);
+    ~FileUploader();
+
+    // Uploads `local_path` to `remote_path` (a full destination path on the server)
+    void start(uint32_t id, const std::string& local_path, const std::string& remote_path);
+    void onAck(const FileUploadAck& ack);
+    void cancel(uint32_t id);
+    void cancelAll();
+
+    std::vector<Progress> progress();
+    void clearFinished();
+
+private:
+    struct Upload {
+        uint32_t id = 0;
+        std::string local_path;
+        std::string remote_path;
+        NativeFile file;
+        uint64_t size = 0;
+        uint64_t offset = 0;
+        bool opened = false;
+        bool ended = false;     // end frame sent, waiting for the final ack
+        bool cancelled = false;
+        Progress progress;
+        std::chrono::steady_clock::time_point sample_time;
+        uint64_t sample_bytes = 0;
+    };
+
+    void run();
+    void finish(Upload& upload, bool success, const std::string& message, bool notify_server);
+
+    SendFunction m_send;
+    CapacityFunction m_wait_capacity;
+    ConnectedFunction m_connected;
+
+    std::thread m_worker;
+    std::mutex m_mutex;
+    std::condition_variable m_cv;
+    std::list<Upload> m_uploads;  // guarded by m_mutex; file I/O happens outside the lock
+    bool m_cancel_all = false;
+    bool m_stop = false;
+};
+
+// Server side: receives uploads into "<dest>.upload" preallocated to the announced size
+// and renames it over the destination only once every byte has been written and synced.
+class UploadReceiver {
+public:
+    ~UploadReceiver();
+
+    // Each returns the acknowledgement to send back, if any
+    std::optional<FileUploadAck> begin(const FileTransferHeader& header);
+    std::optional<FileUploadAck> write(const FileChunkView& chunk);
+    std::optional<FileUploadAck> end(const FileTransferEnd& end);
+    // Connection lost: incomplete uploads are discarded
+    void abortAll();
+
+private:
+    struct Upload {
+        FileTransferHeader header;
+        NativeFile file;
+        uint64_t next_offset = 0;
+        uint64_t acked = 0;
+    };
+
+    static std::string tempPath(const std::string& path);
+    FileUploadAck fail(uint32_t id, const std::string& error);
+
+    std::unordered_map<uint32_t, Upload> m_uploads;
+};
+
+// Client side download queue. Keeps up to `maxActive()` requests in flight so the server
+// always has the next file ready while the current one drains, and tracks per-transfer
+// progress, throughput and ETA for the transfers panel.
+class DownloadQueue {
+public:
+    enum class State {
+        QUEUED,
+        ACTIVE,
+        PAUSED,
+        COMPLETED,
+        FAILED,
+        CANCELLED
+    };
+
+    struct Entry {
+        uint64_t key = 0;          // stable across pause/resume
+        uint32_t transfer_id = 0;  // id of the current attempt, 0 when none
+        std::string remote_path;
+        std::string local_path;
+        std::string name;
+        State state = State::QUEUED;
+        uint64_t size = 0;
+        uint64_t received = 0;
+        double rate = 0.0;         // bytes per second, smoothed
+        std::string message;
+
+        std::chrono::steady_clock::time_point sample_time;
+        uint64_t sample_bytes = 0;
+    };
+
+    void setMaxActive(size_t max_active);
+    size_t maxActive() const;
+
+    void enqueue(const std::string& remote_path, const std::string& local_path, uint64_t size_hint = 0);
+    // Requests for queued entries that fit in the in-flight window
+    std::vector<FileDownloadRequest> pump(FileReceiver& receiver, const std::string& host, uint32_t& next_transfer_id);
+
+    void onStarted(const FileTransferHeader& header);
+    void onProgress(uint32_t transfer_id, uint64_t bytes);
+    void onFinished(uint32_t transfer_id, bool success, const std::string& message);
+    // Connection lost: active transfers go back to the queue. Nothing is requested again until
+    // onAborted, so resumed downloads see the checkpoints the receiver writes as it aborts.
+    void onDisconnected();
+    void onAborted();
+
+    // Return the transfer id the server must stop sending, or 0
+    uint32_t pause(uint64_t key);
+    uint32_t cancel(uint64_t key);
+    void resume(uint64_t key);
+    void clearFinished();
+
+    const std::deque<Entry>& entries() const;
+    double totalRate() const;
+    uint64_t remainingBytes() const;
+    bool empty() const;
+
+private:
+    Entry* findByTransfer(uint32_t transfer_id);
+    Entry* findByKey(uint64_t key);
+
+    std::deque<Entry> m_entries;
+    uint64_t m_next_key = 1;
+    size_t m_max_active = 8;
+    bool m_held = false;        // between onDisconnected and onAborted
+};
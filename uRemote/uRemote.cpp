@@ -1,10 +1,41 @@
 ﻿#include "uRemote.h"
 #include "network.h"
 #include "cli.h"
+#include "logger.h"
+#include "transfer.h"
+#include "cas.h"
+#include "viewer.h"
+#include "search.h"
+#include "names.h"
+#include "listing.h"
+#include "usage.h"
+#include "terminal.h"
+#include <numeric>
+#include <tuple>
 
 NetworkManager network_manager;
 ConnQueue recent_conn;
-ProcessManager cmd;
+FileSender file_sender(
+    [](NetworkMessage&& msg) { network_manager.sendMessage(std::move(msg)); },
+    [](size_t limit) { return network_manager.waitForSendCapacity(limit, std::chrono::milliseconds(100)); },
+    []() { return network_manager.isConnected(); });
+FileReceiver file_receiver;
+FileUploader file_uploader(
+    [](NetworkMessage&& msg) { network_manager.sendMessage(std::move(msg)); },
+    [](size_t limit) { return network_manager.waitForSendCapacity(limit, std::chrono::milliseconds(100)); },
+    []() { return network_manager.isConnected(); });
+UploadReceiver upload_receiver;
+DeltaSigner delta_signer([](NetworkMessage&& msg) { network_manager.sendMessage(std::move(msg)); });
+FileHashService hash_service([](NetworkMessage&& msg) { network_manager.sendMessage(std::move(msg)); });
+ContentStore content_store;
+LineIndexService line_index([](NetworkMessage&& msg) { network_manager.sendMessage(std::move(msg)); });
+FileViewer file_viewer([](NetworkMessage&& msg) { network_manager.sendMessage(std::move(msg)); });
+SearchService search_service([](NetworkMessage&& msg) { network_manager.sendMessage(std::move(msg)); });
+NameIndexService name_index([](NetworkMessage&& msg) { network_manager.sendMessage(std::move(msg)); });
+DiskUsageService disk_usage([](NetworkMessage&& msg) { network_manager.sendMessage(std::move(msg)); });
+ListingService listing_service([](NetworkMessage&& msg) { network_manager.sendMessage(std::move(msg)); });
+FileTreeService file_trees([](NetworkMessage&& msg) { network_manager.sendMessage(std::move(msg)); });
+TerminalSessions terminal_sessions([](NetworkMessage&& msg) { network_manager.sendMessage(std::move(msg)); });
 
 int main() {
     json config;
@@ -12,6 +43,9 @@ int main() {
     std::string port;
     std::string download_path;
     std::string password;
+    int max_parallel_downloads = 8;
+    bool content_cache = true;
+    std::vector<std::string> name_index_roots;
 
     std::ifstream file(CONFIG);
     if (file.is_open()) {
@@ -20,6 +54,13 @@ int main() {
         download_path = config.value("download_path", "");
         password = config.value("password", "");
         json recent_conn_json = config.value("recent_conn", json::array());
+        max_parallel_downloads = config.value("max_parallel_downloads", 8);
+        file_receiver.setDeltaEnabled(config.value("delta_downloads", true));
+        content_cache = config.value("content_cache", true);
+        file_receiver.setHashAlgorithm(parseHashAlgorithm(config.value("integrity_hash", "xxh3")));
+        file_sender.setZeroCopy(config.value("zero_copy_send", true));
+        file_receiver.setSyncOnFinish(config.value("sync_downloads", true));
+        name_index_roots = config.value("name_index_roots", std::vector<std::string>());
         recent_conn.fromJson(recent_conn_json);
         file.close();
         if (port.empty() || download_path.empty() || password.empty()) {
@@ -41,6 +82,27 @@ int main() {
         file.close();
     }
 
+    if (content_cache) content_store.open((std::filesystem::path(download_path) / CONTENT_STORE_DIR).string());
+
+    // Keystrokes, resizes and screen acknowledgements reach an open shell straight from the
+    // network thread; those for a session not open yet wait in the queue behind its OPEN
+    network_manager.setMessageHandler(MessageType::COMMAND, [](const NetworkMessage& msg) {
+        auto [session, line] = msg.toTerminalInput();
+        return terminal_sessions.input(session, line);
+    });
+    network_manager.setMessageHandler(MessageType::TERMINAL_ACK, [](const NetworkMessage& msg) {
+        auto [session, screen_state] = msg.toTerminalAck();
+        return terminal_sessions.acknowledge(session, screen_state);
+    });
+    network_manager.setMessageHandler(MessageType::TERMINAL_CONTROL, [](const NetworkMessage& msg) {
+        TerminalControl control = msg.toTerminalControl();
+        if (control.action == TerminalControl::RESIZE)
+            return terminal_sessions.resize(control.session, control.columns, control.rows);
+        if (control.action == TerminalControl::INTERRUPT)
+            return terminal_sessions.interrupt(control.session);
+        return false;
+    });
+
     if (!glfwInit()) return -1;
     GLFWwindow* window = glfwCreateWindow(1280, 720, "uRemote", NULL, NULL);
     if (!window) {
@@ -79,7 +141,6 @@ int main() {
 	bool authentication_failed = false;
 
     bool running = false;
-    std::vector<std::string> server_output_vec;
 
     bool show_messages_panel = true;
     bool auto_scroll = true;
@@ -93,26 +154,121 @@ int main() {
     bool show_recent_conn = false;
 
     bool show_cli = true;
-    std::vector<std::string> cli_logs;
-    bool cmd_busy = false;
-    char cli_input[256] = "";
-    bool new_input = false;
-    std::vector<std::string> client_output_vec;
-    bool new_log = false;
-    bool scroll = false;
+    // Terminal sessions on the server, one tab each
+    std::vector<RemoteTerminal> terminals;
+    uint32_t next_terminal_id = 1;
 
     // File Explorer variables
     bool show_file_explorer = true;
     std::string current_path = "";
+    std::string watched_path;   // directory the server was last asked to push changes for
     DirectoryListing current_directory;
+    RemoteListings remote_listings;
+    ListingPrefetcher listing_prefetcher([](NetworkMessage&& msg) { network_manager.sendMessage(std::move(msg)); });
+    // Directory under the mouse in the file list, and since when
+    std::string hovered_directory;
+    std::chrono::steady_clock::time_point hovered_since;
     char path_input[512] = "";
     bool show_filesystem_error = false;
     std::string filesystem_error_msg;
+    uint32_t next_transfer_id = 1;
+    std::set<std::string> selected_files;
+    // Asks for a listing, telling the server which version of it is already here. A listing
+    // held fresh is shown at once; the reply then only confirms or updates it.
+    auto list_directory = [&](const std::string& path) {
+        if (const DirectoryListing* held = remote_listings.fresh(path)) {
+            if (held->path != current_path) selected_files.clear();
+            current_directory = *held;
+            current_path = current_directory.path;
+            path_input[0] = '\0';
+        }
+        NetworkMessage request;
+        request.fromFilesystemRequest(path, remote_listings.version(path));
+        network_manager.sendMessage(request);
+        listing_prefetcher.foreground(true);
+    };
+    auto send_terminal_control = [&](const RemoteTerminal& terminal, uint8_t action) {
+        TerminalControl control;
+        control.session = terminal.session;
+        control.action = action;
+        control.columns = terminal.columns;
+        control.rows = terminal.rows;
+        NetworkMessage msg;
+        msg.fromTerminalControl(control);
+        network_manager.sendMessage(std::move(msg));
+    };
+    auto open_terminal = [&]() {
+        RemoteTerminal& terminal = terminals.emplace_back();
+        terminal.session = next_terminal_id++;
+        send_terminal_control(terminal, TerminalControl::OPEN);
+    };
+    auto find_terminal = [&](uint32_t session) -> RemoteTerminal* {
+        auto it = std::find_if(terminals.begin(), terminals.end(), [session](const RemoteTerminal& t) { return t.session == session; });
+        return it == terminals.end() ? nullptr : &*it;
+    };
+    // Remote paths whose last download failed its integrity check, with the reason
+    std::unordered_map<std::string, std::string> integrity_failures;
+    char upload_input[512] = "";
+
+    // Transfers panel variables
+    bool show_transfers = true;
+    DownloadQueue download_queue;
+    download_queue.setMaxActive(max_parallel_downloads);
+    // Downloads waiting for the server's content hash, and then the content store's lookup,
+    // before anything is transferred
+    std::unordered_map<uint32_t, FileDownloadRequest> awaiting_hash;
+    auto send_download = [&](const FileDownloadRequest& request) {
+        if (request.delta_block_size) {
+            delta_signer.submit(request, file_receiver.localPath(request.id));
+            return;
+        }
+        NetworkMessage message;
+        message.fromFileDownloadRequest(request);
+        network_manager.sendMessage(std::move(message));
+    };
 
     // File Viewer variables
     bool show_file_viewer = false;
     std::string file_viewer_title = "";
-    std::string file_viewer_content = "";
+    // First line of the window of the file the viewer's list currently spans
+    uint64_t file_viewer_base = 0;
+    uint64_t file_viewer_goto = 0;
+    bool file_viewer_jump = false;
+
+    // Search variables
+    bool show_search = false;
+    char search_pattern[256] = "";
+    char search_globs[256] = "";
+    bool search_regex = false;
+    bool search_case_sensitive = false;
+    int search_context = 0;
+    int search_max_size_mb = 64;
+    std::string search_root = "";
+    uint32_t search_id = 0;
+    bool search_running = false;
+    std::vector<SearchMatch> search_matches;
+    std::string search_status = "";
+
+    // Disk Usage variables: the latest walk's totals for each subdirectory of its root
+    uint32_t usage_id = 0;
+    bool usage_running = false;
+    std::string usage_root = "";
+    std::unordered_map<std::string, DiskUsageEntry> usage_entries;
+    DiskUsageResults usage_summary;
+    uint64_t usage_generation = 0;
+    bool sort_by_size = false;
+    // Rows of the file list when filtered or sorted, as indices into the listing, and what
+    // they were worked out from
+    char file_filter[128] = "";
+    std::vector<uint32_t> file_rows;
+    std::tuple<std::string, uint64_t, size_t, uint64_t, bool, std::string> file_rows_key;
+
+    // Find by Name variables
+    bool show_find = false;
+    char find_input[256] = "";
+    bool find_fuzzy = false;
+    uint32_t find_id = 0;
+    NameResults find_results;
 
     // Remote Desktop variables
     bool show_remote_desktop = true;
@@ -148,82 +304,116 @@ int main() {
                 file.close();
                 // Request initial directory listing for file explorer
                 if (mode == Mode::CLIENT) {
-                    NetworkMessage request;
-                    request.fromFilesystemRequest();
-                    network_manager.sendMessage(request);
+                    list_directory("");
+
+                    // Continue downloads interrupted by a disconnect or a restart
+                    std::string host = std::string(conn_input.host_machine) + ":" + conn_input.port;
+                    for (const auto& [remote_path, local_path] : FileReceiver::pendingDownloads(download_path, host)) {
+                        download_queue.enqueue(remote_path, local_path);
+                    }
+                    open_terminal();
                 }
                 break;
             }
             case SignalType::DISCONNECTED:
-                if (cmd.isRunning()) {
-                    cmd.stop();
-                }
+                terminal_sessions.closeAll();
+                terminals.clear();
+                file_sender.cancelAll();
+                file_receiver.abortAll();
+                remote_listings.clear();
+                listing_prefetcher.clear();
+                listing_service.watch({});
+                file_trees.cancelAll();
+                watched_path.clear();
+                download_queue.onDisconnected();
+                delta_signer.cancelAll();
+                awaiting_hash.clear();
+                content_store.forgetAll();
+                hash_service.cancelAll();
+                line_index.cancelAll();
+                search_service.cancelAll();
+                disk_usage.cancelAll();
+                file_uploader.cancelAll();
+                upload_receiver.abortAll();
                 break;
             default:
                 break;
             }
         }
-        auto cmd_signals = cmd.popSignals();
-        for (const auto& signal : cmd_signals) {
-            switch (signal) {
-            case SignalType::CMD_BUSY:
-            case SignalType::CMD_IDLE: {
-                NetworkMessage signal_message;
-                signal_message.fromSignal(signal);
-                network_manager.sendMessage(signal_message);
-				std::cout << "Sent signal to network: " << (signal == SignalType::CMD_BUSY ? "CMD_BUSY" : "CMD_IDLE") << std::endl;
-                break;
-            }
-            default:
-                break;
-            }
+        if (mode == Mode::SERVER) {
+            terminal_sessions.update();
         }
 
         auto network_messages = network_manager.popNetworkMessages();
-        for (const auto& msg : network_messages) {
+        for (auto& msg : network_messages) {
             switch (msg.type) {
             case MessageType::COMMAND:
-                if (mode == Mode::SERVER && cmd.isRunning()) {
-                    std::cout << "Server sent command to cmd: " << msg.toString() << std::endl;
-                    cmd.sendCommand(msg.toString());
+                if (mode == Mode::SERVER) {
+                    auto [session, line] = msg.toTerminalInput();
+                    LOG_DEBUG("Server sent command to terminal {} ({} bytes)", session, line.size());
+                    terminal_sessions.input(session, line);
                 }
                 break;
-            case MessageType::TERMIAL_OUTPUT:
+            case MessageType::TERMINAL_ACK:
+                if (mode == Mode::SERVER) {
+                    auto [session, screen_state] = msg.toTerminalAck();
+                    terminal_sessions.acknowledge(session, screen_state);
+                }
+                break;
+            case MessageType::TERMINAL_UPDATE:
                 if (mode == Mode::CLIENT && state == ConnectionState::CONNECTED) {
-                    client_output_vec.push_back(msg.toString());
-					std::cout << "terminal received output: " << msg.toString() << std::endl;
+                    TerminalUpdate update = msg.toTerminalUpdate();
+                    if (RemoteTerminal* terminal = find_terminal(update.session)) {
+                        NetworkMessage ack;
+                        ack.fromTerminalAck(update.session, terminal->apply(update));
+                        network_manager.sendMessage(std::move(ack));
+                    }
                 }
                 break;
-            case MessageType::SIGNAL: {
-                SignalType signal = msg.toSignal();
-				std::cout << "received signal from network: " << (signal == SignalType::CMD_BUSY ? "CMD_BUSY" : "CMD_IDLE") << std::endl;
-                if (signal == SignalType::CMD_BUSY)
-                    cmd_busy = true;
-                else if (signal == SignalType::CMD_IDLE)
-                    cmd_busy = false;
-				std::cout << "terminal cmd_busy set to: " << (cmd_busy ? "true" : "false") << std::endl;
+            case MessageType::TERMINAL_CONTROL: {
+                TerminalControl control = msg.toTerminalControl();
+                if (mode == Mode::SERVER) {
+                    switch (control.action) {
+                    case TerminalControl::OPEN:
+                        terminal_sessions.open(control.session, control.columns, control.rows, network_manager.ioContext());
+                        break;
+                    case TerminalControl::RESIZE:
+                        terminal_sessions.resize(control.session, control.columns, control.rows);
+                        break;
+                    case TerminalControl::INTERRUPT:
+                        terminal_sessions.interrupt(control.session);
+                        break;
+                    case TerminalControl::CLOSE:
+                        terminal_sessions.close(control.session);
+                        break;
+                    }
+                }
+                else if (RemoteTerminal* terminal = find_terminal(control.session)) {
+                    // The tab stays with the shell's last screen until it is closed
+                    if (control.action == TerminalControl::CLOSE) terminal->exited = true;
+                    else if (control.action == TerminalControl::BUSY) terminal->busy = true;
+                    else if (control.action == TerminalControl::IDLE) terminal->busy = false;
+                }
                 break;
             }
             case MessageType::FILESYSTEM_REQUEST:
                 if (mode == Mode::SERVER) {
-                    std::string requestedPath = msg.toFilesystemRequest();
-                    if (requestedPath.empty()) 
-                        requestedPath = std::getenv("USERPROFILE");
-                    std::cout << "Server received filesystem request for path: " << requestedPath << std::endl;
-                    auto [success, listing] = getDirectoryListing(requestedPath);
-                    NetworkMessage response;
-                    if (success) {
-                        response.fromDirectoryListing(listing);
-                    } else {
-                        response.fromError("Path not found: " + requestedPath);
-                    }
-                    network_manager.sendMessage(response);
+                    FilesystemRequest request = msg.toFilesystemRequest();
+                    if (request.path.empty()) 
+                        request.path = std::getenv("USERPROFILE");
+                    LOG_INFO("Server received filesystem request for path: {}", request.path);
+                    listing_service.request(request);
+                }
+                break;
+            case MessageType::FILESYSTEM_WATCH:
+                if (mode == Mode::SERVER) {
+                    listing_service.watch(msg.toFilesystemWatch());
                 }
                 break;
             case MessageType::FILE_CONTENT_REQUEST:
                 if (mode == Mode::SERVER) {
                     std::string requestedPath = msg.toFileContentRequest();
-                    std::cout << "Server received file content request for path: " << requestedPath << std::endl;
+                    LOG_INFO("Server received file content request for path: {}", requestedPath);
                     auto [success, content] = readFileContent(requestedPath);
                     NetworkMessage response;
                     if (success) {
@@ -239,69 +429,282 @@ int main() {
                 break;
             case MessageType::FILE_DOWNLOAD_REQUEST:
                 if (mode == Mode::SERVER) {
-                    std::string requestedPath = msg.toFileDownloadRequest();
-                    std::cout << "Server received file download request for path: " << requestedPath << std::endl;
-                    auto [success, content] = readFileContent(requestedPath);
-                    NetworkMessage response;
-                    if (success) {
-                        FileResponse fr;
-                        fr.filename = std::filesystem::path(requestedPath).filename().string();
-                        fr.content = content;
-                        response.fromFileDownloadResponse(fr);
+                    FileDownloadRequest request = msg.toFileDownloadRequest();
+                    LOG_INFO("Server received file download request for path: {}", request.path);
+                    file_sender.start(request);
+                }
+                break;
+            case MessageType::FILE_DOWNLOAD_CANCEL:
+                if (mode == Mode::SERVER) {
+                    uint32_t id = msg.toFileDownloadCancel();
+                    LOG_INFO("Server received file download cancel for transfer {}", id);
+                    file_sender.cancel(id);
+                }
+                break;
+            case MessageType::FILE_HASH_REQUEST:
+                if (mode == Mode::SERVER) {
+                    auto [id, path] = msg.toFileHashRequest();
+                    LOG_INFO("Server received file hash request {} for {}", id, path);
+                    hash_service.request(id, path);
+                }
+                break;
+            case MessageType::FILE_HASH_RESPONSE:
+                if (mode == Mode::CLIENT && state == ConnectionState::CONNECTED) {
+                    FileHashInfo info = msg.toFileHashResponse();
+                    auto it = awaiting_hash.find(info.id);
+                    if (it == awaiting_hash.end()) break;
+                    // The store answers with an event; the request waits for it
+                    if (info.error.empty() && content_store.lookup(info, file_receiver.localPath(info.id))) break;
+                    FileDownloadRequest request = std::move(it->second);
+                    awaiting_hash.erase(it);
+                    send_download(request);
+                }
+                break;
+            case MessageType::FILE_LINES_REQUEST:
+                if (mode == Mode::SERVER) {
+                    FileLinesRequest request = msg.toFileLinesRequest();
+                    LOG_DEBUG("Server received file lines request {} for {} at line {}", request.id, request.path, request.first_line);
+                    line_index.request(request);
+                }
+                break;
+            case MessageType::FILE_LINES_RESPONSE:
+                if (mode == Mode::CLIENT && state == ConnectionState::CONNECTED) {
+                    file_viewer.onLines(msg.toFileLinesResponse());
+                }
+                break;
+            case MessageType::SEARCH_REQUEST:
+                if (mode == Mode::SERVER) {
+                    SearchRequest request = msg.toSearchRequest();
+                    LOG_DEBUG("Server received search request {} for '{}' below {}", request.id, request.pattern, request.root);
+                    search_service.request(request);
+                }
+                break;
+            case MessageType::SEARCH_CANCEL:
+                if (mode == Mode::SERVER) {
+                    search_service.cancel(msg.toSearchCancel());
+                }
+                break;
+            case MessageType::SEARCH_RESULTS:
+                if (mode == Mode::CLIENT && state == ConnectionState::CONNECTED) {
+                    SearchResults results = msg.toSearchResults();
+                    if (results.id != search_id) break;
+                    for (auto& match : results.matches)
+                        search_matches.push_back(std::move(match));
+                    if (!results.error.empty()) {
+                        search_status = results.error;
                     } else {
-                        response.fromError("Failed to read file: " + requestedPath);
+                        search_status = std::to_string(search_matches.size()) + " matches in " + std::to_string(results.files_scanned) + " files (" +
+                            formatBytes(results.bytes_scanned) + ", " + std::to_string(results.files_skipped) + " skipped)";
+                        if (results.done) {
+                            char seconds[32];
+                            std::snprintf(seconds, sizeof(seconds), " in %.2f s", results.seconds);
+                            search_status += seconds;
+                            if (results.truncated) search_status += ", stopped at the match limit";
+                        }
                     }
-                    network_manager.sendMessage(response);
+                    if (results.done) search_running = false;
                 }
                 break;
-            case MessageType::FILESYSTEM_RESPONSE:
+            case MessageType::DISK_USAGE_REQUEST:
+                if (mode == Mode::SERVER) {
+                    DiskUsageRequest request = msg.toDiskUsageRequest();
+                    LOG_DEBUG("Server received disk usage request {} for {}", request.id, request.root);
+                    disk_usage.request(request);
+                }
+                break;
+            case MessageType::DISK_USAGE_CANCEL:
+                if (mode == Mode::SERVER) {
+                    disk_usage.cancel(msg.toDiskUsageCancel());
+                }
+                break;
+            case MessageType::DISK_USAGE_RESULTS:
                 if (mode == Mode::CLIENT && state == ConnectionState::CONNECTED) {
-                    current_directory = msg.toDirectoryListing();
-                    current_path = current_directory.path;
-                    path_input[0] = '\0'; // Clear the input field
-                    std::cout << "Client received filesystem response for path: " << current_path << " with " << current_directory.files.size() << " items" << std::endl;
+                    DiskUsageResults results = msg.toDiskUsageResults();
+                    if (results.id != usage_id) break;
+                    // Updates carry only the subdirectories whose totals moved
+                    for (auto& entry : results.entries)
+                        usage_entries[entry.name] = std::move(entry);
+                    results.entries.clear();
+                    usage_summary = std::move(results);
+                    if (usage_summary.done) usage_running = false;
+                    ++usage_generation;
                 }
                 break;
-            case MessageType::FILE_CONTENT_RESPONSE:
+            case MessageType::NAME_QUERY:
+                if (mode == Mode::SERVER) {
+                    name_index.query(msg.toNameQuery());
+                }
+                break;
+            case MessageType::NAME_RESULTS:
                 if (mode == Mode::CLIENT && state == ConnectionState::CONNECTED) {
-                    FileResponse response = msg.toFileContentResponse();
-                    file_viewer_content = std::string(response.content.begin(), response.content.end());
-                    file_viewer_title = "File Viewer - " + response.filename;
-                    show_file_viewer = true;
-                    std::cout << "Client received file content response for " << response.filename << " with " << response.content.size() << " bytes" << std::endl;
+                    NameResults results = msg.toNameResults();
+                    // Answers to queries the user has typed past are dropped
+                    if (results.id == find_id) find_results = std::move(results);
                 }
                 break;
-            case MessageType::FILE_DOWNLOAD_RESPONSE:
+            case MessageType::FILE_TREE_REQUEST:
+                if (mode == Mode::SERVER) {
+                    std::string requestedPath = msg.toFileTreeRequest();
+                    LOG_INFO("Server received file tree request for path: {}", requestedPath);
+                    file_trees.request(requestedPath);
+                }
+                break;
+            case MessageType::FILE_TREE_RESPONSE:
+                if (mode == Mode::CLIENT && state == ConnectionState::CONNECTED) {
+                    FileTree tree = msg.toFileTreeResponse();
+                    // Recreate the remote folder under the download path
+                    std::filesystem::path remote_root(tree.path);
+                    std::filesystem::path folder = remote_root.filename();
+                    if (folder.empty()) folder = remote_root.parent_path().filename();  // "dir/"
+                    std::filesystem::path local_root = (std::filesystem::path(download_path) / folder).lexically_normal();
+                    size_t queued = 0;
+                    for (const auto& [relative, size] : tree.files) {
+                        // The server names the files; none may be written outside local_root
+                        std::filesystem::path part(relative);
+                        bool contained = !part.empty() && !part.is_absolute() && !part.has_root_name() && !part.has_root_directory() &&
+                            std::none_of(part.begin(), part.end(), [](const std::filesystem::path& p) { return p == ".."; });
+                        std::filesystem::path local = (local_root / part).lexically_normal();
+                        std::filesystem::path inside = local.lexically_relative(local_root);
+                        if (!contained || inside.empty() || inside == "." || *inside.begin() == "..") {
+                            LOG_WARN("Client skipped tree entry outside the download folder: {}", relative);
+                            continue;
+                        }
+                        download_queue.enqueue((remote_root / part).string(), local.string(), size);
+                        ++queued;
+                    }
+                    LOG_INFO("Client queued {} of {} files from {}", queued, tree.files.size(), tree.path);
+                }
+                break;
+            case MessageType::FILE_UPLOAD_BEGIN:
+                if (mode == Mode::SERVER) {
+                    FileTransferHeader header = msg.toFileUploadBegin();
+                    LOG_INFO("Server received file upload for path: {} ({} bytes)", header.filename, header.size);
+                    if (auto ack = upload_receiver.begin(header)) {
+                        NetworkMessage response;
+                        response.fromFileUploadAck(*ack);
+                        network_manager.sendMessage(std::move(response));
+                    }
+                }
+                break;
+            case MessageType::FILE_UPLOAD_CHUNK:
+                if (mode == Mode::SERVER) {
+                    if (auto ack = upload_receiver.write(msg.toFileChunk())) {
+                        NetworkMessage response;
+                        response.fromFileUploadAck(*ack);
+                        network_manager.sendMessage(std::move(response));
+                    }
+                }
+                break;
+            case MessageType::FILE_UPLOAD_END:
+                if (mode == Mode::SERVER) {
+                    if (auto ack = upload_receiver.end(msg.toFileUploadEnd())) {
+                        NetworkMessage response;
+                        response.fromFileUploadAck(*ack);
+                        network_manager.sendMessage(std::move(response));
+                    }
+                }
+                break;
+            case MessageType::FILE_UPLOAD_ACK:
                 if (mode == Mode::CLIENT && state == ConnectionState::CONNECTED) {
-                    FileResponse response = msg.toFileDownloadResponse();
-                    // Save to download path
-                    std::filesystem::path downloadDir(download_path);
-                    if (!std::filesystem::exists(downloadDir)) {
-                        std::filesystem::create_directories(downloadDir);
-                    }
-                    std::filesystem::path filePath = downloadDir / response.filename;
-                    std::ofstream outFile(filePath, std::ios::binary);
-                    if (outFile.is_open()) {
-                        outFile.write(reinterpret_cast<const char*>(response.content.data()), response.content.size());
-                        outFile.close();
-                        filesystem_error_msg = "Download completed: " + response.filename;
+                    FileUploadAck ack = msg.toFileUploadAck();
+                    file_uploader.onAck(ack);
+                    if (ack.done) {
+                        LOG_INFO("Client upload {} finished with {} bytes: {}", ack.id, ack.bytes, ack.success ? "ok" : ack.error);
+                        // Show the new file if it landed in the directory being browsed
+                        if (ack.success) {
+                            list_directory(current_path);
+                        }
+                    }
+                }
+                break;
+            case MessageType::FILESYSTEM_RESPONSE:
+                if (mode == Mode::CLIENT && state == ConnectionState::CONNECTED) {
+                    DirectoryListing page = msg.toDirectoryListing();
+                    if (page.prefetch) {
+                        listing_prefetcher.received(page.path);
+                        if (page.files.size() >= page.total) remote_listings.store(std::move(page));
+                        break;
+                    }
+                    if (page.offset == 0) {
+                        if (page.path != current_path) selected_files.clear();
+                        current_directory = std::move(page);
+                        current_path = current_directory.path;
+                        path_input[0] = '\0'; // Clear the input field
+                    } else if (page.path == current_directory.path && page.version == current_directory.version &&
+                        page.offset == current_directory.files.size()) {
+                        current_directory.files.append(page.files, 0, page.files.size());
                     } else {
-                        filesystem_error_msg = "Failed to save file: " + response.filename;
+                        break; // rest of a listing already replaced by a newer one
+                    }
+                    if (current_directory.files.size() >= current_directory.total) {
+                        remote_listings.store(DirectoryListing(current_directory));
+                        listing_prefetcher.foreground(false);
+                        listing_prefetcher.want(std::filesystem::path(current_path).parent_path().string());
+                        LOG_INFO("Client received filesystem response for path: {} with {} items ({} bytes held)", current_path,
+                            current_directory.files.size(), current_directory.files.memoryBytes());
                     }
-                    show_filesystem_error = true;
-                    std::cout << "Client received file download response for " << response.filename << " with " << response.content.size() << " bytes" << std::endl;
                 }
                 break;
+            case MessageType::FILESYSTEM_DIFF:
+                if (mode == Mode::CLIENT && state == ConnectionState::CONNECTED) {
+                    DirectoryDiff diff = msg.toDirectoryDiff();
+                    const DirectoryListing* listing = remote_listings.apply(diff);
+                    if (diff.pushed) {
+                        // The directory on screen changed on the server
+                        if (diff.path != current_path) break;
+                        LOG_DEBUG("Client received pushed changes for path: {}: {} changed, {} removed", diff.path, diff.changed.size(), diff.removed.size());
+                        if (!listing)
+                            list_directory(current_path);
+                        else if (current_directory.files.size() >= current_directory.total)
+                            current_directory = *listing;
+                        break;
+                    }
+                    if (diff.prefetch) {
+                        listing_prefetcher.received(diff.path);
+                        break;
+                    }
+                    listing_prefetcher.foreground(false);
+                    if (!listing) {
+                        // The listing the diff applies to was dropped meanwhile; ask for all of it
+                        NetworkMessage request;
+                        request.fromFilesystemRequest(diff.path);
+                        network_manager.sendMessage(request);
+                        break;
+                    }
+                    // "Not modified" for the directory on screen leaves it as it is
+                    if (listing->path != current_path || listing->version != current_directory.version) current_directory = *listing;
+                    if (current_directory.path != current_path) selected_files.clear();
+                    current_path = current_directory.path;
+                    path_input[0] = '\0';
+                    LOG_DEBUG("Client received filesystem diff for path: {}: {} changed, {} removed", current_path, diff.changed.size(), diff.removed.size());
+                }
+                break;
+            case MessageType::FILE_DOWNLOAD_RESPONSE:
+                if (mode == Mode::CLIENT && state == ConnectionState::CONNECTED) {
+                    FileTransferHeader header = msg.toFileDownloadResponse();
+                    LOG_INFO("Client download {} started: {} ({} bytes)", header.id, header.filename, header.size);
+                    content_store.onHeader(header);
+                    file_receiver.post(std::move(msg));
+                }
+                break;
+            case MessageType::FILE_DOWNLOAD_CHUNK:
+            case MessageType::FILE_DOWNLOAD_COPY:
+            case MessageType::FILE_DOWNLOAD_END:
+                // Written on the receiver's own thread; results come back as events below
+                if (mode == Mode::CLIENT && state == ConnectionState::CONNECTED)
+                    file_receiver.post(std::move(msg));
+                break;
             case MessageType::ERR:
                 if (mode == Mode::CLIENT && state == ConnectionState::CONNECTED) {
                     filesystem_error_msg = msg.toError();
                     show_filesystem_error = true;
-                    std::cout << "Client received error: " << filesystem_error_msg << std::endl;
+                    listing_prefetcher.foreground(false);
+                    LOG_WARN("Client received error: {}", filesystem_error_msg);
                 }
                 break;
             case MessageType::SCREENSHOT_REQUEST:
                 if (mode == Mode::SERVER) {
-                    std::cout << "Server received screenshot request" << std::endl;
+                    LOG_INFO("Server received screenshot request");
                     auto [success, response] = captureScreenshot();
                     NetworkMessage msg;
                     if (success) {
@@ -319,15 +722,75 @@ int main() {
                     screenshot_width = response.width;
                     screenshot_height = response.height;
                     screenshot_updated = true;
-                    std::cout << "Client received screenshot response with " << screenshot_buffer.size() << " bytes, " << screenshot_width << "x" << screenshot_height << std::endl;
+                    LOG_INFO("Client received screenshot response with {} bytes, {}x{}", screenshot_buffer.size(), screenshot_width, screenshot_height);
                 }
                 break;
             default:
-				std::cout << "unknown message type received from network" << std::endl;
+				LOG_WARN("unknown message type {} received from network", msg.type);
                 break;
             }
         }
 
+        for (const auto& event : file_receiver.popEvents()) {
+            switch (event.kind) {
+            case FileReceiver::Event::Kind::STARTED:
+                download_queue.onStarted(event.header);
+                break;
+            case FileReceiver::Event::Kind::PROGRESS:
+                download_queue.onProgress(event.id, event.result.bytes);
+                break;
+            case FileReceiver::Event::Kind::FINISHED:
+                content_store.onCompleted(event.id, event.result.success, event.result.sha256);
+                download_queue.onFinished(event.id, event.result.success, event.result.message);
+                if (event.result.corrupt)
+                    integrity_failures[event.result.remote_path] = event.result.message;
+                else if (event.result.success)
+                    integrity_failures.erase(event.result.remote_path);
+                break;
+            case FileReceiver::Event::Kind::ABORTED:
+                download_queue.onAborted();
+                break;
+            }
+        }
+        for (auto& event : content_store.popEvents()) {
+            auto it = awaiting_hash.find(event.info.id);
+            if (it == awaiting_hash.end()) continue;
+            FileDownloadRequest request = std::move(it->second);
+            awaiting_hash.erase(it);
+            if (event.restored) {
+                file_receiver.release(request.id);
+                download_queue.onFinished(request.id, true, "Restored from local cache");
+                continue;
+            }
+            // Only bytes seen to hash to info.hash are added to the store
+            content_store.expect(request.id, event.info, event.local_path);
+            file_receiver.setRequestHash(request, HashAlgorithm::SHA256);
+            send_download(request);
+        }
+
+        // Keep the download pipeline full
+        if (mode == Mode::CLIENT && state == ConnectionState::CONNECTED) {
+            std::string host = std::string(conn_input.host_machine) + ":" + conn_input.port;
+            for (const auto& request : download_queue.pump(file_receiver, host, next_transfer_id)) {
+                // Fresh downloads ask for the content hash first; the local store may already have the bytes
+                if (content_cache && request.offset == 0) {
+                    awaiting_hash[request.id] = request;
+                    NetworkMessage message;
+                    message.fromFileHashRequest(request.id, request.path);
+                    network_manager.sendMessage(std::move(message));
+                    continue;
+                }
+                send_download(request);
+            }
+            listing_prefetcher.update(remote_listings);
+            if (!current_path.empty() && current_path != watched_path) {
+                NetworkMessage message;
+                message.fromFilesystemWatch({ current_path });
+                network_manager.sendMessage(std::move(message));
+                watched_path = current_path;
+            }
+        }
+
         ImGui_ImplOpenGL3_NewFrame();
         ImGui_ImplGlfw_NewFrame();
         ImGui::NewFrame();
@@ -397,35 +860,16 @@ int main() {
                     mode = Mode::SERVER;
                     conn_input = { "","","","" };
                     network_manager.startServer(port, password);
-                    if (!cmd.isRunning()) {
-                        cmd.start();
-                    }
+                    name_index.start(name_index_roots, NAME_INDEX_FILE);
                 }
             }
 
             if (running) {
                 if (ImGui::Button("Stop")) {
+                    terminal_sessions.closeAll(); // before their io_context goes away with the server
                     network_manager.stopAll();
                     mode = Mode::NONE;
                 }
-                if (mode == Mode::SERVER && cmd.isRunning()) {
-                    //send output by network manager server to client
-                    std::vector<std::string> cmd_output = cmd.getOutput();
-                    if (cmd_output.size() > 0) {
-						server_output_vec.insert(server_output_vec.end(), cmd_output.begin(), cmd_output.end());
-						std::cout << "server get " << cmd_output.size() << " outputs from cmd" << std::endl;
-					}
-                    if (state == ConnectionState::CONNECTED) {
-                        for (const auto& output : server_output_vec) {
-                            NetworkMessage msg;
-                            msg.type = MessageType::TERMIAL_OUTPUT;
-                            msg.data.assign(output.begin(), output.end());
-                            std::cout << "Server send output to client: " << output << std::endl;
-                            network_manager.sendMessage(msg);
-                        }
-						server_output_vec.clear();
-                    }
-                }
             }
 
             if (show_connection_panel && !running) {
@@ -561,6 +1005,7 @@ int main() {
                 if (ImGui::Button("Apply")) {
                     download_path = download_path_input;
                     config["download_path"] = download_path;
+                    if (content_cache) content_store.open((std::filesystem::path(download_path) / CONTENT_STORE_DIR).string());
                     std::ofstream file(CONFIG);
                     file << config.dump(4);
                     file.close();
@@ -639,59 +1084,60 @@ int main() {
 
         if (show_cli && state == ConnectionState::CONNECTED && mode == Mode::CLIENT) {
             ImGui::StyleColorsDark();
-            ImGui::SetNextWindowSize(ImVec2(600, 400), ImGuiCond_FirstUseEver);
+            ImGui::SetNextWindowSize(ImVec2(700, 460), ImGuiCond_FirstUseEver);
             ImGui::Begin("Command Line Interface", &show_cli);
 
-            for (const auto& log : cli_logs) {
-                if (log.length()) {
-                    // Split log by newlines to handle multiline output properly
-                    std::stringstream ss(log);
-                    std::string line;
-                    while (std::getline(ss, line)) {
-                        if (!line.empty()) {
-                            ImGui::TextWrapped("%s", line.c_str());
-                        }
-                    }
+            if (ImGui::BeginTabBar("##Terminals", ImGuiTabBarFlags_AutoSelectNewTabs)) {
+                if (ImGui::TabItemButton("+", ImGuiTabItemFlags_Trailing) && terminals.size() < TERMINAL_MAX_SESSIONS) {
+                    open_terminal();
                 }
-            }
+                for (auto& terminal : terminals) {
+                    std::string label = "Shell " + std::to_string(terminal.session) + (terminal.exited ? " (exited)" : "") +
+                        "###terminal" + std::to_string(terminal.session);
+                    if (!ImGui::BeginTabItem(label.c_str(), &terminal.open)) continue;
+                    ImGui::PushID(static_cast<int>(terminal.session));
+
+                    // The screen takes what the input line leaves of the panel
+                    ImVec2 avail = ImGui::GetContentRegionAvail();
+                    int fit_columns = static_cast<int>(avail.x / ImGui::CalcTextSize("M").x);
+                    int fit_rows = static_cast<int>((avail.y - ImGui::GetFrameHeightWithSpacing()) / ImGui::GetTextLineHeight());
+                    if (!terminal.exited && terminal.fit(
+                            static_cast<uint16_t>(std::clamp<int>(fit_columns, TERMINAL_MIN_COLUMNS, TERMINAL_MAX_COLUMNS)),
+                            static_cast<uint16_t>(std::clamp<int>(fit_rows, TERMINAL_MIN_ROWS, TERMINAL_MAX_ROWS)))) {
+                        send_terminal_control(terminal, TerminalControl::RESIZE);
+                    }
+                    drawTerminal(terminal.screen);
 
-            if (!cmd_busy) {
-                ImGui::SameLine();
-                ImGui::PushItemWidth(ImGui::GetContentRegionAvail().x - 10);
-                if (ImGui::InputText("##Input", cli_input, IM_ARRAYSIZE(cli_input), ImGuiInputTextFlags_EnterReturnsTrue)) {
-                    std::string command(cli_input);
-                    cli_input[0] = '\0';
-                    // send command to by network manager client
-                    NetworkMessage msg;
-                    msg.type = MessageType::COMMAND;
-                    msg.data.assign(command.begin(), command.end());
-                    network_manager.sendMessage(msg);
-                    new_input = true;
-                }
-                ImGui::PopItemWidth();
-            }
-            // get output from network manager client sent by server
-            if (client_output_vec.size()) {
-                for (size_t i = 0; i < client_output_vec.size(); ++i) {
-                    if (new_input) {
-                        cli_logs.back() += client_output_vec[i];
-                        new_input = false;
+                    if (!terminal.exited) {
+                        // Reaches the shell even while its output floods in
+                        if (ImGui::SmallButton("^C")) {
+                            send_terminal_control(terminal, TerminalControl::INTERRUPT);
+                        }
+                        if (!terminal.busy) {
+                            ImGui::SameLine();
+                            ImGui::PushItemWidth(ImGui::GetContentRegionAvail().x - 10);
+                            if (ImGui::InputText("##Input", terminal.input, IM_ARRAYSIZE(terminal.input), ImGuiInputTextFlags_EnterReturnsTrue)) {
+                                NetworkMessage msg;
+                                msg.fromTerminalInput(terminal.session, terminal.input);
+                                network_manager.sendMessage(std::move(msg));
+                                terminal.input[0] = '\0';
+                            }
+                            ImGui::PopItemWidth();
+                        }
                     }
-                    else
-                        cli_logs.emplace_back(client_output_vec[i]);
+                    ImGui::PopID();
+                    ImGui::EndTabItem();
                 }
-                client_output_vec.clear();
-                if (cli_logs.size() > 200)
-                    cli_logs.erase(cli_logs.begin());
-                new_log = true;
+                ImGui::EndTabBar();
             }
-            if (scroll && ImGui::GetScrollY() >= ImGui::GetScrollMaxY()) {
-                ImGui::SetScrollHereY(1.0f);
-                scroll = false;
-            }
-            if (new_log) {
-                new_log = false;
-                scroll = true; //scroll next round, the logs are updated
+            // A tab closed by its button ends its shell
+            for (auto it = terminals.begin(); it != terminals.end();) {
+                if (it->open) {
+                    ++it;
+                    continue;
+                }
+                if (!it->exited) send_terminal_control(*it, TerminalControl::CLOSE);
+                it = terminals.erase(it);
             }
             ImGui::End();
             ImGui::StyleColorsLight();
@@ -703,9 +1149,7 @@ int main() {
             
             // Current path display and navigation
             if (ImGui::InputTextWithHint("##path", current_path.c_str(), path_input, IM_ARRAYSIZE(path_input), ImGuiInputTextFlags_EnterReturnsTrue)) {
-                NetworkMessage request;
-                request.fromFilesystemRequest(path_input);
-                network_manager.sendMessage(request);
+                list_directory(path_input);
                 // Clear the input after sending
                 path_input[0] = '\0';
             }
@@ -716,86 +1160,258 @@ int main() {
                 std::filesystem::path p(current_path);
                 if (p.has_parent_path()) {
                     std::string parentPath = p.parent_path().string();
-                    NetworkMessage request;
-                    request.fromFilesystemRequest(parentPath);
-                    network_manager.sendMessage(request);
+                    list_directory(parentPath);
                 }
             }
             ImGui::SameLine();
             if (ImGui::Button("Refresh")) {
-                NetworkMessage request;
-                request.fromFilesystemRequest(current_path);
-                network_manager.sendMessage(request);
+                list_directory(current_path);
             }
             ImGui::SameLine();
             if (ImGui::Button("Root")) {
-                NetworkMessage request;
-                request.fromFilesystemRequest("");
-                network_manager.sendMessage(request);
+                list_directory("");
+            }
+            ImGui::SameLine();
+            ImGui::BeginDisabled(selected_files.empty());
+            if (ImGui::Button(("Download Selected (" + std::to_string(selected_files.size()) + ")").c_str())) {
+                for (size_t i = 0; i < current_directory.files.size(); ++i) {
+                    FileRef file = current_directory.files[i];
+                    std::string name(file.name);
+                    if (!selected_files.count(name)) continue;
+                    std::filesystem::path filePath = std::filesystem::path(current_path) / name;
+                    if (file.isDirectory) {
+                        NetworkMessage request;
+                        request.fromFileTreeRequest(filePath.string());
+                        network_manager.sendMessage(request);
+                    } else {
+                        download_queue.enqueue(filePath.string(), (std::filesystem::path(download_path) / name).string(), file.size);
+                    }
+                }
+                selected_files.clear();
+            }
+            ImGui::EndDisabled();
+            ImGui::SameLine();
+            if (ImGui::Button("Upload")) {
+                ImGui::OpenPopup("UploadFile");
+            }
+            if (ImGui::BeginPopup("UploadFile")) {
+                ImGui::Text("Upload to %s", current_path.c_str());
+                ImGui::InputTextWithHint("##upload", "Local file path...", upload_input, IM_ARRAYSIZE(upload_input));
+                if (ImGui::Button("Start")) {
+                    std::error_code ec;
+                    if (std::filesystem::is_regular_file(upload_input, ec)) {
+                        std::filesystem::path local(upload_input);
+                        std::filesystem::path remote = std::filesystem::path(current_path) / local.filename();
+                        file_uploader.start(next_transfer_id++, local.string(), remote.string());
+                        show_transfers = true;
+                        upload_input[0] = '\0';
+                        ImGui::CloseCurrentPopup();
+                    } else {
+                        filesystem_error_msg = std::string("Not a file: ") + upload_input;
+                        show_filesystem_error = true;
+                    }
+                }
+                ImGui::SameLine();
+                if (ImGui::Button("Cancel")) {
+                    ImGui::CloseCurrentPopup();
+                }
+                ImGui::EndPopup();
+            }
+            ImGui::SameLine();
+            if (ImGui::Button("Search")) {
+                search_root = current_path;
+                show_search = true;
+            }
+            ImGui::SameLine();
+            if (ImGui::Button("Find")) {
+                // An empty query fetches the index's state
+                NameQuery query;
+                query.id = ++find_id;
+                query.query = find_input;
+                query.fuzzy = find_fuzzy;
+                NetworkMessage message;
+                message.fromNameQuery(query);
+                network_manager.sendMessage(std::move(message));
+                show_find = true;
+            }
+            ImGui::SameLine();
+            if (usage_running) {
+                if (ImGui::Button("Stop Usage")) {
+                    NetworkMessage message;
+                    message.fromDiskUsageCancel(usage_id);
+                    network_manager.sendMessage(std::move(message));
+                }
+            } else if (ImGui::Button("Disk Usage")) {
+                DiskUsageRequest request;
+                request.id = ++usage_id;
+                request.root = current_path;
+                NetworkMessage message;
+                message.fromDiskUsageRequest(request);
+                network_manager.sendMessage(std::move(message));
+                usage_root = current_path;
+                usage_entries.clear();
+                usage_summary = DiskUsageResults();
+                usage_running = true;
+                sort_by_size = true;
+                ++usage_generation;
+            }
+            // Sizes are shown while the explorer is on the directory they were counted for
+            bool usage_shown = usage_id && usage_root == current_path;
+            if (usage_shown) {
+                ImGui::SameLine();
+                ImGui::Checkbox("Sort by size", &sort_by_size);
+                if (!usage_summary.error.empty()) {
+                    ImGui::TextColored(ImVec4(1.0f, 0.3f, 0.3f, 1.0f), "%s", usage_summary.error.c_str());
+                } else {
+                    ImGui::Text("%s in %llu files, %llu directories (%s of data)%s%s", formatBytes(usage_summary.total.allocated).c_str(),
+                        static_cast<unsigned long long>(usage_summary.total.files), static_cast<unsigned long long>(usage_summary.total.directories),
+                        formatBytes(usage_summary.total.bytes).c_str(), usage_running ? ", counting..." : usage_summary.cancelled ? ", stopped" : "",
+                        usage_summary.unreadable ? ", some directories unreadable" : "");
+                }
+            }
+            ImGui::SetNextItemWidth(200);
+            ImGui::InputText("Filter", file_filter, sizeof(file_filter));
+            if (current_directory.files.size() < current_directory.total) {
+                ImGui::SameLine();
+                ImGui::Text("Loading %zu of %llu entries...", current_directory.files.size(),
+                    static_cast<unsigned long long>(current_directory.total));
+            }
+            bool sorted = usage_shown && sort_by_size;
+            bool by_rows = sorted || file_filter[0];
+            if (by_rows) {
+                auto key = std::make_tuple(current_path, current_directory.version, current_directory.files.size(), usage_generation, sorted, std::string(file_filter));
+                if (key != file_rows_key) {
+                    const FileTable& files = current_directory.files;
+                    std::string filter = file_filter;
+                    std::transform(filter.begin(), filter.end(), filter.begin(), [](unsigned char c) { return std::tolower(c); });
+                    file_rows.clear();
+                    for (uint32_t i = 0; i < files.size(); ++i) {
+                        std::string_view name = files.name(i);
+                        auto found = std::search(name.begin(), name.end(), filter.begin(), filter.end(),
+                            [](char a, char b) { return std::tolower(static_cast<unsigned char>(a)) == b; });
+                        if (filter.empty() || found != name.end()) file_rows.push_back(i);
+                    }
+                    if (sorted) {
+                        // Directories by what is below them, files by their own size, largest first
+                        std::vector<uint64_t> sizes(files.size());
+                        for (uint32_t i : file_rows) {
+                            auto counted = files.isDirectory(i) ? usage_entries.find(std::string(files.name(i))) : usage_entries.end();
+                            sizes[i] = counted != usage_entries.end() ? counted->second.allocated : files[i].size;
+                        }
+                        std::stable_sort(file_rows.begin(), file_rows.end(), [&](uint32_t a, uint32_t b) { return sizes[a] > sizes[b]; });
+                    }
+                    file_rows_key = std::move(key);
+                }
             }
-            
             ImGui::Separator();
             
             // File list
+            // Opened after the loop, which a listing held here would otherwise replace under it
+            std::string open_directory;
             if (ImGui::BeginChild("FileList", ImVec2(0, 0), true)) {
-                for (const auto& file : current_directory.files) {
-                    bool isSelected = false;
-                    ImGuiTreeNodeFlags flags = ImGuiTreeNodeFlags_Leaf | ImGuiTreeNodeFlags_NoTreePushOnOpen;
+                ImGuiListClipper clipper;
+                clipper.Begin(static_cast<int>(by_rows ? file_rows.size() : current_directory.files.size()));
+                while (clipper.Step()) {
+                    for (int i = clipper.DisplayStart; i < clipper.DisplayEnd; ++i) {
+                        FileRef file = current_directory.files[by_rows ? file_rows[i] : i];
+                        std::string name(file.name);
+                        bool isSelected = selected_files.count(name) > 0;
+                        auto integrity = integrity_failures.find((std::filesystem::path(current_path) / name).string());
+                        bool corrupt = integrity != integrity_failures.end();
+                        ImGuiTreeNodeFlags flags = ImGuiTreeNodeFlags_Leaf | ImGuiTreeNodeFlags_NoTreePushOnOpen;
+                        if (isSelected) flags |= ImGuiTreeNodeFlags_Selected;
                     
-                    if (file.isDirectory) {
-                        flags |= ImGuiTreeNodeFlags_OpenOnDoubleClick;
-                        ImGui::PushStyleColor(ImGuiCol_Text, ImVec4(0.2f, 0.6f, 1.0f, 1.0f)); // Blue for directories
-                    }
+                        if (file.isDirectory) {
+                            flags |= ImGuiTreeNodeFlags_OpenOnDoubleClick;
+                            ImGui::PushStyleColor(ImGuiCol_Text, ImVec4(0.2f, 0.6f, 1.0f, 1.0f)); // Blue for directories
+                        } else if (corrupt) {
+                            ImGui::PushStyleColor(ImGuiCol_Text, ImVec4(1.0f, 0.3f, 0.3f, 1.0f)); // Red for failed integrity checks
+                        }
                     
-                    bool nodeOpen = ImGui::TreeNodeEx(file.name.c_str(), flags);
+                        ImGui::TreeNodeEx(name.c_str(), flags);
                     
-                    if (file.isDirectory) {
-                        ImGui::PopStyleColor();
-                    }
+                        if (file.isDirectory || corrupt) {
+                            ImGui::PopStyleColor();
+                        }
+                        if (corrupt && ImGui::IsItemHovered()) {
+                            ImGui::SetTooltip("%s", integrity->second.c_str());
+                        }
+
+                        // Ctrl+click toggles the item in the download selection
+                        if (ImGui::IsItemClicked() && ImGui::GetIO().KeyCtrl) {
+                            if (isSelected) selected_files.erase(name);
+                            else selected_files.insert(name);
+                        }
                     
-                    // Handle double-click to navigate into directories
-                    if (ImGui::IsItemHovered() && ImGui::IsMouseDoubleClicked(0) && file.isDirectory) {
-                        std::filesystem::path newPath = std::filesystem::path(current_path) / file.name;
-                        NetworkMessage request;
-                        request.fromFilesystemRequest(newPath.string());
-                        network_manager.sendMessage(request);
-                    }
+                        // Handle double-click to navigate into directories
+                        if (ImGui::IsItemHovered() && ImGui::IsMouseDoubleClicked(0) && file.isDirectory) {
+                            std::filesystem::path newPath = std::filesystem::path(current_path) / name;
+                            open_directory = newPath.string();
+                        }
+
+                        // A directory the mouse rests on is likely opened next
+                        if (ImGui::IsItemHovered() && file.isDirectory) {
+                            std::string path = (std::filesystem::path(current_path) / name).string();
+                            if (path != hovered_directory) {
+                                hovered_directory = path;
+                                hovered_since = std::chrono::steady_clock::now();
+                            } else if (std::chrono::steady_clock::now() - hovered_since > LISTING_HOVER_DELAY) {
+                                listing_prefetcher.want(path);
+                            }
+                        }
                     
-                    // Context menu
-                    if (ImGui::BeginPopupContextItem()) {
-                        if (ImGui::MenuItem("Open", NULL, false, !file.isDirectory && isTextFile(file.name))) {
-                            if (!file.isDirectory && isTextFile(file.name)) {
-                                std::filesystem::path filePath = std::filesystem::path(current_path) / file.name;
-                                NetworkMessage request;
-                                request.fromFileContentRequest(filePath.string());
-                                network_manager.sendMessage(request);
+                        // Context menu
+                        if (ImGui::BeginPopupContextItem()) {
+                            if (ImGui::MenuItem("Open", NULL, false, !file.isDirectory && isTextFile(name))) {
+                                if (!file.isDirectory && isTextFile(name)) {
+                                    std::filesystem::path filePath = std::filesystem::path(current_path) / name;
+                                    file_viewer.open(filePath.string());
+                                    file_viewer_title = "File Viewer - " + name;
+                                    file_viewer_base = 0;
+                                    show_file_viewer = true;
+                                }
+                            }
+                            if (ImGui::MenuItem("Download")) {
+                                std::filesystem::path filePath = std::filesystem::path(current_path) / name;
+                                if (file.isDirectory) {
+                                    NetworkMessage request;
+                                    request.fromFileTreeRequest(filePath.string());
+                                    network_manager.sendMessage(request);
+                                } else {
+                                    download_queue.enqueue(filePath.string(), (std::filesystem::path(download_path) / name).string(), file.size);
+                                }
                             }
+                            ImGui::EndPopup();
                         }
-                        if (ImGui::MenuItem("Download", NULL, false, !file.isDirectory)) {
+                    
+                        // Show file info in tooltip
+                        if (ImGui::IsItemHovered()) {
+                            ImGui::BeginTooltip();
+                            ImGui::Text("Name: %s", name.c_str());
+                            ImGui::Text("Type: %s", file.isDirectory ? "Directory" : "File");
                             if (!file.isDirectory) {
-                                std::filesystem::path filePath = std::filesystem::path(current_path) / file.name;
-                                NetworkMessage request;
-                                request.fromFileDownloadRequest(filePath.string());
-                                network_manager.sendMessage(request);
+                                ImGui::Text("Size: %zu bytes", file.size);
                             }
+                            ImGui::Text("Modified: %s", formatTime(file.modified).c_str());
+                            ImGui::EndTooltip();
                         }
-                        ImGui::EndPopup();
-                    }
-                    
-                    // Show file info in tooltip
-                    if (ImGui::IsItemHovered()) {
-                        ImGui::BeginTooltip();
-                        ImGui::Text("Name: %s", file.name.c_str());
-                        ImGui::Text("Type: %s", file.isDirectory ? "Directory" : "File");
-                        if (!file.isDirectory) {
-                            ImGui::Text("Size: %zu bytes", file.size);
+
+                        if (usage_shown) {
+                            auto counted = file.isDirectory ? usage_entries.find(name) : usage_entries.end();
+                            if (counted != usage_entries.end()) {
+                                ImGui::SameLine();
+                                ImGui::TextDisabled("%s, %llu files", formatBytes(counted->second.allocated).c_str(),
+                                    static_cast<unsigned long long>(counted->second.files));
+                            } else if (!file.isDirectory) {
+                                ImGui::SameLine();
+                                ImGui::TextDisabled("%s", formatBytes(file.size).c_str());
+                            }
                         }
-                        ImGui::Text("Modified: %s", file.lastModified.c_str());
-                        ImGui::EndTooltip();
                     }
                 }
             }
             ImGui::EndChild();
+            if (!open_directory.empty()) list_directory(open_directory);
             
             // Error popup
             if (show_filesystem_error) {
@@ -813,10 +1429,349 @@ int main() {
             ImGui::End();
         }
 
+        // Transfers Panel
+        std::vector<FileUploader::Progress> uploads;
+        if (show_transfers && mode == Mode::CLIENT)
+            uploads = file_uploader.progress();
+        if (show_transfers && mode == Mode::CLIENT && (!download_queue.empty() || !uploads.empty())) {
+            ImGui::Begin("Transfers", &show_transfers);
+
+            double total_rate = download_queue.totalRate();
+            uint64_t remaining = download_queue.remainingBytes();
+            ImGui::Text("Total: %s/s", formatBytes(static_cast<uint64_t>(total_rate)).c_str());
+            ImGui::SameLine();
+            ImGui::Text("ETA: %s", total_rate > 0 ? formatDuration(remaining / total_rate).c_str() : "--");
+            ImGui::SameLine();
+            ImGui::PushItemWidth(100);
+            int parallel = static_cast<int>(download_queue.maxActive());
+            if (ImGui::InputInt("Parallel", &parallel)) {
+                parallel = std::clamp(parallel, 1, 32);
+                download_queue.setMaxActive(parallel);
+                config["max_parallel_downloads"] = parallel;
+                std::ofstream file(CONFIG);
+                file << config.dump(4);
+                file.close();
+            }
+            ImGui::PopItemWidth();
+            ImGui::SameLine();
+            if (ImGui::Button("Clear finished")) {
+                download_queue.clearFinished();
+                file_uploader.clearFinished();
+            }
+            if (content_cache) {
+                uint64_t lookups = content_store.hits() + content_store.misses();
+                ImGui::Text("Cache: %llu/%llu hits (%.0f%%), %s saved", static_cast<unsigned long long>(content_store.hits()),
+                    static_cast<unsigned long long>(lookups), lookups ? 100.0 * content_store.hits() / lookups : 0.0,
+                    formatBytes(content_store.bytesSaved()).c_str());
+            }
+            if (uint64_t unwritten = file_receiver.queuedBytes())
+                ImGui::Text("Writing: %s queued for disk", formatBytes(unwritten).c_str());
+            ImGui::Separator();
+
+            static const char* state_names[] = { "Queued", "Active", "Paused", "Completed", "Failed", "Cancelled" };
+            uint64_t pause_key = 0, resume_key = 0, cancel_key = 0;
+            for (const auto& entry : download_queue.entries()) {
+                ImGui::PushID(static_cast<int>(entry.key));
+                float fraction = entry.size ? static_cast<float>(static_cast<double>(entry.received) / entry.size) : 0.0f;
+                ImGui::Text("%s", entry.name.c_str());
+                ImGui::ProgressBar(fraction, ImVec2(ImGui::GetContentRegionAvail().x * 0.5f, 0),
+                    (formatBytes(entry.received) + " / " + formatBytes(entry.size)).c_str());
+                ImGui::SameLine();
+                if (entry.state == DownloadQueue::State::ACTIVE && entry.rate > 0) {
+                    uint64_t left = entry.size > entry.received ? entry.size - entry.received : 0;
+                    ImGui::Text("%s/s  ETA %s", formatBytes(static_cast<uint64_t>(entry.rate)).c_str(), formatDuration(left / entry.rate).c_str());
+                } else {
+                    ImGui::Text("%s", state_names[static_cast<int>(entry.state)]);
+                }
+                ImGui::SameLine();
+                if (entry.state == DownloadQueue::State::ACTIVE || entry.state == DownloadQueue::State::QUEUED) {
+                    if (ImGui::SmallButton("Pause")) pause_key = entry.key;
+                } else if (entry.state == DownloadQueue::State::PAUSED || entry.state == DownloadQueue::State::FAILED) {
+                    if (ImGui::SmallButton("Resume")) resume_key = entry.key;
+                }
+                if (entry.state != DownloadQueue::State::COMPLETED && entry.state != DownloadQueue::State::CANCELLED) {
+                    ImGui::SameLine();
+                    if (ImGui::SmallButton("Cancel")) cancel_key = entry.key;
+                }
+                if (!entry.message.empty() && entry.state == DownloadQueue::State::FAILED) {
+                    ImGui::TextColored(ImVec4(1.0f, 0.3f, 0.3f, 1.0f), "%s", entry.message.c_str());
+                }
+                ImGui::PopID();
+            }
+
+            if (!uploads.empty()) {
+                ImGui::SeparatorText("Uploads");
+            }
+            for (const auto& upload : uploads) {
+                ImGui::PushID(static_cast<int>(upload.id) | 0x40000000);
+                float fraction = upload.size ? static_cast<float>(static_cast<double>(upload.acked) / upload.size) : (upload.done ? 1.0f : 0.0f);
+                ImGui::Text("%s", upload.name.c_str());
+                ImGui::ProgressBar(fraction, ImVec2(ImGui::GetContentRegionAvail().x * 0.5f, 0),
+                    (formatBytes(upload.acked) + " / " + formatBytes(upload.size)).c_str());
+                ImGui::SameLine();
+                if (!upload.done && upload.rate > 0) {
+                    uint64_t left = upload.size > upload.acked ? upload.size - upload.acked : 0;
+                    ImGui::Text("%s/s  ETA %s", formatBytes(static_cast<uint64_t>(upload.rate)).c_str(), formatDuration(left / upload.rate).c_str());
+                } else {
+                    ImGui::Text("%s", upload.done ? (upload.success ? "Completed" : "Failed") : "Active");
+                }
+                if (!upload.done) {
+                    ImGui::SameLine();
+                    if (ImGui::SmallButton("Cancel")) file_uploader.cancel(upload.id);
+                } else if (!upload.success) {
+                    ImGui::TextColored(ImVec4(1.0f, 0.3f, 0.3f, 1.0f), "%s", upload.message.c_str());
+                }
+                ImGui::PopID();
+            }
+
+            // Applied after the loop so the entry list is not modified while iterating
+            if (pause_key) {
+                if (uint32_t id = download_queue.pause(pause_key)) {
+                    awaiting_hash.erase(id);
+                    content_store.forget(id);
+                    delta_signer.cancel(id);
+                    file_receiver.cancel(id, false);
+                    NetworkMessage request;
+                    request.fromFileDownloadCancel(id);
+                    network_manager.sendMessage(request);
+                }
+            }
+            if (resume_key) {
+                download_queue.resume(resume_key);
+            }
+            if (cancel_key) {
+                std::string local_path;
+                for (const auto& entry : download_queue.entries()) {
+                    if (entry.key == cancel_key) local_path = entry.local_path;
+                }
+                uint32_t id = download_queue.cancel(cancel_key);
+                if (id) {
+                    awaiting_hash.erase(id);
+                    content_store.forget(id);
+                    delta_signer.cancel(id);
+                    file_receiver.cancel(id, true);
+                    NetworkMessage request;
+                    request.fromFileDownloadCancel(id);
+                    network_manager.sendMessage(request);
+                } else {
+                    // Not in flight; drop any partial data left from an earlier attempt
+                    std::error_code ec;
+                    std::filesystem::remove(local_path + ".part", ec);
+                    std::filesystem::remove(local_path + ".part.json", ec);
+                }
+            }
+            ImGui::End();
+        }
+
         // File Viewer Panel
         if (show_file_viewer) {
             ImGui::Begin(file_viewer_title.c_str(), &show_file_viewer);
-            ImGui::TextWrapped("%s", file_viewer_content.c_str());
+            uint64_t total = file_viewer.lineCount();
+            if (!file_viewer.error().empty()) {
+                ImGui::TextColored(ImVec4(1.0f, 0.3f, 0.3f, 1.0f), "%s", file_viewer.error().c_str());
+            } else if (file_viewer.complete()) {
+                ImGui::Text("%s, %llu lines", formatBytes(file_viewer.size()).c_str(), static_cast<unsigned long long>(total));
+            } else {
+                ImGui::Text("%s, ~%llu lines (indexing %.0f%%)", formatBytes(file_viewer.size()).c_str(), static_cast<unsigned long long>(total),
+                    file_viewer.size() ? 100.0 * file_viewer.indexed() / file_viewer.size() : 0.0);
+            }
+            ImGui::SameLine();
+            ImGui::PushItemWidth(150);
+            if (ImGui::InputScalar("Go to line", ImGuiDataType_U64, &file_viewer_goto, NULL, NULL, NULL, ImGuiInputTextFlags_EnterReturnsTrue))
+                file_viewer_jump = true;
+            ImGui::PopItemWidth();
+
+            ImGui::BeginChild("##file_viewer_lines", ImVec2(0, 0), false, ImGuiWindowFlags_HorizontalScrollbar);
+            float line_height = ImGui::GetTextLineHeightWithSpacing();
+            // Scroll offsets are floats and lose precision on huge lists, so the clipper spans a
+            // window of VIEWER_WINDOW_LINES lines that slides along the file
+            // A jump past the estimated end waits until the index gets there
+            if (file_viewer_jump && (total >= file_viewer_goto || file_viewer.complete() || !file_viewer.error().empty())) {
+                uint64_t target = std::min(file_viewer_goto > 0 ? file_viewer_goto - 1 : 0, total > 0 ? total - 1 : 0);
+                file_viewer_base = target > VIEWER_WINDOW_LINES / 2 ? target - VIEWER_WINDOW_LINES / 2 : 0;
+                ImGui::SetScrollY((target - file_viewer_base) * line_height);
+                file_viewer_jump = false;
+            }
+            if (file_viewer_base >= total) file_viewer_base = total > VIEWER_WINDOW_LINES ? total - VIEWER_WINDOW_LINES : 0;
+            uint64_t window = std::min<uint64_t>(VIEWER_WINDOW_LINES, total - file_viewer_base);
+            int digits = static_cast<int>(std::to_string(total).size());
+            ImGuiListClipper clipper;
+            clipper.Begin(static_cast<int>(window), line_height);
+            while (clipper.Step()) {
+                file_viewer.show(file_viewer_base + clipper.DisplayStart, file_viewer_base + clipper.DisplayEnd);
+                for (int i = clipper.DisplayStart; i < clipper.DisplayEnd; ++i) {
+                    uint64_t n = file_viewer_base + i;
+                    ImGui::TextDisabled("%*llu", digits, static_cast<unsigned long long>(n + 1));
+                    ImGui::SameLine();
+                    if (const std::string_view* text = file_viewer.line(n))
+                        ImGui::TextUnformatted(text->data(), text->data() + text->size());
+                    else
+                        ImGui::TextDisabled("...");
+                }
+            }
+            clipper.End();
+            uint64_t first_visible = static_cast<uint64_t>(ImGui::GetScrollY() / line_height);
+            uint64_t shift = VIEWER_WINDOW_LINES / 4;
+            if (first_visible > window - std::min(window, shift) && file_viewer_base + window < total) {
+                file_viewer_base += shift;
+                ImGui::SetScrollY(ImGui::GetScrollY() - shift * line_height);
+            } else if (first_visible < shift && file_viewer_base > 0 && window == VIEWER_WINDOW_LINES) {
+                uint64_t back = std::min(shift, file_viewer_base);
+                file_viewer_base -= back;
+                ImGui::SetScrollY(ImGui::GetScrollY() + back * line_height);
+            }
+            ImGui::EndChild();
+            ImGui::End();
+        }
+
+        // Search Panel
+        if (show_search && mode == Mode::CLIENT && state == ConnectionState::CONNECTED) {
+            ImGui::Begin("Search", &show_search);
+            ImGui::Text("In %s", search_root.c_str());
+            bool start = ImGui::InputTextWithHint("##search_pattern", "Text or regex...", search_pattern, IM_ARRAYSIZE(search_pattern), ImGuiInputTextFlags_EnterReturnsTrue);
+            ImGui::InputTextWithHint("##search_globs", "Files, e.g. *.cpp;*.h;!build", search_globs, IM_ARRAYSIZE(search_globs));
+            ImGui::Checkbox("Regex", &search_regex);
+            ImGui::SameLine();
+            ImGui::Checkbox("Match case", &search_case_sensitive);
+            ImGui::SameLine();
+            ImGui::PushItemWidth(80);
+            ImGui::SliderInt("Context", &search_context, 0, static_cast<int>(SEARCH_MAX_CONTEXT));
+            ImGui::SameLine();
+            ImGui::InputInt("Max MB", &search_max_size_mb, 0);
+            ImGui::PopItemWidth();
+            ImGui::BeginDisabled(search_pattern[0] == '\0');
+            start |= ImGui::Button("Search");
+            ImGui::EndDisabled();
+            if (start && search_pattern[0] != '\0') {
+                SearchRequest request;
+                request.id = ++search_id;
+                request.root = search_root;
+                request.pattern = search_pattern;
+                request.regex = search_regex;
+                request.case_sensitive = search_case_sensitive;
+                request.globs = search_globs;
+                request.max_file_size = static_cast<uint64_t>(std::max(search_max_size_mb, 0)) * 1024 * 1024;
+                request.context = static_cast<uint32_t>(search_context);
+                NetworkMessage message;
+                message.fromSearchRequest(request);
+                network_manager.sendMessage(std::move(message));
+                search_matches.clear();
+                search_status = "Searching...";
+                search_running = true;
+            }
+            ImGui::SameLine();
+            ImGui::BeginDisabled(!search_running);
+            if (ImGui::Button("Cancel")) {
+                NetworkMessage message;
+                message.fromSearchCancel(search_id);
+                network_manager.sendMessage(std::move(message));
+                search_status += " (cancelled)";
+                search_running = false;
+                ++search_id;
+            }
+            ImGui::EndDisabled();
+            ImGui::SameLine();
+            ImGui::TextUnformatted(search_status.c_str());
+            ImGui::Separator();
+
+            if (ImGui::BeginChild("##search_results", ImVec2(0, 0), false, ImGuiWindowFlags_HorizontalScrollbar)) {
+                ImGuiListClipper clipper;
+                clipper.Begin(static_cast<int>(search_matches.size()));
+                while (clipper.Step()) {
+                    for (int i = clipper.DisplayStart; i < clipper.DisplayEnd; ++i) {
+                        const SearchMatch& match = search_matches[i];
+                        std::string path = std::filesystem::path(match.path).lexically_relative(search_root).string();
+                        if (path.empty()) path = match.path;
+                        std::string label = path + ":" + std::to_string(match.line) + ": " + match.text + "##" + std::to_string(i);
+                        if (ImGui::Selectable(label.c_str())) {
+                            file_viewer.open(match.path);
+                            file_viewer_title = "File Viewer - " + std::filesystem::path(match.path).filename().string();
+                            file_viewer_base = 0;
+                            file_viewer_goto = match.line;
+                            file_viewer_jump = true;
+                            show_file_viewer = true;
+                        }
+                        if (ImGui::IsItemHovered() && (!match.before.empty() || !match.after.empty())) {
+                            ImGui::BeginTooltip();
+                            uint64_t n = match.line - match.before.size();
+                            for (const auto& line : match.before)
+                                ImGui::TextDisabled("%llu: %s", static_cast<unsigned long long>(n++), line.c_str());
+                            ImGui::Text("%llu: %s", static_cast<unsigned long long>(n++), match.text.c_str());
+                            for (const auto& line : match.after)
+                                ImGui::TextDisabled("%llu: %s", static_cast<unsigned long long>(n++), line.c_str());
+                            ImGui::EndTooltip();
+                        }
+                    }
+                }
+                clipper.End();
+            }
+            ImGui::EndChild();
+            ImGui::End();
+        }
+
+        // Find by Name Panel
+        if (show_find && mode == Mode::CLIENT && state == ConnectionState::CONNECTED) {
+            ImGui::Begin("Find by Name", &show_find);
+            // Every edit is a query; the index answers in milliseconds
+            bool changed = ImGui::InputTextWithHint("##find_input", "File or directory name...", find_input, IM_ARRAYSIZE(find_input));
+            ImGui::SameLine();
+            changed |= ImGui::Checkbox("Fuzzy", &find_fuzzy);
+            if (changed) {
+                NameQuery query;
+                query.id = ++find_id;
+                query.query = find_input;
+                query.fuzzy = find_fuzzy;
+                NetworkMessage message;
+                message.fromNameQuery(query);
+                network_manager.sendMessage(std::move(message));
+            }
+            if (!find_results.error.empty()) {
+                ImGui::TextColored(ImVec4(1.0f, 0.3f, 0.3f, 1.0f), "%s", find_results.error.c_str());
+            } else {
+                if (find_input[0] != '\0')
+                    ImGui::Text("%zu of %llu matches in %.2f ms", find_results.matches.size(), static_cast<unsigned long long>(find_results.total), find_results.query_ms);
+                ImGui::TextDisabled("Index: %llu names, %s in memory, built in %.1f s%s", static_cast<unsigned long long>(find_results.entries),
+                    formatBytes(find_results.memory_bytes).c_str(), find_results.build_seconds, find_results.building ? ", rescanning" : "");
+            }
+            ImGui::Separator();
+
+            if (ImGui::BeginChild("##find_results", ImVec2(0, 0))) {
+                ImGuiListClipper clipper;
+                clipper.Begin(static_cast<int>(find_results.matches.size()));
+                while (clipper.Step()) {
+                    for (int i = clipper.DisplayStart; i < clipper.DisplayEnd; ++i) {
+                        const NameMatch& match = find_results.matches[i];
+                        std::filesystem::path path(match.path);
+                        if (match.directory) ImGui::PushStyleColor(ImGuiCol_Text, ImVec4(0.2f, 0.6f, 1.0f, 1.0f));
+                        bool clicked = ImGui::Selectable((match.path + "##" + std::to_string(i)).c_str());
+                        if (match.directory) ImGui::PopStyleColor();
+                        // Show the match in the File Explorer: directories are opened, files their parent
+                        if (clicked) {
+                            list_directory(match.directory ? match.path : path.parent_path().string());
+                        }
+                        if (ImGui::BeginPopupContextItem()) {
+                            if (ImGui::MenuItem("Open", NULL, false, !match.directory && isTextFile(path.filename().string()))) {
+                                file_viewer.open(match.path);
+                                file_viewer_title = "File Viewer - " + path.filename().string();
+                                file_viewer_base = 0;
+                                show_file_viewer = true;
+                            }
+                            if (ImGui::MenuItem("Download")) {
+                                if (match.directory) {
+                                    NetworkMessage request;
+                                    request.fromFileTreeRequest(match.path);
+                                    network_manager.sendMessage(request);
+                                } else {
+                                    download_queue.enqueue(match.path, (std::filesystem::path(download_path) / path.filename()).string());
+                                }
+                            }
+                            ImGui::EndPopup();
+                        }
+                    }
+                }
+                clipper.End();
+            }
+            ImGui::EndChild();
             ImGui::End();
         }
 
@@ -862,5 +1817,6 @@ int main() {
 
     glfwDestroyWindow(window);
     glfwTerminate();
+    Logger::instance().shutdown();
     return 0;
 }
\ No newline at end of file
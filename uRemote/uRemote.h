@@ -9,6 +9,11 @@
 #include <nlohmann/json.hpp>
 #include <filesystem>
 #include <chrono>
+#include <set>
+#include <algorithm>
+#include <string_view>
+#include <bit>
+#include "logger.h"
 #define WIN32_LEAN_AND_MEAN
 #include <windows.h>
 
@@ -44,56 +49,232 @@ enum class SettingType {
 
 struct FileInfo {
     std::string name;
-    bool isDirectory;
-    size_t size;
-    std::string lastModified;
-    
+    bool isDirectory = false;
+    size_t size = 0;
+    int64_t modified = 0;   // seconds since the Unix epoch, 0 if unknown; formatted by the client
+
+    bool operator==(const FileInfo& other) const = default;
+};
+
+// One entry of a FileTable, by value; `name` points into the table and is only good while
+// the table is not changed
+struct FileRef {
+    std::string_view name;
+    bool isDirectory = false;
+    uint64_t size = 0;
+    int64_t modified = 0;
+
+    FileRef() = default;
+    FileRef(std::string_view name, bool isDirectory, uint64_t size, int64_t modified)
+        : name(name), isDirectory(isDirectory), size(size), modified(modified) {}
+    FileRef(const FileInfo& file) : name(file.name), isDirectory(file.isDirectory), size(file.size), modified(file.modified) {}
+
+    bool operator==(const FileRef& other) const = default;
+};
+
+// Directory entries stored by column: the names back to back in one string with the offset
+// each ends at, and one array each of flags, sizes and modification times. An entry costs
+// its name and 21 bytes, where a FileInfo costs 56 and a heap block for any name longer than
+// the string's inline buffer. On the wire each column is one BSON binary field, so there is
+// no per-entry object or field name to write, parse or hold as a json tree.
+class FileTable {
+public:
+    enum : uint8_t { DIRECTORY = 1 };
+
+    size_t size() const { return m_flags.size(); }
+    bool empty() const { return m_flags.empty(); }
+    std::string_view name(size_t i) const {
+        uint32_t begin = i ? m_ends[i - 1] : 0;
+        return std::string_view(m_names).substr(begin, m_ends[i] - begin);
+    }
+    bool isDirectory(size_t i) const { return m_flags[i] & DIRECTORY; }
+    FileRef operator[](size_t i) const { return FileRef(name(i), isDirectory(i), m_sizes[i], m_modified[i]); }
+
+    void reserve(size_t entries, size_t name_bytes) {
+        m_names.reserve(name_bytes);
+        m_ends.reserve(entries);
+        m_flags.reserve(entries);
+        m_sizes.reserve(entries);
+        m_modified.reserve(entries);
+    }
+    void push_back(const FileRef& file) {
+        m_names.append(file.name);
+        m_ends.push_back(static_cast<uint32_t>(m_names.size()));
+        m_flags.push_back(file.isDirectory ? DIRECTORY : 0);
+        m_sizes.push_back(file.size);
+        m_modified.push_back(file.modified);
+    }
+    // Appends entries [begin, end) of `other`, a column at a time
+    void append(const FileTable& other, size_t begin, size_t end) {
+        if (begin >= end) return;
+        uint32_t from = begin ? other.m_ends[begin - 1] : 0;
+        uint32_t base = static_cast<uint32_t>(m_names.size());
+        m_names.append(other.m_names, from, other.m_ends[end - 1] - from);
+        for (size_t i = begin; i < end; ++i) m_ends.push_back(base + other.m_ends[i] - from);
+        m_flags.insert(m_flags.end(), other.m_flags.begin() + begin, other.m_flags.begin() + end);
+        m_sizes.insert(m_sizes.end(), other.m_sizes.begin() + begin, other.m_sizes.begin() + end);
+        m_modified.insert(m_modified.end(), other.m_modified.begin() + begin, other.m_modified.begin() + end);
+    }
+    void clear() { *this = FileTable(); }
+    size_t memoryBytes() const {
+        return m_names.capacity() + m_ends.capacity() * sizeof(uint32_t) + m_flags.capacity() +
+            (m_sizes.capacity() + m_modified.capacity()) * sizeof(uint64_t);
+    }
+
+    bool operator==(const FileTable& other) const = default;
+
+    // Columns in host byte order, which is little-endian everywhere this is built
     json toJson() const {
+        static_assert(std::endian::native == std::endian::little, "FileTable columns are sent in host byte order");
         json j;
-        j["name"] = name;
-        j["isDirectory"] = isDirectory;
-        j["size"] = size;
-        j["lastModified"] = lastModified;
+        j["names"] = json::binary(std::vector<uint8_t>(m_names.begin(), m_names.end()));
+        j["ends"] = json::binary(bytesOf(m_ends));
+        j["flags"] = json::binary(std::vector<uint8_t>(m_flags));
+        j["sizes"] = json::binary(bytesOf(m_sizes));
+        j["modified"] = json::binary(bytesOf(m_modified));
         return j;
     }
-    
-    static FileInfo fromJson(const json& j) {
-        FileInfo fi;
-        fi.name = j.value("name", "");
-        fi.isDirectory = j.value("isDirectory", false);
-        fi.size = j.value("size", 0);
-        fi.lastModified = j.value("lastModified", "");
-        return fi;
+
+    // An empty table if the columns do not fit together
+    static FileTable fromJson(const json& j) {
+        FileTable table;
+        auto column = [&j](const char* key) -> const std::vector<uint8_t>* {
+            return j.contains(key) && j[key].is_binary() ? &j[key].get_binary() : nullptr;
+        };
+        const auto* names = column("names");
+        const auto* ends = column("ends");
+        const auto* flags = column("flags");
+        const auto* sizes = column("sizes");
+        const auto* modified = column("modified");
+        if (!names || !ends || !flags || !sizes || !modified) return table;
+        size_t n = flags->size();
+        if (ends->size() != n * sizeof(uint32_t) || sizes->size() != n * sizeof(uint64_t) || modified->size() != n * sizeof(int64_t))
+            return table;
+        table.m_names.assign(names->begin(), names->end());
+        table.m_ends.resize(n);
+        table.m_flags = *flags;
+        table.m_sizes.resize(n);
+        table.m_modified.resize(n);
+        if (n) {
+            std::memcpy(table.m_ends.data(), ends->data(), ends->size());
+            std::memcpy(table.m_sizes.data(), sizes->data(), sizes->size());
+            std::memcpy(table.m_modified.data(), modified->data(), modified->size());
+        }
+        uint32_t previous = 0;
+        for (uint32_t end : table.m_ends) {
+            if (end < previous || end > table.m_names.size()) return FileTable();
+            previous = end;
+        }
+        return table;
+    }
+
+private:
+    template<typename T>
+    static std::vector<uint8_t> bytesOf(const std::vector<T>& values) {
+        std::vector<uint8_t> bytes(values.size() * sizeof(T));
+        if (!bytes.empty()) std::memcpy(bytes.data(), values.data(), bytes.size());
+        return bytes;
     }
+
+    std::string m_names;
+    std::vector<uint32_t> m_ends;
+    std::vector<uint8_t> m_flags;
+    std::vector<uint64_t> m_sizes;
+    std::vector<int64_t> m_modified;
 };
 
 struct DirectoryListing {
     std::string path;
-    std::vector<FileInfo> files;
+    FileTable files;
+    uint64_t version = 0;   // server's tag for this content; a client holding it may ask for changes only
+    // Large listings come in pages: `files` holds entries [offset, offset + files.size()) of `total`
+    uint64_t offset = 0;
+    uint64_t total = 0;
+    bool prefetch = false;  // answers a prefetch request; kept, not shown
     
     json toJson() const {
         json j;
         j["path"] = path;
-        json filesJson = json::array();
-        for (const auto& file : files) {
-            filesJson.push_back(file.toJson());
-        }
-        j["files"] = filesJson;
+        j["version"] = version;
+        j["offset"] = offset;
+        j["total"] = total;
+        j["prefetch"] = prefetch;
+        j["files"] = files.toJson();
         return j;
     }
     
     static DirectoryListing fromJson(const json& j) {
         DirectoryListing dl;
         dl.path = j.value("path", "");
-        if (j.contains("files") && j["files"].is_array()) {
-            for (const auto& fileJson : j["files"]) {
-                dl.files.push_back(FileInfo::fromJson(fileJson));
-            }
-        }
+        dl.version = j.value("version", uint64_t(0));
+        dl.offset = j.value("offset", uint64_t(0));
+        dl.total = j.value("total", uint64_t(0));
+        dl.prefetch = j.value("prefetch", false);
+        if (j.contains("files")) dl.files = FileTable::fromJson(j["files"]);
         return dl;
     }
 };
 
+// Client to server: list a directory; `version` is that of the listing the client already has
+struct FilesystemRequest {
+    std::string path;
+    uint64_t version = 0;
+    // Asked ahead of need: answered after every other request, and only when small
+    bool prefetch = false;
+
+    json toJson() const {
+        json j;
+        j["path"] = path;
+        j["version"] = version;
+        j["prefetch"] = prefetch;
+        return j;
+    }
+
+    static FilesystemRequest fromJson(const json& j) {
+        FilesystemRequest r;
+        r.path = j.value("path", "");
+        r.version = j.value("version", uint64_t(0));
+        r.prefetch = j.value("prefetch", false);
+        return r;
+    }
+};
+
+// Server to client: how the listing at `base_version` became the one at `version`. Entries in
+// `changed` are new or replace the entry of the same name; no changes means "not modified".
+struct DirectoryDiff {
+    std::string path;
+    uint64_t base_version = 0;
+    uint64_t version = 0;
+    FileTable changed;
+    std::vector<std::string> removed;
+    bool prefetch = false;
+    bool pushed = false;    // sent unasked for a watched directory; base_version 0 means "ask again"
+
+    json toJson() const {
+        json j;
+        j["path"] = path;
+        j["base_version"] = base_version;
+        j["version"] = version;
+        j["prefetch"] = prefetch;
+        j["pushed"] = pushed;
+        j["changed"] = changed.toJson();
+        j["removed"] = removed;
+        return j;
+    }
+
+    static DirectoryDiff fromJson(const json& j) {
+        DirectoryDiff d;
+        d.path = j.value("path", "");
+        d.base_version = j.value("base_version", uint64_t(0));
+        d.version = j.value("version", uint64_t(0));
+        if (j.contains("changed")) d.changed = FileTable::fromJson(j["changed"]);
+        d.removed = j.value("removed", std::vector<std::string>());
+        d.prefetch = j.value("prefetch", false);
+        d.pushed = j.value("pushed", false);
+        return d;
+    }
+};
+
 struct FileResponse {
     std::string filename;
     std::vector<uint8_t> content;
@@ -113,6 +294,703 @@ struct FileResponse {
     }
 };
 
+struct FileDownloadRequest {
+    uint32_t id = 0;
+    std::string path;
+    uint64_t offset = 0;
+    uint64_t length = 0;       // 0 = to end of file
+    // Identity of the partial copy being resumed; the server restarts from 0 when they differ
+    uint64_t expect_size = 0;
+    int64_t expect_mtime = 0;
+    // Delta mode: block signatures of the client's existing copy (see delta.h); empty for a full transfer
+    uint32_t delta_block_size = 0;
+    uint64_t delta_basis_size = 0;
+    std::vector<uint8_t> delta_signatures;
+    // Streaming integrity check of the transferred bytes: "xxh3", "sha256" or empty for none
+    std::string hash_algorithm;
+
+    json toJson() const {
+        json j;
+        j["id"] = id;
+        j["path"] = path;
+        j["offset"] = offset;
+        j["length"] = length;
+        j["expect_size"] = expect_size;
+        j["expect_mtime"] = expect_mtime;
+        j["hash_algorithm"] = hash_algorithm;
+        if (!delta_signatures.empty()) {
+            j["delta_block_size"] = delta_block_size;
+            j["delta_basis_size"] = delta_basis_size;
+            j["delta_signatures"] = json::binary(delta_signatures);
+        }
+        return j;
+    }
+
+    static FileDownloadRequest fromJson(const json& j) {
+        FileDownloadRequest req;
+        req.id = j.value("id", 0u);
+        req.path = j.value("path", "");
+        req.offset = j.value("offset", uint64_t(0));
+        req.length = j.value("length", uint64_t(0));
+        req.expect_size = j.value("expect_size", uint64_t(0));
+        req.expect_mtime = j.value("expect_mtime", int64_t(0));
+        req.hash_algorithm = j.value("hash_algorithm", "");
+        if (j.contains("delta_signatures") && j["delta_signatures"].is_binary()) {
+            req.delta_block_size = j.value("delta_block_size", 0u);
+            req.delta_basis_size = j.value("delta_basis_size", uint64_t(0));
+            req.delta_signatures = j["delta_signatures"].get_binary();
+        }
+        return req;
+    }
+};
+
+// Opens a streamed transfer; followed by chunk frames and an end frame carrying the same id
+struct FileTransferHeader {
+    uint32_t id = 0;
+    std::string filename;
+    uint64_t size = 0;         // size of the whole file
+    int64_t mtime = 0;
+    uint64_t offset = 0;       // first byte that will be sent
+    uint64_t length = 0;       // bytes that will be sent
+
+    json toJson() const {
+        json j;
+        j["id"] = id;
+        j["filename"] = filename;
+        j["size"] = size;
+        j["mtime"] = mtime;
+        j["offset"] = offset;
+        j["length"] = length;
+        return j;
+    }
+
+    static FileTransferHeader fromJson(const json& j) {
+        FileTransferHeader h;
+        h.id = j.value("id", 0u);
+        h.filename = j.value("filename", "");
+        h.size = j.value("size", uint64_t(0));
+        h.mtime = j.value("mtime", int64_t(0));
+        h.offset = j.value("offset", uint64_t(0));
+        h.length = j.value("length", h.size);
+        return h;
+    }
+};
+
+struct FileTransferEnd {
+    uint32_t id = 0;
+    bool success = false;
+    uint64_t bytes = 0;
+    std::string error;
+    // Digest of the bytes sent, in file order, when the request asked for one
+    std::string hash;
+
+    json toJson() const {
+        json j;
+        j["id"] = id;
+        j["success"] = success;
+        j["bytes"] = bytes;
+        j["error"] = error;
+        j["hash"] = hash;
+        return j;
+    }
+
+    static FileTransferEnd fromJson(const json& j) {
+        FileTransferEnd e;
+        e.id = j.value("id", 0u);
+        e.success = j.value("success", false);
+        e.bytes = j.value("bytes", uint64_t(0));
+        e.error = j.value("error", "");
+        e.hash = j.value("hash", "");
+        return e;
+    }
+};
+
+// Server's answer to a hash-first download: content hash (SHA-256 hex) and identity of the file
+struct FileHashInfo {
+    uint32_t id = 0;
+    std::string path;
+    uint64_t size = 0;
+    int64_t mtime = 0;
+    std::string hash;
+    std::string error;
+
+    json toJson() const {
+        json j;
+        j["id"] = id;
+        j["path"] = path;
+        j["size"] = size;
+        j["mtime"] = mtime;
+        j["hash"] = hash;
+        j["error"] = error;
+        return j;
+    }
+
+    static FileHashInfo fromJson(const json& j) {
+        FileHashInfo info;
+        info.id = j.value("id", 0u);
+        info.path = j.value("path", "");
+        info.size = j.value("size", uint64_t(0));
+        info.mtime = j.value("mtime", int64_t(0));
+        info.hash = j.value("hash", "");
+        info.error = j.value("error", "");
+        return info;
+    }
+};
+
+// A window of lines of a remote text file, for the paged viewer. `id` is the viewer session.
+struct FileLinesRequest {
+    uint32_t id = 0;
+    std::string path;
+    uint64_t first_line = 0;
+    uint32_t count = 0;
+
+    json toJson() const {
+        json j;
+        j["id"] = id;
+        j["path"] = path;
+        j["first_line"] = first_line;
+        j["count"] = count;
+        return j;
+    }
+
+    static FileLinesRequest fromJson(const json& j) {
+        FileLinesRequest request;
+        request.id = j.value("id", 0u);
+        request.path = j.value("path", "");
+        request.first_line = j.value("first_line", uint64_t(0));
+        request.count = j.value("count", 0u);
+        return request;
+    }
+};
+
+struct FileLines {
+    uint32_t id = 0;
+    std::string path;
+    uint64_t first_line = 0;
+    // The lines back to back without their terminators; line i ends at ends[i]
+    std::vector<uint8_t> text;
+    std::vector<uint32_t> ends;
+    // How far the server's line index has got: `lines` counts the lines in the first
+    // `indexed` of `size` bytes, and is the exact total once `complete`
+    uint64_t lines = 0;
+    uint64_t indexed = 0;
+    uint64_t size = 0;
+    bool complete = false;
+    std::string error;
+
+    json toJson() const {
+        json j;
+        j["id"] = id;
+        j["path"] = path;
+        j["first_line"] = first_line;
+        j["text"] = json::binary(text);
+        j["ends"] = ends;
+        j["lines"] = lines;
+        j["indexed"] = indexed;
+        j["size"] = size;
+        j["complete"] = complete;
+        j["error"] = error;
+        return j;
+    }
+
+    static FileLines fromJson(const json& j) {
+        FileLines lines;
+        lines.id = j.value("id", 0u);
+        lines.path = j.value("path", "");
+        lines.first_line = j.value("first_line", uint64_t(0));
+        if (j.contains("text")) lines.text = j["text"].get_binary();
+        lines.ends = j.value("ends", std::vector<uint32_t>());
+        lines.lines = j.value("lines", uint64_t(0));
+        lines.indexed = j.value("indexed", uint64_t(0));
+        lines.size = j.value("size", uint64_t(0));
+        lines.complete = j.value("complete", false);
+        lines.error = j.value("error", "");
+        return lines;
+    }
+};
+
+// Content search below a remote directory
+struct SearchRequest {
+    uint32_t id = 0;
+    std::string root;
+    std::string pattern;
+    bool regex = false;
+    bool case_sensitive = true;
+    // File name globs separated by ';' or ','; a leading '!' excludes files and directories
+    std::string globs;
+    uint64_t max_file_size = 0;     // 0 = no limit
+    uint32_t context = 0;           // lines shown before and after each match
+
+    json toJson() const {
+        json j;
+        j["id"] = id;
+        j["root"] = root;
+        j["pattern"] = pattern;
+        j["regex"] = regex;
+        j["case_sensitive"] = case_sensitive;
+        j["globs"] = globs;
+        j["max_file_size"] = max_file_size;
+        j["context"] = context;
+        return j;
+    }
+
+    static SearchRequest fromJson(const json& j) {
+        SearchRequest request;
+        request.id = j.value("id", 0u);
+        request.root = j.value("root", "");
+        request.pattern = j.value("pattern", "");
+        request.regex = j.value("regex", false);
+        request.case_sensitive = j.value("case_sensitive", true);
+        request.globs = j.value("globs", "");
+        request.max_file_size = j.value("max_file_size", uint64_t(0));
+        request.context = j.value("context", 0u);
+        return request;
+    }
+};
+
+struct SearchMatch {
+    std::string path;
+    uint64_t line = 0;      // 1-based
+    std::string text;
+    std::vector<std::string> before;
+    std::vector<std::string> after;
+
+    json toJson() const {
+        json j;
+        j["path"] = path;
+        j["line"] = line;
+        j["text"] = text;
+        j["before"] = before;
+        j["after"] = after;
+        return j;
+    }
+
+    static SearchMatch fromJson(const json& j) {
+        SearchMatch match;
+        match.path = j.value("path", "");
+        match.line = j.value("line", uint64_t(0));
+        match.text = j.value("text", "");
+        match.before = j.value("before", std::vector<std::string>());
+        match.after = j.value("after", std::vector<std::string>());
+        return match;
+    }
+};
+
+// One batch of a search's streamed results; the last one has `done` set
+struct SearchResults {
+    uint32_t id = 0;
+    std::vector<SearchMatch> matches;
+    uint64_t files_scanned = 0;
+    uint64_t files_skipped = 0;     // binary or over the size limit
+    uint64_t bytes_scanned = 0;
+    bool done = false;
+    bool truncated = false;         // stopped at the match limit
+    double seconds = 0;
+    std::string error;
+
+    json toJson() const {
+        json j;
+        j["id"] = id;
+        j["matches"] = json::array();
+        for (const auto& match : matches) j["matches"].push_back(match.toJson());
+        j["files_scanned"] = files_scanned;
+        j["files_skipped"] = files_skipped;
+        j["bytes_scanned"] = bytes_scanned;
+        j["done"] = done;
+        j["truncated"] = truncated;
+        j["seconds"] = seconds;
+        j["error"] = error;
+        return j;
+    }
+
+    static SearchResults fromJson(const json& j) {
+        SearchResults results;
+        results.id = j.value("id", 0u);
+        for (const auto& match : j.value("matches", json::array())) results.matches.push_back(SearchMatch::fromJson(match));
+        results.files_scanned = j.value("files_scanned", uint64_t(0));
+        results.files_skipped = j.value("files_skipped", uint64_t(0));
+        results.bytes_scanned = j.value("bytes_scanned", uint64_t(0));
+        results.done = j.value("done", false);
+        results.truncated = j.value("truncated", false);
+        results.seconds = j.value("seconds", 0.0);
+        results.error = j.value("error", "");
+        return results;
+    }
+};
+
+// Find-by-name query against the server's filename index
+struct NameQuery {
+    uint32_t id = 0;
+    std::string query;
+    bool fuzzy = false;     // characters in order with gaps allowed, instead of a substring
+    uint32_t limit = 0;
+
+    json toJson() const {
+        json j;
+        j["id"] = id;
+        j["query"] = query;
+        j["fuzzy"] = fuzzy;
+        j["limit"] = limit;
+        return j;
+    }
+
+    static NameQuery fromJson(const json& j) {
+        NameQuery q;
+        q.id = j.value("id", 0u);
+        q.query = j.value("query", "");
+        q.fuzzy = j.value("fuzzy", false);
+        q.limit = j.value("limit", 0u);
+        return q;
+    }
+};
+
+struct NameMatch {
+    std::string path;
+    bool directory = false;
+
+    json toJson() const {
+        json j;
+        j["path"] = path;
+        j["directory"] = directory;
+        return j;
+    }
+
+    static NameMatch fromJson(const json& j) {
+        NameMatch m;
+        m.path = j.value("path", "");
+        m.directory = j.value("directory", false);
+        return m;
+    }
+};
+
+// Best matches for a NameQuery, with the state of the index that answered it
+struct NameResults {
+    uint32_t id = 0;
+    std::vector<NameMatch> matches;
+    uint64_t total = 0;             // matches found, of which the best `matches` were sent
+    double query_ms = 0;
+    uint64_t entries = 0;           // names in the index
+    uint64_t memory_bytes = 0;
+    double build_seconds = 0;       // time the last full scan of the roots took
+    bool building = false;          // a scan is in progress; results may be stale
+    std::vector<std::string> roots;
+    std::string error;
+
+    json toJson() const {
+        json j;
+        j["id"] = id;
+        j["matches"] = json::array();
+        for (const auto& match : matches) j["matches"].push_back(match.toJson());
+        j["total"] = total;
+        j["query_ms"] = query_ms;
+        j["entries"] = entries;
+        j["memory_bytes"] = memory_bytes;
+        j["build_seconds"] = build_seconds;
+        j["building"] = building;
+        j["roots"] = roots;
+        j["error"] = error;
+        return j;
+    }
+
+    static NameResults fromJson(const json& j) {
+        NameResults results;
+        results.id = j.value("id", 0u);
+        for (const auto& match : j.value("matches", json::array())) results.matches.push_back(NameMatch::fromJson(match));
+        results.total = j.value("total", uint64_t(0));
+        results.query_ms = j.value("query_ms", 0.0);
+        results.entries = j.value("entries", uint64_t(0));
+        results.memory_bytes = j.value("memory_bytes", uint64_t(0));
+        results.build_seconds = j.value("build_seconds", 0.0);
+        results.building = j.value("building", false);
+        results.roots = j.value("roots", std::vector<std::string>());
+        results.error = j.value("error", "");
+        return results;
+    }
+};
+
+// Disk usage of everything below a remote directory
+struct DiskUsageRequest {
+    uint32_t id = 0;
+    std::string root;
+
+    json toJson() const {
+        json j;
+        j["id"] = id;
+        j["root"] = root;
+        return j;
+    }
+
+    static DiskUsageRequest fromJson(const json& j) {
+        DiskUsageRequest request;
+        request.id = j.value("id", 0u);
+        request.root = j.value("root", "");
+        return request;
+    }
+};
+
+// Totals for one subdirectory of the root, everything below it included
+struct DiskUsageEntry {
+    std::string name;
+    uint64_t bytes = 0;         // file sizes
+    uint64_t allocated = 0;     // space taken on disk
+    uint64_t files = 0;
+    uint64_t directories = 0;
+
+    json toJson() const {
+        json j;
+        j["name"] = name;
+        j["bytes"] = bytes;
+        j["allocated"] = allocated;
+        j["files"] = files;
+        j["directories"] = directories;
+        return j;
+    }
+
+    static DiskUsageEntry fromJson(const json& j) {
+        DiskUsageEntry entry;
+        entry.name = j.value("name", "");
+        entry.bytes = j.value("bytes", uint64_t(0));
+        entry.allocated = j.value("allocated", uint64_t(0));
+        entry.files = j.value("files", uint64_t(0));
+        entry.directories = j.value("directories", uint64_t(0));
+        return entry;
+    }
+};
+
+// One update of a disk usage walk: the subdirectories whose totals changed since the last
+// one, and the totals of the whole root so far; the last one has `done` set
+struct DiskUsageResults {
+    uint32_t id = 0;
+    std::string root;
+    std::vector<DiskUsageEntry> entries;
+    DiskUsageEntry total;
+    uint64_t unreadable = 0;        // directories that could not be listed
+    bool done = false;
+    bool cancelled = false;
+    double seconds = 0;
+    std::string error;
+
+    json toJson() const {
+        json j;
+        j["id"] = id;
+        j["root"] = root;
+        j["entries"] = json::array();
+        for (const auto& entry : entries) j["entries"].push_back(entry.toJson());
+        j["total"] = total.toJson();
+        j["unreadable"] = unreadable;
+        j["done"] = done;
+        j["cancelled"] = cancelled;
+        j["seconds"] = seconds;
+        j["error"] = error;
+        return j;
+    }
+
+    static DiskUsageResults fromJson(const json& j) {
+        DiskUsageResults results;
+        results.id = j.value("id", 0u);
+        results.root = j.value("root", "");
+        for (const auto& entry : j.value("entries", json::array())) results.entries.push_back(DiskUsageEntry::fromJson(entry));
+        if (j.contains("total")) results.total = DiskUsageEntry::fromJson(j["total"]);
+        results.unreadable = j.value("unreadable", uint64_t(0));
+        results.done = j.value("done", false);
+        results.cancelled = j.value("cancelled", false);
+        results.seconds = j.value("seconds", 0.0);
+        results.error = j.value("error", "");
+        return results;
+    }
+};
+
+// One character cell of a terminal screen; colors index xterm's 256-color palette
+struct TerminalCell {
+    enum : uint8_t { BOLD = 1, UNDERLINE = 2, REVERSE = 4, ITALIC = 8, DEFAULT_FG = 16, DEFAULT_BG = 32 };
+    uint32_t ch = ' ';
+    uint8_t fg = 7;
+    uint8_t bg = 0;
+    uint8_t attrs = DEFAULT_FG | DEFAULT_BG;
+
+    bool operator==(const TerminalCell&) const = default;
+};
+
+// Cells of one row that changed, from `column` on
+struct TerminalSpan {
+    uint16_t row = 0;
+    uint16_t column = 0;
+    std::vector<TerminalCell> cells;
+};
+
+// Server to client: the cells of terminal session `session` that differ between screen state
+// `base`, which the client holds, and `state`; base 0, or a size other than the client's,
+// starts from a blank screen. The spans travel as one BSON binary field: row, column and cell
+// count as 16-bit values, then 7 bytes per cell.
+struct TerminalUpdate {
+    uint32_t session = 0;
+    uint64_t base = 0;
+    uint64_t state = 0;
+    uint16_t columns = 0;
+    uint16_t rows = 0;
+    uint16_t cursor_row = 0;
+    uint16_t cursor_column = 0;
+    bool cursor_visible = true;
+    std::vector<TerminalSpan> spans;
+
+    json toJson() const {
+        static_assert(std::endian::native == std::endian::little, "terminal spans are sent in host byte order");
+        std::vector<uint8_t> bytes;
+        auto put = [&bytes](const auto& value) {
+            const auto* p = reinterpret_cast<const uint8_t*>(&value);
+            bytes.insert(bytes.end(), p, p + sizeof(value));
+        };
+        for (const auto& span : spans) {
+            put(span.row);
+            put(span.column);
+            put(static_cast<uint16_t>(span.cells.size()));
+            for (const auto& cell : span.cells) {
+                put(cell.ch);
+                bytes.push_back(cell.fg);
+                bytes.push_back(cell.bg);
+                bytes.push_back(cell.attrs);
+            }
+        }
+        json j;
+        j["session"] = session;
+        j["base"] = base;
+        j["state"] = state;
+        j["columns"] = columns;
+        j["rows"] = rows;
+        j["cursor_row"] = cursor_row;
+        j["cursor_column"] = cursor_column;
+        j["cursor_visible"] = cursor_visible;
+        j["spans"] = json::binary(std::move(bytes));
+        return j;
+    }
+
+    // A malformed update comes back with state 0, which the client does not apply
+    static TerminalUpdate fromJson(const json& j) {
+        TerminalUpdate u;
+        u.session = j.value("session", 0u);
+        u.base = j.value("base", uint64_t(0));
+        u.state = j.value("state", uint64_t(0));
+        u.columns = j.value("columns", uint16_t(0));
+        u.rows = j.value("rows", uint16_t(0));
+        u.cursor_row = j.value("cursor_row", uint16_t(0));
+        u.cursor_column = j.value("cursor_column", uint16_t(0));
+        u.cursor_visible = j.value("cursor_visible", true);
+        if (!j.contains("spans") || !j["spans"].is_binary()) return u;
+        const auto& bytes = j["spans"].get_binary();
+        size_t at = 0;
+        auto get = [&bytes, &at](auto& value) {
+            if (bytes.size() - at < sizeof(value)) return false;
+            std::memcpy(&value, bytes.data() + at, sizeof(value));
+            at += sizeof(value);
+            return true;
+        };
+        while (at < bytes.size()) {
+            TerminalSpan span;
+            uint16_t count = 0;
+            if (!get(span.row) || !get(span.column) || !get(count) || bytes.size() - at < size_t(count) * 7) {
+                u.state = 0;
+                u.spans.clear();
+                return u;
+            }
+            span.cells.resize(count);
+            for (auto& cell : span.cells) {
+                get(cell.ch);
+                cell.fg = bytes[at++];
+                cell.bg = bytes[at++];
+                cell.attrs = bytes[at++];
+            }
+            u.spans.push_back(std::move(span));
+        }
+        return u;
+    }
+};
+
+// Client to server: opens terminal session `session` (numbered by the client) at the given
+// size, resizes, interrupts or closes it. Server to client: CLOSE once its shell has exited or
+// could not be started, BUSY and IDLE around commands where the shell reports them (cmd.exe).
+struct TerminalControl {
+    enum Action : uint8_t { OPEN, RESIZE, INTERRUPT, CLOSE, BUSY, IDLE };
+    uint32_t session = 0;
+    uint8_t action = OPEN;
+    uint16_t columns = 0;
+    uint16_t rows = 0;
+
+    json toJson() const {
+        json j;
+        j["session"] = session;
+        j["action"] = action;
+        j["columns"] = columns;
+        j["rows"] = rows;
+        return j;
+    }
+
+    static TerminalControl fromJson(const json& j) {
+        TerminalControl c;
+        c.session = j.value("session", 0u);
+        c.action = j.value("action", uint8_t(CLOSE));
+        c.columns = j.value("columns", uint16_t(0));
+        c.rows = j.value("rows", uint16_t(0));
+        return c;
+    }
+};
+
+// Server to client during an upload: bytes written so far; `done` closes the transfer
+struct FileUploadAck {
+    uint32_t id = 0;
+    uint64_t bytes = 0;
+    bool done = false;
+    bool success = false;
+    std::string error;
+
+    json toJson() const {
+        json j;
+        j["id"] = id;
+        j["bytes"] = bytes;
+        j["done"] = done;
+        j["success"] = success;
+        j["error"] = error;
+        return j;
+    }
+
+    static FileUploadAck fromJson(const json& j) {
+        FileUploadAck a;
+        a.id = j.value("id", 0u);
+        a.bytes = j.value("bytes", uint64_t(0));
+        a.done = j.value("done", false);
+        a.success = j.value("success", false);
+        a.error = j.value("error", "");
+        return a;
+    }
+};
+
+// Every regular file below a directory, for downloading whole folders
+struct FileTree {
+    std::string path;
+    std::vector<std::pair<std::string, uint64_t>> files; // path relative to `path`, size
+
+    json toJson() const {
+        json j;
+        j["path"] = path;
+        json filesJson = json::array();
+        for (const auto& [relative, size] : files) {
+            filesJson.push_back({ {"path", relative}, {"size", size} });
+        }
+        j["files"] = filesJson;
+        return j;
+    }
+
+    static FileTree fromJson(const json& j) {
+        FileTree tree;
+        tree.path = j.value("path", "");
+        if (j.contains("files") && j["files"].is_array()) {
+            for (const auto& fileJson : j["files"]) {
+                tree.files.emplace_back(fileJson.value("path", ""), fileJson.value("size", uint64_t(0)));
+            }
+        }
+        return tree;
+    }
+};
+
 struct ScreenshotResponse {
     int width;
     int height;
@@ -274,83 +1152,40 @@ static inline void check_conn_input(ConnInputForm* input_form, char* conn_err) {
 	}
 }
 
-static std::pair<bool, DirectoryListing> getDirectoryListing(const std::string& path) {
-    DirectoryListing listing;
-    listing.path = path;
-    
-    try {
-        std::filesystem::path dirPath(path.empty() ? "." : path);
-        
-        // If path is empty, use current directory
-        if (path.empty()) {
-            dirPath = std::filesystem::current_path();
-            listing.path = dirPath.string();
-        }
-        
-        // Check if directory exists
-        if (!std::filesystem::exists(dirPath)) {
-            return {false, listing}; // Path does not exist
-        }
-        if (!std::filesystem::is_directory(dirPath)) {
-            return {false, listing}; // Not a directory
-        }
-        
-        for (const auto& entry : std::filesystem::directory_iterator(dirPath)) {
-            FileInfo fileInfo;
-            fileInfo.name = entry.path().filename().string();
-            fileInfo.isDirectory = entry.is_directory();
-            
-            if (!fileInfo.isDirectory) {
-                try {
-                    fileInfo.size = entry.file_size();
-                } catch (...) {
-                    fileInfo.size = 0;
-                }
-            } else {
-                fileInfo.size = 0;
-            }
-            
-            try {
-                auto lastWriteTime = entry.last_write_time();
-                auto timeT = std::chrono::system_clock::to_time_t(std::chrono::clock_cast<std::chrono::system_clock>(lastWriteTime));
-                char timeStr[20];
-                std::strftime(timeStr, sizeof(timeStr), "%Y-%m-%d %H:%M:%S", std::localtime(&timeT));
-                fileInfo.lastModified = timeStr;
-            } catch (...) {
-                fileInfo.lastModified = "Unknown";
-            }
-            
-            listing.files.push_back(fileInfo);
-        }
-        
-        // Sort: directories first, then files alphabetically
-        std::sort(listing.files.begin(), listing.files.end(), 
-            [](const FileInfo& a, const FileInfo& b) {
-                if (a.isDirectory != b.isDirectory) {
-                    return a.isDirectory > b.isDirectory;
-                }
-                return a.name < b.name;
-            });
-            
-    } catch (const std::exception& e) {
-        // Return empty listing on error
-        std::cerr << "Error listing directory: " << e.what() << std::endl;
-        return {false, listing};
+static std::pair<bool, FileTree> getFileTree(const std::string& path) {
+    FileTree tree;
+    tree.path = path;
+    std::error_code ec;
+    std::filesystem::path root(path);
+    if (!std::filesystem::is_directory(root, ec)) {
+        return {false, tree};
     }
-    
-    return {true, listing};
+    auto options = std::filesystem::directory_options::skip_permission_denied;
+    for (auto it = std::filesystem::recursive_directory_iterator(root, options, ec); !ec && it != std::filesystem::recursive_directory_iterator(); it.increment(ec)) {
+        std::error_code entry_ec;
+        if (!it->is_regular_file(entry_ec)) continue;
+        uint64_t size = it->file_size(entry_ec);
+        tree.files.emplace_back(std::filesystem::relative(it->path(), root, entry_ec).generic_string(), entry_ec ? 0 : size);
+    }
+    return {true, tree};
 }
 
 static std::pair<bool, std::vector<uint8_t>> readFileContent(const std::string& path) {
     try {
-        std::ifstream file(path, std::ios::binary);
+        std::ifstream file(path, std::ios::binary | std::ios::ate);
         if (!file.is_open()) {
             return {false, {}};
         }
-        std::vector<uint8_t> content((std::istreambuf_iterator<char>(file)), std::istreambuf_iterator<char>());
+        // Size the buffer once and read it in a single call instead of byte by byte
+        std::streamsize size = file.tellg();
+        file.seekg(0, std::ios::beg);
+        std::vector<uint8_t> content(size > 0 ? static_cast<size_t>(size) : 0);
+        if (size > 0 && !file.read(reinterpret_cast<char*>(content.data()), size)) {
+            return {false, {}};
+        }
         return {true, content};
     } catch (const std::exception& e) {
-        std::cerr << "Error reading file: " << e.what() << std::endl;
+        LOG_ERROR("Error reading file: {}", e.what());
         return {false, {}};
     }
 }
@@ -365,6 +1200,44 @@ static bool isTextFile(const std::string& filename) {
     return false;
 }
 
+static std::string formatBytes(uint64_t bytes) {
+    static const char* units[] = {"B", "KB", "MB", "GB", "TB"};
+    double value = static_cast<double>(bytes);
+    int unit = 0;
+    while (value >= 1024.0 && unit < 4) {
+        value /= 1024.0;
+        ++unit;
+    }
+    char buffer[32];
+    snprintf(buffer, sizeof(buffer), unit ? "%.1f %s" : "%.0f %s", value, units[unit]);
+    return buffer;
+}
+
+static std::string formatDuration(double seconds) {
+    uint64_t total = static_cast<uint64_t>(seconds);
+    char buffer[32];
+    if (total >= 3600)
+        snprintf(buffer, sizeof(buffer), "%lluh %02llum", static_cast<unsigned long long>(total / 3600), static_cast<unsigned long long>(total / 60 % 60));
+    else
+        snprintf(buffer, sizeof(buffer), "%llum %02llus", static_cast<unsigned long long>(total / 60), static_cast<unsigned long long>(total % 60));
+    return buffer;
+}
+
+// Local date and time of a Unix timestamp, as "YYYY-MM-DD HH:MM:SS"
+static std::string formatTime(int64_t seconds) {
+    if (seconds == 0) return "Unknown";
+    std::time_t time = static_cast<std::time_t>(seconds);
+    std::tm local{};
+#ifdef _WIN32
+    localtime_s(&local, &time);
+#else
+    localtime_r(&time, &local);
+#endif
+    char buffer[20];
+    std::strftime(buffer, sizeof(buffer), "%Y-%m-%d %H:%M:%S", &local);
+    return buffer;
+}
+
 static std::pair<bool, ScreenshotResponse> captureScreenshot() {
     // Get the device context of the screen
     HDC hScreenDC = GetDC(NULL);
@@ -0,0 +1,340 @@
+#include "usage.h"
+#include "logger.h"
+#include <random>
+#include <set>
+#ifdef __linux__
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <dirent.h>
+#endif
+
+// How often the totals so far are sent while a walk runs
+constexpr auto DISK_USAGE_FLUSH_INTERVAL = std::chrono::milliseconds(250);
+
+struct DiskUsageService::Walk {
+    static constexpr uint32_t ROOT = UINT32_MAX;   // slot of files directly in the root
+
+    struct Task {
+        std::filesystem::path path;
+        uint32_t slot = ROOT;
+    };
+    struct Queue {
+        std::mutex mutex;
+        std::deque<Task> tasks;
+    };
+    struct Totals {
+        std::atomic<uint64_t> bytes{ 0 };
+        std::atomic<uint64_t> allocated{ 0 };
+        std::atomic<uint64_t> files{ 0 };
+        std::atomic<uint64_t> directories{ 0 };
+
+        void add(const DiskUsageEntry& counted) {
+            bytes.fetch_add(counted.bytes, std::memory_order_relaxed);
+            allocated.fetch_add(counted.allocated, std::memory_order_relaxed);
+            files.fetch_add(counted.files, std::memory_order_relaxed);
+            directories.fetch_add(counted.directories, std::memory_order_relaxed);
+        }
+        void read(DiskUsageEntry& entry) const {
+            entry.bytes = bytes.load(std::memory_order_relaxed);
+            entry.allocated = allocated.load(std::memory_order_relaxed);
+            entry.files = files.load(std::memory_order_relaxed);
+            entry.directories = directories.load(std::memory_order_relaxed);
+        }
+    };
+
+    std::atomic<bool>* abort = nullptr;
+    uint64_t device = 0;
+
+    // One slot per subdirectory of the root, fixed before the pool starts
+    std::vector<std::string> names;
+    std::unique_ptr<Totals[]> totals;
+    Totals root_files;
+    std::atomic<uint64_t> unreadable{ 0 };
+
+    std::vector<std::unique_ptr<Queue>> queues;
+    std::atomic<size_t> outstanding{ 0 };
+    // Wakes the thread streaming the totals when the last directory is done
+    std::mutex finished_mutex;
+    std::condition_variable finished;
+
+    // Files with more than one link seen so far, by device and inode
+    std::mutex links_mutex;
+    std::set<std::pair<uint64_t, uint64_t>> links;
+
+    bool stopped() const { return abort->load(std::memory_order_relaxed); }
+
+    Totals& slot(uint32_t index) { return index == ROOT ? root_files : totals[index]; }
+
+    void push(size_t worker, Task&& task) {
+        ++outstanding;
+        Queue& queue = *queues[worker];
+        std::lock_guard<std::mutex> lock(queue.mutex);
+        queue.tasks.push_back(std::move(task));
+    }
+
+    // Newest task of our own, else the oldest of someone else's
+    bool pop(size_t worker, std::mt19937& random, Task& task) {
+        {
+            Queue& own = *queues[worker];
+            std::lock_guard<std::mutex> lock(own.mutex);
+            if (!own.tasks.empty()) {
+                task = std::move(own.tasks.back());
+                own.tasks.pop_back();
+                return true;
+            }
+        }
+        size_t start = random() % queues.size();
+        for (size_t i = 0; i < queues.size(); ++i) {
+            Queue& victim = *queues[(start + i) % queues.size()];
+            std::lock_guard<std::mutex> lock(victim.mutex);
+            if (!victim.tasks.empty()) {
+                task = std::move(victim.tasks.front());
+                victim.tasks.pop_front();
+                return true;
+            }
+        }
+        return false;
+    }
+
+    bool firstLink(uint64_t dev, uint64_t ino) {
+        std::lock_guard<std::mutex> lock(links_mutex);
+        return links.emplace(dev, ino).second;
+    }
+
+    // Counts the files of `task`'s directory into its slot and hands back its subdirectories.
+    // The root's own subdirectories each start a slot of their own.
+    void visit(size_t worker, const Task& task, bool root) {
+        DiskUsageEntry counted;
+#ifdef __linux__
+        // The root may be reached through a symlink; nothing below it is
+        int fd = open(task.path.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC | (root ? 0 : O_NOFOLLOW));
+        DIR* dir = fd < 0 ? nullptr : fdopendir(fd);
+        if (!dir) {
+            if (fd >= 0) close(fd);
+            ++unreadable;
+            return;
+        }
+        // A directory's own blocks count too, as du counts them
+        struct stat self;
+        if (fstat(fd, &self) == 0) {
+            counted.bytes += self.st_size;
+            counted.allocated += static_cast<uint64_t>(self.st_blocks) * 512;
+        }
+        while (dirent* entry = readdir(dir)) {
+            if (stopped()) break;
+            const char* name = entry->d_name;
+            if (name[0] == '.' && (name[1] == '\0' || (name[1] == '.' && name[2] == '\0'))) continue;
+            struct stat st;
+            if (fstatat(fd, name, &st, AT_SYMLINK_NOFOLLOW) != 0) continue;
+            if (S_ISDIR(st.st_mode)) {
+                // Other filesystems mounted below the root are not part of its usage
+                if (static_cast<uint64_t>(st.st_dev) != device) continue;
+                if (root) {
+                    names.push_back(name);
+                    continue;
+                }
+                ++counted.directories;
+                push(worker, { task.path / name, task.slot });
+                continue;
+            }
+            if (st.st_nlink > 1 && !firstLink(st.st_dev, st.st_ino)) continue;
+            ++counted.files;
+            counted.bytes += st.st_size;
+            counted.allocated += static_cast<uint64_t>(st.st_blocks) * 512;
+        }
+        closedir(dir);
+#else
+        std::error_code ec;
+        auto options = std::filesystem::directory_options::skip_permission_denied;
+        auto it = std::filesystem::directory_iterator(task.path, options, ec);
+        if (ec) {
+            ++unreadable;
+            return;
+        }
+        for (; !ec && it != std::filesystem::directory_iterator(); it.increment(ec)) {
+            if (stopped()) break;
+            std::error_code entry_ec;
+            auto status = it->symlink_status(entry_ec);
+            if (entry_ec) continue;
+            if (std::filesystem::is_directory(status)) {
+                if (root) {
+                    names.push_back(it->path().filename().string());
+                    continue;
+                }
+                ++counted.directories;
+                push(worker, { it->path(), task.slot });
+                continue;
+            }
+            ++counted.files;
+            if (std::filesystem::is_regular_file(status)) {
+                uint64_t size = it->file_size(entry_ec);
+                if (!entry_ec) {
+                    counted.bytes += size;
+                    counted.allocated += size;
+                }
+            }
+        }
+#endif
+        slot(task.slot).add(counted);
+    }
+
+    void work(size_t worker) {
+        std::mt19937 random(static_cast<unsigned>(worker * 7919 + 1));
+        Task task;
+        while (outstanding > 0 && !stopped()) {
+            if (!pop(worker, random, task)) {
+                // Others are still reading directories that may hold work for us
+                std::this_thread::sleep_for(std::chrono::microseconds(200));
+                continue;
+            }
+            visit(worker, task, false);
+            if (--outstanding == 0) {
+                std::lock_guard<std::mutex> lock(finished_mutex);
+                finished.notify_all();
+            }
+        }
+    }
+};
+
+DiskUsageService::DiskUsageService(SendFunction send) : m_send(std::move(send)) {
+}
+
+DiskUsageService::~DiskUsageService() {
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        m_stop = true;
+        m_jobs.clear();
+    }
+    m_abort = true;
+    m_cv.notify_all();
+    if (m_worker.joinable()) m_worker.join();
+}
+
+void DiskUsageService::request(const DiskUsageRequest& request) {
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        // A new walk replaces whatever the client asked for before
+        m_jobs.clear();
+        if (m_running) m_abort = true;
+        m_jobs.push_back(request);
+        if (!m_worker.joinable())
+            m_worker = std::thread(&DiskUsageService::run, this);
+    }
+    m_cv.notify_one();
+}
+
+void DiskUsageService::cancel(uint32_t id) {
+    std::lock_guard<std::mutex> lock(m_mutex);
+    m_jobs.erase(std::remove_if(m_jobs.begin(), m_jobs.end(), [id](const DiskUsageRequest& job) { return job.id == id; }), m_jobs.end());
+    if (m_running == id) m_abort = true;
+}
+
+void DiskUsageService::cancelAll() {
+    std::lock_guard<std::mutex> lock(m_mutex);
+    m_jobs.clear();
+    if (m_running) m_abort = true;
+}
+
+void DiskUsageService::run() {
+    for (;;) {
+        DiskUsageRequest job;
+        {
+            std::unique_lock<std::mutex> lock(m_mutex);
+            m_running = 0;
+            m_cv.wait(lock, [this]() { return m_stop || !m_jobs.empty(); });
+            if (m_stop) break;
+            job = std::move(m_jobs.front());
+            m_jobs.pop_front();
+            m_running = job.id;
+            m_abort = false;
+        }
+        walk(job);
+    }
+}
+
+void DiskUsageService::walk(const DiskUsageRequest& request) {
+    auto started = std::chrono::steady_clock::now();
+    auto elapsed = [&]() { return std::chrono::duration<double>(std::chrono::steady_clock::now() - started).count(); };
+    auto fail = [&](const std::string& error) {
+        DiskUsageResults results;
+        results.id = request.id;
+        results.root = request.root;
+        results.done = true;
+        results.error = error;
+        NetworkMessage msg;
+        msg.fromDiskUsageResults(results);
+        m_send(std::move(msg));
+    };
+
+    Walk walk;
+    walk.abort = &m_abort;
+    std::error_code ec;
+    if (!std::filesystem::is_directory(request.root, ec)) return fail("Not a directory: " + request.root);
+#ifdef __linux__
+    struct stat st;
+    if (stat(request.root.c_str(), &st) != 0) return fail("Not a directory: " + request.root);
+    walk.device = static_cast<uint64_t>(st.st_dev);
+#endif
+
+    size_t threads = std::max(2u, std::thread::hardware_concurrency());
+    for (size_t i = 0; i < threads; ++i)
+        walk.queues.push_back(std::make_unique<Walk::Queue>());
+
+    // The root is read here so each of its subdirectories has a slot before the pool starts
+    std::filesystem::path root(request.root);
+    walk.visit(0, { root, Walk::ROOT }, true);
+    if (walk.unreadable) return fail("Cannot read " + request.root);
+    walk.totals = std::make_unique<Walk::Totals[]>(walk.names.size());
+    for (uint32_t i = 0; i < walk.names.size(); ++i) {
+        walk.totals[i].directories = 1;
+        walk.push(i % threads, { root / walk.names[i], i });
+    }
+    LOG_INFO("disk usage {}: {} ({} subdirectories) on {} threads", request.id, request.root, walk.names.size(), threads);
+
+    std::vector<std::thread> pool;
+    for (size_t i = 0; i < threads; ++i)
+        pool.emplace_back(&Walk::work, &walk, i);
+
+    // Stream the slots that moved until the pool runs out of work
+    std::vector<DiskUsageEntry> sent(walk.names.size());
+    auto flush = [&](bool done, bool cancelled = false) {
+        DiskUsageResults results;
+        results.id = request.id;
+        results.root = request.root;
+        walk.root_files.read(results.total);
+        for (uint32_t i = 0; i < walk.names.size(); ++i) {
+            DiskUsageEntry entry;
+            walk.totals[i].read(entry);
+            results.total.bytes += entry.bytes;
+            results.total.allocated += entry.allocated;
+            results.total.files += entry.files;
+            results.total.directories += entry.directories;
+            if (entry.bytes == sent[i].bytes && entry.files == sent[i].files && entry.directories == sent[i].directories &&
+                entry.allocated == sent[i].allocated && !sent[i].name.empty()) continue;
+            entry.name = walk.names[i];
+            sent[i] = entry;
+            results.entries.push_back(std::move(entry));
+        }
+        results.unreadable = walk.unreadable;
+        results.seconds = elapsed();
+        results.done = done;
+        results.cancelled = cancelled;
+        NetworkMessage msg;
+        msg.fromDiskUsageResults(results);
+        m_send(std::move(msg));
+        return results.total;
+    };
+    for (;;) {
+        std::unique_lock<std::mutex> lock(walk.finished_mutex);
+        if (walk.finished.wait_for(lock, DISK_USAGE_FLUSH_INTERVAL, [&]() { return walk.outstanding == 0 || walk.stopped(); })) break;
+        lock.unlock();
+        flush(false);
+    }
+    for (auto& thread : pool)
+        thread.join();
+    bool cancelled = walk.stopped();
+    DiskUsageEntry total = flush(true, cancelled);
+    LOG_INFO("disk usage {}: {} files, {} directories, {} in {} s{}", request.id, total.files, total.directories,
+        formatBytes(total.allocated), elapsed(), cancelled ? ", cancelled" : "");
+}
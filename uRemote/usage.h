@@ -0,0 +1,39 @@
+#pragma once
+#include "uRemote.h"
+#include "network.h"
+#include "transfer.h"
+#include <atomic>
+
+// Server side: adds up the sizes of everything below a directory and streams the totals of
+// each of its subdirectories back in DISK_USAGE_RESULTS updates, sending only the ones that
+// changed since the last. Directories are tasks on a pool of work-stealing threads, as in
+// SearchService; files are only stat'ed where they are found, never queued, so memory grows
+// with the directories waiting to be read rather than with the files below them. The walk
+// stays on the root's filesystem, does not follow symlinks and counts a file with several
+// hard links once.
+class DiskUsageService {
+public:
+    using SendFunction = FileSender::SendFunction;
+
+    explicit DiskUsageService(SendFunction send);
+    ~DiskUsageService();
+
+    void request(const DiskUsageRequest& request);
+    void cancel(uint32_t id);
+    void cancelAll();
+
+private:
+    struct Walk;
+
+    void run();
+    void walk(const DiskUsageRequest& request);
+
+    SendFunction m_send;
+    std::thread m_worker;
+    std::mutex m_mutex;
+    std::condition_variable m_cv;
+    std::deque<DiskUsageRequest> m_jobs;
+    uint32_t m_running = 0;             // id of the walk in progress, under m_mutex
+    std::atomic<bool> m_abort{ false }; // tells the running walk's threads to stop
+    bool m_stop = false;
+};
@@ -0,0 +1,334 @@
+#include "viewer.h"
+#include "logger.h"
+#include <cstring>
+
+// Size of each read while indexing or collecting lines
+constexpr size_t LINE_INDEX_READ_SIZE = 1024 * 1024;
+// Bytes indexed per background step, so requests never wait long behind one
+constexpr uint64_t LINE_INDEX_SLICE = 16 * 1024 * 1024;
+// Files whose line index the server keeps
+constexpr size_t LINE_INDEX_CACHE_LIMIT = 8;
+// Most lines one request may ask for
+constexpr uint32_t VIEWER_MAX_REQUEST_LINES = 4 * VIEWER_PAGE_LINES;
+// Client page cache and request limits
+constexpr size_t VIEWER_CACHED_PAGES = 64;
+constexpr size_t VIEWER_MAX_PENDING = 8;
+constexpr uint64_t VIEWER_PREFETCH_PAGES = 2;
+// How often an open viewer asks again for the line count while the server is still indexing
+constexpr auto VIEWER_REFRESH_INTERVAL = std::chrono::milliseconds(500);
+
+LineIndexService::LineIndexService(SendFunction send) : m_send(std::move(send)) {
+}
+
+LineIndexService::~LineIndexService() {
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        m_stop = true;
+    }
+    m_cv.notify_all();
+    if (m_worker.joinable()) m_worker.join();
+}
+
+void LineIndexService::request(const FileLinesRequest& request) {
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        m_jobs.push_back(request);
+        if (!m_worker.joinable())
+            m_worker = std::thread(&LineIndexService::run, this);
+    }
+    m_cv.notify_one();
+}
+
+void LineIndexService::cancelAll() {
+    std::lock_guard<std::mutex> lock(m_mutex);
+    m_jobs.clear();
+}
+
+void LineIndexService::run() {
+    m_buffer.resize(LINE_INDEX_READ_SIZE);
+    bool background = false;
+    for (;;) {
+        FileLinesRequest job;
+        {
+            std::unique_lock<std::mutex> lock(m_mutex);
+            if (!background)
+                m_cv.wait(lock, [this]() { return m_stop || !m_jobs.empty(); });
+            if (m_stop) break;
+            if (m_jobs.empty()) {
+                lock.unlock();
+                background = extendInBackground();
+                continue;
+            }
+            job = std::move(m_jobs.front());
+            m_jobs.pop_front();
+        }
+        NetworkMessage msg;
+        msg.fromFileLinesResponse(serve(job));
+        m_send(std::move(msg));
+        background = true;
+    }
+}
+
+LineIndexService::Index& LineIndexService::indexFor(const std::string& path, const FileIdentity& identity) {
+    auto it = m_indexes.find(path);
+    if (it != m_indexes.end()) {
+        Index& index = it->second;
+        // Appends keep the index; a replaced, truncated or rewritten file starts over
+        bool same_file = index.identity.device == identity.device && index.identity.inode == identity.inode && identity.size >= index.scanned;
+        bool rewritten = identity.size == index.identity.size && identity.mtime_ns != index.identity.mtime_ns;
+        if (same_file && !rewritten) {
+            if (identity.size != index.identity.size) index.complete = false;
+            index.identity = identity;
+            index.last_used = ++m_clock;
+            return index;
+        }
+        m_indexes.erase(it);
+    }
+    if (m_indexes.size() >= LINE_INDEX_CACHE_LIMIT) {
+        auto oldest = std::min_element(m_indexes.begin(), m_indexes.end(),
+            [](const auto& a, const auto& b) { return a.second.last_used < b.second.last_used; });
+        m_indexes.erase(oldest);
+    }
+    Index& index = m_indexes[path];
+    index.identity = identity;
+    index.checkpoints.push_back(0);
+    index.complete = identity.size == 0;
+    index.last_used = ++m_clock;
+    return index;
+}
+
+bool LineIndexService::extend(Index& index, NativeFile file, uint64_t line, uint64_t budget) {
+    while (!index.complete && index.newlines < line && budget > 0) {
+        uint64_t remaining = index.identity.size - index.scanned;
+        size_t want = static_cast<size_t>(std::min<uint64_t>({ m_buffer.size(), remaining, budget }));
+        int64_t n = want > 0 ? readFileAt(file, m_buffer.data(), want, index.scanned) : 0;
+        if (n <= 0) {
+            // Shorter than it was a moment ago; the next request sees the new identity
+            index.complete = true;
+            break;
+        }
+        const uint8_t* begin = m_buffer.data();
+        const uint8_t* end = begin + n;
+        for (const uint8_t* p = begin; (p = static_cast<const uint8_t*>(std::memchr(p, '\n', end - p))) != nullptr; ++p) {
+            ++index.newlines;
+            index.line_start = index.scanned + (p - begin) + 1;
+            if (index.newlines % LINE_INDEX_STRIDE == 0)
+                index.checkpoints.push_back(index.line_start);
+        }
+        index.scanned += static_cast<uint64_t>(n);
+        budget -= static_cast<uint64_t>(n);
+        if (index.scanned == index.identity.size) index.complete = true;
+    }
+    return index.newlines >= line;
+}
+
+bool LineIndexService::extendInBackground() {
+    std::string path;
+    Index* next = nullptr;
+    for (auto& [candidate, index] : m_indexes) {
+        if (!index.complete && (!next || index.last_used > next->last_used)) {
+            path = candidate;
+            next = &index;
+        }
+    }
+    if (!next) return false;
+
+    uint64_t size = 0;
+    int64_t mtime = 0;
+    FileIdentity identity;
+    NativeFile file = openFileForRead(path, size, mtime);
+    if (!isValidNativeFile(file) || !fileIdentity(file, identity)) {
+        closeNativeFile(file);
+        m_indexes.erase(path);
+        return true;
+    }
+    uint64_t last_used = next->last_used;
+    Index& index = indexFor(path, identity);
+    index.last_used = last_used;    // background work does not count as use
+    extend(index, file, UINT64_MAX, LINE_INDEX_SLICE);
+    closeNativeFile(file);
+    if (index.complete)
+        LOG_INFO("line index: {} has {} lines ({} bytes)", path, index.newlines + (index.line_start < index.identity.size), index.identity.size);
+    return true;
+}
+
+FileLines LineIndexService::serve(const FileLinesRequest& request) {
+    FileLines lines;
+    lines.id = request.id;
+    lines.path = request.path;
+    lines.first_line = request.first_line;
+
+    uint64_t size = 0;
+    int64_t mtime = 0;
+    FileIdentity identity;
+    NativeFile file = openFileForRead(request.path, size, mtime);
+    if (!isValidNativeFile(file) || !fileIdentity(file, identity)) {
+        closeNativeFile(file);
+        lines.error = "Cannot open file: " + request.path;
+        return lines;
+    }
+
+    auto started = std::chrono::steady_clock::now();
+    Index& index = indexFor(request.path, identity);
+    uint32_t count = std::min(request.count, VIEWER_MAX_REQUEST_LINES);
+    extend(index, file, request.first_line + count, UINT64_MAX);
+
+    // Walk from the nearest indexed line to the first one wanted, then collect
+    uint64_t stride = std::min<uint64_t>(request.first_line / LINE_INDEX_STRIDE, index.checkpoints.size() - 1);
+    uint64_t offset = index.checkpoints[stride];
+    uint64_t skip = request.first_line - stride * LINE_INDEX_STRIDE;
+    size_t line_bytes = 0;
+    bool in_line = false;
+    bool truncated = false;
+    auto finishLine = [&]() {
+        if (truncated) {
+            static const char marker[] = " \xE2\x80\xA6";
+            lines.text.insert(lines.text.end(), marker, marker + sizeof(marker) - 1);
+        } else if (line_bytes > 0 && lines.text.back() == '\r') {
+            lines.text.pop_back();
+        }
+        lines.ends.push_back(static_cast<uint32_t>(lines.text.size()));
+        line_bytes = 0;
+        in_line = truncated = false;
+    };
+    while (offset < identity.size && lines.ends.size() < count) {
+        size_t want = static_cast<size_t>(std::min<uint64_t>(m_buffer.size(), identity.size - offset));
+        int64_t n = readFileAt(file, m_buffer.data(), want, offset);
+        if (n <= 0) break;
+        const uint8_t* p = m_buffer.data();
+        const uint8_t* end = p + n;
+        while (p < end && lines.ends.size() < count) {
+            const uint8_t* newline = static_cast<const uint8_t*>(std::memchr(p, '\n', end - p));
+            const uint8_t* stop = newline ? newline : end;
+            if (skip == 0) {
+                in_line = true;
+                size_t take = std::min<size_t>(stop - p, VIEWER_MAX_LINE_BYTES - line_bytes);
+                lines.text.insert(lines.text.end(), p, p + take);
+                line_bytes += take;
+                if (take < static_cast<size_t>(stop - p)) truncated = true;
+            }
+            if (!newline) break;
+            if (skip > 0) --skip;
+            else finishLine();
+            p = newline + 1;
+        }
+        offset += static_cast<uint64_t>(n);
+    }
+    // The last line of a file need not end with a line break
+    if (in_line && lines.ends.size() < count && offset >= identity.size) finishLine();
+    closeNativeFile(file);
+
+    lines.lines = index.newlines + (index.complete && index.line_start < index.identity.size ? 1 : 0);
+    lines.indexed = index.scanned;
+    lines.size = identity.size;
+    lines.complete = index.complete;
+    double ms = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - started).count();
+    LOG_DEBUG("viewer {}: lines {}+{} of {} in {} ms ({} of {} bytes indexed)", request.id, request.first_line,
+        lines.ends.size(), request.path, ms, index.scanned, identity.size);
+    return lines;
+}
+
+FileViewer::FileViewer(SendFunction send) : m_send(std::move(send)) {
+}
+
+void FileViewer::open(const std::string& path) {
+    ++m_session;
+    m_path = path;
+    m_error.clear();
+    m_pages.clear();
+    m_pending.clear();
+    m_lines = m_indexed = m_size = 0;
+    m_complete = false;
+    m_last_first = 0;
+    m_direction = 1;
+    fetch(0);
+}
+
+void FileViewer::onLines(const FileLines& lines) {
+    if (lines.id != m_session) return;
+    uint64_t number = lines.first_line / VIEWER_PAGE_LINES;
+    m_pending.erase(number);
+    if (!lines.error.empty()) {
+        m_error = lines.error;
+        return;
+    }
+    m_lines = lines.lines;
+    m_indexed = lines.indexed;
+    m_size = lines.size;
+    m_complete = lines.complete;
+
+    Page& page = m_pages[number];
+    page.text.assign(lines.text.begin(), lines.text.end());
+    page.lines.clear();
+    uint32_t begin = 0;
+    for (uint32_t end : lines.ends) {
+        if (end < begin || end > page.text.size()) break;
+        page.lines.emplace_back(page.text.data() + begin, end - begin);
+        begin = end;
+    }
+
+    // Keep the pages nearest the view
+    uint64_t current = m_last_first / VIEWER_PAGE_LINES;
+    while (m_pages.size() > VIEWER_CACHED_PAGES) {
+        auto front = m_pages.begin();
+        auto back = std::prev(m_pages.end());
+        uint64_t front_distance = current > front->first ? current - front->first : 0;
+        uint64_t back_distance = back->first > current ? back->first - current : 0;
+        m_pages.erase(front_distance >= back_distance ? front : back);
+    }
+}
+
+uint64_t FileViewer::lineCount() const {
+    if (m_complete || m_indexed == 0) return m_lines;
+    // Extrapolate from the part indexed so far; corrected as the index grows
+    double estimate = static_cast<double>(m_lines) * m_size / m_indexed;
+    return std::max<uint64_t>(m_lines, static_cast<uint64_t>(estimate));
+}
+
+void FileViewer::send(uint64_t page) {
+    FileLinesRequest request;
+    request.id = m_session;
+    request.path = m_path;
+    request.first_line = page * VIEWER_PAGE_LINES;
+    request.count = VIEWER_PAGE_LINES;
+    m_pending.insert(page);
+    NetworkMessage msg;
+    msg.fromFileLinesRequest(request);
+    m_send(std::move(msg));
+}
+
+void FileViewer::fetch(uint64_t page) {
+    if (m_pending.count(page) || m_pages.count(page) || m_pending.size() >= VIEWER_MAX_PENDING) return;
+    send(page);
+}
+
+void FileViewer::show(uint64_t first, uint64_t last) {
+    if (m_path.empty() || !m_error.empty()) return;
+    if (first != m_last_first) m_direction = first > m_last_first ? 1 : -1;
+    m_last_first = first;
+
+    uint64_t first_page = first / VIEWER_PAGE_LINES;
+    uint64_t last_page = (last > first ? last - 1 : first) / VIEWER_PAGE_LINES;
+    for (uint64_t page = first_page; page <= last_page; ++page)
+        fetch(page);
+    // Read ahead the way the user is going
+    for (uint64_t i = 1; i <= VIEWER_PREFETCH_PAGES; ++i) {
+        if (m_direction > 0) fetch(last_page + i);
+        else if (first_page >= i) fetch(first_page - i);
+    }
+
+    // Until the index is complete the line count is an estimate; keep it fresh
+    auto now = std::chrono::steady_clock::now();
+    if (!m_complete && m_pending.empty() && now - m_last_refresh >= VIEWER_REFRESH_INTERVAL) {
+        m_last_refresh = now;
+        send(first_page);
+    }
+}
+
+const std::string_view* FileViewer::line(uint64_t n) {
+    auto it = m_pages.find(n / VIEWER_PAGE_LINES);
+    if (it == m_pages.end()) return nullptr;
+    static const std::string_view past_end;
+    size_t index = static_cast<size_t>(n % VIEWER_PAGE_LINES);
+    return index < it->second.lines.size() ? &it->second.lines[index] : &past_end;
+}
@@ -0,0 +1,113 @@
+#pragma once
+#include "uRemote.h"
+#include "network.h"
+#include "transfer.h"
+#include <map>
+#include <set>
+#include <string_view>
+
+// Lines per viewer request; the client caches whole pages of this many lines
+constexpr uint32_t VIEWER_PAGE_LINES = 256;
+// Longer lines are cut here and marked, so one huge line cannot blow up a response
+constexpr size_t VIEWER_MAX_LINE_BYTES = 4096;
+// Lines the viewer's list spans at once; it slides along the file as the user scrolls
+constexpr uint64_t VIEWER_WINDOW_LINES = 100000;
+// The server remembers the start of every this many lines
+constexpr uint64_t LINE_INDEX_STRIDE = 1024;
+
+// Server side: serves windows of lines from text files of any size. Each file gets a sparse
+// index holding the byte offset of every LINE_INDEX_STRIDE-th line. The index is extended
+// only as far as a request needs, and keeps growing in the background between requests, so
+// the first page of a multi-GB log comes back at once and later jumps read at most one
+// stride of lines. A file that grows keeps its index; one that is replaced or truncated
+// starts over.
+class LineIndexService {
+public:
+    using SendFunction = FileSender::SendFunction;
+
+    explicit LineIndexService(SendFunction send);
+    ~LineIndexService();
+
+    void request(const FileLinesRequest& request);
+    void cancelAll();
+
+private:
+    struct Index {
+        FileIdentity identity;
+        std::vector<uint64_t> checkpoints;  // start of line k * LINE_INDEX_STRIDE
+        uint64_t newlines = 0;              // line breaks in the first `scanned` bytes
+        uint64_t line_start = 0;            // start of the line after the last break
+        uint64_t scanned = 0;
+        bool complete = false;
+        uint64_t last_used = 0;
+    };
+
+    void run();
+    FileLines serve(const FileLinesRequest& request);
+    // Scans `index` until it knows where line `line` starts, the file ends, or `budget` bytes were read
+    bool extend(Index& index, NativeFile file, uint64_t line, uint64_t budget);
+    Index& indexFor(const std::string& path, const FileIdentity& identity);
+    // Extends the most recently used unfinished index by one slice; false when all are finished
+    bool extendInBackground();
+
+    SendFunction m_send;
+    std::thread m_worker;
+    std::mutex m_mutex;
+    std::condition_variable m_cv;
+    std::deque<FileLinesRequest> m_jobs;
+    bool m_stop = false;
+
+    // Only touched by the worker
+    std::unordered_map<std::string, Index> m_indexes;
+    uint64_t m_clock = 0;
+    std::vector<uint8_t> m_buffer;
+};
+
+// Client side: the pages of one remote file the viewer has fetched. The UI reports which
+// lines are on screen; missing pages around them are requested, with extra pages ahead in
+// the direction the user is scrolling, and pages far from the view are dropped.
+class FileViewer {
+public:
+    using SendFunction = FileSender::SendFunction;
+
+    explicit FileViewer(SendFunction send);
+
+    void open(const std::string& path);
+    void onLines(const FileLines& lines);
+
+    // Lines to lay out: exact once the server has indexed the whole file, else an estimate
+    uint64_t lineCount() const;
+    // Called with the lines on screen each frame; fetches what is missing
+    void show(uint64_t first, uint64_t last);
+    // Text of line `n` without its terminator, or nullptr while it is being fetched
+    const std::string_view* line(uint64_t n);
+
+    const std::string& path() const { return m_path; }
+    const std::string& error() const { return m_error; }
+    uint64_t size() const { return m_size; }
+    uint64_t indexed() const { return m_indexed; }
+    bool complete() const { return m_complete; }
+
+private:
+    struct Page {
+        std::string text;
+        std::vector<std::string_view> lines;
+    };
+
+    void fetch(uint64_t page);
+    void send(uint64_t page);
+
+    SendFunction m_send;
+    uint32_t m_session = 0;
+    std::string m_path;
+    std::string m_error;
+    std::map<uint64_t, Page> m_pages;
+    std::set<uint64_t> m_pending;
+    uint64_t m_lines = 0;
+    uint64_t m_indexed = 0;
+    uint64_t m_size = 0;
+    bool m_complete = false;
+    uint64_t m_last_first = 0;
+    int m_direction = 1;
+    std::chrono::steady_clock::time_point m_last_refresh;
+};